@@ -0,0 +1,120 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include "bench.h"
+
+
+static inline unsigned hist_index(uint64_t v) {
+
+    if (v < HIST_SUB)
+        return v;
+
+    unsigned shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Lower bound of the values falling in a bucket */
+static inline uint64_t hist_value(unsigned idx) {
+
+    if (idx < HIST_SUB)
+        return idx;
+
+    unsigned shift = idx / HIST_SUB - 1;
+
+    return (uint64_t) (HIST_SUB + idx % HIST_SUB) << shift;
+}
+
+
+void hist_init(Histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+
+void hist_record(Histogram *h, uint64_t v) {
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+
+void hist_merge(Histogram *dst, const Histogram *src) {
+
+    for (int i = 0; i < HIST_BUCKETS; ++i)
+        dst->buckets[i] += src->buckets[i];
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+
+uint64_t hist_percentile(const Histogram *h, double p) {
+
+    if (h->count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (p / 100.0 * h->count + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0) rank = 1;
+
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = hist_value(i);
+            /* Buckets are coarse, never report outside the observed range */
+            if (v < h->min) v = h->min;
+            if (v > h->max) v = h->max;
+            return v;
+        }
+    }
+
+    return h->max;
+}
+
+
+double hist_mean(const Histogram *h) {
+    return h->count ? (double) h->sum / h->count : 0.0;
+}
+
+
+void hist_json(FILE *fp, const Histogram *h) {
+    fprintf(fp, "{\"min\":%" PRIu64 ",\"mean\":%.0f,\"p50\":%" PRIu64
+            ",\"p90\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64
+            ",\"max\":%" PRIu64 "}",
+            h->count ? h->min : 0, hist_mean(h),
+            hist_percentile(h, 50.0), hist_percentile(h, 90.0),
+            hist_percentile(h, 99.0), hist_percentile(h, 99.9), h->max);
+}
@@ -0,0 +1,516 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reference servers for the load generator, all of them are plain vessel
+ * servers with different handlers:
+ *
+ * - echo:  every byte received is sent back
+ * - fixed: every request of --size bytes is answered with --reply bytes
+ * - large: same as fixed, with a 1 MB reply by default
+ * - idle:  echo server meant to hold many idle connections alongside a few
+ *          active ones (see loadgen --idle)
+ * - file:  every request of --size bytes is answered with the content of
+ *          --file, sent with sendfile(2) through the open files cache
+ * - coecho: same as echo, written as a coroutine handler
+ *
+ * With --unix the same handlers are served on a unix socket too, to compare
+ * it with TCP loopback.
+ *
+ * With --udp the server listens for datagrams too, echoing every one of them
+ * back, --gso coalesces the replies with UDP_SEGMENT.
+ *
+ * With --proxy every connection is forwarded to an upstream server in place
+ * of being handled, with splice(2). The upstream is taken to be an echo server,
+ * its connections are pooled once they echoed all they got, the pool counters
+ * are printed on exit.
+ *
+ * With --zerocopy replies are sent without blocking through reply_buffer,
+ * using MSG_ZEROCOPY from the given size up.
+ *
+ * With --trace the workers record their events in the flight recorder,
+ * dumped as a Chrome trace to --trace-path on every SIGUSR2.
+ *
+ * The server runs until SIGINT or SIGTERM.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include "../src/networking.h"
+#include "../src/vessel.h"
+
+
+#define ONEMB (1024 * 1024)
+
+#define RECV_SIZE (ONEMB * 2)
+
+
+enum mode { ECHO, FIXED, LARGE, IDLE, SENDFILE, COECHO };
+
+
+static struct {
+    enum mode mode;
+    size_t reqsize;
+    size_t replysize;
+    uint8_t *reply;
+    int tls;
+    /* Replies sent with send_buffer_reply */
+    int buffers;
+    /* Bytes of a partially received request, indexed by client fd */
+    size_t *partial;
+    /* Requests waiting for a file reply, indexed by client fd */
+    size_t *pending;
+    const char *path;
+    rlim_t maxfds;
+} srv;
+
+
+static Listener udp_listener = { .type = LISTEN_UDP, .addr = "127.0.0.1" };
+
+static Listener unix_listener = { .type = LISTEN_UNIX };
+
+static Listener listeners[2];
+
+
+static Config conf = {
+    .epoll_events = 64,
+    .epoll_workers = 4,
+    .addr = "127.0.0.1",
+    .port = "4040",
+    .use_ssl = 0,
+    .certfile = "cert.pem",
+    .keyfile = "key.pem",
+    .acc_handler = NULL
+};
+
+/* Send a whole reply, waiting for the socket to be writable when the send
+   buffer is full */
+static void send_full(Client *client, uint8_t *buf, size_t len) {
+
+    size_t total = 0;
+    ssize_t sent = 0;
+    int r;
+
+    while (total < len) {
+
+        if (srv.tls)
+            r = ssl_send(client->ssl, buf + total, len - total, &sent);
+        else
+            r = sendall(client->reply->fd, buf + total, len - total, &sent);
+
+        total += sent;
+
+        if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return;
+
+        if (total < len) {
+            struct pollfd pfd = { .fd = client->fd, .events = POLLOUT };
+            if (poll(&pfd, 1, 1000) <= 0)
+                return;
+        }
+    }
+}
+
+
+/* Send the file once for every pending request, resuming on EPOLLOUT */
+static int file_reply_handler(Client *client) {
+
+    const int fd = client->fd;
+
+    while (client->reply->file || srv.pending[fd] > 0) {
+
+        if (!client->reply->file) {
+            if (reply_file(client, srv.path, 0, 0) < 0) {
+                perror(srv.path);
+                srv.pending[fd] = 0;
+                return -1;
+            }
+            srv.pending[fd]--;
+        }
+
+        int rc = send_file_reply(client);
+
+        if (rc != HANDLER_OK)
+            return rc;
+    }
+
+    return HANDLER_OK;
+}
+
+
+static int reply_handler(Client *client) {
+
+    Reply *r = client->reply;
+
+    if (srv.mode == SENDFILE)
+        return file_reply_handler(client);
+
+    if (srv.buffers)
+        return send_buffer_reply(client);
+
+    if (!r->data)
+        return 0;
+
+    send_full(client, r->data, strlen((char *) r->data));
+
+    free(r->data);
+    r->data = NULL;
+
+    return 0;
+}
+
+static void set_reply(Client *client, uint8_t *data, size_t len) {
+    if (srv.buffers)
+        reply_buffer(client, data, len);
+    else
+        client->reply->data = data;
+}
+
+/* Echo every datagram back */
+static int dgram_handler(Datagram *d) {
+
+    memcpy(d->reply, d->data, d->len);
+    d->reply_len = d->len;
+
+    return 0;
+}
+
+/* Receive buffer of a worker, allocated on its first request */
+static __thread uint8_t *recv_buf = NULL;
+
+static pthread_key_t recv_key;
+static pthread_once_t recv_once = PTHREAD_ONCE_INIT;
+
+
+static void recv_buf_free(void *arg) {
+    free(arg);
+    recv_buf = NULL;
+}
+
+
+static void recv_key_init(void) {
+    pthread_key_create(&recv_key, recv_buf_free);
+}
+
+
+static uint8_t *get_recv_buf(void) {
+
+    if (recv_buf)
+        return recv_buf;
+
+    recv_buf = malloc(RECV_SIZE);
+    if (!recv_buf) {
+        perror("allocating receive buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_once(&recv_once, recv_key_init);
+    pthread_setspecific(recv_key, recv_buf);
+
+    return recv_buf;
+}
+
+/* Read everything available and prepare the reply according to the mode */
+static int request_handler(Client *client) {
+
+    const int clientfd = client->fd;
+
+    Ringbuf *rbuf = ringbuf_init(get_recv_buf(), RECV_SIZE);
+
+    /* The reply of a new connection comes zeroed, the counters of its fd
+       still hold what the last connection on it left when it was closed */
+    if (client->reply->fd != clientfd && clientfd < (int) srv.maxfds) {
+        srv.partial[clientfd] = 0;
+        srv.pending[clientfd] = 0;
+    }
+
+    int bytes;
+
+    if (srv.tls)
+        bytes = ssl_recv(client->ssl, rbuf, -1);
+    else
+        bytes = recvall(clientfd, rbuf, -1);
+
+    client->reply->fd = clientfd;
+    client->reply->data = NULL;
+
+    if (bytes <= 0) {
+        ringbuf_free(rbuf);
+        return bytes;
+    }
+
+    if (srv.mode == ECHO || srv.mode == IDLE) {
+        uint8_t *data = malloc(bytes + 1);
+        ringbuf_bulk_pop(rbuf, data, bytes);
+        data[bytes] = '\0';
+        set_reply(client, data, bytes);
+    } else if (srv.mode == SENDFILE && clientfd < (int) srv.maxfds) {
+        size_t total = srv.partial[clientfd] + bytes;
+        srv.pending[clientfd] += total / srv.reqsize;
+        srv.partial[clientfd] = total % srv.reqsize;
+    } else if (clientfd < (int) srv.maxfds) {
+        /* One reply for every complete request, keeping the remainder */
+        size_t total = srv.partial[clientfd] + bytes;
+        size_t count = total / srv.reqsize;
+        srv.partial[clientfd] = total % srv.reqsize;
+        if (count > 0) {
+            uint8_t *data = malloc(count * srv.replysize + 1);
+            for (size_t i = 0; i < count; ++i)
+                memcpy(data + i * srv.replysize, srv.reply, srv.replysize);
+            data[count * srv.replysize] = '\0';
+            set_reply(client, data, count * srv.replysize);
+        }
+    }
+
+    ringbuf_free(rbuf);
+
+    return 0;
+}
+
+
+/* Echo as a straight loop, suspended by vessel_read and vessel_write */
+static void echo_coro_handler(Client *client) {
+
+    uint8_t buf[16384];
+    ssize_t n;
+
+    while ((n = vessel_read(client, buf, sizeof(buf))) > 0)
+        if (vessel_write(client, buf, n) < 0)
+            break;
+}
+
+
+/* Upstream connections of an echo server are answered in full once they sent
+   back as much as they got */
+static int echo_answered(uint64_t up, uint64_t down) {
+    return up == down;
+}
+
+
+static void *run_server(void *arg) {
+    start_server(&conf);
+    return NULL;
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -m, --mode MODE        echo, fixed, large, idle, file or coecho\n"
+            "                         (default echo)\n"
+            "  -a, --addr ADDR        listen address (default 127.0.0.1)\n"
+            "  -p, --port PORT        listen port (default 4040)\n"
+            "  -w, --workers N        epoll workers (default 4)\n"
+            "  -s, --size BYTES       request size for fixed and large (default 64)\n"
+            "  -r, --reply BYTES      reply size for fixed and large\n"
+            "  -f, --file PATH        file served in file mode\n"
+            "  -Z, --zerocopy BYTES   send replies from BYTES up with MSG_ZEROCOPY\n"
+            "  -U, --unix PATH        listen on a unix socket too, @name for abstract ones\n"
+            "  -u, --udp PORT         echo datagrams received on PORT\n"
+            "  -G, --gso              coalesce datagram replies with UDP_SEGMENT\n"
+            "  -B, --busy-poll USECS  workers spin on epoll for USECS before blocking\n"
+            "  -P, --proxy UPSTREAM   forward connections to HOST:PORT or a unix path\n"
+            "  -N, --nodelay          set TCP_NODELAY on the connections\n"
+            "  -L, --lowat BYTES      set TCP_NOTSENT_LOWAT on the connections\n"
+            "  -S, --tls              use TLS\n"
+            "  -C, --cert FILE        certificate file (default cert.pem)\n"
+            "  -K, --key FILE         key file (default key.pem)\n"
+            "  -T, --trace EVENTS     record EVENTS per worker, dumped on SIGUSR2\n"
+            "  -O, --trace-path FILE  trace dump file (default vessel-trace.json)\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv) {
+
+    static const struct option long_opts[] = {
+        { "mode", required_argument, NULL, 'm' },
+        { "addr", required_argument, NULL, 'a' },
+        { "port", required_argument, NULL, 'p' },
+        { "workers", required_argument, NULL, 'w' },
+        { "size", required_argument, NULL, 's' },
+        { "reply", required_argument, NULL, 'r' },
+        { "file", required_argument, NULL, 'f' },
+        { "zerocopy", required_argument, NULL, 'Z' },
+        { "unix", required_argument, NULL, 'U' },
+        { "udp", required_argument, NULL, 'u' },
+        { "gso", no_argument, NULL, 'G' },
+        { "busy-poll", required_argument, NULL, 'B' },
+        { "proxy", required_argument, NULL, 'P' },
+        { "nodelay", no_argument, NULL, 'N' },
+        { "lowat", required_argument, NULL, 'L' },
+        { "tls", no_argument, NULL, 'S' },
+        { "cert", required_argument, NULL, 'C' },
+        { "key", required_argument, NULL, 'K' },
+        { "trace", required_argument, NULL, 'T' },
+        { "trace-path", required_argument, NULL, 'O' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+
+    srv.mode = ECHO;
+    srv.reqsize = 64;
+
+    while ((opt = getopt_long(argc, argv,
+                    "m:a:p:w:s:r:f:Z:U:u:GB:P:NL:SC:K:T:O:", long_opts,
+                    NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "echo") == 0) srv.mode = ECHO;
+                else if (strcmp(optarg, "fixed") == 0) srv.mode = FIXED;
+                else if (strcmp(optarg, "large") == 0) srv.mode = LARGE;
+                else if (strcmp(optarg, "idle") == 0) srv.mode = IDLE;
+                else if (strcmp(optarg, "file") == 0) srv.mode = SENDFILE;
+                else if (strcmp(optarg, "coecho") == 0) srv.mode = COECHO;
+                else usage(argv[0]);
+                break;
+            case 'a': conf.addr = optarg; break;
+            case 'p': conf.port = optarg; break;
+            case 'w': conf.epoll_workers = atoi(optarg); break;
+            case 's': srv.reqsize = strtoul(optarg, NULL, 10); break;
+            case 'r': srv.replysize = strtoul(optarg, NULL, 10); break;
+            case 'f': srv.path = optarg; break;
+            case 'Z': conf.zerocopy_threshold = atoi(optarg); break;
+            case 'U': unix_listener.addr = optarg; break;
+            case 'u': udp_listener.port = optarg; break;
+            case 'G': udp_listener.gso = 1; break;
+            case 'B': conf.busy_poll_us = atoi(optarg); break;
+            case 'P': {
+                /* host:port, anything without a colon is a unix path */
+                char *colon = strrchr(optarg, ':');
+                conf.proxy_addr = optarg;
+                conf.proxy_pool_size = 32;
+                conf.proxy_reuse = echo_answered;
+                if (colon) {
+                    *colon = '\0';
+                    conf.proxy_port = colon + 1;
+                }
+                break;
+            }
+            case 'N': conf.sockopts.nodelay = 1; break;
+            case 'L': conf.sockopts.notsent_lowat = atoi(optarg); break;
+            case 'S': srv.tls = 1; break;
+            case 'C': conf.certfile = optarg; break;
+            case 'K': conf.keyfile = optarg; break;
+            case 'T':
+                conf.trace_events = strtoul(optarg, NULL, 10);
+                conf.trace_signal = SIGUSR2;
+                break;
+            case 'O': conf.trace_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (srv.reqsize == 0 || conf.epoll_workers < 1
+            || (srv.mode == SENDFILE && !srv.path))
+        usage(argv[0]);
+
+    if (srv.replysize == 0)
+        srv.replysize = srv.mode == LARGE ? ONEMB : 128;
+
+    /* Idle connection scenarios need a lot of descriptors */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    getrlimit(RLIMIT_NOFILE, &rl);
+
+    srv.maxfds = rl.rlim_cur;
+    srv.partial = calloc(srv.maxfds, sizeof(size_t));
+    srv.pending = calloc(srv.maxfds, sizeof(size_t));
+    srv.reply = malloc(srv.replysize);
+
+    if (!srv.partial || !srv.pending || !srv.reply) {
+        perror("malloc(3) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Replies are sent as strings, so no NUL bytes in there */
+    for (size_t i = 0; i < srv.replysize; ++i)
+        srv.reply[i] = 'A' + i % 26;
+
+    conf.use_ssl = srv.tls;
+    srv.buffers = conf.zerocopy_threshold > 0;
+
+    conf.listeners = listeners;
+
+    if (unix_listener.addr)
+        listeners[conf.nlisteners++] = unix_listener;
+
+    if (udp_listener.port) {
+        udp_listener.addr = conf.addr;
+        listeners[conf.nlisteners++] = udp_listener;
+        conf.dgram_handler = dgram_handler;
+    }
+    conf.req_handler = request_handler;
+    conf.rep_handler = reply_handler;
+
+    if (srv.mode == COECHO)
+        conf.co_handler = echo_coro_handler;
+
+    /* Signals are handled synchronously by the main thread only */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t server;
+    pthread_create(&server, NULL, run_server, NULL);
+
+    int sig;
+    sigwait(&set, &sig);
+
+    stop_server();
+    pthread_join(server, NULL);
+
+    if (conf.proxy_addr)
+        fprintf(stderr, "upstream connects %" PRIu64 " reuses %" PRIu64
+                " stale %" PRIu64 ", bytes up %" PRIu64 " down %" PRIu64 "\n",
+                instance.stats.upstream_connects, instance.stats.upstream_reuses,
+                instance.stats.upstream_stale, instance.stats.proxy_bytes_up,
+                instance.stats.proxy_bytes_down);
+
+    free(srv.reply);
+    free(srv.partial);
+    free(srv.pending);
+
+    return 0;
+}
@@ -0,0 +1,323 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compare two microbench result files, a saved baseline and a new run,
+ * benchmark by benchmark. A slowdown is flagged when the new mean is worse
+ * than the baseline by more than --threshold percent and Welch's t-test on the
+ * two sets of samples says the difference is significant at --alpha. Exits
+ * with 1 if at least one regression has been found.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+
+#define MAX_SAMPLES     100
+#define MAX_LINE        8192
+
+
+struct result {
+    char name[256];
+    int nsamples;
+    double samples[MAX_SAMPLES];
+};
+
+
+struct results {
+    struct result *items;
+    int len;
+};
+
+
+/* Extract the string value of "key" from a JSON line written by microbench */
+static int json_string(const char *line, const char *key, char *dst, size_t n) {
+
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+
+    const char *p = strstr(line, pattern);
+
+    if (!p)
+        return -1;
+
+    p += strlen(pattern);
+
+    const char *end = strchr(p, '"');
+
+    if (!end || (size_t) (end - p) >= n)
+        return -1;
+
+    memcpy(dst, p, end - p);
+    dst[end - p] = '\0';
+
+    return 0;
+}
+
+/* Extract the "samples" array of numbers */
+static int json_samples(const char *line, double *samples) {
+
+    const char *p = strstr(line, "\"samples\":[");
+
+    if (!p)
+        return -1;
+
+    p += strlen("\"samples\":[");
+
+    int n = 0;
+    char *end;
+
+    while (*p && *p != ']' && n < MAX_SAMPLES) {
+        samples[n++] = strtod(p, &end);
+        if (end == p)
+            return -1;
+        p = end;
+        if (*p == ',')
+            p++;
+    }
+
+    return n;
+}
+
+
+static void load_results(const char *path, struct results *rs) {
+
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        perror(path);
+        exit(2);
+    }
+
+    char line[MAX_LINE];
+    int cap = 64;
+
+    rs->len = 0;
+    rs->items = malloc(sizeof(struct result) * cap);
+
+    while (fgets(line, sizeof(line), fp)) {
+
+        struct result r;
+
+        if (json_string(line, "name", r.name, sizeof(r.name)) < 0)
+            continue;
+
+        if ((r.nsamples = json_samples(line, r.samples)) < 2)
+            continue;
+
+        if (rs->len == cap) {
+            cap *= 2;
+            rs->items = realloc(rs->items, sizeof(struct result) * cap);
+        }
+
+        rs->items[rs->len++] = r;
+    }
+
+    fclose(fp);
+}
+
+
+static void mean_var(const struct result *r, double *mean, double *var) {
+
+    double sum = 0.0, sq = 0.0;
+
+    for (int i = 0; i < r->nsamples; ++i)
+        sum += r->samples[i];
+
+    *mean = sum / r->nsamples;
+
+    for (int i = 0; i < r->nsamples; ++i)
+        sq += (r->samples[i] - *mean) * (r->samples[i] - *mean);
+
+    *var = sq / (r->nsamples - 1);
+}
+
+/* Continued fraction of the regularized incomplete beta function, modified
+   Lentz's method */
+static double betacf(double a, double b, double x) {
+
+    const double eps = 1e-12, tiny = 1e-300;
+    double qab = a + b, qap = a + 1.0, qam = a - 1.0;
+    double c = 1.0, d = 1.0 - qab * x / qap;
+
+    if (fabs(d) < tiny) d = tiny;
+    d = 1.0 / d;
+
+    double h = d;
+
+    for (int m = 1; m <= 300; ++m) {
+
+        int m2 = 2 * m;
+        double aa = m * (b - m) * x / ((qam + m2) * (a + m2));
+
+        d = 1.0 + aa * d;
+        if (fabs(d) < tiny) d = tiny;
+        c = 1.0 + aa / c;
+        if (fabs(c) < tiny) c = tiny;
+        d = 1.0 / d;
+        h *= d * c;
+
+        aa = -(a + m) * (qab + m) * x / ((a + m2) * (qap + m2));
+        d = 1.0 + aa * d;
+        if (fabs(d) < tiny) d = tiny;
+        c = 1.0 + aa / c;
+        if (fabs(c) < tiny) c = tiny;
+        d = 1.0 / d;
+
+        double del = d * c;
+        h *= del;
+
+        if (fabs(del - 1.0) < eps)
+            break;
+    }
+
+    return h;
+}
+
+
+static double incomplete_beta(double a, double b, double x) {
+
+    if (x <= 0.0) return 0.0;
+    if (x >= 1.0) return 1.0;
+
+    double bt = exp(lgamma(a + b) - lgamma(a) - lgamma(b)
+                    + a * log(x) + b * log(1.0 - x));
+
+    if (x < (a + 1.0) / (a + b + 2.0))
+        return bt * betacf(a, b, x) / a;
+
+    return 1.0 - bt * betacf(b, a, 1.0 - x) / b;
+}
+
+/* Two-sided p-value of Welch's t-test */
+static double welch_pvalue(const struct result *a, const struct result *b,
+                           double *t) {
+
+    double ma, va, mb, vb;
+
+    mean_var(a, &ma, &va);
+    mean_var(b, &mb, &vb);
+
+    double sa = va / a->nsamples, sb = vb / b->nsamples;
+
+    if (sa + sb == 0.0) {
+        *t = 0.0;
+        return ma == mb ? 1.0 : 0.0;
+    }
+
+    *t = (mb - ma) / sqrt(sa + sb);
+
+    double df = (sa + sb) * (sa + sb)
+        / (sa * sa / (a->nsamples - 1) + sb * sb / (b->nsamples - 1));
+
+    return incomplete_beta(df / 2.0, 0.5, df / (df + *t * *t));
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] BASELINE CURRENT\n"
+            "  -t, --threshold PCT    minimum slowdown to report (default 5)\n"
+            "  -a, --alpha P          significance level (default 0.01)\n",
+            prog);
+    exit(2);
+}
+
+
+int main(int argc, char **argv) {
+
+    static const struct option long_opts[] = {
+        { "threshold", required_argument, NULL, 't' },
+        { "alpha", required_argument, NULL, 'a' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    double threshold = 5.0, alpha = 0.01;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "t:a:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 't': threshold = atof(optarg); break;
+            case 'a': alpha = atof(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2)
+        usage(argv[0]);
+
+    struct results base, cur;
+
+    load_results(argv[optind], &base);
+    load_results(argv[optind + 1], &cur);
+
+    int regressions = 0;
+
+    printf("%-48s %12s %12s %9s %9s\n", "benchmark", "baseline", "current",
+           "change", "p-value");
+
+    for (int i = 0; i < cur.len; ++i) {
+
+        struct result *c = &cur.items[i];
+        struct result *b = NULL;
+
+        for (int j = 0; j < base.len && !b; ++j)
+            if (strcmp(base.items[j].name, c->name) == 0)
+                b = &base.items[j];
+
+        if (!b) {
+            printf("%-48s %12s\n", c->name, "new");
+            continue;
+        }
+
+        double mb, vb, mc, vc, t;
+
+        mean_var(b, &mb, &vb);
+        mean_var(c, &mc, &vc);
+
+        double change = (mc - mb) / mb * 100.0;
+        double p = welch_pvalue(b, c, &t);
+        int slower = change > threshold && p < alpha;
+        int faster = change < -threshold && p < alpha;
+
+        printf("%-48s %12.3f %12.3f %+8.1f%% %9.4f%s\n", c->name, mb, mc,
+               change, p, slower ? "  SLOWER" : faster ? "  faster" : "");
+
+        regressions += slower;
+    }
+
+    if (regressions)
+        printf("\n%d significant regression(s)\n", regressions);
+
+    free(base.items);
+    free(cur.items);
+
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,609 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Connection scaling harness. A vessel echo server is forked as a child
+ * process, then connections are opened in steps up to --connections, bound to
+ * several loopback source addresses to avoid running out of ephemeral ports.
+ * At every step, once all connections have been accepted, the harness records:
+ *
+ * - server RSS from /proc/<pid>/status and heap in use from mallinfo2(3)
+ * - accept rate of the step
+ * - round trip latency of a sample of the connections, which measures how
+ *   the epoll loop copes with the growing set of mostly idle descriptors
+ * - epoll wakeups and events dispatched by the server workers
+ *
+ * The round trip stands in for the latency of epoll_wait itself: the workers
+ * wait with no timeout, so the time spent in the call is mostly idle sleep,
+ * and timing it would put two clock reads per wakeup in the server loop. A
+ * ping goes through the wakeup, the dispatch and the reply, so a loop slowed
+ * down by the number of descriptors shows up there, with wakeups and events
+ * telling the cost of a larger ready list apart from a slower wait.
+ *
+ * With --coro the server is a coroutine echo holding a pooled buffer per
+ * connection, --release-idle gives the buffers and the unused stacks of the
+ * quiet connections back while they wait, to compare the costs of the two.
+ *
+ * Every step is printed as a JSON line, followed by a report of the per
+ * connection costs and of the first step where they stop scaling linearly.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "bench.h"
+#include "../src/list.h"
+#include "../src/vessel.h"
+#include "../src/bufpool.h"
+#include "../src/networking.h"
+
+
+#define MAX_STEPS   1024
+
+/* Buffer of the coroutine echo */
+#define CO_BUFFER_SIZE  (16 * 1024)
+
+
+struct options {
+    int connections;
+    int step;
+    int addresses;
+    int workers;
+    int pings;
+    int coro;
+    int release_idle;
+    const char *port;
+    const char *output;
+};
+
+
+struct server_sample {
+    uint64_t heap;
+    uint64_t accepted;
+    uint64_t wakeups;
+    uint64_t events;
+};
+
+
+struct step {
+    int connections;
+    uint64_t rss;
+    uint64_t heap;
+    double accept_rate;
+    uint64_t rtt_p50;
+    uint64_t rtt_p99;
+    uint64_t wakeups;
+    uint64_t events;
+};
+
+
+static struct options opts = {
+    .connections = 10000,
+    .step = 1000,
+    .addresses = 0,
+    .workers = 4,
+    .pings = 200,
+    .coro = 0,
+    .release_idle = 0,
+    .port = "19191",
+    .output = NULL
+};
+
+
+/*
+ * Server side, runs in the child process
+ */
+
+static int echo_handler(Client *client) {
+
+    uint8_t buffer[4096];
+    Ringbuf *rbuf = ringbuf_init(buffer, sizeof(buffer));
+    int bytes = recvall(client->fd, rbuf, -1);
+
+    client->reply->fd = client->fd;
+    client->reply->data = NULL;
+
+    if (bytes > 0) {
+        uint8_t *data = malloc(bytes + 1);
+        ringbuf_bulk_pop(rbuf, data, bytes);
+        data[bytes] = '\0';
+        client->reply->data = data;
+    }
+
+    ringbuf_free(rbuf);
+
+    return 0;
+}
+
+
+static int reply_handler(Client *client) {
+
+    Reply *r = client->reply;
+    ssize_t sent;
+
+    if (r->data) {
+        sendall(r->fd, r->data, strlen((char *) r->data), &sent);
+        free(r->data);
+        r->data = NULL;
+    }
+
+    return 0;
+}
+
+
+/* Coroutine echo, the buffer is held only while there is something to echo
+   if idle connections are released */
+static void co_echo(Client *c) {
+
+    size_t cap;
+    uint8_t *buf = bufpool_get(CO_BUFFER_SIZE, &cap);
+
+    for (;;) {
+
+        if (opts.release_idle) {
+            bufpool_put(buf, cap);
+            buf = NULL;
+            if (vessel_wait_readable(c) <= 0)
+                break;
+            buf = bufpool_get(CO_BUFFER_SIZE, &cap);
+        }
+
+        ssize_t n = vessel_read(c, buf, cap);
+        if (n <= 0 || vessel_write(c, buf, n) < 0)
+            break;
+    }
+
+    bufpool_put(buf, cap);
+}
+
+
+static Config server_conf = {
+    .epoll_events = 64,
+    .addr = "127.0.0.1",
+    .use_ssl = 0,
+    .acc_handler = NULL,
+    .req_handler = echo_handler,
+    .rep_handler = reply_handler
+};
+
+
+static void *run_server(void *arg) {
+    start_server(&server_conf);
+    return NULL;
+}
+
+/* Serve the harness requests on the control socket: 's' asks for a sample of
+   the server internals, 'q' stops the server */
+static void server_main(int ctl) {
+
+    char cmd;
+
+    server_conf.port = opts.port;
+    server_conf.epoll_workers = opts.workers;
+    server_conf.release_idle = opts.release_idle;
+
+    if (opts.coro)
+        server_conf.co_handler = co_echo;
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, run_server, NULL);
+
+    while (read(ctl, &cmd, 1) == 1 && cmd != 'q') {
+        struct mallinfo2 mi = mallinfo2();
+        struct server_sample s = {
+            .heap = mi.uordblks + mi.hblkhd,
+            .accepted = __atomic_load_n(&instance.stats.accepted,
+                                        __ATOMIC_RELAXED),
+            .wakeups = __atomic_load_n(&instance.stats.epoll_wakeups,
+                                       __ATOMIC_RELAXED),
+            .events = __atomic_load_n(&instance.stats.events,
+                                      __ATOMIC_RELAXED)
+        };
+        if (write(ctl, &s, sizeof(s)) != sizeof(s))
+            break;
+    }
+
+    stop_server();
+    pthread_join(tid, NULL);
+    exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Harness side
+ */
+
+static void sample_server(int ctl, struct server_sample *s) {
+    if (write(ctl, "s", 1) != 1 || read(ctl, s, sizeof(*s)) != sizeof(*s)) {
+        fprintf(stderr, "server control channel closed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static uint64_t read_rss(pid_t pid) {
+
+    char path[64], line[256];
+    uint64_t rss = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+    FILE *fp = fopen(path, "r");
+
+    if (!fp)
+        return 0;
+
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "VmRSS: %" SCNu64 " kB", &rss) == 1)
+            break;
+
+    fclose(fp);
+
+    return rss * 1024;
+}
+
+/* Connect from 127.0.0.(2 + i % addresses), every source address has its own
+   range of ephemeral ports */
+static int open_connection(int i) {
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_in src = {
+        .sin_family = AF_INET,
+        .sin_port = 0,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + i % opts.addresses)
+    };
+
+    struct sockaddr_in dst = {
+        .sin_family = AF_INET,
+        .sin_port = htons(atoi(opts.port)),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+
+    /* Let connect(2) pick the source port, bind(2) with port 0 would search
+       for one which is free on its own, slowing down as the ports fill up */
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &(int) { 1 },
+               sizeof(int));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) { 1 }, sizeof(int));
+
+    if (bind(fd, (struct sockaddr *) &src, sizeof(src)) < 0
+            || connect(fd, (struct sockaddr *) &dst, sizeof(dst)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct timeval tv = { .tv_sec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    return fd;
+}
+
+/* Round trip of a single byte over a sample of the open connections */
+static void ping(int *fds, int n, struct step *st) {
+
+    Histogram h;
+    char c = 'p';
+
+    hist_init(&h);
+
+    for (int i = 0; i < opts.pings; ++i) {
+        int fd = fds[(uint64_t) rand() % n];
+        uint64_t start = now_ns();
+        if (send(fd, &c, 1, MSG_NOSIGNAL) != 1 || recv(fd, &c, 1, 0) != 1)
+            continue;
+        hist_record(&h, now_ns() - start);
+    }
+
+    st->rtt_p50 = hist_percentile(&h, 50.0);
+    st->rtt_p99 = hist_percentile(&h, 99.0);
+}
+
+
+static void raise_nofile(rlim_t needed) {
+
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return;
+
+    if (rl.rlim_cur < needed) {
+        rl.rlim_cur = needed < rl.rlim_max ? needed : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (rl.rlim_cur < needed) {
+        fprintf(stderr, "RLIMIT_NOFILE capped at %lu, running up to %lu "
+                "connections\n", (unsigned long) rl.rlim_cur,
+                (unsigned long) rl.rlim_cur - 64);
+        opts.connections = rl.rlim_cur - 64;
+    }
+}
+
+
+static void print_step(FILE *fp, const struct step *st) {
+    fprintf(fp, "{\"connections\":%d,\"rss\":%" PRIu64 ",\"heap\":%" PRIu64
+            ",\"accept_rate\":%.1f,\"rtt_p50_ns\":%" PRIu64 ",\"rtt_p99_ns\":%"
+            PRIu64 ",\"epoll_wakeups\":%" PRIu64 ",\"events\":%" PRIu64 "}\n",
+            st->connections, st->rss, st->heap, st->accept_rate, st->rtt_p50,
+            st->rtt_p99, st->wakeups, st->events);
+    fflush(fp);
+}
+
+/* Per connection costs of every step compared to the first one, the layout
+   stops scaling where the marginal cost per connection or the latency grows
+   well beyond what it was at the beginning */
+static void report(const struct step *steps, int n,
+                   const struct step *base) {
+
+    printf("\nPer connection layout: Client %zu B (list link embedded), "
+           "Reply %zu B, addr %d B, 3 allocations\n", sizeof(Client),
+           sizeof(Reply), INET_ADDRSTRLEN);
+    printf("\n%12s %14s %14s %14s %14s %12s %12s\n", "connections",
+           "rss/conn", "heap/conn", "d-rss/conn", "d-heap/conn", "accept/s",
+           "rtt p99 us");
+
+    int breaking = -1;
+
+    for (int i = 0; i < n; ++i) {
+
+        const struct step *st = &steps[i];
+        const struct step *prev = i ? &steps[i - 1] : base;
+        int conns = st->connections - prev->connections;
+
+        double rss = (double) (st->rss - base->rss) / st->connections;
+        double heap = (double) (st->heap - base->heap) / st->connections;
+        double drss = ((double) st->rss - prev->rss) / conns;
+        double dheap = ((double) st->heap - prev->heap) / conns;
+
+        printf("%12d %14.1f %14.1f %14.1f %14.1f %12.0f %12.1f\n",
+               st->connections, rss, heap, drss, dheap, st->accept_rate,
+               st->rtt_p99 / 1e3);
+
+        if (i > 0 && breaking < 0) {
+            double heap0 = ((double) steps[0].heap - base->heap)
+                / steps[0].connections;
+            if ((heap0 > 0 && dheap > 2 * heap0)
+                    || st->rtt_p99 > 2 * steps[0].rtt_p99 + 100000
+                    || st->accept_rate < steps[0].accept_rate / 2)
+                breaking = i;
+        }
+    }
+
+    if (breaking >= 0)
+        printf("\nScaling breaks at %d connections\n",
+               steps[breaking].connections);
+    else
+        printf("\nLinear scaling up to %d connections\n",
+               steps[n - 1].connections);
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n, --connections N    connections to reach (default 10000)\n"
+            "  -s, --step N           connections opened per step (default 1000)\n"
+            "  -a, --addresses N      loopback source addresses (default: enough\n"
+            "                         for N connections)\n"
+            "  -w, --workers N        server epoll workers (default 4)\n"
+            "  -P, --pings N          round trips sampled per step (default 200)\n"
+            "  -c, --coro             coroutine echo server\n"
+            "  -R, --release-idle     free the buffers of idle connections\n"
+            "  -p, --port PORT        server port (default 19191)\n"
+            "  -o, --output FILE      append the JSON lines to FILE\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv) {
+
+    static const struct option long_opts[] = {
+        { "connections", required_argument, NULL, 'n' },
+        { "step", required_argument, NULL, 's' },
+        { "addresses", required_argument, NULL, 'a' },
+        { "workers", required_argument, NULL, 'w' },
+        { "pings", required_argument, NULL, 'P' },
+        { "coro", no_argument, NULL, 'c' },
+        { "release-idle", no_argument, NULL, 'R' },
+        { "port", required_argument, NULL, 'p' },
+        { "output", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "n:s:a:w:P:cRp:o:",
+                    long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'n': opts.connections = atoi(optarg); break;
+            case 's': opts.step = atoi(optarg); break;
+            case 'a': opts.addresses = atoi(optarg); break;
+            case 'w': opts.workers = atoi(optarg); break;
+            case 'P': opts.pings = atoi(optarg); break;
+            case 'c': opts.coro = 1; break;
+            case 'R': opts.release_idle = 1; break;
+            case 'p': opts.port = optarg; break;
+            case 'o': opts.output = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (opts.connections < 1 || opts.step < 1 || opts.workers < 1)
+        usage(argv[0]);
+
+    /* Roughly 28k ephemeral ports are available per source address, but
+       connect(2) slows down searching for a free one well before they are
+       exhausted */
+    if (opts.addresses <= 0)
+        opts.addresses = opts.connections / 8000 + 1;
+
+    /* Both processes hold one descriptor per connection */
+    raise_nofile(opts.connections + 64);
+
+    if (opts.step > opts.connections)
+        opts.step = opts.connections;
+
+    int ctl[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) < 0) {
+        perror("socketpair(2)");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork(2)");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0) {
+        close(ctl[0]);
+        server_main(ctl[1]);
+    }
+
+    close(ctl[1]);
+
+    int *fds = malloc(sizeof(int) * opts.connections);
+    struct step *steps = calloc(MAX_STEPS, sizeof(*steps));
+    struct step base = { 0 };
+    struct server_sample s;
+    FILE *fp = opts.output ? fopen(opts.output, "a") : NULL;
+
+    if (!fds || !steps) {
+        perror("malloc(3) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Wait for the server to listen, the probe connection is accepted too */
+    int probe = -1;
+
+    for (int i = 0; i < 100 && probe < 0; ++i) {
+        usleep(20000);
+        probe = open_connection(0);
+    }
+
+    if (probe < 0) {
+        fprintf(stderr, "server not listening on port %s\n", opts.port);
+        kill(pid, SIGKILL);
+        exit(EXIT_FAILURE);
+    }
+
+    do {
+        usleep(1000);
+        sample_server(ctl[0], &s);
+    } while (s.accepted < 1);
+
+    base.rss = read_rss(pid);
+    base.heap = s.heap;
+
+    /* The probe connection */
+    uint64_t accepted = s.accepted;
+    int n = 0, nsteps = 0;
+
+    while (n < opts.connections && nsteps < MAX_STEPS) {
+
+        int target = n + opts.step;
+        struct step *st = &steps[nsteps++];
+
+        if (target > opts.connections)
+            target = opts.connections;
+
+        uint64_t start = now_ns();
+
+        for (; n < target; ++n) {
+            if ((fds[n] = open_connection(n)) < 0) {
+                perror("connect(2)");
+                break;
+            }
+        }
+
+        /* All accepted by the server, give up after a few seconds */
+        for (int i = 0; i < 5000; ++i) {
+            sample_server(ctl[0], &s);
+            if (s.accepted - accepted >= (uint64_t) n)
+                break;
+            usleep(1000);
+        }
+
+        double elapsed = (now_ns() - start) / 1e9;
+        int opened = n - (st == steps ? 0 : st[-1].connections);
+
+        st->connections = n;
+        st->accept_rate = opened / elapsed;
+        st->rss = read_rss(pid);
+        st->heap = s.heap;
+        st->wakeups = s.wakeups;
+        st->events = s.events;
+
+        ping(fds, n, st);
+        print_step(fp ? fp : stdout, st);
+
+        if (n < target)
+            break;
+    }
+
+    report(steps, nsteps, &base);
+
+    /* Stop the server before closing the connections */
+    if (write(ctl[0], "q", 1) != 1)
+        kill(pid, SIGTERM);
+
+    waitpid(pid, NULL, 0);
+
+    for (int i = 0; i < n; ++i)
+        close(fds[i]);
+
+    close(probe);
+
+    if (fp)
+        fclose(fp);
+
+    free(steps);
+    free(fds);
+
+    return 0;
+}
@@ -0,0 +1,295 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Multi-threaded benchmark of the sharded hash map, with integer keys so
+ * that only the map is measured.
+ *
+ * The map is first loaded with --keys entries by all the threads together,
+ * growing from empty through its incremental migrations, every insert is
+ * timed to show that growing never stalls a writer for long. Then every
+ * thread runs a mixed workload for --duration seconds on random keys:
+ * --reads percent of lookups, and writes split between updates of existing
+ * keys, inserts of new ones and deletions of those, so that the size stays
+ * the same. One operation every 16 is timed.
+ *
+ * Results are printed as a single JSON line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "bench.h"
+#include "../src/hashmap.h"
+
+
+static struct {
+    size_t keys;
+    int threads;
+    int reads;
+    size_t shards;
+    double duration;
+    double warmup;
+    const char *name;
+    const char *output;
+} opts = {
+    .keys = 1000000,
+    .threads = 4,
+    .reads = 90,
+    .shards = 0,
+    .duration = 5.0,
+    .warmup = 1.0,
+    .name = "hashmap",
+    .output = NULL
+};
+
+
+struct worker {
+    pthread_t tid;
+    int id;
+    HashMap *map;
+    uint64_t rng;
+    uint64_t ops;
+    Histogram load;
+    Histogram hist;
+};
+
+
+static volatile int running = 1;
+static volatile int measuring = 0;
+
+static pthread_barrier_t loaded;
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -k, --keys N           entries loaded in the map (default 1000000)\n"
+            "  -t, --threads N        threads (default 4)\n"
+            "  -r, --reads PERCENT    lookups out of all operations (default 90)\n"
+            "  -s, --shards N         shards of the map (default 64)\n"
+            "  -D, --duration SECS    measurement duration (default 5)\n"
+            "  -w, --warmup SECS      warmup before measuring (default 1)\n"
+            "  -n, --name NAME        scenario name reported in the results\n"
+            "  -o, --output FILE      append results to FILE instead of stdout\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+
+static void parse_options(int argc, char **argv) {
+
+    static const struct option long_opts[] = {
+        { "keys", required_argument, NULL, 'k' },
+        { "threads", required_argument, NULL, 't' },
+        { "reads", required_argument, NULL, 'r' },
+        { "shards", required_argument, NULL, 's' },
+        { "duration", required_argument, NULL, 'D' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "name", required_argument, NULL, 'n' },
+        { "output", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "k:t:r:s:D:w:n:o:",
+                    long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'k': opts.keys = strtoull(optarg, NULL, 10); break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 'r': opts.reads = atoi(optarg); break;
+            case 's': opts.shards = strtoul(optarg, NULL, 10); break;
+            case 'D': opts.duration = atof(optarg); break;
+            case 'w': opts.warmup = atof(optarg); break;
+            case 'n': opts.name = optarg; break;
+            case 'o': opts.output = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (opts.keys == 0 || opts.threads < 1 || opts.reads < 0
+            || opts.reads > 100)
+        usage(argv[0]);
+}
+
+/* xorshift64* */
+static inline uint64_t next_rand(uint64_t *s) {
+
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+
+    return *s * 0x2545f4914f6cdd1dULL;
+}
+
+/* Keys start from 1, the map doesn't care but NULL values would be
+   ambiguous to a reader of the code */
+static inline void *key_of(uint64_t i) {
+    return (void *) (uintptr_t) (i + 1);
+}
+
+
+static void *worker_loop(void *arg) {
+
+    struct worker *w = arg;
+    size_t from = opts.keys / opts.threads * w->id;
+    size_t to = w->id == opts.threads - 1 ? opts.keys
+        : from + opts.keys / opts.threads;
+
+    for (size_t i = from; i < to; ++i) {
+        uint64_t start = now_ns();
+        hashmap_put(w->map, key_of(i), key_of(i), NULL, NULL);
+        hist_record(&w->load, now_ns() - start);
+    }
+
+    pthread_barrier_wait(&loaded);
+
+    /* Keys inserted and deleted by the workload, past the loaded ones and
+       apart from those of the other threads */
+    uint64_t fresh = opts.keys + ((uint64_t) w->id << 40), last = 0;
+    void *val;
+
+    while (running) {
+
+        uint64_t r = next_rand(&w->rng), start = 0;
+        int timed = measuring && (w->ops & 15) == 0;
+
+        if (timed)
+            start = now_ns();
+
+        if ((int) (r % 100) < opts.reads) {
+            hashmap_get(w->map, key_of((r >> 8) % opts.keys), &val);
+        } else if (r & (1ULL << 7)) {
+            hashmap_put(w->map, key_of((r >> 8) % opts.keys), &val, NULL,
+                        NULL);
+        } else if (last == 0) {
+            last = ++fresh;
+            hashmap_put(w->map, key_of(last), &val, NULL, NULL);
+        } else {
+            hashmap_del(w->map, key_of(last), NULL, NULL);
+            last = 0;
+        }
+
+        if (timed)
+            hist_record(&w->hist, now_ns() - start);
+
+        if (measuring)
+            w->ops++;
+    }
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv) {
+
+    parse_options(argc, argv);
+
+    HashMap *map = hashmap_new(opts.shards, hashmap_hash_int,
+                               hashmap_eq_int);
+    struct worker *workers = calloc(opts.threads, sizeof(*workers));
+
+    if (!workers) {
+        perror("malloc(3) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_init(&loaded, NULL, opts.threads + 1);
+
+    uint64_t load_start = now_ns();
+
+    for (int i = 0; i < opts.threads; ++i) {
+        struct worker *w = &workers[i];
+        w->id = i;
+        w->map = map;
+        w->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        hist_init(&w->load);
+        hist_init(&w->hist);
+        pthread_create(&w->tid, NULL, worker_loop, w);
+    }
+
+    pthread_barrier_wait(&loaded);
+
+    double load_secs = (now_ns() - load_start) / 1e9;
+
+    usleep((useconds_t) (opts.warmup * 1e6));
+
+    uint64_t start = now_ns();
+    measuring = 1;
+
+    usleep((useconds_t) (opts.duration * 1e6));
+
+    measuring = 0;
+    double elapsed = (now_ns() - start) / 1e9;
+    running = 0;
+
+    Histogram load, hist;
+    uint64_t ops = 0;
+
+    hist_init(&load);
+    hist_init(&hist);
+
+    for (int i = 0; i < opts.threads; ++i) {
+        pthread_join(workers[i].tid, NULL);
+        hist_merge(&load, &workers[i].load);
+        hist_merge(&hist, &workers[i].hist);
+        ops += workers[i].ops;
+    }
+
+    FILE *fp = stdout;
+
+    if (opts.output && !(fp = fopen(opts.output, "a"))) {
+        perror(opts.output);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(fp, "{\"scenario\":\"%s\",\"mode\":\"hashmap\",\"keys\":%zu,"
+            "\"threads\":%d,\"shards\":%zu,\"reads\":%d,\"load_secs\":%.3f,"
+            "\"load_ops\":%.1f,\"load_latency_ns\":",
+            opts.name, opts.keys, opts.threads, map->nshards, opts.reads,
+            load_secs, opts.keys / load_secs);
+    hist_json(fp, &load);
+    fprintf(fp, ",\"duration\":%.3f,\"ops\":%" PRIu64 ",\"ops_per_sec\":%.1f,"
+            "\"size\":%zu,\"latency_ns\":", elapsed, ops, ops / elapsed,
+            hashmap_size(map));
+    hist_json(fp, &hist);
+    fprintf(fp, "}\n");
+
+    if (fp != stdout)
+        fclose(fp);
+
+    hashmap_free(map, NULL);
+    pthread_barrier_destroy(&loaded);
+    free(workers);
+
+    return 0;
+}
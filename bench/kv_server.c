@@ -0,0 +1,501 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * In-memory key-value server speaking RESP2 and RESP3, a reference workload
+ * closer to a real cache service than the fixed size handlers of
+ * bench_server.c, and a template for one. It serves GET, SET, DEL, MGET,
+ * INCR and what the usual load tools send around them (PING, ECHO, HELLO,
+ * COMMAND, CONFIG, CLIENT, SELECT, DBSIZE, QUIT), so redis-benchmark,
+ * memtier_benchmark or loadgen --request can drive it.
+ *
+ * Every connection runs a coroutine parsing commands from its input buffer,
+ * pipelined ones are executed in order and their replies written together
+ * once the input runs out. Keys live in a HashMap, whose shards are locked
+ * and grown independently.
+ *
+ * The server runs until SIGINT or SIGTERM.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include "../src/resp.h"
+#include "../src/hashmap.h"
+#include "../src/vessel.h"
+
+
+#define KV_BUFSIZE      (64 * 1024)
+
+/* Replies are written once they reach this size even with more commands
+   pending, to bound the output buffer of long pipelines */
+#define KV_FLUSH        (256 * 1024)
+
+
+/* Stored keys are a RespStr pointing to the bytes following it, so that
+   lookups can pass the RespStr of the command in place */
+struct key {
+    RespStr str;
+    char data[];
+};
+
+
+static HashMap *kv;
+
+
+static Config conf = {
+    .epoll_events = 64,
+    .epoll_workers = 4,
+    .addr = "127.0.0.1",
+    .port = "6379",
+    .use_ssl = 0
+};
+
+
+static uint64_t hash_key(const void *k) {
+
+    const RespStr *s = k;
+
+    return hashmap_hash_bytes(s->p, s->len);
+}
+
+
+static int eq_key(const void *a, const void *b) {
+
+    const RespStr *x = a, *y = b;
+
+    return x->len == y->len && memcmp(x->p, y->p, x->len) == 0;
+}
+
+
+static struct key *new_key(const RespStr *k) {
+
+    struct key *key = malloc(sizeof(*key) + k->len);
+
+    if (!key) {
+        perror("allocating key");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(key->data, k->p, k->len);
+    key->str.p = key->data;
+    key->str.len = k->len;
+
+    return key;
+}
+
+
+static void free_entry(void *key, void *val) {
+
+    free(key);
+    sbuf_put(val);
+}
+
+/* The value is copied in the reply with the shard locked for reading, it's
+   as cheap as taking a reference to it for the sizes of a cache */
+static void copy_value(const void *key, void *val, void *arg) {
+
+    (void) key;
+
+    Sbuf *v = val;
+
+    resp_add_bulk(arg, v->data, v->len);
+}
+
+
+static void kv_get(const RespStr *k, RespOut *out) {
+
+    if (!hashmap_read(kv, k, copy_value, out))
+        resp_add_null(out);
+}
+
+/* Store a value, taking over the reference. The key is allocated out of
+   the lock, and freed along with the old value if it was there already */
+static void kv_set(const RespStr *k, Sbuf *val) {
+
+    void *old_key, *old_val;
+
+    if (hashmap_put(kv, new_key(k), val, &old_key, &old_val))
+        free_entry(old_key, old_val);
+}
+
+
+static int kv_del(const RespStr *k) {
+
+    void *old_key, *old_val;
+
+    if (!hashmap_del(kv, k, &old_key, &old_val))
+        return 0;
+
+    free_entry(old_key, old_val);
+
+    return 1;
+}
+
+
+struct incr {
+    int64_t v;
+    Sbuf *old;
+};
+
+
+static int incr_value(void **key, void **val, int found, void *arg) {
+
+    struct incr *in = arg;
+    char tmp[24];
+
+    if (found) {
+        Sbuf *cur = *val;
+        RespStr s = { (const char *) cur->data, cur->len };
+        if (resp_to_int(&s, &in->v) < 0 || in->v == INT64_MAX)
+            return 0;
+        in->old = cur;
+    } else {
+        *key = new_key(*key);
+    }
+
+    *val = sbuf_from(tmp, snprintf(tmp, sizeof(tmp), "%" PRId64, ++in->v));
+
+    return 1;
+}
+
+/* Increment the integer stored at a key, a missing one counting as 0.
+   Return -1 if the value isn't an integer or would overflow */
+static int kv_incr(const RespStr *k, int64_t *result) {
+
+    struct incr in = { 0, NULL };
+
+    if (!hashmap_update(kv, k, incr_value, &in))
+        return -1;
+
+    sbuf_put(in.old);
+
+    *result = in.v;
+
+    return 0;
+}
+
+
+/*
+ * Commands
+ */
+
+static inline int is(const RespStr *s, const char *name) {
+    return s->len == strlen(name) && strncasecmp(s->p, name, s->len) == 0;
+}
+
+
+static void wrong_args(RespOut *out, const RespStr *cmd) {
+
+    char msg[128];
+
+    snprintf(msg, sizeof(msg),
+             "ERR wrong number of arguments for '%.*s' command",
+             (int) (cmd->len < 32 ? cmd->len : 32), cmd->p);
+    resp_add_error(out, msg);
+}
+
+
+static void hello(RespOut *out, const RespStr *argv, size_t argc) {
+
+    int64_t proto = out->proto;
+
+    if (argc > 1 && (resp_to_int(&argv[1], &proto) < 0
+                     || proto < 2 || proto > 3)) {
+        resp_add_error(out, "NOPROTO unsupported protocol version");
+        return;
+    }
+
+    out->proto = proto;
+
+    resp_add_map(out, 5);
+    resp_add_bulk(out, "server", 6);
+    resp_add_bulk(out, "vessel", 6);
+    resp_add_bulk(out, "proto", 5);
+    resp_add_integer(out, proto);
+    resp_add_bulk(out, "mode", 4);
+    resp_add_bulk(out, "standalone", 10);
+    resp_add_bulk(out, "role", 4);
+    resp_add_bulk(out, "master", 6);
+    resp_add_bulk(out, "modules", 7);
+    resp_add_array(out, 0);
+}
+
+/* Execute a command appending its reply, return 1 to close the connection
+   after writing it */
+static int execute(const RespStr *argv, size_t argc, RespOut *out) {
+
+    const RespStr *cmd = &argv[0];
+
+    if (is(cmd, "GET")) {
+        if (argc != 2)
+            wrong_args(out, cmd);
+        else
+            kv_get(&argv[1], out);
+    } else if (is(cmd, "SET")) {
+        /* No expiry or conditions */
+        if (argc < 3) {
+            wrong_args(out, cmd);
+        } else if (argc > 3) {
+            resp_add_error(out, "ERR syntax error");
+        } else {
+            kv_set(&argv[1], sbuf_from(argv[2].p, argv[2].len));
+            resp_add_simple(out, "OK");
+        }
+    } else if (is(cmd, "DEL")) {
+        int64_t n = 0;
+        if (argc < 2) {
+            wrong_args(out, cmd);
+        } else {
+            for (size_t i = 1; i < argc; ++i)
+                n += kv_del(&argv[i]);
+            resp_add_integer(out, n);
+        }
+    } else if (is(cmd, "MGET")) {
+        if (argc < 2) {
+            wrong_args(out, cmd);
+        } else {
+            resp_add_array(out, argc - 1);
+            for (size_t i = 1; i < argc; ++i)
+                kv_get(&argv[i], out);
+        }
+    } else if (is(cmd, "INCR")) {
+        int64_t v;
+        if (argc != 2)
+            wrong_args(out, cmd);
+        else if (kv_incr(&argv[1], &v) < 0)
+            resp_add_error(out, "ERR value is not an integer or out of range");
+        else
+            resp_add_integer(out, v);
+    } else if (is(cmd, "PING")) {
+        if (argc == 1)
+            resp_add_simple(out, "PONG");
+        else if (argc == 2)
+            resp_add_bulk(out, argv[1].p, argv[1].len);
+        else
+            wrong_args(out, cmd);
+    } else if (is(cmd, "ECHO")) {
+        if (argc != 2)
+            wrong_args(out, cmd);
+        else
+            resp_add_bulk(out, argv[1].p, argv[1].len);
+    } else if (is(cmd, "DBSIZE")) {
+        resp_add_integer(out, hashmap_size(kv));
+    } else if (is(cmd, "HELLO")) {
+        hello(out, argv, argc);
+    } else if (is(cmd, "COMMAND") || is(cmd, "CONFIG")) {
+        /* Nothing to tell the clients asking on connection */
+        resp_add_map(out, 0);
+    } else if (is(cmd, "CLIENT") || is(cmd, "SELECT")) {
+        resp_add_simple(out, "OK");
+    } else if (is(cmd, "QUIT")) {
+        resp_add_simple(out, "OK");
+        return 1;
+    } else {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "ERR unknown command '%.*s'",
+                 (int) (cmd->len < 32 ? cmd->len : 32), cmd->p);
+        resp_add_error(out, msg);
+    }
+
+    return 0;
+}
+
+/* Coroutine handler of the connections */
+static void kv_serve(Client *c) {
+
+    size_t cap = KV_BUFSIZE, len = 0;
+    char *in = malloc(cap);
+    RespStr *argv = malloc(RESP_MAX_VALUES * sizeof(*argv));
+    RespOut out;
+    int quit = 0;
+
+    if (!in || !argv) {
+        perror("allocating connection buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    resp_out_init(&out, 2);
+
+    while (!quit) {
+
+        size_t off = 0, argc;
+        ssize_t n;
+
+        while ((n = resp_parse_command(in + off, len - off, argv,
+                                       RESP_MAX_VALUES, &argc)) > 0) {
+            off += n;
+            if (argc > 0 && (quit = execute(argv, argc, &out)))
+                break;
+            if (resp_out_len(&out) >= KV_FLUSH) {
+                if (vessel_write(c, resp_out_data(&out),
+                                 resp_out_len(&out)) < 0)
+                    goto out;
+                resp_out_reset(&out);
+            }
+        }
+
+        if (n < 0) {
+            resp_add_error(&out, "ERR Protocol error");
+            quit = 1;
+        }
+
+        if (resp_out_len(&out) > 0) {
+            if (vessel_write(c, resp_out_data(&out), resp_out_len(&out)) < 0)
+                break;
+            resp_out_reset(&out);
+        }
+
+        if (quit)
+            break;
+
+        memmove(in, in + off, len - off);
+        len -= off;
+
+        /* A value larger than the buffer, the parser refuses them past
+           RESP_MAX_BULK */
+        if (len == cap && !(in = realloc(in, cap *= 2))) {
+            perror("growing connection buffer");
+            exit(EXIT_FAILURE);
+        }
+
+        if ((n = vessel_read(c, in + len, cap - len)) <= 0)
+            break;
+
+        len += n;
+    }
+
+out:
+    resp_out_free(&out);
+    free(argv);
+    free(in);
+}
+
+/* Keys key:0 to key:n-1, all with the same value */
+static void preload(size_t n, size_t size) {
+
+    char key[32], *val = malloc(size);
+
+    if (!val) {
+        perror("allocating value");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < size; ++i)
+        val[i] = 'a' + i % 26;
+
+    for (size_t i = 0; i < n; ++i) {
+        RespStr k = { key, snprintf(key, sizeof(key), "key:%zu", i) };
+        kv_set(&k, sbuf_from(val, size));
+    }
+
+    free(val);
+}
+
+
+static void *run_server(void *arg) {
+    start_server(&conf);
+    return NULL;
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -a, --addr ADDR        listen address (default 127.0.0.1)\n"
+            "  -p, --port PORT        listen port (default 6379)\n"
+            "  -w, --workers N        epoll workers (default 4)\n"
+            "  -n, --preload N        store keys key:0 to key:N-1 at startup\n"
+            "  -v, --value BYTES      size of the preloaded values (default 64)\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv) {
+
+    static const struct option long_opts[] = {
+        { "addr", required_argument, NULL, 'a' },
+        { "port", required_argument, NULL, 'p' },
+        { "workers", required_argument, NULL, 'w' },
+        { "preload", required_argument, NULL, 'n' },
+        { "value", required_argument, NULL, 'v' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    size_t keys = 0, value = 64;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "a:p:w:n:v:",
+                    long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'a': conf.addr = optarg; break;
+            case 'p': conf.port = optarg; break;
+            case 'w': conf.epoll_workers = atoi(optarg); break;
+            case 'n': keys = strtoul(optarg, NULL, 10); break;
+            case 'v': value = strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (conf.epoll_workers < 1)
+        usage(argv[0]);
+
+    kv = hashmap_new(0, hash_key, eq_key);
+    preload(keys, value);
+
+    conf.co_handler = kv_serve;
+
+    /* Signals are handled synchronously by the main thread only */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t server;
+    pthread_create(&server, NULL, run_server, NULL);
+
+    int sig;
+    sigwait(&set, &sig);
+
+    stop_server();
+    pthread_join(server, NULL);
+
+    fprintf(stderr, "keys %zu\n", hashmap_size(kv));
+
+    hashmap_free(kv, free_entry);
+
+    return 0;
+}
@@ -0,0 +1,839 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Multi-threaded, non-blocking load generator for vessel servers.
+ *
+ * Every thread owns an epoll instance and a slice of the connections, each
+ * connection writes fixed size requests and expects fixed size responses, that
+ * is enough to frame the traffic of the reference servers in bench_server.c
+ * without parsing anything. Two modes are supported:
+ *
+ * - closed loop: every connection keeps `depth` requests in flight, a new one
+ *   is sent as soon as a response is complete
+ * - open loop: requests are scheduled at a fixed total rate regardless of the
+ *   responses, latency is measured from the intended send time so a stalled
+ *   server is not hidden by a stalled client (coordinated omission)
+ *
+ * With --request every request is the given string, with C escapes, for
+ * servers speaking an actual protocol, as long as the responses have a
+ * fixed size: "GET key:1\r\n" against kv_server.c for example.
+ *
+ * Connections go over TCP, or over a unix socket with --unix, so the two
+ * transports can be compared against the same server handlers.
+ *
+ * Results are printed as a single JSON line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "bench.h"
+
+
+#define READ_BUFSIZE    (64 * 1024)
+#define WRITE_BUFSIZE   (64 * 1024)
+/* Max requests in flight on a single connection in open loop mode */
+#define MAX_INFLIGHT    4096
+
+
+struct options {
+    const char *host;
+    const char *port;
+    const char *name;
+    const char *output;
+    int connections;
+    int idle;
+    int threads;
+    int depth;
+    size_t payload;
+    size_t response;
+    double rate;
+    double duration;
+    double warmup;
+    int tls;
+    /* Unix socket path, '@' for abstract names, instead of host and port */
+    const char *unix_path;
+    /* Request sent in place of the generated payload, unescaped */
+    char *request;
+};
+
+
+struct conn {
+    int fd;
+    SSL *ssl;
+    /* Events currently armed on the epoll instance */
+    int events;
+    /* Bytes of requests still to be written and offset in the current one */
+    size_t wpending;
+    size_t woff;
+    /* Bytes received of the response currently being read */
+    size_t rgot;
+    /* FIFO of send timestamps of in-flight requests, head and tail are
+       monotonically increasing, capacity is a power of two */
+    uint64_t *stamps;
+    size_t shead;
+    size_t stail;
+    size_t smask;
+    /* Open loop only, intended time of the next request */
+    uint64_t next_send;
+};
+
+
+struct worker {
+    pthread_t tid;
+    int epollfd;
+    struct conn *conns;
+    int nconns;
+    /* Open loop only, interval between requests on a single connection */
+    uint64_t interval;
+    Histogram hist;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes_sent;
+    uint64_t bytes_recv;
+};
+
+
+static struct options opts = {
+    .host = "127.0.0.1",
+    .port = "4040",
+    .name = "default",
+    .output = NULL,
+    .connections = 16,
+    .idle = 0,
+    .threads = 1,
+    .depth = 1,
+    .payload = 64,
+    .response = 0,
+    .rate = 0.0,
+    .duration = 5.0,
+    .warmup = 1.0,
+    .tls = 0
+};
+
+
+/* Requests repeated back to back, a connection writes from its offset in the
+   current request up to the end of the buffer in a single call */
+static uint8_t *wbuf;
+static size_t wbuf_len;
+
+static SSL_CTX *ssl_ctx;
+
+static volatile int running = 1;
+static volatile int measuring = 0;
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -h, --host HOST        server address (default 127.0.0.1)\n"
+            "  -p, --port PORT        server port (default 4040)\n"
+            "  -c, --connections N    active connections (default 16)\n"
+            "  -i, --idle N           additional idle connections (default 0)\n"
+            "  -t, --threads N        generator threads (default 1)\n"
+            "  -d, --depth N          pipelined requests per connection (default 1)\n"
+            "  -s, --size BYTES       request payload size (default 64)\n"
+            "  -q, --request STR      send STR as the request, \\r \\n \\t \\\\ unescaped\n"
+            "  -r, --response BYTES   expected response size (default: request size)\n"
+            "  -R, --rate REQS        open loop at REQS requests/s total (default: closed loop)\n"
+            "  -D, --duration SECS    measurement duration (default 5)\n"
+            "  -w, --warmup SECS      warmup before measuring (default 1)\n"
+            "  -S, --tls              use TLS\n"
+            "  -U, --unix PATH        connect to a unix socket, @name for abstract ones\n"
+            "  -n, --name NAME        scenario name reported in the results\n"
+            "  -o, --output FILE      append results to FILE instead of stdout\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+
+/* Replace the C escapes of a string in place */
+static char *unescape(char *s) {
+
+    char *out = s;
+
+    for (const char *p = s; *p; ++p) {
+        if (*p != '\\' || !p[1]) {
+            *out++ = *p;
+            continue;
+        }
+        switch (*++p) {
+            case 'r': *out++ = '\r'; break;
+            case 'n': *out++ = '\n'; break;
+            case 't': *out++ = '\t'; break;
+            default: *out++ = *p; break;
+        }
+    }
+
+    *out = '\0';
+
+    return s;
+}
+
+
+static void parse_options(int argc, char **argv) {
+
+    static const struct option long_opts[] = {
+        { "host", required_argument, NULL, 'h' },
+        { "port", required_argument, NULL, 'p' },
+        { "connections", required_argument, NULL, 'c' },
+        { "idle", required_argument, NULL, 'i' },
+        { "threads", required_argument, NULL, 't' },
+        { "depth", required_argument, NULL, 'd' },
+        { "size", required_argument, NULL, 's' },
+        { "request", required_argument, NULL, 'q' },
+        { "response", required_argument, NULL, 'r' },
+        { "rate", required_argument, NULL, 'R' },
+        { "duration", required_argument, NULL, 'D' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "tls", no_argument, NULL, 'S' },
+        { "unix", required_argument, NULL, 'U' },
+        { "name", required_argument, NULL, 'n' },
+        { "output", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "h:p:c:i:t:d:s:q:r:R:D:w:SU:n:o:",
+                    long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'h': opts.host = optarg; break;
+            case 'p': opts.port = optarg; break;
+            case 'c': opts.connections = atoi(optarg); break;
+            case 'i': opts.idle = atoi(optarg); break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 'd': opts.depth = atoi(optarg); break;
+            case 's': opts.payload = strtoul(optarg, NULL, 10); break;
+            case 'q': opts.request = unescape(optarg); break;
+            case 'r': opts.response = strtoul(optarg, NULL, 10); break;
+            case 'R': opts.rate = atof(optarg); break;
+            case 'D': opts.duration = atof(optarg); break;
+            case 'w': opts.warmup = atof(optarg); break;
+            case 'S': opts.tls = 1; break;
+            case 'U': opts.unix_path = optarg; break;
+            case 'n': opts.name = optarg; break;
+            case 'o': opts.output = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (opts.request)
+        opts.payload = strlen(opts.request);
+
+    if (opts.connections < 1 || opts.threads < 1 || opts.depth < 1
+            || opts.payload == 0 || opts.idle < 0)
+        usage(argv[0]);
+
+    if (opts.threads > opts.connections)
+        opts.threads = opts.connections;
+
+    /* Echo is the default reference server */
+    if (opts.response == 0)
+        opts.response = opts.payload;
+}
+
+/* Make room for all the requested connections, idle ones included */
+static void raise_nofile(void) {
+
+    struct rlimit rl;
+    rlim_t needed = opts.connections + opts.idle + opts.threads + 64;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= needed)
+        return;
+
+    rl.rlim_cur = needed < rl.rlim_max ? needed : rl.rlim_max;
+
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        perror("setrlimit(2)");
+}
+
+
+static int set_nonblocking(const int fd) {
+
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1)
+        return -1;
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Fill an addrinfo with the unix socket address of a path, same rules of
+   unix_address in networking.c, '@' selects the abstract namespace */
+static int unix_address(const char *path, struct sockaddr_un *sun,
+                        struct addrinfo *ai) {
+
+    size_t len = strlen(path);
+
+    if (len == 0 || len >= sizeof(sun->sun_path))
+        return -1;
+
+    memset(sun, 0, sizeof(*sun));
+    memset(ai, 0, sizeof(*ai));
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, path, len);
+
+    ai->ai_family = AF_UNIX;
+    ai->ai_socktype = SOCK_STREAM;
+    ai->ai_addr = (struct sockaddr *) sun;
+    ai->ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+
+    if (path[0] == '@') {
+        sun->sun_path[0] = '\0';
+        ai->ai_addrlen--;
+    }
+
+    return 0;
+}
+
+/* Blocking connect, the TLS handshake too is completed here, before the
+   descriptor is switched to non-blocking mode */
+static int open_connection(struct addrinfo *ai, SSL **ssl) {
+
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+    if (fd < 0) {
+        perror("socket(2)");
+        return -1;
+    }
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        perror("connect(2)");
+        close(fd);
+        return -1;
+    }
+
+    if (ai->ai_family != AF_UNIX)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) { 1 }, sizeof(int));
+
+    if (ssl) {
+        *ssl = SSL_new(ssl_ctx);
+        SSL_set_fd(*ssl, fd);
+        SSL_set_mode(*ssl, SSL_MODE_ENABLE_PARTIAL_WRITE
+                | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        if (SSL_connect(*ssl) <= 0) {
+            ERR_print_errors_fp(stderr);
+            SSL_free(*ssl);
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (set_nonblocking(fd) < 0) {
+        perror("fcntl(2)");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static inline size_t inflight(const struct conn *c) {
+    return c->shead - c->stail;
+}
+
+
+static inline void queue_request(struct conn *c, uint64_t stamp) {
+    c->stamps[c->shead++ & c->smask] = stamp;
+    c->wpending += opts.payload;
+}
+
+/* Count a complete response, in closed loop mode a new request replaces it */
+static void complete_response(struct worker *w, struct conn *c, uint64_t now) {
+
+    uint64_t stamp = c->stamps[c->stail++ & c->smask];
+
+    if (measuring) {
+        hist_record(&w->hist, now > stamp ? now - stamp : 0);
+        w->requests++;
+    }
+
+    if (opts.rate == 0.0 && running)
+        queue_request(c, now);
+}
+
+
+static ssize_t conn_send(struct conn *c, const uint8_t *buf, size_t len) {
+
+    if (!c->ssl)
+        return send(c->fd, buf, len, MSG_NOSIGNAL);
+
+    int n = SSL_write(c->ssl, buf, len);
+
+    if (n > 0)
+        return n;
+
+    int err = SSL_get_error(c->ssl, n);
+
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+        errno = EAGAIN;
+    else
+        errno = EIO;
+
+    return -1;
+}
+
+
+static ssize_t conn_recv(struct conn *c, uint8_t *buf, size_t len) {
+
+    if (!c->ssl)
+        return recv(c->fd, buf, len, 0);
+
+    int n = SSL_read(c->ssl, buf, len);
+
+    if (n > 0)
+        return n;
+
+    int err = SSL_get_error(c->ssl, n);
+
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return err == SSL_ERROR_ZERO_RETURN ? 0 : (errno = EIO, -1);
+}
+
+/* Write as much of the pending requests as the socket accepts */
+static int conn_write(struct worker *w, struct conn *c) {
+
+    while (c->wpending > 0) {
+
+        size_t chunk = wbuf_len - c->woff;
+
+        if (chunk > c->wpending)
+            chunk = c->wpending;
+
+        ssize_t n = conn_send(c, wbuf + c->woff, chunk);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        c->wpending -= n;
+        c->woff = (c->woff + n) % opts.payload;
+
+        if (measuring)
+            w->bytes_sent += n;
+    }
+
+    return 0;
+}
+
+/* Drain the socket, splitting the stream in fixed size responses */
+static int conn_read(struct worker *w, struct conn *c, uint8_t *buf) {
+
+    for (;;) {
+
+        ssize_t n = conn_recv(c, buf, READ_BUFSIZE);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        /* Server closed the connection */
+        if (n == 0)
+            return -1;
+
+        if (measuring)
+            w->bytes_recv += n;
+
+        uint64_t now = now_ns();
+
+        while (n > 0) {
+
+            size_t take = opts.response - c->rgot;
+
+            if (take > (size_t) n)
+                take = n;
+
+            c->rgot += take;
+            n -= take;
+
+            if (c->rgot == opts.response) {
+                c->rgot = 0;
+                /* More bytes than requested, nothing to match them with */
+                if (inflight(c) == 0)
+                    return -1;
+                complete_response(w, c, now);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Open loop scheduling, queue every request due by now */
+static void schedule_requests(struct worker *w, struct conn *c, uint64_t now) {
+    while (c->next_send <= now && inflight(c) < MAX_INFLIGHT) {
+        queue_request(c, c->next_send);
+        c->next_send += w->interval;
+    }
+}
+
+
+static void conn_rearm(struct worker *w, struct conn *c) {
+
+    int events = EPOLLIN | (c->wpending > 0 ? EPOLLOUT : 0);
+
+    if (events == c->events)
+        return;
+
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+        perror("epoll_ctl(2)");
+
+    c->events = events;
+}
+
+
+static void conn_fail(struct worker *w, struct conn *c) {
+
+    if (running)
+        w->errors++;
+
+    epoll_ctl(w->epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+
+    if (c->ssl) {
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+
+    close(c->fd);
+    c->fd = -1;
+}
+
+
+static void *worker_loop(void *arg) {
+
+    struct worker *w = arg;
+    uint8_t *rbuf = malloc(READ_BUFSIZE);
+    struct epoll_event *evs = malloc(sizeof(*evs) * w->nconns);
+
+    if (!rbuf || !evs) {
+        perror("malloc(3) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t now = now_ns();
+
+    for (int i = 0; i < w->nconns; ++i) {
+        struct conn *c = &w->conns[i];
+        if (opts.rate > 0.0) {
+            /* Spread the first requests over a single interval */
+            c->next_send = now + w->interval * i / w->nconns;
+        } else {
+            for (int j = 0; j < opts.depth; ++j)
+                queue_request(c, now);
+        }
+        conn_write(w, c);
+        conn_rearm(w, c);
+    }
+
+    while (running) {
+
+        int timeout = opts.rate > 0.0 ? 1 : 100;
+        int n = epoll_wait(w->epollfd, evs, w->nconns, timeout);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait(2)");
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+
+            struct conn *c = evs[i].data.ptr;
+
+            if (c->fd < 0)
+                continue;
+
+            if (evs[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn_fail(w, c);
+                continue;
+            }
+
+            if ((evs[i].events & EPOLLIN) && conn_read(w, c, rbuf) < 0) {
+                conn_fail(w, c);
+                continue;
+            }
+
+            if (c->wpending > 0 && conn_write(w, c) < 0) {
+                conn_fail(w, c);
+                continue;
+            }
+
+            conn_rearm(w, c);
+        }
+
+        if (opts.rate > 0.0) {
+            now = now_ns();
+            for (int i = 0; i < w->nconns; ++i) {
+                struct conn *c = &w->conns[i];
+                if (c->fd < 0)
+                    continue;
+                schedule_requests(w, c, now);
+                if (conn_write(w, c) < 0) {
+                    conn_fail(w, c);
+                    continue;
+                }
+                conn_rearm(w, c);
+            }
+        }
+    }
+
+    free(evs);
+    free(rbuf);
+
+    return NULL;
+}
+
+
+static void report(FILE *fp, struct worker *workers, double elapsed) {
+
+    Histogram hist;
+    uint64_t requests = 0, errors = 0, sent = 0, recvd = 0;
+
+    hist_init(&hist);
+
+    for (int i = 0; i < opts.threads; ++i) {
+        hist_merge(&hist, &workers[i].hist);
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        sent += workers[i].bytes_sent;
+        recvd += workers[i].bytes_recv;
+    }
+
+    fprintf(fp, "{\"scenario\":\"%s\",\"mode\":\"%s\",\"transport\":\"%s\","
+            "\"connections\":%d,"
+            "\"idle\":%d,\"threads\":%d,\"depth\":%d,\"payload\":%zu,"
+            "\"response\":%zu,\"rate\":%.0f,\"tls\":%s,\"duration\":%.3f,"
+            "\"requests\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"rps\":%.1f,"
+            "\"bytes_sent\":%" PRIu64 ",\"bytes_recv\":%" PRIu64 ","
+            "\"tx_bps\":%.1f,\"rx_bps\":%.1f,\"latency_ns\":",
+            opts.name, opts.rate > 0.0 ? "open" : "closed",
+            opts.unix_path ? "unix" : "tcp", opts.connections,
+            opts.idle, opts.threads, opts.depth, opts.payload, opts.response,
+            opts.rate, opts.tls ? "true" : "false", elapsed, requests, errors,
+            requests / elapsed, sent, recvd, sent / elapsed, recvd / elapsed);
+    hist_json(fp, &hist);
+    fprintf(fp, "}\n");
+}
+
+
+int main(int argc, char **argv) {
+
+    parse_options(argc, argv);
+    raise_nofile();
+
+    if (opts.tls) {
+        SSL_load_error_strings();
+        OpenSSL_add_ssl_algorithms();
+        ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+        if (!ssl_ctx) {
+            ERR_print_errors_fp(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Request payload, the reference servers accept any non-NUL byte */
+    size_t reps = WRITE_BUFSIZE / opts.payload + 2;
+    wbuf_len = opts.payload * reps;
+    wbuf = malloc(wbuf_len);
+
+    if (!wbuf) {
+        perror("malloc(3) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < wbuf_len; ++i)
+        wbuf[i] = opts.request ? opts.request[i % opts.payload]
+            : 'a' + (i % opts.payload) % 26;
+
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+    struct addrinfo *ai, unix_ai;
+    struct sockaddr_un sun;
+
+    if (opts.unix_path) {
+        /* A single address, no resolution needed */
+        if (unix_address(opts.unix_path, &sun, &unix_ai) < 0) {
+            fprintf(stderr, "Invalid unix socket path %s\n", opts.unix_path);
+            exit(EXIT_FAILURE);
+        }
+        ai = &unix_ai;
+    } else if (getaddrinfo(opts.host, opts.port, &hints, &ai) != 0) {
+        perror("getaddrinfo error");
+        exit(EXIT_FAILURE);
+    }
+
+    /* In-flight FIFO capacity, rounded up to a power of two */
+    size_t scap = 1;
+    size_t maxflight = opts.rate > 0.0 ? MAX_INFLIGHT : (size_t) opts.depth;
+
+    while (scap < maxflight)
+        scap <<= 1;
+
+    struct worker *workers = calloc(opts.threads, sizeof(*workers));
+    struct conn *conns = calloc(opts.connections, sizeof(*conns));
+    int *idle = malloc(sizeof(int) * (opts.idle + 1));
+
+    if (!workers || !conns || !idle) {
+        perror("malloc(3) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < opts.idle; ++i) {
+        idle[i] = open_connection(ai, NULL);
+        if (idle[i] < 0)
+            exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0, next = 0; i < opts.threads; ++i) {
+
+        struct worker *w = &workers[i];
+
+        w->nconns = opts.connections / opts.threads
+            + (i < opts.connections % opts.threads);
+        w->conns = &conns[next];
+        w->epollfd = epoll_create1(0);
+        hist_init(&w->hist);
+
+        if (w->epollfd < 0) {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+
+        if (opts.rate > 0.0)
+            w->interval = (uint64_t) (1e9 * opts.connections / opts.rate);
+
+        for (int j = 0; j < w->nconns; ++j) {
+
+            struct conn *c = &w->conns[j];
+
+            c->fd = open_connection(ai, opts.tls ? &c->ssl : NULL);
+            c->smask = scap - 1;
+            c->stamps = malloc(sizeof(uint64_t) * scap);
+            c->events = EPOLLIN;
+
+            if (c->fd < 0 || !c->stamps)
+                exit(EXIT_FAILURE);
+
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+
+            if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+                perror("epoll_ctl(2)");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        next += w->nconns;
+    }
+
+    if (!opts.unix_path)
+        freeaddrinfo(ai);
+
+    for (int i = 0; i < opts.threads; ++i)
+        pthread_create(&workers[i].tid, NULL, worker_loop, &workers[i]);
+
+    usleep((useconds_t) (opts.warmup * 1e6));
+
+    uint64_t start = now_ns();
+    measuring = 1;
+
+    usleep((useconds_t) (opts.duration * 1e6));
+
+    measuring = 0;
+    double elapsed = (now_ns() - start) / 1e9;
+    running = 0;
+
+    for (int i = 0; i < opts.threads; ++i)
+        pthread_join(workers[i].tid, NULL);
+
+    FILE *fp = stdout;
+
+    if (opts.output && !(fp = fopen(opts.output, "a"))) {
+        perror(opts.output);
+        exit(EXIT_FAILURE);
+    }
+
+    report(fp, workers, elapsed);
+
+    if (fp != stdout)
+        fclose(fp);
+
+    for (int i = 0; i < opts.connections; ++i) {
+        if (conns[i].ssl)
+            SSL_free(conns[i].ssl);
+        if (conns[i].fd >= 0)
+            close(conns[i].fd);
+        free(conns[i].stamps);
+    }
+
+    for (int i = 0; i < opts.idle; ++i)
+        close(idle[i]);
+
+    for (int i = 0; i < opts.threads; ++i)
+        close(workers[i].epollfd);
+
+    if (ssl_ctx)
+        SSL_CTX_free(ssl_ctx);
+
+    free(idle);
+    free(conns);
+    free(workers);
+    free(wbuf);
+
+    return 0;
+}
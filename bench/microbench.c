@@ -0,0 +1,1195 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks of the core primitives: Ringbuf and its searches, List, the
+ * coroutine switch, the HTTP request parser and the sendall and recvall I/O helpers over a
+ * socketpair.
+ *
+ * Every benchmark is calibrated to run for roughly --sample-ms per sample,
+ * warmed up and then repeated --repeats times on a pinned CPU, each sample
+ * being the mean time per operation of a run. Hardware counters are read
+ * through perf_event_open(2) when the kernel allows it. Results are printed
+ * one JSON object per line, compare.c reads them back to spot regressions
+ * against a saved baseline.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "bench.h"
+#include "../src/list.h"
+#include "../src/coro.h"
+#include "../src/http.h"
+#include "../src/hashmap.h"
+#include "../src/trace.h"
+#include "../src/log.h"
+#include "../src/ws.h"
+#include "../src/ringbuf.h"
+#include "../src/typed_ringbuf.h"
+#include "../src/networking.h"
+#include "../src/transport.h"
+
+
+#define MAX_REPEATS     100
+#define NR_COUNTERS     4
+
+
+struct options {
+    const char *filter;
+    const char *output;
+    int repeats;
+    int cpu;
+    double sample_ms;
+    double warmup_ms;
+};
+
+
+struct sample_stats {
+    double mean;
+    double median;
+    double stddev;
+    double min;
+};
+
+
+static struct options opts = {
+    .filter = NULL,
+    .output = NULL,
+    .repeats = 10,
+    .cpu = -1,
+    .sample_ms = 20.0,
+    .warmup_ms = 50.0
+};
+
+
+static const char *counter_names[NR_COUNTERS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+static const uint64_t counter_configs[NR_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/* perf event group leader, -1 if hardware counters are not available */
+static int perf_fd = -1;
+
+static FILE *out;
+
+
+/*
+ * Hardware counters
+ */
+
+static int perf_open(uint64_t config, int group) {
+
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+
+static void perf_init(void) {
+
+    perf_fd = perf_open(counter_configs[0], -1);
+
+    if (perf_fd < 0)
+        return;
+
+    for (int i = 1; i < NR_COUNTERS; ++i) {
+        if (perf_open(counter_configs[i], perf_fd) < 0) {
+            close(perf_fd);
+            perf_fd = -1;
+            return;
+        }
+    }
+}
+
+
+static void perf_start(void) {
+    if (perf_fd < 0)
+        return;
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+
+static void perf_stop(uint64_t *values) {
+
+    struct { uint64_t nr; uint64_t values[NR_COUNTERS]; } group;
+
+    if (perf_fd < 0)
+        return;
+
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    if (read(perf_fd, &group, sizeof(group)) != sizeof(group))
+        return;
+
+    for (int i = 0; i < NR_COUNTERS; ++i)
+        values[i] += group.values[i];
+}
+
+
+/*
+ * Runner
+ */
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+
+static void compute_stats(double *samples, int n, struct sample_stats *s) {
+
+    double sorted[MAX_REPEATS];
+    double sum = 0.0, sq = 0.0;
+
+    memcpy(sorted, samples, sizeof(double) * n);
+    qsort(sorted, n, sizeof(double), cmp_double);
+
+    for (int i = 0; i < n; ++i)
+        sum += samples[i];
+
+    s->mean = sum / n;
+
+    for (int i = 0; i < n; ++i)
+        sq += (samples[i] - s->mean) * (samples[i] - s->mean);
+
+    s->stddev = n > 1 ? sqrt(sq / (n - 1)) : 0.0;
+    s->median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    s->min = sorted[0];
+}
+
+/* Run a benchmark, fn executes `iters` rounds of `ops` operations each, every
+   operation moving `bytes` bytes (0 if not meaningful) */
+static void measure(const char *name, void (*fn)(void *, uint64_t),
+                    void *arg, uint64_t ops, size_t bytes) {
+
+    if (opts.filter && !strstr(name, opts.filter))
+        return;
+
+    /* Calibrate the number of rounds to reach the sample duration, warming up
+       caches, branch predictors and allocator in the meantime */
+    uint64_t iters = 1;
+    uint64_t warmup_end = now_ns() + (uint64_t) (opts.warmup_ms * 1e6);
+
+    for (;;) {
+        uint64_t start = now_ns();
+        fn(arg, iters);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= opts.sample_ms * 1e6 / 2 && now_ns() >= warmup_end)
+            break;
+        if (elapsed < opts.sample_ms * 1e6 / 2)
+            iters *= 2;
+    }
+
+    double samples[MAX_REPEATS];
+    uint64_t counters[NR_COUNTERS] = { 0 };
+
+    for (int r = 0; r < opts.repeats; ++r) {
+        perf_start();
+        uint64_t start = now_ns();
+        fn(arg, iters);
+        uint64_t elapsed = now_ns() - start;
+        perf_stop(counters);
+        samples[r] = (double) elapsed / (iters * ops);
+    }
+
+    struct sample_stats s;
+    compute_stats(samples, opts.repeats, &s);
+
+    fprintf(out, "{\"name\":\"%s\",\"unit\":\"ns/op\",\"ops\":%" PRIu64
+            ",\"repeats\":%d,\"mean\":%.3f,\"median\":%.3f,\"stddev\":%.3f,"
+            "\"min\":%.3f", name, iters * ops, opts.repeats, s.mean, s.median,
+            s.stddev, s.min);
+
+    if (bytes > 0)
+        fprintf(out, ",\"bytes_per_sec\":%.0f", bytes * 1e9 / s.median);
+
+    if (perf_fd >= 0) {
+        double total_ops = (double) iters * ops * opts.repeats;
+        fprintf(out, ",\"counters\":{");
+        for (int i = 0; i < NR_COUNTERS; ++i)
+            fprintf(out, "%s\"%s\":%.3f", i ? "," : "", counter_names[i],
+                    counters[i] / total_ops);
+        fprintf(out, "}");
+    }
+
+    fprintf(out, ",\"samples\":[");
+    for (int r = 0; r < opts.repeats; ++r)
+        fprintf(out, "%s%.3f", r ? "," : "", samples[r]);
+    fprintf(out, "]}\n");
+    fflush(out);
+}
+
+
+/*
+ * Ringbuf
+ */
+
+struct ringbuf_arg {
+    Ringbuf *rbuf;
+    uint8_t *chunk;
+    uint8_t *dest;
+    size_t len;
+};
+
+
+static void bench_ringbuf_push_pop(void *arg, uint64_t iters) {
+
+    struct ringbuf_arg *a = arg;
+    uint8_t b;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        ringbuf_push(a->rbuf, (uint8_t) i);
+        ringbuf_pop(a->rbuf, &b);
+    }
+
+    __asm__ volatile("" : : "r"(b) : "memory");
+}
+
+
+static void bench_ringbuf_bulk(void *arg, uint64_t iters) {
+
+    struct ringbuf_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        ringbuf_bulk_push(a->rbuf, a->chunk, a->len);
+        ringbuf_bulk_pop(a->rbuf, a->dest, a->len);
+    }
+
+    __asm__ volatile("" : : "r"(a->dest) : "memory");
+}
+
+
+static void bench_ringbuf_fill_drain(void *arg, uint64_t iters) {
+
+    struct ringbuf_arg *a = arg;
+    uint8_t b;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        for (size_t j = 0; j < a->len; ++j)
+            ringbuf_push(a->rbuf, (uint8_t) j);
+        while (ringbuf_pop(a->rbuf, &b) == 0)
+            ;
+    }
+
+    __asm__ volatile("" : : "r"(b) : "memory");
+}
+
+
+struct event {
+    int fd;
+    unsigned events;
+    void *ptr;
+};
+
+
+RINGBUF_DECLARE_STATIC(event_ring, struct event, 1024)
+
+
+static void bench_typed_ring_push_pop(void *arg, uint64_t iters) {
+
+    struct event_ring *r = arg;
+    struct event e = { 0, 1, arg };
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        e.fd = (int) i;
+        event_ring_push(r, &e);
+        event_ring_pop(r, &e);
+    }
+
+    __asm__ volatile("" : : "r"(&e) : "memory");
+}
+
+
+static void bench_typed_ring_bulk(void *arg, uint64_t iters) {
+
+    struct event_ring *r = arg;
+    struct event batch[64];
+
+    memset(batch, 0, sizeof(batch));
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        event_ring_push_bulk(r, batch, 64);
+        event_ring_pop_bulk(r, batch, 64);
+    }
+
+    __asm__ volatile("" : : "r"(batch) : "memory");
+}
+
+
+static void ringbuf_benchmarks(void) {
+
+    static const size_t capacities[] = { 64, 4096, 1024 * 1024 };
+    static const size_t chunks[] = { 16, 256, 4096, 65536 };
+    char name[128];
+
+    for (size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]); ++i) {
+
+        uint8_t *buf = malloc(capacities[i]);
+        struct ringbuf_arg a = { ringbuf_init(buf, capacities[i]), NULL, NULL,
+            capacities[i] };
+
+        snprintf(name, sizeof(name), "ringbuf_push_pop/cap=%zu", capacities[i]);
+        measure(name, bench_ringbuf_push_pop, &a, 1, 1);
+
+        snprintf(name, sizeof(name), "ringbuf_fill_drain/cap=%zu",
+                 capacities[i]);
+        measure(name, bench_ringbuf_fill_drain, &a, capacities[i], 1);
+
+        ringbuf_free(a.rbuf);
+        free(buf);
+    }
+
+    /* Typed ring of 16 bytes records, single and in batches of 64 */
+    struct event_ring *er = malloc(sizeof(*er));
+
+    event_ring_init(er);
+    measure("typed_ring_push_pop/record=16", bench_typed_ring_push_pop, er, 1,
+            sizeof(struct event));
+    measure("typed_ring_bulk_push_pop/record=16/batch=64",
+            bench_typed_ring_bulk, er, 64, sizeof(struct event));
+    free(er);
+
+    /* Bulk operations, with a capacity multiple of the chunk no operation
+       straddles the end of the buffer, with 1.5 times the chunk two out of
+       three operations wrap around */
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+        for (int wrap = 0; wrap < 2; ++wrap) {
+
+            size_t len = chunks[i];
+            size_t cap = wrap ? len + len / 2 : len * 4;
+            uint8_t *buf = malloc(cap);
+            struct ringbuf_arg a = { ringbuf_init(buf, cap), malloc(len),
+                malloc(len), len };
+
+            memset(a.chunk, 'x', len);
+
+            snprintf(name, sizeof(name), "ringbuf_bulk_push_pop/chunk=%zu/%s",
+                     len, wrap ? "wrap" : "nowrap");
+            measure(name, bench_ringbuf_bulk, &a, 1, len);
+
+            ringbuf_free(a.rbuf);
+            free(a.chunk);
+            free(a.dest);
+            free(buf);
+        }
+    }
+}
+
+
+/* Searches over 64 KB of text wrapping around the end of the buffer, the
+   delimiters being only at the very end */
+static void bench_ringbuf_find(void *arg, uint64_t iters) {
+
+    struct ringbuf_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i)
+        if (ringbuf_find(a->rbuf, 0, '\n') < 0)
+            abort();
+}
+
+
+static void bench_ringbuf_find_pattern(void *arg, uint64_t iters) {
+
+    struct ringbuf_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i)
+        if (ringbuf_find_pattern(a->rbuf, 0, (uint8_t *) "\r\n\r\n", 4) < 0)
+            abort();
+}
+
+
+static void bench_ringbuf_count(void *arg, uint64_t iters) {
+
+    struct ringbuf_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i)
+        if (ringbuf_count(a->rbuf, '\n') != 2)
+            abort();
+}
+
+
+static void ringbuf_search_benchmarks(void) {
+
+    static const struct {
+        enum ringbuf_kernel k;
+        const char *name;
+    } kernels[] = {
+        { RINGBUF_KERNEL_SCALAR, "scalar" },
+        { RINGBUF_KERNEL_SSE2, "sse2" },
+        { RINGBUF_KERNEL_AVX2, "avx2" }
+    };
+    const size_t len = 65536, cap = len + len / 2;
+    uint8_t *buf = malloc(cap);
+    struct ringbuf_arg a = { ringbuf_init(buf, cap), malloc(len), NULL, len };
+    char name[128];
+
+    /* Start half way through so that the content wraps around */
+    memset(a.chunk, 'x', len);
+    ringbuf_bulk_push(a.rbuf, a.chunk, len);
+    ringbuf_bulk_pop(a.rbuf, a.chunk, len);
+    memcpy(a.chunk + len - 4, "\r\n\r\n", 4);
+    ringbuf_bulk_push(a.rbuf, a.chunk, len);
+
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+
+        if (ringbuf_set_kernel(kernels[i].k) < 0)
+            continue;
+
+        snprintf(name, sizeof(name), "ringbuf_find/kernel=%s",
+                 kernels[i].name);
+        measure(name, bench_ringbuf_find, &a, 1, len);
+
+        snprintf(name, sizeof(name), "ringbuf_find_pattern/kernel=%s",
+                 kernels[i].name);
+        measure(name, bench_ringbuf_find_pattern, &a, 1, len);
+
+        snprintf(name, sizeof(name), "ringbuf_count/kernel=%s",
+                 kernels[i].name);
+        measure(name, bench_ringbuf_count, &a, 1, len);
+    }
+
+    ringbuf_set_kernel(RINGBUF_KERNEL_AUTO);
+    ringbuf_free(a.rbuf);
+    free(a.chunk);
+    free(buf);
+}
+
+
+/*
+ * List
+ */
+
+struct list_arg {
+    size_t n;
+    ListNode **nodes;
+};
+
+
+static void bench_list_push(void *arg, uint64_t iters) {
+
+    struct list_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        List *l = list_init();
+        for (size_t j = 0; j < a->n; ++j)
+            list_push(l, a);
+        list_free(l, 0);
+    }
+}
+
+
+static void bench_list_push_back(void *arg, uint64_t iters) {
+
+    struct list_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        List *l = list_init();
+        for (size_t j = 0; j < a->n; ++j)
+            list_push_back(l, a);
+        list_free(l, 0);
+    }
+}
+
+
+static int cmp_node(void *a, void *b) {
+    return a != b;
+}
+
+/* Build a list pushing on the front, then remove its nodes in insertion order,
+   which are always at the back of the list */
+static void bench_list_remove_back(void *arg, uint64_t iters) {
+
+    struct list_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        List *l = list_init();
+        for (size_t j = 0; j < a->n; ++j) {
+            list_push(l, a);
+            a->nodes[j] = l->head;
+        }
+        for (size_t j = 0; j < a->n; ++j)
+            list_remove(l, a->nodes[j], cmp_node);
+        list_free(l, 0);
+    }
+}
+
+/* Remove nodes from the front of the list, the best case */
+static void bench_list_remove_front(void *arg, uint64_t iters) {
+
+    struct list_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        List *l = list_init();
+        for (size_t j = 0; j < a->n; ++j) {
+            list_push_back(l, a);
+            a->nodes[j] = l->tail;
+        }
+        for (size_t j = 0; j < a->n; ++j)
+            list_remove(l, a->nodes[j], cmp_node);
+        list_free(l, 0);
+    }
+}
+
+/* Unlink nodes in O(1) from the middle of the list outwards */
+static void bench_list_remove_node(void *arg, uint64_t iters) {
+
+    struct list_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        List *l = list_init();
+        for (size_t j = 0; j < a->n; ++j) {
+            list_push_back(l, a);
+            a->nodes[j] = l->tail;
+        }
+        for (size_t j = 0; j < a->n; ++j)
+            list_remove_node(l, a->nodes[(j + a->n / 2) % a->n]);
+        list_free(l, 0);
+    }
+}
+
+
+struct item {
+    int value;
+    struct ilist_node node;
+};
+
+
+struct ilist_arg {
+    size_t n;
+    struct item *items;
+};
+
+/* Link and unlink embedded nodes, no allocation involved */
+static void bench_ilist_push_del(void *arg, uint64_t iters) {
+
+    struct ilist_arg *a = arg;
+    IList l;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        ilist_init(&l);
+        for (size_t j = 0; j < a->n; ++j)
+            ilist_push_back(&l, &a->items[j].node);
+        for (size_t j = 0; j < a->n; ++j)
+            ilist_del(&l, &a->items[(j + a->n / 2) % a->n].node);
+    }
+
+    __asm__ volatile("" : : "r"(&l) : "memory");
+}
+
+
+static void list_benchmarks(void) {
+
+    static const size_t sizes[] = { 100, 10000, 1000000 };
+    char name[128];
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+
+        struct list_arg a = { sizes[i], malloc(sizeof(ListNode *) * sizes[i]) };
+
+        snprintf(name, sizeof(name), "list_push/n=%zu", sizes[i]);
+        measure(name, bench_list_push, &a, sizes[i], 0);
+
+        snprintf(name, sizeof(name), "list_push_back/n=%zu", sizes[i]);
+        measure(name, bench_list_push_back, &a, sizes[i], 0);
+
+        snprintf(name, sizeof(name), "list_remove_front/n=%zu", sizes[i]);
+        measure(name, bench_list_remove_front, &a, sizes[i], 0);
+
+        snprintf(name, sizeof(name), "list_remove_node/n=%zu", sizes[i]);
+        measure(name, bench_list_remove_node, &a, sizes[i], 0);
+
+        /* Quadratic, keep it small */
+        if (sizes[i] <= 10000) {
+            snprintf(name, sizeof(name), "list_remove_back/n=%zu", sizes[i]);
+            measure(name, bench_list_remove_back, &a, sizes[i], 0);
+        }
+
+        struct ilist_arg ia = { sizes[i], calloc(sizes[i], sizeof(struct item)) };
+
+        snprintf(name, sizeof(name), "ilist_push_del/n=%zu", sizes[i]);
+        measure(name, bench_ilist_push_del, &ia, sizes[i], 0);
+
+        free(ia.items);
+        free(a.nodes);
+    }
+}
+
+
+/*
+ * Hash map
+ */
+
+struct hashmap_arg {
+    HashMap *map;
+    size_t n;
+    uint64_t rng;
+};
+
+/* Keys 1 to n are stored, random ones over twice the range miss half of
+   the time */
+static inline void *hashmap_key(struct hashmap_arg *a, size_t range) {
+
+    a->rng = a->rng * 6364136223846793005ULL + 1442695040888963407ULL;
+
+    return (void *) (uintptr_t) ((a->rng >> 33) % range + 1);
+}
+
+
+static void bench_hashmap_get(void *arg, uint64_t iters) {
+
+    struct hashmap_arg *a = arg;
+    void *val;
+
+    for (uint64_t i = 0; i < iters * 1024; ++i) {
+        int found = hashmap_get(a->map, hashmap_key(a, a->n), &val);
+        __asm__ volatile("" : : "r"(found), "r"(val) : "memory");
+    }
+}
+
+
+static void bench_hashmap_get_miss(void *arg, uint64_t iters) {
+
+    struct hashmap_arg *a = arg;
+    void *val;
+
+    for (uint64_t i = 0; i < iters * 1024; ++i) {
+        int found = hashmap_get(a->map, hashmap_key(a, 2 * a->n), &val);
+        __asm__ volatile("" : : "r"(found), "r"(val) : "memory");
+    }
+}
+
+
+static void bench_hashmap_put(void *arg, uint64_t iters) {
+
+    struct hashmap_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters * 1024; ++i) {
+        void *key = hashmap_key(a, a->n);
+        hashmap_put(a->map, key, key, NULL, NULL);
+    }
+}
+
+/* Single threaded costs of the operations, bench/hashmap_bench measures
+   them under contention */
+static void hashmap_benchmarks(void) {
+
+    static const size_t sizes[] = { 1000, 1000000 };
+    char name[128];
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+
+        struct hashmap_arg a = {
+            hashmap_new(0, hashmap_hash_int, hashmap_eq_int), sizes[i], 1
+        };
+
+        for (uintptr_t k = 1; k <= sizes[i]; ++k)
+            hashmap_put(a.map, (void *) k, (void *) k, NULL, NULL);
+
+        snprintf(name, sizeof(name), "hashmap_get/n=%zu", sizes[i]);
+        measure(name, bench_hashmap_get, &a, 1024, 0);
+
+        snprintf(name, sizeof(name), "hashmap_get_miss50/n=%zu", sizes[i]);
+        measure(name, bench_hashmap_get_miss, &a, 1024, 0);
+
+        snprintf(name, sizeof(name), "hashmap_put_replace/n=%zu", sizes[i]);
+        measure(name, bench_hashmap_put, &a, 1024, 0);
+
+        hashmap_free(a.map, NULL);
+    }
+}
+
+
+/*
+ * Tracing
+ */
+
+static void bench_trace_event(void *arg, uint64_t iters) {
+
+    (void) arg;
+
+    for (uint64_t i = 0; i < iters * 1024; ++i)
+        TRACE(TRACE_WAKEUP, -1, i);
+}
+
+/* Cost of a trace point with the flight recorder off, the one paid all the
+   time, and on */
+static void trace_benchmarks(void) {
+
+    trace_stop();
+    measure("trace_event/disabled", bench_trace_event, NULL, 1024, 0);
+
+    trace_start(0);
+    measure("trace_event/enabled", bench_trace_event, NULL, 1024, 0);
+    trace_stop();
+}
+
+
+/*
+ * Logging
+ */
+
+static void bench_log_record(void *arg, uint64_t iters) {
+
+    enum log_level level = *(enum log_level *) arg;
+
+    for (uint64_t i = 0; i < iters * 1024; ++i)
+        log_record(level, "microbench", i, EPIPE);
+}
+
+/* Hot path costs of the records of the workers, under the level and once
+   over the rate of the thread, the background writes are left out */
+static void log_benchmarks(void) {
+
+    enum log_level debug = LOG_LEVEL_DEBUG, error = LOG_LEVEL_ERROR;
+
+    if (log_start("/dev/null", LOG_LEVEL_ERROR, 1) < 0)
+        return;
+
+    measure("log_record/filtered", bench_log_record, &debug, 1024, 0);
+    measure("log_record/rate_limited", bench_log_record, &error, 1024, 0);
+
+    log_stop();
+}
+
+
+/*
+ * Coroutines
+ */
+
+static void yield_forever(void *arg) {
+
+    Coro **co = arg;
+
+    for (;;)
+        coro_yield(*co);
+}
+
+/* A resume and the matching yield, two switches per operation */
+static void bench_coro_switch(void *arg, uint64_t iters) {
+
+    Coro **co = arg;
+
+    for (uint64_t i = 0; i < iters; ++i)
+        coro_resume(*co);
+}
+
+
+static void noop(void *arg) {
+}
+
+/* Stacks come from the pool of the thread after the first round */
+static void bench_coro_new_free(void *arg, uint64_t iters) {
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        Coro *co = coro_new(noop, NULL, 0);
+        coro_resume(co);
+        coro_free(co);
+    }
+}
+
+
+static void coro_benchmarks(void) {
+
+    Coro *co;
+
+    co = coro_new(yield_forever, &co, 0);
+    measure("coro_resume_yield", bench_coro_switch, &co, 1, 0);
+    coro_free(co);
+
+    measure("coro_new_run_free", bench_coro_new_free, NULL, 1, 0);
+}
+
+
+/*
+ * HTTP
+ */
+
+/* A request as sent by a browser, long values are where the vector scans
+   pay off */
+static const char browser_request[] =
+    "GET /assets/css/main.min.css?v=20240101 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) "
+    "Gecko/20100101 Firefox/121.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/products/category/item?id=1234\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; "
+    "consent=1\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n";
+
+
+static void bench_http_parse(void *arg, uint64_t iters) {
+
+    HttpRequest *r = arg;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        http_parse_request(browser_request, sizeof(browser_request) - 1, 0, r);
+        __asm__ volatile("" : : "r"(r) : "memory");
+    }
+}
+
+/* The scalar kernel is the byte at a time baseline */
+static void http_benchmarks(void) {
+
+    static const struct { enum http_kernel k; const char *name; } kernels[] = {
+        { HTTP_KERNEL_SCALAR, "scalar" },
+        { HTTP_KERNEL_SSE42, "sse42" },
+        { HTTP_KERNEL_AVX2, "avx2" }
+    };
+    HttpRequest *r = malloc(sizeof(*r));
+    char name[128];
+
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+        if (http_set_kernel(kernels[i].k) < 0)
+            continue;
+        snprintf(name, sizeof(name), "http_parse/kernel=%s", kernels[i].name);
+        measure(name, bench_http_parse, r, 1, sizeof(browser_request) - 1);
+    }
+
+    http_set_kernel(HTTP_KERNEL_AUTO);
+    free(r);
+}
+
+
+/*
+ * In-memory transport
+ */
+
+struct mem_arg {
+    Client *c;
+    char *batch;
+    size_t len;
+};
+
+
+static int hello_handler(Client *c, const HttpRequest *req,
+                         HttpResponse *res) {
+
+    res->body = "Hello, World!";
+    res->body_len = 13;
+
+    return 0;
+}
+
+/* A batch of pipelined requests through http_serve, the whole server side
+   of a keep-alive connection minus the kernel */
+static void bench_http_serve_mem(void *arg, uint64_t iters) {
+
+    struct mem_arg *a = arg;
+    size_t len;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        mem_client_feed(a->c, a->batch, a->len);
+        mem_client_run(a->c);
+        mem_client_output(a->c, &len);
+    }
+}
+
+
+static void transport_benchmarks(void) {
+
+    static const int depths[] = { 1, 16 };
+    size_t req_len = sizeof(browser_request) - 1;
+    char name[128];
+
+    instance.http_handler = hello_handler;
+    instance.http_max_body = HTTP_MAX_BODY;
+
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i) {
+
+        struct mem_arg a = {
+            .c = mem_client_new(http_serve),
+            .batch = malloc(req_len * depths[i]),
+            .len = req_len * depths[i]
+        };
+
+        for (int j = 0; j < depths[i]; ++j)
+            memcpy(a.batch + j * req_len, browser_request, req_len);
+
+        snprintf(name, sizeof(name), "http_serve_mem/pipeline=%d", depths[i]);
+        measure(name, bench_http_serve_mem, &a, depths[i], req_len);
+
+        mem_client_free(a.c);
+        free(a.batch);
+    }
+
+    instance.http_handler = NULL;
+}
+
+
+/*
+ * WebSocket
+ */
+
+struct ws_arg {
+    uint8_t *buf;
+    size_t len;
+};
+
+
+static void bench_ws_unmask(void *arg, uint64_t iters) {
+
+    static const uint8_t key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    struct ws_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        ws_unmask(a->buf, a->len, key, 0);
+        __asm__ volatile("" : : "r"(a->buf) : "memory");
+    }
+}
+
+
+static void bench_ws_utf8(void *arg, uint64_t iters) {
+
+    struct ws_arg *a = arg;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        int ok = ws_utf8_valid(a->buf, a->len);
+        __asm__ volatile("" : : "r"(ok) : "memory");
+    }
+}
+
+/* Text mostly ASCII with a few multibyte characters, as chat messages or
+   JSON payloads usually are */
+static void ws_benchmarks(void) {
+
+    static const struct { enum ws_kernel k; const char *name; } kernels[] = {
+        { WS_KERNEL_SCALAR, "scalar" },
+        { WS_KERNEL_SSSE3, "ssse3" },
+        { WS_KERNEL_AVX2, "avx2" }
+    };
+    static const char sample[] = "{\"user\": \"J\xc3\xbcrgen\", \"text\": "
+        "\"caf\xc3\xa9 \xe2\x82\xac 5 \xf0\x9f\x98\x80\"}, ";
+    const size_t n = sizeof(sample) - 1;
+    struct ws_arg a = { malloc(65536), 65536 - 65536 % n };
+    char name[128];
+
+    for (size_t i = 0; i < a.len; i += n)
+        memcpy(a.buf + i, sample, n);
+
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+        if (ws_set_kernel(kernels[i].k) < 0)
+            continue;
+        snprintf(name, sizeof(name), "ws_utf8_valid/kernel=%s",
+                 kernels[i].name);
+        measure(name, bench_ws_utf8, &a, 1, a.len);
+    }
+
+    /* Unmasking scrambles the text, it goes last */
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+        if (ws_set_kernel(kernels[i].k) < 0)
+            continue;
+        snprintf(name, sizeof(name), "ws_unmask/kernel=%s", kernels[i].name);
+        measure(name, bench_ws_unmask, &a, 1, a.len);
+    }
+
+    ws_set_kernel(WS_KERNEL_AUTO);
+    free(a.buf);
+}
+
+
+/*
+ * Networking
+ */
+
+struct io_arg {
+    int fds[2];
+    uint8_t *msg;
+    size_t len;
+    Ringbuf *rbuf;
+};
+
+
+static void bench_sendall_recvall(void *arg, uint64_t iters) {
+
+    struct io_arg *a = arg;
+    ssize_t sent;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+
+        size_t total = 0;
+
+        while (total < a->len) {
+            sendall(a->fds[0], a->msg + total, a->len - total, &sent);
+            total += sent;
+            while (ringbuf_size(a->rbuf) < total)
+                recvall(a->fds[1], a->rbuf, -1);
+        }
+
+        ringbuf_reset(a->rbuf);
+    }
+}
+
+
+static void networking_benchmarks(void) {
+
+    static const size_t sizes[] = { 64, 4096, 65536 };
+    char name[128];
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+
+        struct io_arg a;
+
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, a.fds) < 0) {
+            perror("socketpair(2)");
+            return;
+        }
+
+        uint8_t *buf = malloc(sizes[i]);
+        a.msg = malloc(sizes[i]);
+        a.len = sizes[i];
+        a.rbuf = ringbuf_init(buf, sizes[i]);
+        memset(a.msg, 'x', sizes[i]);
+
+        snprintf(name, sizeof(name), "sendall_recvall/size=%zu", sizes[i]);
+        measure(name, bench_sendall_recvall, &a, 1, sizes[i]);
+
+        ringbuf_free(a.rbuf);
+        free(a.msg);
+        free(buf);
+        close(a.fds[0]);
+        close(a.fds[1]);
+    }
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -f, --filter STR       run only benchmarks whose name contains STR\n"
+            "  -r, --repeats N        samples per benchmark (default 10)\n"
+            "  -c, --cpu N            pin to CPU N (default: the current one)\n"
+            "  -s, --sample-ms MS     duration of a single sample (default 20)\n"
+            "  -w, --warmup-ms MS     minimum warmup per benchmark (default 50)\n"
+            "  -o, --output FILE      write results to FILE instead of stdout\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv) {
+
+    static const struct option long_opts[] = {
+        { "filter", required_argument, NULL, 'f' },
+        { "repeats", required_argument, NULL, 'r' },
+        { "cpu", required_argument, NULL, 'c' },
+        { "sample-ms", required_argument, NULL, 's' },
+        { "warmup-ms", required_argument, NULL, 'w' },
+        { "output", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "f:r:c:s:w:o:",
+                    long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'f': opts.filter = optarg; break;
+            case 'r': opts.repeats = atoi(optarg); break;
+            case 'c': opts.cpu = atoi(optarg); break;
+            case 's': opts.sample_ms = atof(optarg); break;
+            case 'w': opts.warmup_ms = atof(optarg); break;
+            case 'o': opts.output = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (opts.repeats < 2 || opts.repeats > MAX_REPEATS || opts.sample_ms <= 0)
+        usage(argv[0]);
+
+    /* Avoid migrations between samples */
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(opts.cpu >= 0 ? opts.cpu : sched_getcpu(), &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        perror("sched_setaffinity(2)");
+
+    perf_init();
+
+    if (perf_fd < 0)
+        fprintf(stderr, "Hardware counters not available\n");
+
+    out = stdout;
+
+    if (opts.output && !(out = fopen(opts.output, "w"))) {
+        perror(opts.output);
+        exit(EXIT_FAILURE);
+    }
+
+    ringbuf_benchmarks();
+    ringbuf_search_benchmarks();
+    list_benchmarks();
+    hashmap_benchmarks();
+    trace_benchmarks();
+    log_benchmarks();
+    coro_benchmarks();
+    http_benchmarks();
+    transport_benchmarks();
+    ws_benchmarks();
+    networking_benchmarks();
+
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}
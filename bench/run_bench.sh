@@ -0,0 +1,147 @@
+#!/bin/sh
+#
+# Standard end-to-end scenario matrix, every scenario starts a fresh reference
+# server, runs the load generator against it and appends a JSON line to the
+# results file.
+#
+# Environment:
+#   OUT       results file (default results.json)
+#   DURATION  seconds measured per scenario (default 5)
+#   WARMUP    seconds of warmup per scenario (default 1)
+#   PORT      port used by the reference servers (default 19090)
+#   THREADS   load generator threads (default 2)
+#   WORKERS   server epoll workers (default 4)
+
+BIN=${1:-../bin}
+OUT=${OUT:-results.json}
+DURATION=${DURATION:-5}
+WARMUP=${WARMUP:-1}
+PORT=${PORT:-19090}
+THREADS=${THREADS:-2}
+WORKERS=${WORKERS:-4}
+
+set -e
+
+# TLS scenarios need a certificate, a throwaway self-signed one is enough
+if [ ! -f cert.pem ] || [ ! -f key.pem ]; then
+    openssl req -x509 -newkey rsa:2048 -nodes -keyout key.pem -out cert.pem \
+        -days 365 -subj "/CN=localhost" > /dev/null 2>&1
+fi
+
+# Static file served by the file scenario, 1 MB of binary data
+if [ ! -f blob.bin ]; then
+    head -c 1048576 /dev/urandom > blob.bin
+fi
+
+# run NAME "SERVER ARGS" "LOADGEN ARGS"
+run() {
+    name=$1
+    "$BIN/bench_server" -p "$PORT" -w "$WORKERS" $2 &
+    pid=$!
+    sleep 0.5
+    status=0
+    "$BIN/loadgen" -p "$PORT" -t "$THREADS" -D "$DURATION" -w "$WARMUP" \
+        -n "$name" -o "$OUT" $3 || status=$?
+    kill "$pid"
+    wait "$pid" || true
+    if [ "$status" -ne 0 ]; then
+        echo "scenario $name failed" >&2
+        exit "$status"
+    fi
+    tail -n 1 "$OUT"
+}
+
+# run_proxy NAME "SERVER ARGS" "LOADGEN ARGS", the server at PORT proxies to
+# an echo server at PORT + 2
+run_proxy() {
+    name=$1
+    "$BIN/bench_server" -p $((PORT + 2)) -w "$WORKERS" -m echo &
+    upstream=$!
+    "$BIN/bench_server" -p "$PORT" -w "$WORKERS" -P 127.0.0.1:$((PORT + 2)) $2 &
+    pid=$!
+    sleep 0.5
+    status=0
+    "$BIN/loadgen" -p "$PORT" -t "$THREADS" -D "$DURATION" -w "$WARMUP" \
+        -n "$name" -o "$OUT" $3 || status=$?
+    kill "$pid" "$upstream"
+    wait "$pid" || true
+    wait "$upstream" || true
+    if [ "$status" -ne 0 ]; then
+        echo "scenario $name failed" >&2
+        exit "$status"
+    fi
+    tail -n 1 "$OUT"
+}
+
+# run_udp NAME "SERVER ARGS" "UDP_BENCH ARGS", the UDP port is PORT + 1
+run_udp() {
+    name=$1
+    "$BIN/bench_server" -p "$PORT" -w "$WORKERS" -u $((PORT + 1)) $2 &
+    pid=$!
+    sleep 0.5
+    status=0
+    "$BIN/udp_bench" -p $((PORT + 1)) -t "$THREADS" -D "$DURATION" \
+        -w "$WARMUP" -n "$name" -o "$OUT" $3 || status=$?
+    kill "$pid"
+    wait "$pid" || true
+    if [ "$status" -ne 0 ]; then
+        echo "scenario $name failed" >&2
+        exit "$status"
+    fi
+    tail -n 1 "$OUT"
+}
+
+# run_kv NAME "SERVER ARGS" REQUEST "LOADGEN ARGS", against kv_server
+run_kv() {
+    name=$1
+    "$BIN/kv_server" -p "$PORT" -w "$WORKERS" $2 &
+    pid=$!
+    sleep 0.5
+    status=0
+    "$BIN/loadgen" -p "$PORT" -t "$THREADS" -D "$DURATION" -w "$WARMUP" \
+        -n "$name" -o "$OUT" -q "$3" $4 || status=$?
+    kill "$pid"
+    wait "$pid" || true
+    if [ "$status" -ne 0 ]; then
+        echo "scenario $name failed" >&2
+        exit "$status"
+    fi
+    tail -n 1 "$OUT"
+}
+
+# run_hashmap NAME "HASHMAP_BENCH ARGS", no server involved
+run_hashmap() {
+    "$BIN/hashmap_bench" -t "$THREADS" -D "$DURATION" -w "$WARMUP" \
+        -n "$1" -o "$OUT" $2
+    tail -n 1 "$OUT"
+}
+
+run echo-c1-d1-s64        "-m echo"                 "-c 1 -d 1 -s 64"
+run echo-c64-d1-s64       "-m echo"                 "-c 64 -d 1 -s 64"
+run echo-c64-d16-s64      "-m echo"                 "-c 64 -d 16 -s 64"
+run unix-echo-c1-d1-s64   "-m echo -U @vessel-bench" "-c 1 -d 1 -s 64 -U @vessel-bench"
+run unix-echo-c64-d1-s64  "-m echo -U @vessel-bench" "-c 64 -d 1 -s 64 -U @vessel-bench"
+run unix-echo-c64-d16-s64 "-m echo -U @vessel-bench" "-c 64 -d 16 -s 64 -U @vessel-bench"
+run busy-echo-c1-d1-s64   "-m echo -B 100"          "-c 1 -d 1 -s 64"
+run busy-echo-open-r5k-c1 "-m echo -B 100"          "-c 1 -s 64 -R 5000"
+run echo-open-r5k-c1      "-m echo"                 "-c 1 -s 64 -R 5000"
+run coecho-c1-d1-s64      "-m coecho"               "-c 1 -d 1 -s 64"
+run coecho-c64-d16-s64    "-m coecho"               "-c 64 -d 16 -s 64"
+run echo-c64-d1-s4096     "-m echo"                 "-c 64 -d 1 -s 4096"
+run echo-open-r20k-c64    "-m echo"                 "-c 64 -s 64 -R 20000"
+run fixed-c64-d8-s32-r128 "-m fixed -s 32 -r 128"   "-c 64 -d 8 -s 32 -r 128"
+run large-c16-d1-r1m      "-m large -s 32"          "-c 16 -d 1 -s 32 -r 1048576"
+run large-zc-c16-d1-r1m    "-m large -s 32 -Z 65536" "-c 16 -d 1 -s 32 -r 1048576"
+run file-c16-d1-r1m       "-m file -s 32 -f blob.bin" "-c 16 -d 1 -s 32 -r 1048576"
+run idle-c16-i5000        "-m idle"                 "-c 16 -i 5000 -s 64"
+run tls-echo-c16-d1-s64   "-m echo -S"              "-c 16 -d 1 -s 64 -S"
+run_proxy proxy-echo-c1-d1-s64   ""            "-c 1 -d 1 -s 64"
+run_proxy proxy-echo-c64-d16-s64 ""            "-c 64 -d 16 -s 64"
+run_proxy proxy-echo-c16-d1-s64k ""            "-c 16 -d 1 -s 65536"
+run_udp udp-echo-b32-s64      ""                        "-b 32 -s 64"
+run_udp udp-echo-gso-b32-s64  "-G"                      "-b 32 -s 64"
+run_kv kv-get-c64-d16-v64  "-n 1000 -v 64" 'GET key:1\r\n'           "-c 64 -d 16 -r 71"
+run_kv kv-set-c64-d16-v8   ""              'SET key:1 abcdefgh\r\n'  "-c 64 -d 16 -r 5"
+run_kv kv-mget-c64-d1-v64  "-n 1000 -v 64" 'MGET key:1 key:2 key:3 key:4\r\n' "-c 64 -d 1 -r 288"
+run_hashmap hashmap-k1m-r90     "-k 1000000 -r 90"
+run_hashmap hashmap-k1m-r50     "-k 1000000 -r 50"
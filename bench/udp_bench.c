@@ -0,0 +1,335 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Datagram load generator for the UDP listeners of vessel servers, meant to
+ * be run against bench_server --udp, which echoes every datagram back.
+ *
+ * Every thread owns a connected UDP socket and runs in closed loop: a batch
+ * of datagrams is sent with a single sendmmsg(2) call, then the replies are
+ * collected with recvmmsg(2) before sending the next batch. Each datagram
+ * carries its send time, so the round trip time of every reply is recorded.
+ * Replies missing after a timeout are counted as lost.
+ *
+ * Results are printed as a single JSON line.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "bench.h"
+
+
+#define MAX_BATCH   64
+
+
+static struct {
+    const char *host;
+    const char *port;
+    int threads;
+    size_t size;
+    int batch;
+    double duration;
+    double warmup;
+    const char *name;
+    const char *output;
+} opts = {
+    .host = "127.0.0.1",
+    .port = "4050",
+    .threads = 1,
+    .size = 64,
+    .batch = 32,
+    .duration = 5.0,
+    .warmup = 1.0,
+    .name = "udp",
+    .output = NULL
+};
+
+
+struct worker {
+    pthread_t tid;
+    int fd;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t lost;
+    Histogram hist;
+};
+
+
+static volatile int running = 1;
+static volatile int measuring = 0;
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -h, --host HOST        server address (default 127.0.0.1)\n"
+            "  -p, --port PORT        server UDP port (default 4050)\n"
+            "  -t, --threads N        generator threads (default 1)\n"
+            "  -s, --size BYTES       datagram size, at least 8 (default 64)\n"
+            "  -b, --batch N          datagrams per batch, up to 64 (default 32)\n"
+            "  -D, --duration SECS    measurement duration (default 5)\n"
+            "  -w, --warmup SECS      warmup before measuring (default 1)\n"
+            "  -n, --name NAME        scenario name reported in the results\n"
+            "  -o, --output FILE      append results to FILE instead of stdout\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+
+static void parse_options(int argc, char **argv) {
+
+    static const struct option long_opts[] = {
+        { "host", required_argument, NULL, 'h' },
+        { "port", required_argument, NULL, 'p' },
+        { "threads", required_argument, NULL, 't' },
+        { "size", required_argument, NULL, 's' },
+        { "batch", required_argument, NULL, 'b' },
+        { "duration", required_argument, NULL, 'D' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "name", required_argument, NULL, 'n' },
+        { "output", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "h:p:t:s:b:D:w:n:o:",
+                    long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'h': opts.host = optarg; break;
+            case 'p': opts.port = optarg; break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 's': opts.size = strtoul(optarg, NULL, 10); break;
+            case 'b': opts.batch = atoi(optarg); break;
+            case 'D': opts.duration = atof(optarg); break;
+            case 'w': opts.warmup = atof(optarg); break;
+            case 'n': opts.name = optarg; break;
+            case 'o': opts.output = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (opts.threads < 1 || opts.size < sizeof(uint64_t) || opts.batch < 1
+            || opts.batch > MAX_BATCH || opts.duration <= 0.0)
+        usage(argv[0]);
+}
+
+
+static void *worker_loop(void *arg) {
+
+    struct worker *w = arg;
+    uint8_t *tx = calloc(MAX_BATCH, opts.size);
+    uint8_t *rx = malloc(MAX_BATCH * (opts.size + 1));
+    struct mmsghdr txm[MAX_BATCH], rxm[MAX_BATCH];
+    struct iovec txv[MAX_BATCH], rxv[MAX_BATCH];
+
+    if (!tx || !rx) {
+        perror("malloc(3) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(txm, 0, sizeof(txm));
+    memset(rxm, 0, sizeof(rxm));
+
+    for (int i = 0; i < opts.batch; ++i) {
+        txv[i].iov_base = tx + i * opts.size;
+        txv[i].iov_len = opts.size;
+        txm[i].msg_hdr.msg_iov = &txv[i];
+        txm[i].msg_hdr.msg_iovlen = 1;
+        rxv[i].iov_base = rx + i * (opts.size + 1);
+        rxv[i].iov_len = opts.size + 1;
+        rxm[i].msg_hdr.msg_iov = &rxv[i];
+        rxm[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (running) {
+
+        uint64_t start = now_ns();
+
+        for (int i = 0; i < opts.batch; ++i)
+            memcpy(txv[i].iov_base, &start, sizeof(start));
+
+        int sent = 0;
+
+        while (sent < opts.batch) {
+            int n = sendmmsg(w->fd, txm + sent, opts.batch - sent, 0);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("sendmmsg(2)");
+                exit(EXIT_FAILURE);
+            }
+            sent += n;
+        }
+
+        /* Replies are collected until the whole batch is back or the
+           receive times out, anything missing is lost */
+        int received = 0;
+
+        while (received < opts.batch) {
+            int n = recvmmsg(w->fd, rxm, opts.batch - received, 0, NULL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            uint64_t now = now_ns();
+            for (int i = 0; i < n; ++i) {
+                uint64_t stamp;
+                memcpy(&stamp, rxv[i].iov_base, sizeof(stamp));
+                if (measuring)
+                    hist_record(&w->hist, now - stamp);
+            }
+            received += n;
+        }
+
+        if (measuring) {
+            w->sent += sent;
+            w->received += received;
+            w->lost += opts.batch - received;
+        }
+    }
+
+    free(tx);
+    free(rx);
+
+    return NULL;
+}
+
+
+static void report(FILE *fp, struct worker *workers, double elapsed) {
+
+    Histogram hist;
+    uint64_t sent = 0, received = 0, lost = 0;
+
+    hist_init(&hist);
+
+    for (int i = 0; i < opts.threads; ++i) {
+        hist_merge(&hist, &workers[i].hist);
+        sent += workers[i].sent;
+        received += workers[i].received;
+        lost += workers[i].lost;
+    }
+
+    fprintf(fp, "{\"scenario\":\"%s\",\"mode\":\"udp\",\"threads\":%d,"
+            "\"batch\":%d,\"payload\":%zu,\"duration\":%.3f,"
+            "\"sent\":%" PRIu64 ",\"received\":%" PRIu64 ","
+            "\"lost\":%" PRIu64 ",\"pps\":%.1f,\"latency_ns\":",
+            opts.name, opts.threads, opts.batch, opts.size, elapsed,
+            sent, received, lost, received / elapsed);
+    hist_json(fp, &hist);
+    fprintf(fp, "}\n");
+}
+
+
+int main(int argc, char **argv) {
+
+    parse_options(argc, argv);
+
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM
+    };
+    struct addrinfo *ai;
+
+    if (getaddrinfo(opts.host, opts.port, &hints, &ai) != 0) {
+        perror("getaddrinfo error");
+        exit(EXIT_FAILURE);
+    }
+
+    struct worker *workers = calloc(opts.threads, sizeof(*workers));
+
+    if (!workers) {
+        perror("malloc(3) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < opts.threads; ++i) {
+
+        struct worker *w = &workers[i];
+        struct timeval tv = { 0, 200000 };
+
+        hist_init(&w->hist);
+        w->fd = socket(ai->ai_family, SOCK_DGRAM, 0);
+
+        if (w->fd < 0 || connect(w->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            perror("connect(2)");
+            exit(EXIT_FAILURE);
+        }
+
+        setsockopt(w->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    freeaddrinfo(ai);
+
+    for (int i = 0; i < opts.threads; ++i)
+        pthread_create(&workers[i].tid, NULL, worker_loop, &workers[i]);
+
+    usleep((useconds_t) (opts.warmup * 1e6));
+
+    uint64_t start = now_ns();
+    measuring = 1;
+
+    usleep((useconds_t) (opts.duration * 1e6));
+
+    measuring = 0;
+    double elapsed = (now_ns() - start) / 1e9;
+    running = 0;
+
+    for (int i = 0; i < opts.threads; ++i)
+        pthread_join(workers[i].tid, NULL);
+
+    FILE *fp = stdout;
+
+    if (opts.output && !(fp = fopen(opts.output, "a"))) {
+        perror(opts.output);
+        exit(EXIT_FAILURE);
+    }
+
+    report(fp, workers, elapsed);
+
+    if (fp != stdout)
+        fclose(fp);
+
+    for (int i = 0; i < opts.threads; ++i)
+        close(workers[i].fd);
+
+    free(workers);
+
+    return 0;
+}
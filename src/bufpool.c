@@ -0,0 +1,140 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "bufpool.h"
+
+
+#define BUFPOOL_CLASSES 5
+
+
+/* Free buffers are linked through their first bytes */
+struct free_buf {
+    struct free_buf *next;
+};
+
+
+/* Cache line aligned, buffers of different sizes are taken and given back
+   without contending on the same line */
+struct buf_class {
+    pthread_mutex_t lock;
+    struct free_buf *head;
+    size_t count;
+} __attribute__((aligned(64)));
+
+
+static struct buf_class classes[BUFPOOL_CLASSES] = {
+    [0 ... BUFPOOL_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+
+/* Class of the smallest buffers holding size bytes, -1 if too large */
+static int class_of(size_t size) {
+
+    int i = 0;
+
+    for (size_t cap = BUFPOOL_MIN; cap < size; cap <<= 1)
+        if (++i == BUFPOOL_CLASSES)
+            return -1;
+
+    return i;
+}
+
+
+void *bufpool_get(size_t size, size_t *cap) {
+
+    int i = class_of(size);
+    struct free_buf *b = NULL;
+
+    if (i >= 0) {
+
+        struct buf_class *c = &classes[i];
+
+        size = (size_t) BUFPOOL_MIN << i;
+
+        pthread_mutex_lock(&c->lock);
+        if ((b = c->head)) {
+            c->head = b->next;
+            c->count--;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    if (!b && !(b = malloc(size))) {
+        perror("allocating pooled buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    *cap = size;
+
+    return b;
+}
+
+
+void bufpool_put(void *buf, size_t cap) {
+
+    if (!buf)
+        return;
+
+    int i = class_of(cap);
+
+    /* Grown to a size in between the classes */
+    if (i < 0 || cap != (size_t) BUFPOOL_MIN << i) {
+        free(buf);
+        return;
+    }
+
+    struct buf_class *c = &classes[i];
+    struct free_buf *b = buf;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (c->count < BUFPOOL_KEEP) {
+        b->next = c->head;
+        c->head = b;
+        c->count++;
+        b = NULL;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    free(b);
+}
+
+
+size_t bufpool_bytes(void) {
+
+    size_t bytes = 0;
+
+    for (int i = 0; i < BUFPOOL_CLASSES; ++i)
+        bytes += __atomic_load_n(&classes[i].count, __ATOMIC_RELAXED)
+            * ((size_t) BUFPOOL_MIN << i);
+
+    return bytes;
+}
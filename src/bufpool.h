@@ -0,0 +1,61 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+
+/* Smallest and largest buffers pooled, the classes are the powers of two
+   in between */
+#define BUFPOOL_MIN     4096
+#define BUFPOOL_MAX     (64 * 1024)
+
+/* Free buffers kept by every class, the others are freed */
+#define BUFPOOL_KEEP    256
+
+
+/* A pool of I/O buffers shared by all the threads, for the connections to
+   hold buffers only while they have something to read or write. The pooled
+   ones are the buffers of the connections that went idle, reused by the
+   ones that wake up, so the memory follows the active connections rather
+   than the open ones */
+
+/* Take a buffer of at least size bytes, setting its capacity in cap. Sizes
+   above BUFPOOL_MAX are allocated on their own */
+void *bufpool_get(size_t, size_t *);
+
+/* Give a buffer back, cap being the capacity it was taken with, or grown to
+   with realloc. Buffers of other capacities are freed, NULL is ignored */
+void bufpool_put(void *, size_t);
+
+/* Bytes held by the pool */
+size_t bufpool_bytes(void);
+
+
+#endif
@@ -0,0 +1,378 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "coro.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#define CORO_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CORO_ASAN 1
+#endif
+#endif
+
+#ifdef CORO_ASAN
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+
+struct coro {
+    /* Saved stack pointers of the coroutine and of whoever resumed it */
+    void *sp;
+    void *caller_sp;
+    void (*fn)(void *);
+    void *arg;
+    int done;
+    /* Stack mapping, starting with the guard page */
+    uint8_t *stack;
+    size_t stack_size;
+#ifdef CORO_ASAN
+    /* Stack switching has to be announced to AddressSanitizer, or it would
+       take the coroutine frames for overflows of the thread stack */
+    void *fake_stack;
+    const void *caller_bottom;
+    size_t caller_size;
+#endif
+#if !defined(__x86_64__)
+    ucontext_t ctx;
+    ucontext_t caller_ctx;
+#endif
+};
+
+
+/* Free stacks are linked through their lowest bytes, right above the guard
+   page */
+struct stack_node {
+    struct stack_node *next;
+    size_t size;
+};
+
+
+struct stack_pool {
+    struct stack_node *head;
+    int count;
+};
+
+
+static __thread struct stack_pool pool;
+
+/* Releases the stacks pooled by a thread when it exits */
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static size_t page_size;
+
+
+static void pool_destroy(void *arg) {
+
+    struct stack_pool *p = arg;
+
+    while (p->head) {
+        struct stack_node *n = p->head;
+        p->head = n->next;
+        munmap((uint8_t *) n - page_size, n->size + page_size);
+    }
+
+    p->count = 0;
+}
+
+
+static void pool_init(void) {
+    page_size = sysconf(_SC_PAGESIZE);
+    pthread_key_create(&pool_key, pool_destroy);
+}
+
+/* Take a stack of size bytes from the pool, or map a new one, size is a
+   multiple of the page size. Return the base of the mapping */
+static uint8_t *stack_get(size_t size) {
+
+    /* Stacks of a different size are unlikely, they are just not reused */
+    if (pool.head && pool.head->size == size) {
+        struct stack_node *n = pool.head;
+        pool.head = n->next;
+        pool.count--;
+        return (uint8_t *) n - page_size;
+    }
+
+    uint8_t *base = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+
+    if (base == MAP_FAILED) {
+        perror("mmap(2) of a coroutine stack");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Overflows hit the guard page instead of the memory below the stack */
+    if (mprotect(base, page_size, PROT_NONE) < 0)
+        perror("mprotect(2) of a coroutine stack guard");
+
+    return base;
+}
+
+
+static void stack_put(uint8_t *base, size_t size) {
+
+    if (pool.count >= CORO_POOL_SIZE) {
+        munmap(base, size + page_size);
+        return;
+    }
+
+    if (pool.count == 0)
+        pthread_setspecific(pool_key, &pool);
+
+#ifdef CORO_ASAN
+    /* Frames of a coroutine dropped while suspended are still poisoned */
+    ASAN_UNPOISON_MEMORY_REGION(base + page_size, size);
+#endif
+
+    struct stack_node *n = (struct stack_node *) (base + page_size);
+    n->next = pool.head;
+    n->size = size;
+    pool.head = n;
+    pool.count++;
+}
+
+
+#ifdef CORO_ASAN
+#define asan_start(save, bottom, size) \
+    __sanitizer_start_switch_fiber((save), (bottom), (size))
+#define asan_finish(save, bottom, size) \
+    __sanitizer_finish_switch_fiber((save), (bottom), (size))
+#else
+#define asan_start(save, bottom, size) do { } while (0)
+#define asan_finish(save, bottom, size) do { } while (0)
+#endif
+
+
+#if defined(__x86_64__)
+
+/* Push the callee saved registers on the current stack and store the stack
+   pointer in *from, then move to the stack pointer to, pop the registers
+   saved there and return where that context was suspended. The FPU control
+   words are not switched, they belong to the thread running the coroutine */
+void coro_switch(void **from, void *to);
+
+/* First frame of a new coroutine, calling r13 with r12 as argument */
+void coro_trampoline(void);
+
+__asm__(
+    ".text\n"
+    ".globl coro_switch\n"
+    ".hidden coro_switch\n"
+    ".type coro_switch, @function\n"
+    "coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_switch, .-coro_switch\n"
+    ".globl coro_trampoline\n"
+    ".hidden coro_trampoline\n"
+    ".type coro_trampoline, @function\n"
+    "coro_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+    ".size coro_trampoline, .-coro_trampoline\n"
+);
+
+
+static void coro_main(Coro *);
+
+/* Lay out the frame popped by the first switch to the coroutine, the stack
+   pointer has to be 16 bytes aligned once coro_trampoline makes its call */
+static void context_init(Coro *co) {
+
+    uintptr_t top = (uintptr_t) (co->stack + page_size + co->stack_size) & ~15;
+    void **sp = (void **) (top - 72);
+
+    sp[0] = NULL;                       /* r15 */
+    sp[1] = NULL;                       /* r14 */
+    sp[2] = (void *) coro_main;         /* r13 */
+    sp[3] = co;                         /* r12 */
+    sp[4] = NULL;                       /* rbx */
+    sp[5] = NULL;                       /* rbp */
+    sp[6] = (void *) coro_trampoline;   /* return address */
+    sp[7] = NULL;
+    sp[8] = NULL;
+
+    co->sp = sp;
+}
+
+#define context_resume(co) coro_switch(&(co)->caller_sp, (co)->sp)
+#define context_suspend(co) coro_switch(&(co)->sp, (co)->caller_sp)
+
+#else
+
+static void coro_main(Coro *);
+
+/* makecontext passes int arguments only */
+static void coro_entry(unsigned hi, unsigned lo) {
+    coro_main((Coro *) (((uintptr_t) hi << 16 << 16) | lo));
+}
+
+
+static void context_init(Coro *co) {
+
+    uintptr_t p = (uintptr_t) co;
+
+    if (getcontext(&co->ctx) < 0) {
+        perror("getcontext(3)");
+        exit(EXIT_FAILURE);
+    }
+
+    co->ctx.uc_stack.ss_sp = co->stack + page_size;
+    co->ctx.uc_stack.ss_size = co->stack_size;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, (void (*)(void)) coro_entry, 2,
+                (unsigned) (p >> 16 >> 16), (unsigned) p);
+}
+
+#define context_resume(co) swapcontext(&(co)->caller_ctx, &(co)->ctx)
+#define context_suspend(co) swapcontext(&(co)->ctx, &(co)->caller_ctx)
+
+#endif
+
+
+static void coro_main(Coro *co) {
+
+    asan_finish(NULL, &co->caller_bottom, &co->caller_size);
+
+    co->fn(co->arg);
+    co->done = 1;
+
+    /* A NULL fake stack tells AddressSanitizer this stack is gone for good */
+    asan_start(NULL, co->caller_bottom, co->caller_size);
+    context_suspend(co);
+
+    /* Never resumed once done */
+    abort();
+}
+
+
+Coro *coro_new(void (*fn)(void *), void *arg, size_t stack_size) {
+
+    pthread_once(&pool_once, pool_init);
+
+    if (stack_size == 0)
+        stack_size = CORO_STACK_SIZE;
+
+    stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+
+    Coro *co = calloc(1, sizeof(*co));
+    if (!co) {
+        perror("creating coroutine");
+        exit(EXIT_FAILURE);
+    }
+
+    co->fn = fn;
+    co->arg = arg;
+    co->stack_size = stack_size;
+    co->stack = stack_get(stack_size);
+
+    context_init(co);
+
+    return co;
+}
+
+
+void coro_free(Coro *co) {
+
+    if (!co)
+        return;
+
+    stack_put(co->stack, co->stack_size);
+    free(co);
+}
+
+
+int coro_resume(Coro *co) {
+
+    if (co->done)
+        return 1;
+
+#ifdef CORO_ASAN
+    void *fake_stack = NULL;
+#endif
+
+    asan_start(&fake_stack, co->stack + page_size, co->stack_size);
+    context_resume(co);
+    asan_finish(fake_stack, NULL, NULL);
+
+    return co->done;
+}
+
+
+void coro_yield(Coro *co) {
+
+    asan_start(&co->fake_stack, co->caller_bottom, co->caller_size);
+    context_suspend(co);
+    asan_finish(co->fake_stack, &co->caller_bottom, &co->caller_size);
+}
+
+
+void coro_trim(Coro *co) {
+
+#if defined(__x86_64__)
+    /* Pages fully below the saved stack pointer and its red zone */
+    uintptr_t low = (uintptr_t) co->stack + page_size;
+    uintptr_t high = ((uintptr_t) co->sp - 128) & ~(page_size - 1);
+
+    if (!co->done && high > low)
+        madvise((void *) low, high - low, MADV_DONTNEED);
+#else
+    (void) co;
+#endif
+}
+
+
+int coro_done(const Coro *co) {
+    return co->done;
+}
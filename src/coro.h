@@ -0,0 +1,73 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+
+
+/* Default stack size of the coroutines, a guard page is added below it */
+#define CORO_STACK_SIZE (64 * 1024)
+
+/* Stacks kept by every thread for reuse, past this they are unmapped */
+#define CORO_POOL_SIZE  64
+
+
+/* A stackful coroutine, running a function on its own small stack. It is
+   suspended only explicitly with coro_yield and can be resumed by any
+   thread, one at a time, so it can follow a connection across the workers.
+   Stacks come from a pool per thread and a switch saves just the callee
+   saved registers on x86-64, other architectures fall back to ucontext */
+typedef struct coro Coro;
+
+
+/* Create a coroutine running fn(arg) on a stack of stack_size bytes, 0 for
+   the default, it doesn't start until the first coro_resume */
+Coro *coro_new(void (*)(void *), void *, size_t);
+
+/* Release a coroutine and return its stack to the pool of the calling
+   thread, a suspended coroutine is dropped without unwinding its stack */
+void coro_free(Coro *);
+
+/* Run a coroutine until it yields or its function returns, return 1 in the
+   latter case, 0 otherwise */
+int coro_resume(Coro *);
+
+/* Suspend the coroutine calling it, going back to the last coro_resume */
+void coro_yield(Coro *);
+
+/* Give the pages of the stack of a suspended coroutine below its current
+   frame back to the kernel, they are faulted in again zeroed if the stack
+   grows there. A no-op outside of x86-64 */
+void coro_trim(Coro *);
+
+/* Return 1 if the function of the coroutine has returned */
+int coro_done(const Coro *);
+
+
+#endif
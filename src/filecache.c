@@ -0,0 +1,329 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "filecache.h"
+
+
+static uint64_t now_ms(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a hash of the path */
+static uint32_t hash_path(const char *path) {
+
+    uint32_t h = 2166136261u;
+
+    for (const unsigned char *p = (const unsigned char *) path; *p; ++p) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* Same file with the same content as the one cached, based on the stat(2)
+   metadata, files replaced by a rename have a different inode */
+static int same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+        && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+        && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+
+static void free_entry(struct file_entry *e) {
+
+    close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+/* Unlink an entry from the cache and release the reference held by it, must
+   be called with the lock held */
+static void drop_entry(FileCache *cache, struct file_entry *e) {
+
+    ilist_del(&cache->buckets[e->hash & (cache->nbuckets - 1)], &e->bucket);
+    ilist_del(&cache->lru, &e->lru);
+    e->cached = 0;
+
+    if (--e->refs == 0)
+        free_entry(e);
+}
+
+
+static struct file_entry *lookup(FileCache *cache,
+                                 const char *path, uint32_t hash) {
+
+    IList *b = &cache->buckets[hash & (cache->nbuckets - 1)];
+    struct ilist_node *n, *tmp;
+
+    ilist_foreach_safe(n, tmp, b) {
+        struct file_entry *e = ilist_entry(n, struct file_entry, bucket);
+        if (e->hash == hash && strcmp(e->path, path) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+/* Open a file and take its metadata, only regular files can be cached */
+static struct file_entry *open_entry(const char *path, uint32_t hash) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return NULL;
+
+    struct file_entry *e = calloc(1, sizeof(*e));
+    if (!e) {
+        perror("creating file cache entry");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fstat(fd, &e->st) < 0)
+        goto err;
+
+    if (!S_ISREG(e->st.st_mode)) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    e->path = strdup(path);
+    e->fd = fd;
+    e->hash = hash;
+    e->checked = now_ms();
+
+    return e;
+
+err:
+    {
+        int err = errno;
+        close(fd);
+        free(e);
+        errno = err;
+    }
+
+    return NULL;
+}
+
+
+FileCache *filecache_new(size_t max_entries, unsigned revalidate_ms) {
+
+    FileCache *cache = malloc(sizeof(*cache));
+    if (!cache) {
+        perror("creating file cache");
+        exit(EXIT_FAILURE);
+    }
+
+    cache->max_entries = max_entries > 0 ? max_entries : 1;
+    cache->revalidate_ms = revalidate_ms;
+
+    /* Keep the load factor under 1, the size is a power of two to select the
+       bucket with a mask */
+    cache->nbuckets = 8;
+    while (cache->nbuckets < cache->max_entries)
+        cache->nbuckets <<= 1;
+
+    cache->buckets = malloc(sizeof(IList) * cache->nbuckets);
+    if (!cache->buckets) {
+        perror("creating file cache buckets");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < cache->nbuckets; ++i)
+        ilist_init(&cache->buckets[i]);
+
+    ilist_init(&cache->lru);
+    pthread_mutex_init(&cache->lock, NULL);
+
+    cache->hits = cache->misses = 0;
+    cache->evictions = cache->invalidations = 0;
+
+    return cache;
+}
+
+
+void filecache_free(FileCache *cache) {
+
+    struct ilist_node *n, *tmp;
+
+    ilist_foreach_safe(n, tmp, &cache->lru) {
+        drop_entry(cache, ilist_entry(n, struct file_entry, lru));
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+
+/* Count a hit and hand out a reference to an entry, must be called with the
+   lock held */
+static struct file_entry *hit(FileCache *cache, struct file_entry *e) {
+
+    cache->hits++;
+    /* Move to the front of the LRU list */
+    ilist_del(&cache->lru, &e->lru);
+    ilist_push(&cache->lru, &e->lru);
+    e->refs++;
+
+    return e;
+}
+
+/* Past the revalidation interval check that the path still leads to the
+   same file, dropping the entry otherwise. The stat(2) runs without the
+   lock, holding a reference to the entry, and the entry counts as checked
+   meanwhile so the other workers don't stat the same path. Return the
+   entry with the reference of the caller, NULL if dropped */
+static struct file_entry *revalidate(FileCache *cache, struct file_entry *e,
+                                     const char *path) {
+
+    struct stat st;
+
+    e->refs++;
+    e->checked = now_ms();
+
+    pthread_mutex_unlock(&cache->lock);
+
+    int same = stat(path, &st) == 0 && same_file(&st, &e->st);
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (same && e->cached) {
+        /* hit takes a reference of its own */
+        e->refs--;
+        return hit(cache, e);
+    }
+
+    /* Replaced, or dropped by someone else in the meanwhile */
+    if (e->cached) {
+        drop_entry(cache, e);
+        cache->invalidations++;
+    }
+
+    if (--e->refs == 0)
+        free_entry(e);
+
+    return NULL;
+}
+
+
+struct file_entry *filecache_get(FileCache *cache, const char *path) {
+
+    uint32_t hash = hash_path(path);
+
+    pthread_mutex_lock(&cache->lock);
+
+    struct file_entry *e = lookup(cache, path, hash);
+
+    if (e && cache->revalidate_ms > 0
+            && now_ms() - e->checked >= cache->revalidate_ms)
+        e = revalidate(cache, e, path);
+    else if (e)
+        e = hit(cache, e);
+
+    if (e) {
+        pthread_mutex_unlock(&cache->lock);
+        return e;
+    }
+
+    cache->misses++;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    /* The disk is not touched with the lock held, workers missing the same
+       path at once all open it and the first one to get back wins */
+    struct file_entry *opened = open_entry(path, hash);
+
+    if (!opened)
+        return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if ((e = lookup(cache, path, hash))) {
+        e->refs++;
+        pthread_mutex_unlock(&cache->lock);
+        free_entry(opened);
+        return e;
+    }
+
+    e = opened;
+
+    /* A reference for the cache and one for the caller */
+    e->refs = 2;
+    e->cached = 1;
+    ilist_push(&cache->buckets[hash & (cache->nbuckets - 1)], &e->bucket);
+    ilist_push(&cache->lru, &e->lru);
+
+    /* Evict the least recently used entries over the limit */
+    while (cache->lru.len > cache->max_entries) {
+        struct ilist_node *last = cache->lru.head.prev;
+        drop_entry(cache, ilist_entry(last, struct file_entry, lru));
+        cache->evictions++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return e;
+}
+
+
+void filecache_put(FileCache *cache, struct file_entry *e) {
+
+    pthread_mutex_lock(&cache->lock);
+    unsigned refs = --e->refs;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (refs == 0)
+        free_entry(e);
+}
+
+
+void filecache_invalidate(FileCache *cache, const char *path) {
+
+    pthread_mutex_lock(&cache->lock);
+
+    struct file_entry *e = lookup(cache, path, hash_path(path));
+
+    if (e) {
+        drop_entry(cache, e);
+        cache->invalidations++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,99 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "list.h"
+
+
+/* An open file shared by all the replies sending it. The descriptor is opened
+   read-only and st is the fstat(2) metadata taken when it was opened, so the
+   size of a cached file is known without touching the filesystem */
+struct file_entry {
+    char *path;
+    int fd;
+    struct stat st;
+    /* Monotonic time in ms of the last check against the filesystem */
+    uint64_t checked;
+    /* One reference is held by the cache, one by every reply using it */
+    unsigned refs;
+    /* Cleared once the entry is evicted or invalidated */
+    int cached;
+    uint32_t hash;
+    /* Link in the hash bucket */
+    struct ilist_node bucket;
+    /* Link in the LRU list, most recently used first */
+    struct ilist_node lru;
+};
+
+
+/* Bounded cache of open files, indexed by path. Entries are evicted in LRU
+   order once max_entries is exceeded and checked again with stat(2) every
+   revalidate_ms, being dropped if the file was replaced, modified or removed
+   in the meanwhile. Files still referenced by a reply stay open until the
+   last reference is released. The lock guards the index only, files are
+   opened and checked without holding it */
+typedef struct filecache {
+    size_t max_entries;
+    /* 0 disables the checks, entries are dropped only by invalidation */
+    unsigned revalidate_ms;
+    size_t nbuckets;
+    IList *buckets;
+    IList lru;
+    pthread_mutex_t lock;
+    /* Counters */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+} FileCache;
+
+
+/* Create a new cache holding up to max_entries open files, revalidated every
+   revalidate_ms milliseconds */
+FileCache *filecache_new(size_t, unsigned);
+
+/* Release the cache, closing all the files not referenced anymore */
+void filecache_free(FileCache *);
+
+/* Retrieve an open file by path, opening it on a miss. The entry returned
+   is referenced and must be released with filecache_put, return NULL and set
+   errno if the file can't be opened or it's not a regular file */
+struct file_entry *filecache_get(FileCache *, const char *);
+
+/* Release a reference to an entry obtained by filecache_get */
+void filecache_put(FileCache *, struct file_entry *);
+
+/* Drop the entry of a path from the cache, following lookups open it again */
+void filecache_invalidate(FileCache *, const char *);
+
+
+#endif
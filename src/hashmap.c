@@ -0,0 +1,542 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashmap.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/* Control bytes, full slots have the 7 low bits of the hash of their key
+   and the high bit clear */
+#define EMPTY       0x80
+#define DELETED     0xfe
+
+/* Tables are grown past 7/8 of their slots used, deleted ones included */
+#define MAX_LOAD(t) ((t)->ngroups * HASHMAP_GROUP / 8 * 7)
+
+
+/*
+ * Group matching, a bit for every slot of a group whose control byte
+ * matches. With SSE2 a group is compared in three instructions, otherwise
+ * eight bytes at a time in general purpose registers.
+ */
+
+#ifdef __SSE2__
+
+static inline unsigned match_byte(const uint8_t *ctrl, uint8_t b) {
+
+    __m128i c = _mm_load_si128((const __m128i *) ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(b)));
+}
+
+static inline unsigned match_empty(const uint8_t *ctrl) {
+    return match_byte(ctrl, EMPTY);
+}
+
+/* Empty or deleted, the only ones with the high bit set */
+static inline unsigned match_free(const uint8_t *ctrl) {
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *) ctrl));
+}
+
+#else
+
+#define LSB     0x0101010101010101ULL
+#define MSB     0x8080808080808080ULL
+
+/* Gather the high bits of the bytes of a word into the low byte */
+static inline unsigned gather(uint64_t w) {
+    return ((w & MSB) >> 7) * 0x0102040810204080ULL >> 56;
+}
+
+static inline uint64_t load(const uint8_t *p) {
+
+    uint64_t w;
+    memcpy(&w, p, 8);
+
+    return w;
+}
+
+/* May report a byte following a match that differs by its lowest bit, the
+   keys are compared anyway */
+static inline unsigned match_byte(const uint8_t *ctrl, uint8_t b) {
+
+    unsigned m = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        uint64_t x = load(ctrl + 8 * i) ^ (LSB * b);
+        m |= gather((x - LSB) & ~x) << (8 * i);
+    }
+
+    return m;
+}
+
+static inline unsigned match_empty(const uint8_t *ctrl) {
+
+    unsigned m = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        uint64_t w = load(ctrl + 8 * i);
+        m |= gather(w & ~(w << 1)) << (8 * i);
+    }
+
+    return m;
+}
+
+static inline unsigned match_free(const uint8_t *ctrl) {
+    return gather(load(ctrl)) | gather(load(ctrl + 8)) << 8;
+}
+
+#endif
+
+
+static inline size_t shard_of(const HashMap *m, uint64_t h) {
+    return (h >> 40) & (m->nshards - 1);
+}
+
+static inline uint8_t h2(uint64_t h) {
+    return h & 0x7f;
+}
+
+
+static void table_init(struct hashmap_table *t, size_t ngroups) {
+
+    memset(t, 0, sizeof(*t));
+
+    if (ngroups == 0)
+        return;
+
+    t->ngroups = ngroups;
+
+    if (posix_memalign((void **) &t->ctrl, 16, ngroups * HASHMAP_GROUP) != 0
+            || !(t->slots = malloc(ngroups * HASHMAP_GROUP
+                                   * sizeof(*t->slots)))) {
+        perror("allocating hash table");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(t->ctrl, EMPTY, ngroups * HASHMAP_GROUP);
+}
+
+
+static void table_free(struct hashmap_table *t) {
+
+    free(t->ctrl);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+/* Index of the slot holding a key, -1 if missing. Groups are probed in
+   triangular steps, visiting all of them, until one with an empty slot */
+static ssize_t find(const HashMap *m, const struct hashmap_table *t,
+                    const void *key, uint64_t h) {
+
+    size_t mask = t->ngroups - 1, g = (h >> 7) & mask;
+
+    for (size_t i = 0; i < t->ngroups; g = (g + ++i) & mask) {
+
+        const uint8_t *ctrl = t->ctrl + g * HASHMAP_GROUP;
+
+        for (unsigned bits = match_byte(ctrl, h2(h)); bits;
+             bits &= bits - 1) {
+            size_t idx = g * HASHMAP_GROUP + __builtin_ctz(bits);
+            if (m->eq(t->slots[idx].key, key))
+                return idx;
+        }
+
+        if (match_empty(ctrl))
+            break;
+    }
+
+    return -1;
+}
+
+/* Store a key known to be missing in the first free slot of its probe
+   sequence, there is always one below the max load */
+static void insert(struct hashmap_table *t, void *key, void *val,
+                   uint64_t h) {
+
+    size_t mask = t->ngroups - 1, g = (h >> 7) & mask;
+    unsigned bits;
+
+    for (size_t i = 0; !(bits = match_free(t->ctrl + g * HASHMAP_GROUP));
+         g = (g + ++i) & mask)
+        ;
+
+    size_t idx = g * HASHMAP_GROUP + __builtin_ctz(bits);
+
+    if (t->ctrl[idx] == DELETED)
+        t->deleted--;
+
+    t->ctrl[idx] = h2(h);
+    t->slots[idx].key = key;
+    t->slots[idx].val = val;
+    t->size++;
+}
+
+/* A slot can be emptied if its group has an empty one, probes stop there
+   anyway, otherwise it's marked deleted to let them go on */
+static void erase(struct hashmap_table *t, size_t idx) {
+
+    const uint8_t *ctrl = t->ctrl + idx / HASHMAP_GROUP * HASHMAP_GROUP;
+
+    if (match_empty(ctrl)) {
+        t->ctrl[idx] = EMPTY;
+    } else {
+        t->ctrl[idx] = DELETED;
+        t->deleted++;
+    }
+
+    t->size--;
+}
+
+/* Move a few groups of the old table to the current one, freeing the old
+   one once done. Moved slots are marked deleted, as lookups still probe
+   the old table until then */
+static void migrate(const HashMap *m, struct hashmap_shard *s, size_t n) {
+
+    struct hashmap_table *old = &s->old;
+
+    for (; n > 0 && s->migrated < old->ngroups; --n, ++s->migrated) {
+        for (size_t i = 0; i < HASHMAP_GROUP; ++i) {
+            size_t idx = s->migrated * HASHMAP_GROUP + i;
+            if (old->ctrl[idx] & 0x80)
+                continue;
+            struct hashmap_slot *slot = &old->slots[idx];
+            insert(&s->cur, slot->key, slot->val, m->hash(slot->key));
+            old->ctrl[idx] = DELETED;
+            old->size--;
+        }
+    }
+
+    if (old->ngroups && s->migrated == old->ngroups) {
+        table_free(old);
+        s->migrated = 0;
+    }
+}
+
+/* Make room for one more entry in the current table. A full table is
+   replaced by one twice as large, or of the same size if it's mostly
+   deleted slots, and becomes the old table migrated from */
+static void reserve(const HashMap *m, struct hashmap_shard *s) {
+
+    struct hashmap_table *cur = &s->cur;
+
+    if (cur->ngroups && cur->size + cur->deleted < MAX_LOAD(cur))
+        return;
+
+    /* Still migrating from the previous growth, done at once, it takes
+       far more inserts than migration steps to get here */
+    if (s->old.ngroups)
+        migrate(m, s, s->old.ngroups);
+
+    size_t ngroups = cur->ngroups == 0 ? 1 : cur->ngroups;
+
+    if (cur->size >= MAX_LOAD(cur) / 2)
+        ngroups *= 2;
+
+    s->old = *cur;
+    s->migrated = 0;
+    table_init(cur, ngroups);
+
+    if (s->old.ngroups == 0)
+        return;
+
+    /* Small tables are moved right away */
+    if (s->old.ngroups <= HASHMAP_MIGRATE)
+        migrate(m, s, s->old.ngroups);
+}
+
+
+HashMap *hashmap_new(size_t nshards, hashmap_hash hash, hashmap_eq eq) {
+
+    HashMap *m = malloc(sizeof(*m));
+    size_t n = 1;
+
+    if (nshards == 0)
+        nshards = HASHMAP_SHARDS;
+
+    while (n < nshards)
+        n *= 2;
+
+    if (!m || posix_memalign((void **) &m->shards, 64,
+                             n * sizeof(*m->shards)) != 0) {
+        perror("allocating hash map");
+        exit(EXIT_FAILURE);
+    }
+
+    m->hash = hash;
+    m->eq = eq;
+    m->nshards = n;
+
+    for (size_t i = 0; i < n; ++i) {
+        struct hashmap_shard *s = &m->shards[i];
+        pthread_rwlock_init(&s->lock, NULL);
+        table_init(&s->cur, 0);
+        table_init(&s->old, 0);
+        s->migrated = 0;
+    }
+
+    return m;
+}
+
+
+void hashmap_free(HashMap *m, void (*fn)(void *, void *)) {
+
+    for (size_t i = 0; i < m->nshards; ++i) {
+
+        struct hashmap_shard *s = &m->shards[i];
+        struct hashmap_table *tables[2] = { &s->cur, &s->old };
+
+        for (int t = 0; t < 2; ++t) {
+            size_t nslots = tables[t]->ngroups * HASHMAP_GROUP;
+            for (size_t j = 0; fn && j < nslots; ++j)
+                if (!(tables[t]->ctrl[j] & 0x80))
+                    fn(tables[t]->slots[j].key, tables[t]->slots[j].val);
+            table_free(tables[t]);
+        }
+
+        pthread_rwlock_destroy(&s->lock);
+    }
+
+    free(m->shards);
+    free(m);
+}
+
+/* Look a key up in both tables of a shard, return the table holding it */
+static struct hashmap_table *lookup(const HashMap *m, struct hashmap_shard *s,
+                                    const void *key, uint64_t h,
+                                    ssize_t *idx) {
+
+    if ((*idx = find(m, &s->cur, key, h)) >= 0)
+        return &s->cur;
+
+    if (s->old.ngroups && (*idx = find(m, &s->old, key, h)) >= 0)
+        return &s->old;
+
+    return NULL;
+}
+
+
+int hashmap_get(HashMap *m, const void *key, void **val) {
+
+    uint64_t h = m->hash(key);
+    struct hashmap_shard *s = &m->shards[shard_of(m, h)];
+    ssize_t idx;
+
+    pthread_rwlock_rdlock(&s->lock);
+
+    struct hashmap_table *t = lookup(m, s, key, h, &idx);
+
+    if (t)
+        *val = t->slots[idx].val;
+
+    pthread_rwlock_unlock(&s->lock);
+
+    return t != NULL;
+}
+
+
+int hashmap_read(HashMap *m, const void *key,
+                 void (*fn)(const void *, void *, void *), void *arg) {
+
+    uint64_t h = m->hash(key);
+    struct hashmap_shard *s = &m->shards[shard_of(m, h)];
+    ssize_t idx;
+
+    pthread_rwlock_rdlock(&s->lock);
+
+    struct hashmap_table *t = lookup(m, s, key, h, &idx);
+
+    if (t)
+        fn(t->slots[idx].key, t->slots[idx].val, arg);
+
+    pthread_rwlock_unlock(&s->lock);
+
+    return t != NULL;
+}
+
+
+int hashmap_put(HashMap *m, void *key, void *val, void **old_key,
+                void **old_val) {
+
+    uint64_t h = m->hash(key);
+    struct hashmap_shard *s = &m->shards[shard_of(m, h)];
+    ssize_t idx;
+
+    pthread_rwlock_wrlock(&s->lock);
+
+    migrate(m, s, HASHMAP_MIGRATE);
+
+    struct hashmap_table *t = lookup(m, s, key, h, &idx);
+
+    if (t) {
+        if (old_key)
+            *old_key = t->slots[idx].key;
+        if (old_val)
+            *old_val = t->slots[idx].val;
+    }
+
+    if (t == &s->cur) {
+        t->slots[idx].key = key;
+        t->slots[idx].val = val;
+    } else {
+        /* Not migrated yet, moved along */
+        if (t)
+            erase(t, idx);
+        reserve(m, s);
+        insert(&s->cur, key, val, h);
+    }
+
+    pthread_rwlock_unlock(&s->lock);
+
+    return t != NULL;
+}
+
+
+int hashmap_del(HashMap *m, const void *key, void **old_key, void **old_val) {
+
+    uint64_t h = m->hash(key);
+    struct hashmap_shard *s = &m->shards[shard_of(m, h)];
+    ssize_t idx;
+
+    pthread_rwlock_wrlock(&s->lock);
+
+    migrate(m, s, HASHMAP_MIGRATE);
+
+    struct hashmap_table *t = lookup(m, s, key, h, &idx);
+
+    if (t) {
+        if (old_key)
+            *old_key = t->slots[idx].key;
+        if (old_val)
+            *old_val = t->slots[idx].val;
+        erase(t, idx);
+    }
+
+    pthread_rwlock_unlock(&s->lock);
+
+    return t != NULL;
+}
+
+
+int hashmap_update(HashMap *m, const void *key,
+                   int (*fn)(void **, void **, int, void *), void *arg) {
+
+    uint64_t h = m->hash(key);
+    struct hashmap_shard *s = &m->shards[shard_of(m, h)];
+    ssize_t idx;
+    int rc;
+
+    pthread_rwlock_wrlock(&s->lock);
+
+    migrate(m, s, HASHMAP_MIGRATE);
+
+    struct hashmap_table *t = lookup(m, s, key, h, &idx);
+    void *k = t ? t->slots[idx].key : (void *) key;
+    void *v = t ? t->slots[idx].val : NULL;
+
+    if ((rc = fn(&k, &v, t != NULL, arg))) {
+        if (t == &s->cur) {
+            t->slots[idx].val = v;
+        } else {
+            if (t)
+                erase(t, idx);
+            reserve(m, s);
+            insert(&s->cur, k, v, h);
+        }
+    }
+
+    pthread_rwlock_unlock(&s->lock);
+
+    return rc;
+}
+
+
+size_t hashmap_size(HashMap *m) {
+
+    size_t n = 0;
+
+    for (size_t i = 0; i < m->nshards; ++i)
+        n += __atomic_load_n(&m->shards[i].cur.size, __ATOMIC_RELAXED)
+            + __atomic_load_n(&m->shards[i].old.size, __ATOMIC_RELAXED);
+
+    return n;
+}
+
+/* Word at a time multiply and xor-shift, finalized so that both the high
+   bits picking the shard and the low ones probing the tables are mixed */
+uint64_t hashmap_hash_bytes(const void *key, size_t len) {
+
+    const uint8_t *p = key;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, w;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    h *= 0xff51afd7ed558ccdULL;
+
+    return h ^ (h >> 32);
+}
+
+
+uint64_t hashmap_hash_str(const void *key) {
+    return hashmap_hash_bytes(key, strlen(key));
+}
+
+
+int hashmap_eq_str(const void *a, const void *b) {
+    return strcmp(a, b) == 0;
+}
+
+/* Finalizer of SplitMix64 */
+uint64_t hashmap_hash_int(const void *key) {
+
+    uint64_t h = (uintptr_t) key;
+
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+
+    return h ^ (h >> 31);
+}
+
+
+int hashmap_eq_int(const void *a, const void *b) {
+    return a == b;
+}
@@ -0,0 +1,145 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+
+/* Default number of shards, a power of two */
+#define HASHMAP_SHARDS      64
+
+/* Slots of a group, probed together */
+#define HASHMAP_GROUP       16
+
+/* Groups of a table being migrated moved to the new one at every write on
+   the shard */
+#define HASHMAP_MIGRATE     4
+
+
+/* Hash and equality of the keys, their type is up to the caller */
+typedef uint64_t (*hashmap_hash)(const void *);
+
+typedef int (*hashmap_eq)(const void *, const void *);
+
+
+struct hashmap_slot {
+    void *key;
+    void *val;
+};
+
+
+/* Open addressing table of a shard. A control byte per slot says if it's
+   empty, deleted, or full along with 7 bits of the hash of its key, a group
+   of them is compared at once to find the candidates of a lookup */
+struct hashmap_table {
+    uint8_t *ctrl;
+    struct hashmap_slot *slots;
+    /* Groups, a power of two */
+    size_t ngroups;
+    size_t size;
+    size_t deleted;
+};
+
+
+/* A shard has its own lock and tables. While it grows, its entries are
+   moved a few groups at a time from the old table to the new one by the
+   writers, lookups search both in the meantime */
+struct hashmap_shard {
+    pthread_rwlock_t lock;
+    struct hashmap_table cur;
+    struct hashmap_table old;
+    /* Next group of the old table to migrate */
+    size_t migrated;
+} __attribute__((aligned(64)));
+
+
+/* A concurrent hash map of pointers, split in shards by the high bits of
+   the hashes of the keys. Keys and values are owned by the caller */
+typedef struct hashmap {
+    hashmap_hash hash;
+    hashmap_eq eq;
+    /* A power of two */
+    size_t nshards;
+    struct hashmap_shard *shards;
+} HashMap;
+
+
+/* Create an empty map with nshards shards, rounded up to a power of two,
+   HASHMAP_SHARDS if 0 */
+HashMap *hashmap_new(size_t, hashmap_hash, hashmap_eq);
+
+/* Release a map, calling fn on every key and value if not NULL */
+void hashmap_free(HashMap *, void (*)(void *, void *));
+
+/* Look a key up, setting its value in val. Return 1 if found, 0 otherwise.
+   The value may be changed or removed right after, so it should be
+   immutable or reference counted, hashmap_read covers the other cases */
+int hashmap_get(HashMap *, const void *, void **);
+
+/* Call fn(key, val, arg) on the entry of a key with its shard locked for
+   reading, return 1 if found, 0 otherwise */
+int hashmap_read(HashMap *, const void *, void (*)(const void *, void *, void *),
+                 void *);
+
+/* Insert or replace the entry of a key. Return 1 if it replaced one, whose
+   key and value are set in old_key and old_val if not NULL, 0 otherwise */
+int hashmap_put(HashMap *, void *, void *, void **, void **);
+
+/* Remove the entry of a key, setting its key and value in old_key and
+   old_val if not NULL. Return 1 if found, 0 otherwise */
+int hashmap_del(HashMap *, const void *, void **, void **);
+
+/* Read-modify-write the entry of a key with its shard locked for writing:
+   fn(&key, &val, found, arg) is called with the stored key and value, or
+   the key looked up and NULL if missing. It can change the value, and for
+   a missing key set a key to store, then return 1 to keep the entry, 0 to
+   leave the map as it was. Return what fn returns */
+int hashmap_update(HashMap *, const void *,
+                   int (*)(void **, void **, int, void *), void *);
+
+/* Number of entries, approximate while the map is being written */
+size_t hashmap_size(HashMap *);
+
+/* Hash and equality of NUL terminated strings and of integers stored in
+   the key pointers themselves */
+uint64_t hashmap_hash_str(const void *);
+
+int hashmap_eq_str(const void *, const void *);
+
+uint64_t hashmap_hash_int(const void *);
+
+int hashmap_eq_int(const void *, const void *);
+
+/* Hash of a buffer, to build hash functions of other key types */
+uint64_t hashmap_hash_bytes(const void *, size_t);
+
+
+#endif
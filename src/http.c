@@ -0,0 +1,1011 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <pthread.h>
+#include "http.h"
+#include "vessel.h"
+#include "bufpool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_X86
+#endif
+
+
+/* Size of the input buffer of a new connection, it grows as needed up to
+   the head and the body of the largest request */
+#define HTTP_BUFFER_SIZE    4096
+
+/* Results of the parsing steps, a complete head is never 0 bytes long */
+#define PARSE_OK        1
+#define PARSE_MORE      0
+#define PARSE_BAD       -1
+
+
+/* tchar of RFC 9110, the characters allowed in methods and header names */
+static const char token_chars[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+
+/*
+ * Scans, each one returning the first character of [p, end) not allowed in
+ * a token, a header value or a request target, end if there is none. The
+ * SIMD kernels go through whole blocks and leave the tail to the scalar
+ * ones, never reading past end.
+ */
+
+static const char *token_scalar(const char *p, const char *end) {
+    while (p < end && token_chars[(unsigned char) *p])
+        ++p;
+    return p;
+}
+
+/* Field values allow any byte but the controls other than HTAB */
+static const char *value_scalar(const char *p, const char *end) {
+    while (p < end && ((unsigned char) *p >= 0x20 || *p == '\t') && *p != 0x7f)
+        ++p;
+    return p;
+}
+
+/* Targets end at the first space or control */
+static const char *target_scalar(const char *p, const char *end) {
+    while (p < end && (unsigned char) *p > 0x20 && *p != 0x7f)
+        ++p;
+    return p;
+}
+
+#ifdef HTTP_X86
+
+/* PCMPESTRI with ranges finds the first byte falling in any of them. The
+   ranges of the token scan cover all the non-token bytes plus '|' and '~',
+   which are checked again with the table */
+__attribute__((target("sse4.2")))
+static const char *ranges_sse42(const char *p, const char *end,
+                                const char *ranges, int nranges) {
+
+    __m128i r = _mm_loadu_si128((const __m128i *) ranges);
+
+    while (end - p >= 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *) p);
+        int i = _mm_cmpestri(r, nranges, b, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES
+                             | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16)
+            return p + i;
+        p += 16;
+    }
+
+    return p;
+}
+
+__attribute__((target("sse4.2")))
+static const char *token_sse42(const char *p, const char *end) {
+
+    static const char ranges[16] __attribute__((aligned(16))) =
+        "\x00 \"\"(),,//:@[]{\xff";
+
+    for (;;) {
+        p = ranges_sse42(p, end, ranges, 16);
+        if (end - p < 16 || !token_chars[(unsigned char) *p])
+            return token_scalar(p, end);
+        ++p;
+    }
+}
+
+__attribute__((target("sse4.2")))
+static const char *value_sse42(const char *p, const char *end) {
+
+    static const char ranges[16] __attribute__((aligned(16))) =
+        "\x00\x08\x0a\x1f\x7f\x7f";
+
+    return value_scalar(ranges_sse42(p, end, ranges, 6), end);
+}
+
+__attribute__((target("sse4.2")))
+static const char *target_sse42(const char *p, const char *end) {
+
+    static const char ranges[16] __attribute__((aligned(16))) =
+        "\x00\x20\x7f\x7f";
+
+    return target_scalar(ranges_sse42(p, end, ranges, 4), end);
+}
+
+/* Bytes below lo, unsigned, or equal to DEL, tab excluded if allowed */
+__attribute__((target("avx2")))
+static const char *controls_avx2(const char *p, const char *end,
+                                 char lo, int tab) {
+
+    const __m256i low = _mm256_set1_epi8(lo);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i ht = _mm256_set1_epi8(tab ? '\t' : 0x7f);
+
+    while (end - p >= 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *) p);
+        /* max(b, lo) == b for the bytes at least lo */
+        __m256i ok = _mm256_cmpeq_epi8(_mm256_max_epu8(b, low), b);
+        __m256i bad = _mm256_or_si256(
+            _mm256_andnot_si256(_mm256_or_si256(ok, _mm256_cmpeq_epi8(b, ht)),
+                                _mm256_set1_epi8(-1)),
+            _mm256_cmpeq_epi8(b, del));
+        unsigned mask = _mm256_movemask_epi8(bad);
+        if (mask) {
+            p += __builtin_ctz(mask);
+            break;
+        }
+        p += 32;
+    }
+
+    /* The compiler doesn't clear the upper halves before a tail call, the
+       legacy SSE code of the token scan would pay for them afterwards */
+    _mm256_zeroupper();
+
+    return p;
+}
+
+__attribute__((target("avx2")))
+static const char *value_avx2(const char *p, const char *end) {
+    return value_scalar(controls_avx2(p, end, 0x20, 1), end);
+}
+
+__attribute__((target("avx2")))
+static const char *target_avx2(const char *p, const char *end) {
+    return target_scalar(controls_avx2(p, end, 0x21, 0), end);
+}
+
+#endif
+
+
+static struct {
+    const char *(*token)(const char *, const char *);
+    const char *(*value)(const char *, const char *);
+    const char *(*target)(const char *, const char *);
+} scan = { token_scalar, value_scalar, target_scalar };
+
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+
+static int set_kernel(enum http_kernel kernel) {
+
+#ifdef HTTP_X86
+    __builtin_cpu_init();
+
+    if (kernel == HTTP_KERNEL_AUTO)
+        kernel = __builtin_cpu_supports("avx2") ? HTTP_KERNEL_AVX2 :
+            __builtin_cpu_supports("sse4.2") ? HTTP_KERNEL_SSE42 :
+            HTTP_KERNEL_SCALAR;
+
+    /* The AVX2 kernel keeps the SSE4.2 token scan */
+    if (kernel == HTTP_KERNEL_AVX2 && (!__builtin_cpu_supports("avx2")
+                                       || !__builtin_cpu_supports("sse4.2")))
+        return -1;
+
+    if (kernel == HTTP_KERNEL_SSE42 && !__builtin_cpu_supports("sse4.2"))
+        return -1;
+
+    switch (kernel) {
+        case HTTP_KERNEL_AVX2:
+            scan.token = token_sse42;
+            scan.value = value_avx2;
+            scan.target = target_avx2;
+            return 0;
+        case HTTP_KERNEL_SSE42:
+            scan.token = token_sse42;
+            scan.value = value_sse42;
+            scan.target = target_sse42;
+            return 0;
+        default:
+            break;
+    }
+#else
+    if (kernel != HTTP_KERNEL_AUTO && kernel != HTTP_KERNEL_SCALAR)
+        return -1;
+#endif
+
+    scan.token = token_scalar;
+    scan.value = value_scalar;
+    scan.target = target_scalar;
+
+    return 0;
+}
+
+
+static void scan_init(void) {
+    set_kernel(HTTP_KERNEL_AUTO);
+}
+
+
+int http_set_kernel(enum http_kernel kernel) {
+    pthread_once(&scan_once, scan_init);
+    return set_kernel(kernel);
+}
+
+/* Case insensitive comparison of a view with a string */
+static int str_ieq(HttpStr s, const char *lit) {
+    return s.len == strlen(lit) && strncasecmp(s.p, lit, s.len) == 0;
+}
+
+/* Consume a line ending, CRLF or a bare LF */
+static int eol(const char **pp, const char *end) {
+
+    const char *p = *pp;
+
+    if (p == end)
+        return PARSE_MORE;
+
+    if (*p == '\r' && ++p == end)
+        return PARSE_MORE;
+
+    if (*p != '\n')
+        return PARSE_BAD;
+
+    *pp = p + 1;
+
+    return PARSE_OK;
+}
+
+/* Check if the end of a head, an empty line, is somewhere in [p, end) */
+static int head_end(const char *p, const char *end) {
+
+    while ((p = memchr(p, '\n', end - p)) && ++p < end) {
+        if (*p == '\n' || (*p == '\r' && p + 1 < end && p[1] == '\n'))
+            return 1;
+    }
+
+    return 0;
+}
+
+int http_has_token(const HttpStr *value, const char *token) {
+
+    const char *p = value->p, *end = value->p + value->len;
+
+    while (p < end) {
+        const char *q = memchr(p, ',', end - p);
+        HttpStr opt = { p, (q ? q : end) - p };
+        while (opt.len && (*opt.p == ' ' || *opt.p == '\t'))
+            opt.p++, opt.len--;
+        while (opt.len && (opt.p[opt.len - 1] == ' '
+                           || opt.p[opt.len - 1] == '\t'))
+            opt.len--;
+        if (str_ieq(opt, token))
+            return 1;
+        p = q ? q + 1 : end;
+    }
+
+    return 0;
+}
+
+/* Headers with a meaning for the framing of the messages and for the
+   connection, conflicting lengths are refused to prevent smuggling */
+static int header_semantics(HttpRequest *r, HttpStr name, HttpStr value,
+                            int *close, int *keep) {
+
+    if (str_ieq(name, "content-length")) {
+
+        size_t len = 0;
+
+        if (value.len == 0)
+            return PARSE_BAD;
+
+        for (size_t i = 0; i < value.len; ++i) {
+            if (value.p[i] < '0' || value.p[i] > '9'
+                    || len > (SIZE_MAX - 9) / 10)
+                return PARSE_BAD;
+            len = len * 10 + (value.p[i] - '0');
+        }
+
+        if (r->content_length != SIZE_MAX && r->content_length != len)
+            return PARSE_BAD;
+
+        r->content_length = len;
+
+    } else if (str_ieq(name, "transfer-encoding")) {
+
+        /* Chunked is the only coding understood */
+        if (!str_ieq(value, "chunked"))
+            return PARSE_BAD;
+
+        r->chunked = 1;
+
+    } else if (str_ieq(name, "connection")) {
+
+        if (http_has_token(&value, "close"))
+            *close = 1;
+        else if (http_has_token(&value, "keep-alive"))
+            *keep = 1;
+
+    } else if (str_ieq(name, "expect")) {
+        r->expect_continue = str_ieq(value, "100-continue");
+    }
+
+    return PARSE_OK;
+}
+
+
+ssize_t http_parse_request(const char *buf, size_t len, size_t last_len,
+                           HttpRequest *r) {
+
+    pthread_once(&scan_once, scan_init);
+
+    const char *p = buf, *end = buf + len, *q;
+    int rc, close = 0, keep = 0;
+
+    /* Nothing to do until the end of the head shows up, searched only in
+       the bytes arrived since the last call */
+    if (last_len > 0) {
+        size_t from = last_len > 3 ? last_len - 3 : 0;
+        if (!head_end(buf + from, end))
+            return PARSE_MORE;
+    }
+
+    r->nheaders = 0;
+    r->content_length = SIZE_MAX;
+    r->chunked = 0;
+    r->expect_continue = 0;
+    r->body.p = NULL;
+    r->body.len = 0;
+
+    /* Empty lines before a request are ignored */
+    while (p < end && (*p == '\r' || *p == '\n'))
+        ++p;
+
+    /* Request line, method SP target SP HTTP/1.x */
+    q = scan.token(p, end);
+    if (q == end)
+        return PARSE_MORE;
+    if (q == p || *q != ' ')
+        return PARSE_BAD;
+
+    r->method.p = p;
+    r->method.len = q - p;
+    p = q + 1;
+
+    q = scan.target(p, end);
+    if (q == end)
+        return PARSE_MORE;
+    if (q == p || *q != ' ')
+        return PARSE_BAD;
+
+    r->target.p = p;
+    r->target.len = q - p;
+    p = q + 1;
+
+    if (end - p < 8)
+        return memcmp(p, "HTTP/1.", end - p < 7 ? end - p : 7) == 0 ?
+            PARSE_MORE : PARSE_BAD;
+
+    if (memcmp(p, "HTTP/1.", 7) != 0 || p[7] < '0' || p[7] > '9')
+        return PARSE_BAD;
+
+    r->minor = p[7] - '0';
+    p += 8;
+
+    if ((rc = eol(&p, end)) != PARSE_OK)
+        return rc;
+
+    /* Header fields up to an empty line, obsolete line folding is refused
+       as a name can't start with a space */
+    for (;;) {
+
+        if (p == end)
+            return PARSE_MORE;
+
+        if (*p == '\r' || *p == '\n') {
+            if ((rc = eol(&p, end)) != PARSE_OK)
+                return rc;
+            break;
+        }
+
+        if (r->nheaders == HTTP_MAX_HEADERS)
+            return PARSE_BAD;
+
+        struct http_header *h = &r->headers[r->nheaders++];
+
+        q = scan.token(p, end);
+        if (q == end)
+            return PARSE_MORE;
+        if (q == p || *q != ':')
+            return PARSE_BAD;
+
+        h->name.p = p;
+        h->name.len = q - p;
+        p = q + 1;
+
+        while (p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+
+        q = scan.value(p, end);
+        if (q == end)
+            return PARSE_MORE;
+        if (*q != '\r' && *q != '\n')
+            return PARSE_BAD;
+
+        h->value.p = p;
+        h->value.len = q - p;
+
+        while (h->value.len && (p[h->value.len - 1] == ' '
+                                || p[h->value.len - 1] == '\t'))
+            h->value.len--;
+
+        p = q;
+
+        if ((rc = eol(&p, end)) != PARSE_OK)
+            return rc;
+
+        if (header_semantics(r, h->name, h->value, &close, &keep) != PARSE_OK)
+            return PARSE_BAD;
+    }
+
+    /* A length along with chunked is a smuggling attempt more than not */
+    if (r->chunked && r->content_length != SIZE_MAX)
+        return PARSE_BAD;
+
+    if (r->content_length == SIZE_MAX)
+        r->content_length = 0;
+
+    r->keep_alive = r->minor >= 1 ? !close : keep && !close;
+
+    return p - buf;
+}
+
+
+enum {
+    CHUNK_SIZE,
+    CHUNK_EXT,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_LF,
+    CHUNK_DONE
+};
+
+
+int http_decode_chunked(HttpChunked *c, char *buf, size_t len) {
+
+    while (c->state != CHUNK_DONE && c->in < len) {
+
+        char ch = buf[c->in];
+
+        switch (c->state) {
+            case CHUNK_SIZE: {
+                int v = ch >= '0' && ch <= '9' ? ch - '0' :
+                    ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 :
+                    ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
+                if (v >= 0) {
+                    if (c->left > (SIZE_MAX >> 4))
+                        return -1;
+                    c->left = (c->left << 4) | v;
+                    c->digits++;
+                    c->in++;
+                    break;
+                }
+                if (c->digits == 0)
+                    return -1;
+                if (ch == ';' || ch == ' ' || ch == '\t')
+                    c->state = CHUNK_EXT;
+                else if (ch == '\r')
+                    c->state = CHUNK_SIZE_LF;
+                else if (ch != '\n')
+                    return -1;
+                else
+                    c->state = c->left ? CHUNK_DATA : CHUNK_TRAILER;
+                c->in++;
+                break;
+            }
+            case CHUNK_EXT:
+                /* Extensions are ignored */
+                if (ch == '\r')
+                    c->state = CHUNK_SIZE_LF;
+                else if (ch == '\n')
+                    c->state = c->left ? CHUNK_DATA : CHUNK_TRAILER;
+                c->in++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (ch != '\n')
+                    return -1;
+                c->state = c->left ? CHUNK_DATA : CHUNK_TRAILER;
+                c->in++;
+                break;
+            case CHUNK_DATA: {
+                size_t n = len - c->in < c->left ? len - c->in : c->left;
+                memmove(buf + c->out, buf + c->in, n);
+                c->in += n;
+                c->out += n;
+                c->left -= n;
+                if (c->left == 0)
+                    c->state = CHUNK_DATA_CR;
+                break;
+            }
+            case CHUNK_DATA_CR:
+                if (ch == '\r')
+                    c->state = CHUNK_DATA_LF;
+                else if (ch != '\n')
+                    return -1;
+                else
+                    c->state = CHUNK_SIZE;
+                c->digits = 0;
+                c->in++;
+                break;
+            case CHUNK_DATA_LF:
+                if (ch != '\n')
+                    return -1;
+                c->state = CHUNK_SIZE;
+                c->in++;
+                break;
+            case CHUNK_TRAILER:
+                /* Trailer fields are skipped up to the empty line */
+                if (ch == '\r')
+                    c->state = CHUNK_TRAILER_LF;
+                else if (ch == '\n')
+                    c->state = CHUNK_DONE;
+                else
+                    c->state = CHUNK_TRAILER_LINE;
+                c->in++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (ch == '\n')
+                    c->state = CHUNK_TRAILER;
+                c->in++;
+                break;
+            case CHUNK_TRAILER_LF:
+                if (ch != '\n')
+                    return -1;
+                c->state = CHUNK_DONE;
+                c->in++;
+                break;
+        }
+    }
+
+    return c->state == CHUNK_DONE;
+}
+
+
+const HttpStr *http_find_header(const HttpRequest *r, const char *name) {
+
+    for (size_t i = 0; i < r->nheaders; ++i) {
+        if (str_ieq(r->headers[i].name, name))
+            return &r->headers[i].value;
+    }
+
+    return NULL;
+}
+
+
+int http_add_header(HttpResponse *res, const char *name, const char *value) {
+
+    size_t room = sizeof(res->headers) - res->headers_len;
+    int n = snprintf(res->headers + res->headers_len, room,
+                     "%s: %s\r\n", name, value);
+
+    if (n < 0 || (size_t) n >= room) {
+        res->headers[res->headers_len] = '\0';
+        return -1;
+    }
+
+    res->headers_len += n;
+
+    return 0;
+}
+
+/* Responses of a connection, batched until more input is needed */
+struct outbuf {
+    char *p;
+    size_t len;
+    size_t cap;
+};
+
+
+static void out_append(struct outbuf *o, const void *data, size_t len) {
+
+    if (!o->p)
+        o->p = bufpool_get(len > HTTP_BUFFER_SIZE ? len : HTTP_BUFFER_SIZE,
+                           &o->cap);
+
+    if (o->len + len > o->cap) {
+        size_t cap = o->cap ? o->cap : HTTP_BUFFER_SIZE;
+        while (cap < o->len + len)
+            cap *= 2;
+        o->p = realloc(o->p, cap);
+        if (!o->p) {
+            perror("growing HTTP output buffer");
+            exit(EXIT_FAILURE);
+        }
+        o->cap = cap;
+    }
+
+    memcpy(o->p + o->len, data, len);
+    o->len += len;
+}
+
+
+static int out_flush(Client *c, struct outbuf *o) {
+
+    if (o->len == 0)
+        return 0;
+
+    ssize_t n = vessel_write(c, o->p, o->len);
+    o->len = 0;
+
+    return n < 0 ? -1 : 0;
+}
+
+
+static const char *reason(int status) {
+
+    switch (status) {
+        case 100: return "Continue";
+        case 101: return "Switching Protocols";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 408: return "Request Timeout";
+        case 411: return "Length Required";
+        case 413: return "Content Too Large";
+        case 426: return "Upgrade Required";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+/* Append the head of a response, and its body if small enough. Return the
+   body still to be written, if any */
+static size_t out_response(struct outbuf *o, const HttpResponse *res,
+                           int head, int close) {
+
+    char line[128];
+    int n = snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n",
+                     res->status, reason(res->status));
+
+    out_append(o, line, n);
+
+    /* No body at all for these */
+    int bodyless = res->status < 200 || res->status == 204
+        || res->status == 304;
+
+    if (!bodyless) {
+        n = snprintf(line, sizeof(line), "Content-Length: %zu\r\n",
+                     res->body_len);
+        out_append(o, line, n);
+    }
+
+    /* Switching protocols sets its own */
+    if (res->status == 101)
+        ;
+    else if (close)
+        out_append(o, "Connection: close\r\n", 19);
+    else
+        out_append(o, "Connection: keep-alive\r\n", 24);
+
+    out_append(o, res->headers, res->headers_len);
+    out_append(o, "\r\n", 2);
+
+    if (bodyless || head || res->body_len == 0)
+        return 0;
+
+    if (res->body_len <= HTTP_INLINE_BODY) {
+        out_append(o, res->body, res->body_len);
+        return 0;
+    }
+
+    return res->body_len;
+}
+
+/* Reply with an error generated by the server itself and close */
+static void error_response(Client *c, struct outbuf *o, int status) {
+
+    HttpResponse res = { .status = status };
+
+    STATS_ADD(http_errors, 1);
+    out_response(o, &res, 0, 1);
+    out_flush(c, o);
+}
+
+
+/* Buffers of a connection, held only while it has a request in flight if
+   the memory of idle connections is released */
+static void http_buffers_get(char **in, size_t size, size_t *cap,
+                             HttpRequest **req, HttpResponse **res) {
+
+    *in = bufpool_get(size > HTTP_BUFFER_SIZE ? size : HTTP_BUFFER_SIZE, cap);
+    *req = malloc(sizeof(**req));
+    *res = malloc(sizeof(**res));
+
+    if (!*req || !*res) {
+        perror("allocating HTTP buffers");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static void http_buffers_put(char **in, size_t cap, HttpRequest **req,
+                             HttpResponse **res, struct outbuf *out) {
+
+    bufpool_put(*in, cap);
+    bufpool_put(out->p, out->cap);
+    free(*req);
+    free(*res);
+
+    *in = NULL;
+    *req = NULL;
+    *res = NULL;
+    *out = (struct outbuf) { NULL, 0, 0 };
+}
+
+
+void http_serve(Client *c) {
+
+    struct outbuf out = { NULL, 0, 0 };
+    size_t max_body = instance.http_max_body;
+    size_t cap, len = 0, last_len = 0;
+    char *in;
+    HttpRequest *req;
+    HttpResponse *res;
+
+    http_buffers_get(&in, 0, &cap, &req, &res);
+
+    for (;;) {
+
+        ssize_t hlen = http_parse_request(in, len, last_len, req);
+
+        if (hlen < 0) {
+            error_response(c, &out, 400);
+            break;
+        }
+
+        /* Need more bytes for the head, the pending responses go out first
+           as the peer may be waiting for them before sending more */
+        if (hlen == 0) {
+            if (len >= HTTP_MAX_HEAD) {
+                error_response(c, &out, 431);
+                break;
+            }
+            if (out_flush(c, &out) < 0)
+                break;
+            /* Nothing half read, the buffers go back to the pool until the
+               peer sends the next request, taken large enough for what is
+               already queued on the socket */
+            if (len == 0 && instance.release_idle) {
+                http_buffers_put(&in, cap, &req, &res, &out);
+                ssize_t n = vessel_wait_readable(c);
+                if (n <= 0)
+                    break;
+                http_buffers_get(&in, n < BUFPOOL_MAX ? n : BUFPOOL_MAX, &cap,
+                                 &req, &res);
+            }
+            if (len == cap) {
+                cap *= 2;
+                if (!(in = realloc(in, cap))) {
+                    perror("growing HTTP input buffer");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            last_len = len;
+            ssize_t n = vessel_read(c, in + len, cap - len);
+            if (n <= 0)
+                break;
+            len += n;
+            continue;
+        }
+
+        last_len = 0;
+
+        if (!req->chunked && req->content_length > max_body) {
+            error_response(c, &out, 413);
+            break;
+        }
+
+        /* Read the body, raw bytes of a chunked one are bounded too to
+           leave room for the chunk sizes but not for an endless stream */
+        HttpChunked chunked = { 0 };
+        size_t body_len = req->content_length;
+        size_t raw_max = hlen + (req->chunked ? 2 * max_body + HTTP_MAX_HEAD
+                                 : body_len);
+        int sent_continue = 0, ok = 1;
+
+        for (;;) {
+
+            size_t want;
+
+            if (req->chunked) {
+                int rc = http_decode_chunked(&chunked, in + hlen, len - hlen);
+                if (rc < 0 || chunked.out > max_body) {
+                    error_response(c, &out, rc < 0 ? 400 : 413);
+                    ok = 0;
+                    break;
+                }
+                if (rc == 1)
+                    break;
+                want = len + 1;
+            } else {
+                if (len - hlen >= body_len)
+                    break;
+                want = hlen + body_len;
+            }
+
+            if (len >= raw_max) {
+                error_response(c, &out, 413);
+                ok = 0;
+                break;
+            }
+
+            if (req->expect_continue && !sent_continue) {
+                out_append(&out, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+                sent_continue = 1;
+            }
+
+            if (out_flush(c, &out) < 0) {
+                ok = 0;
+                break;
+            }
+
+            if (want < len + HTTP_BUFFER_SIZE)
+                want = len + HTTP_BUFFER_SIZE;
+            if (want > raw_max)
+                want = raw_max;
+
+            if (want > cap) {
+                while (cap < want)
+                    cap *= 2;
+                if (!(in = realloc(in, cap))) {
+                    perror("growing HTTP input buffer");
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            ssize_t n = vessel_read(c, in + len, cap - len);
+            if (n <= 0) {
+                ok = 0;
+                break;
+            }
+            len += n;
+        }
+
+        if (!ok)
+            break;
+
+        size_t consumed;
+
+        /* The buffer may have moved while reading the body */
+        http_parse_request(in, hlen, 0, req);
+
+        if (req->chunked) {
+            req->body.p = in + hlen;
+            req->body.len = chunked.out;
+            consumed = hlen + chunked.in;
+        } else {
+            req->body.p = in + hlen;
+            req->body.len = body_len;
+            consumed = hlen + body_len;
+        }
+
+        STATS_ADD(http_requests, 1);
+
+        res->status = 200;
+        res->headers_len = 0;
+        res->body = NULL;
+        res->body_len = 0;
+        res->sbuf = NULL;
+        res->close = 0;
+
+        int close;
+
+        /* The connection goes on with the WebSocket protocol, right after
+           the response accepting the upgrade */
+        if (instance.ws_handler && ws_is_upgrade(req)) {
+            if (ws_accept(req, res) < 0) {
+                error_response(c, &out, 400);
+            } else if (instance.ws_open && instance.ws_open(c, req) < 0) {
+                error_response(c, &out, 403);
+            } else {
+                out_response(&out, res, 0, 0);
+                if (out_flush(c, &out) == 0)
+                    ws_serve(c, (uint8_t *) in + consumed, len - consumed);
+            }
+            break;
+        }
+
+        if (!instance.http_handler) {
+            res->status = 426;
+            http_add_header(res, "Upgrade", "websocket");
+        } else if (instance.http_handler(c, req, res) < 0) {
+            if (res->sbuf)
+                sbuf_put(res->sbuf);
+            error_response(c, &out, 500);
+            break;
+        }
+
+        close = res->close || !req->keep_alive;
+
+        if (res->sbuf) {
+            res->body = res->sbuf->data;
+            res->body_len = res->sbuf->len;
+        }
+
+        int head = str_ieq(req->method, "HEAD");
+        size_t rest = out_response(&out, res, head, close);
+
+        /* Large bodies are written from where they are, along with the
+           responses queued before them */
+        if (rest > 0) {
+            struct iovec iov[2] = {
+                { .iov_base = out.p, .iov_len = out.len },
+                { .iov_base = (void *) res->body, .iov_len = rest }
+            };
+            out.len = 0;
+            if (vessel_writev(c, iov, 2) < 0)
+                close = -1;
+        }
+
+        sbuf_put(res->sbuf);
+
+        if (close) {
+            if (close > 0)
+                out_flush(c, &out);
+            break;
+        }
+
+        /* Pipelined bytes move to the front for the next request */
+        memmove(in, in + consumed, len - consumed);
+        len -= consumed;
+    }
+
+    http_buffers_put(&in, cap, &req, &res, &out);
+}
@@ -0,0 +1,165 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "sbuf.h"
+
+
+/* Max number of headers of a request */
+#define HTTP_MAX_HEADERS    64
+
+/* Max size of a request line and its headers */
+#define HTTP_MAX_HEAD       8192
+
+/* Default max size of a request body, after dechunking */
+#define HTTP_MAX_BODY       (1024 * 1024)
+
+/* Response bodies up to this size are copied next to the head and written
+   along with it, larger ones are written straight from where they are */
+#define HTTP_INLINE_BODY    16384
+
+/* Room for the headers set by the handlers on a response */
+#define HTTP_RESPONSE_HEADERS   1024
+
+
+struct client;
+
+
+/* A view into the input buffer of the connection, not NUL terminated */
+typedef struct http_str {
+    const char *p;
+    size_t len;
+} HttpStr;
+
+
+struct http_header {
+    HttpStr name;
+    HttpStr value;
+};
+
+
+/* A parsed request, all the strings point into the input buffer and are
+   valid only during the handler call */
+typedef struct http_request {
+    HttpStr method;
+    HttpStr target;
+    /* HTTP/1.x */
+    int minor;
+    struct http_header headers[HTTP_MAX_HEADERS];
+    size_t nheaders;
+    /* Content-Length, 0 without it */
+    size_t content_length;
+    /* Transfer-Encoding: chunked */
+    int chunked;
+    /* Expect: 100-continue */
+    int expect_continue;
+    /* The connection stays open after the response, following the version
+       and the Connection header */
+    int keep_alive;
+    /* Complete body, already dechunked */
+    HttpStr body;
+} HttpRequest;
+
+
+/* State of a chunked body being decoded in place */
+typedef struct http_chunked {
+    int state;
+    /* Hex digits of the chunk size read so far */
+    int digits;
+    /* Bytes left of the current chunk */
+    size_t left;
+    /* Raw bytes consumed and decoded bytes produced */
+    size_t in;
+    size_t out;
+} HttpChunked;
+
+
+/* Response filled by the handlers, status defaults to 200. The body is
+   either borrowed, to be valid until the next request of the connection, or
+   a reference to a shared buffer, released once written */
+typedef struct http_response {
+    int status;
+    char headers[HTTP_RESPONSE_HEADERS];
+    size_t headers_len;
+    const void *body;
+    size_t body_len;
+    Sbuf *sbuf;
+    /* Close the connection after the response */
+    int close;
+} HttpResponse;
+
+
+/* Implementations of the scans for delimiters and invalid characters */
+enum http_kernel {
+    /* The best one supported by the CPU */
+    HTTP_KERNEL_AUTO,
+    HTTP_KERNEL_SCALAR,
+    HTTP_KERNEL_SSE42,
+    HTTP_KERNEL_AVX2
+};
+
+
+/* Select the scan kernel used by the parser for the whole process, return
+   -1 if the CPU doesn't support it */
+int http_set_kernel(enum http_kernel);
+
+/* Parse the request line and the headers of a request at the start of buf,
+   len bytes long. last_len is the length of buf on the previous call for
+   the same request, 0 on the first one: only the bytes arrived since then
+   are searched for the end of the head before parsing again. Return the
+   length of the head, 0 if it is incomplete, -1 if malformed */
+ssize_t http_parse_request(const char *, size_t, size_t, HttpRequest *);
+
+/* Decode a chunked body in place, buf starting with the body and holding
+   len bytes, more can be appended between calls. Decoded bytes are moved to
+   the front of buf, up to out, and raw bytes are consumed up to in. Return 1
+   once the last chunk and the trailers are consumed, 0 if more data is
+   needed, -1 if malformed */
+int http_decode_chunked(HttpChunked *, char *, size_t);
+
+/* Find a header of a request by name, case insensitive, NULL if missing */
+const HttpStr *http_find_header(const HttpRequest *, const char *);
+
+/* Check if a comma separated header value lists a token, case insensitive */
+int http_has_token(const HttpStr *, const char *);
+
+/* Add a header to a response, return -1 if there's no room left for it */
+int http_add_header(HttpResponse *, const char *, const char *);
+
+/* Coroutine handler serving HTTP/1.1 on a connection, installed by
+   start_server when Config has an http_handler or a ws_handler. Requests
+   are parsed from a buffer of the connection, pipelined ones are handled in
+   order and their responses written together, keep-alive connections go on
+   until the peer or the handler closes them, or they are upgraded */
+void http_serve(struct client *);
+
+
+#endif
@@ -28,9 +28,103 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "list.h"
 
 
+/* Max number of released nodes kept aside by every thread */
+#define NODE_POOL_MAX   4096
+
+
+/*
+ * Nodes are recycled through a per-thread free list, avoiding a malloc/free
+ * pair for every push and remove without any locking. A node released by a
+ * different thread than the one that allocated it just moves to the pool of
+ * the releasing thread. Pools are drained when their thread exits.
+ */
+static __thread ListNode *node_pool = NULL;
+static __thread unsigned node_pool_len = 0;
+static __thread int node_pool_registered = 0;
+
+static pthread_key_t node_pool_key;
+static pthread_once_t node_pool_once = PTHREAD_ONCE_INIT;
+
+
+static void node_pool_drain(void *arg) {
+
+    (void) arg;
+
+    while (node_pool) {
+        ListNode *next = node_pool->next;
+        free(node_pool);
+        node_pool = next;
+    }
+
+    node_pool_len = 0;
+
+    /* Nodes released later on, by other destructors, register it again */
+    node_pool_registered = 0;
+}
+
+
+static void node_pool_key_init(void) {
+    pthread_key_create(&node_pool_key, node_pool_drain);
+}
+
+
+static ListNode *node_alloc(void) {
+
+    ListNode *n = node_pool;
+
+    if (n) {
+        node_pool = n->next;
+        node_pool_len--;
+        return n;
+    }
+
+    n = malloc(sizeof(ListNode));
+
+    if (!n) {
+        perror("malloc(3) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return n;
+}
+
+
+static void node_release(ListNode *n) {
+
+    if (node_pool_len >= NODE_POOL_MAX) {
+        free(n);
+        return;
+    }
+
+    /* First node pooled by this thread, register the drain on exit */
+    if (!node_pool_registered) {
+        pthread_once(&node_pool_once, node_pool_key_init);
+        pthread_setspecific(node_pool_key, &node_pool);
+        node_pool_registered = 1;
+    }
+
+    n->next = node_pool;
+    node_pool = n;
+    node_pool_len++;
+}
+
+/* Unlink a node, updating head, tail and length of the list */
+static void list_unlink(List *l, ListNode *n) {
+
+    if (n->prev) n->prev->next = n->next;
+    else l->head = n->next;
+
+    if (n->next) n->next->prev = n->prev;
+    else l->tail = n->prev;
+
+    l->len--;
+}
+
+
 /*
  * Create a list, initializing all fields
  */
@@ -68,7 +162,7 @@ void list_free(List *l, int deep) {
 
         if (h) {
             if (h->data && deep == 1) free(h->data);
-            free(h);
+            node_release(h);
         }
 
         h = tmp;
@@ -95,20 +189,17 @@ List *list_attach(List *l, ListNode *head, unsigned long len) {
  */
 List *list_push(List *l, void *val) {
 
-    ListNode *new_node = malloc(sizeof(ListNode));
-
-    if (!new_node) {
-        perror("malloc(3) failed");
-        exit(EXIT_FAILURE);
-    }
+    ListNode *new_node = node_alloc();
 
     new_node->data = val;
+    new_node->prev = NULL;
 
     if (l->len == 0) {
         l->head = l->tail = new_node;
         new_node->next = NULL;
     } else {
         new_node->next = l->head;
+        l->head->prev = new_node;
         l->head = new_node;
     }
 
@@ -124,18 +215,16 @@ List *list_push(List *l, void *val) {
  */
 List *list_push_back(List *l, void *val) {
 
-    ListNode *new_node = malloc(sizeof(ListNode));
-
-    if (!new_node) {
-        perror("malloc(3) failed");
-        exit(EXIT_FAILURE);
-    }
+    ListNode *new_node = node_alloc();
 
     new_node->data = val;
     new_node->next = NULL;
 
-    if (l->len == 0) l->head = l->tail = new_node;
-    else {
+    if (l->len == 0) {
+        new_node->prev = NULL;
+        l->head = l->tail = new_node;
+    } else {
+        new_node->prev = l->tail;
         l->tail->next = new_node;
         l->tail = new_node;
     }
@@ -146,20 +235,34 @@ List *list_push_back(List *l, void *val) {
 }
 
 
-ListNode *list_remove(ListNode *head, ListNode *node, compare_func cmp) {
+/*
+ * Remove the first node matching the compare function
+ * Complexity: O(n)
+ */
+ListNode *list_remove(List *l, ListNode *node, compare_func cmp) {
+
+    for (ListNode *cur = l->head; cur != NULL; cur = cur->next) {
+        if (cmp(cur, node) == 0) {
+            list_unlink(l, cur);
+            node_release(cur);
+            break;
+        }
+    }
 
-    if (!head)
-        return NULL;
+    return l->head;
+}
 
-    if (cmp(head, node) == 0) {
 
-        ListNode *tmp_next = head->next;
-        free(head);
+/*
+ * Remove a node of the list
+ * Complexity: O(1)
+ */
+void *list_remove_node(List *l, ListNode *node) {
 
-        return tmp_next;
-    }
+    void *data = node->data;
 
-    head->next = list_remove(head->next, node, cmp);
+    list_unlink(l, node);
+    node_release(node);
 
-    return head;
+    return data;
 }
@@ -29,9 +29,18 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include <stddef.h>
+
+
+/* Retrieve a pointer to the structure embedding a member, given a pointer to
+   the member itself */
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
 
 struct list_node {
     void *data;
+    struct list_node *prev;
     struct list_node *next;
 };
 
@@ -66,10 +75,104 @@ List *list_push(List *, void *);
 /* Insert data into a node and push it to the back of the list */
 List *list_push_back(List *, void *);
 
-/* Remove a node from the list based on a compare function that must be
-   previously defined and passed in as a function pointer, accept two void *
-   args, which generally means a node and his subsequent */
-ListNode *list_remove(ListNode *, ListNode *, compare_func);
+/* Remove the first node of the list for which the compare function, called
+   with the node being visited and the node passed in, returns 0. Iterative
+   O(n) walk, keeps head, tail and len in sync and return the new head */
+ListNode *list_remove(List *, ListNode *, compare_func);
+
+/* Unlink a node known to belong to the list in O(1), returning its data */
+void *list_remove_node(List *, ListNode *);
+
+
+/*
+ * Intrusive doubly linked list.
+ *
+ * The node is embedded in the owning structure and the owner is recovered
+ * with container_of, so linking and unlinking never allocate. The list is
+ * circular around a sentinel head: an empty list points to itself and no
+ * operation has to special-case the ends. Every operation is O(1) and inlined.
+ */
+
+struct ilist_node {
+    struct ilist_node *prev;
+    struct ilist_node *next;
+};
+
+
+typedef struct ilist {
+    struct ilist_node head;
+    unsigned long len;
+} IList;
+
+
+/* Retrieve the structure embedding an intrusive node */
+#define ilist_entry(ptr, type, member) container_of(ptr, type, member)
+
+/* Iterate over all nodes, pos can be safely unlinked (and released) during
+   the iteration as the next node is saved in tmp beforehand */
+#define ilist_foreach_safe(pos, tmp, list)                  \
+    for (pos = (list)->head.next, tmp = pos->next;          \
+         pos != &(list)->head;                              \
+         pos = tmp, tmp = pos->next)
+
+
+static inline void ilist_init(IList *l) {
+    l->head.prev = l->head.next = &l->head;
+    l->len = 0;
+}
+
+
+static inline int ilist_empty(const IList *l) {
+    return l->head.next == &l->head;
+}
+
+/* Check whether a node is currently linked in a list, nodes must be zeroed
+   or unlinked with ilist_del before being checked */
+static inline int ilist_linked(const struct ilist_node *n) {
+    return n->next != NULL;
+}
+
+
+static inline void ilist_insert(struct ilist_node *n,
+                                struct ilist_node *prev,
+                                struct ilist_node *next) {
+    n->prev = prev;
+    n->next = next;
+    prev->next = n;
+    next->prev = n;
+}
+
+/* Insert a node at the front of the list */
+static inline void ilist_push(IList *l, struct ilist_node *n) {
+    ilist_insert(n, &l->head, l->head.next);
+    l->len++;
+}
+
+/* Insert a node at the back of the list */
+static inline void ilist_push_back(IList *l, struct ilist_node *n) {
+    ilist_insert(n, l->head.prev, &l->head);
+    l->len++;
+}
+
+/* Unlink a node from the list it belongs to */
+static inline void ilist_del(IList *l, struct ilist_node *n) {
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->prev = n->next = NULL;
+    l->len--;
+}
+
+/* Unlink and return the first node, NULL if the list is empty */
+static inline struct ilist_node *ilist_pop(IList *l) {
+
+    if (ilist_empty(l))
+        return NULL;
+
+    struct ilist_node *n = l->head.next;
+    ilist_del(l, n);
+
+    return n;
+}
 
 
 #endif
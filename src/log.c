@@ -0,0 +1,421 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "log.h"
+
+
+/* Lines formatted before a write */
+#define LOG_BATCH   (64 * 1024)
+
+/* Room left in a batch for a line */
+#define LOG_LINE    512
+
+
+/* Records of a thread, a single producer single consumer queue between
+   the thread and the logger. A ring outlives its thread, to be drained and
+   then adopted by a new one */
+struct log_ring {
+    struct log_ring *next;
+    pid_t tid;
+    /* Set once its thread exited */
+    int orphan;
+    /* Written by the owner, read by the logger */
+    uint64_t head;
+    /* Written by the logger, read by the owner */
+    uint64_t tail;
+    /* Records dropped, reset by the logger on every report */
+    uint64_t suppressed;
+    /* Second and count of the current rate limiting window, owner only */
+    uint64_t window;
+    unsigned count;
+    struct log_entry entries[LOG_RECORDS];
+};
+
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* log_start calls not stopped yet */
+    int users;
+    /* Set while the background thread is accepting records */
+    int running;
+    /* log_record calls that may be publishing to a ring, waited for by
+       log_stop before the last drain */
+    int writers;
+    int stopping;
+    pthread_t thread;
+    int fd;
+    int level;
+    int rate;
+    struct log_ring *rings;
+} logger = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+    .level = LOG_LEVEL_INFO
+};
+
+
+static __thread struct log_ring *ring;
+
+static pthread_key_t ring_key;
+
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+
+static const char *const levels[] = {
+    [LOG_LEVEL_ERROR] = "ERROR",
+    [LOG_LEVEL_WARNING] = "WARNING",
+    [LOG_LEVEL_INFO] = "INFO",
+    [LOG_LEVEL_DEBUG] = "DEBUG"
+};
+
+
+static void ring_exit(void *arg) {
+
+    struct log_ring *r = arg;
+
+    __atomic_store_n(&r->orphan, 1, __ATOMIC_RELEASE);
+}
+
+
+static void ring_key_init(void) {
+    pthread_key_create(&ring_key, ring_exit);
+}
+
+/* Ring of the calling thread, adopting the one of an exited thread if
+   possible, rings are never freed */
+static struct log_ring *ring_get(void) {
+
+    struct log_ring *r;
+
+    pthread_once(&ring_once, ring_key_init);
+
+    pthread_mutex_lock(&logger.lock);
+
+    for (r = logger.rings; r; r = r->next)
+        if (__atomic_load_n(&r->orphan, __ATOMIC_ACQUIRE))
+            break;
+
+    if (!r) {
+        if (!(r = calloc(1, sizeof(*r)))) {
+            perror("allocating log ring");
+            exit(EXIT_FAILURE);
+        }
+        r->next = logger.rings;
+        logger.rings = r;
+    }
+
+    r->orphan = 0;
+    r->tid = syscall(SYS_gettid);
+
+    pthread_mutex_unlock(&logger.lock);
+
+    pthread_setspecific(ring_key, r);
+
+    return ring = r;
+}
+
+
+static void log_sync(const char *site, int fd, int err) {
+
+    if (fd >= 0 && err)
+        fprintf(stderr, "%s: fd %d: %s\n", site, fd, strerror(err));
+    else if (err)
+        fprintf(stderr, "%s: %s\n", site, strerror(err));
+    else
+        fprintf(stderr, "%s\n", site);
+}
+
+
+/* Copy a record in the ring of the calling thread */
+static void log_push(enum log_level level, const char *site, int fd, int err) {
+
+    struct log_ring *r = ring;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    /* Rate limited by windows of a second */
+    if ((uint64_t) ts.tv_sec != r->window) {
+        r->window = ts.tv_sec;
+        r->count = 0;
+    }
+
+    uint64_t head = r->head;
+
+    if ((logger.rate >= 0 && r->count >= (unsigned) logger.rate)
+            || head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)
+            == LOG_RECORDS) {
+        __atomic_fetch_add(&r->suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    r->count++;
+
+    r->entries[head & (LOG_RECORDS - 1)] = (struct log_entry) {
+        (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec, site, fd, err, level
+    };
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+void log_record(enum log_level level, const char *site, int fd, int err) {
+
+    if (level == 0)
+        level = LOG_LEVEL_INFO;
+
+    if ((int) level > __atomic_load_n(&logger.level, __ATOMIC_RELAXED))
+        return;
+
+    /* The ring is taken before counting as a writer, log_stop waits for the
+       writers holding the lock ring_get needs */
+    if (!ring && __atomic_load_n(&logger.running, __ATOMIC_ACQUIRE))
+        ring_get();
+
+    /* Either log_stop sees this call in flight and waits for it, or it is
+       seen stopping here and the record is written right away */
+    __atomic_fetch_add(&logger.writers, 1, __ATOMIC_SEQ_CST);
+
+    if (ring && __atomic_load_n(&logger.running, __ATOMIC_SEQ_CST))
+        log_push(level, site, fd, err);
+    else
+        log_sync(site, fd, err);
+
+    __atomic_fetch_sub(&logger.writers, 1, __ATOMIC_RELEASE);
+}
+
+
+static void write_batch(char *buf, size_t len) {
+
+    while (len > 0) {
+        ssize_t n = write(logger.fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            /* Nowhere to report it */
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+
+static size_t format_entry(char *buf, const struct log_entry *e) {
+
+    char date[32];
+    time_t sec = e->ts / 1000000000ULL;
+    struct tm tm;
+    int n;
+
+    gmtime_r(&sec, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    n = snprintf(buf, LOG_LINE, "%s.%06uZ %s %s", date,
+                 (unsigned) (e->ts % 1000000000ULL / 1000), levels[e->level],
+                 e->site);
+
+    if (e->fd >= 0 && n < LOG_LINE)
+        n += snprintf(buf + n, LOG_LINE - n, ": fd %d", e->fd);
+
+    if (e->err && n < LOG_LINE)
+        n += snprintf(buf + n, LOG_LINE - n, ": %s", strerror(e->err));
+
+    if (n >= LOG_LINE - 1)
+        n = LOG_LINE - 2;
+
+    buf[n++] = '\n';
+
+    return n;
+}
+
+/* Format and write the records of all the rings, in batches */
+static void drain(char *buf) {
+
+    size_t len = 0;
+
+    pthread_mutex_lock(&logger.lock);
+    struct log_ring *r = logger.rings;
+    pthread_mutex_unlock(&logger.lock);
+
+    /* Rings are only pushed on the list, the ones found are all there is
+       to walk */
+    for (; r; r = r->next) {
+
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = r->tail;
+
+        for (; tail < head; ++tail) {
+            if (len > LOG_BATCH - LOG_LINE) {
+                write_batch(buf, len);
+                len = 0;
+                /* Make room for the writer as soon as possible */
+                __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+            }
+            len += format_entry(buf + len,
+                                &r->entries[tail & (LOG_RECORDS - 1)]);
+        }
+
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t suppressed = __atomic_exchange_n(&r->suppressed, 0,
+                                                  __ATOMIC_RELAXED);
+
+        if (suppressed > 0) {
+            if (len > LOG_BATCH - LOG_LINE) {
+                write_batch(buf, len);
+                len = 0;
+            }
+            len += snprintf(buf + len, LOG_LINE, "%" PRIu64 " records of "
+                            "thread %d suppressed\n", suppressed, r->tid);
+        }
+    }
+
+    write_batch(buf, len);
+}
+
+
+static void *log_thread(void *arg) {
+
+    (void) arg;
+
+    char *buf = malloc(LOG_BATCH);
+
+    if (!buf) {
+        perror("allocating log batch");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Once stopping, a last drain writes what was logged until then */
+    for (int stop = 0; !stop; ) {
+
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+
+        pthread_mutex_lock(&logger.lock);
+        if (!logger.stopping)
+            pthread_cond_timedwait(&logger.cond, &logger.lock, &ts);
+        stop = logger.stopping;
+        pthread_mutex_unlock(&logger.lock);
+
+        drain(buf);
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+
+int log_start(const char *path, enum log_level level, int rate) {
+
+    int rc = 0;
+
+    pthread_mutex_lock(&logger.lock);
+
+    if (logger.users++ > 0)
+        goto out;
+
+    logger.fd = path ? open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                            0644) : STDERR_FILENO;
+
+    if (logger.fd < 0) {
+        perror("open(2): log file");
+        goto err;
+    }
+
+    logger.level = level ? level : LOG_LEVEL_INFO;
+    logger.rate = rate == 0 ? LOG_RATE : rate;
+    logger.stopping = 0;
+
+    if (pthread_create(&logger.thread, NULL, log_thread, NULL) != 0) {
+        perror("pthread_create(3): logger");
+        if (path)
+            close(logger.fd);
+        goto err;
+    }
+
+    __atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+
+out:
+    pthread_mutex_unlock(&logger.lock);
+
+    return rc;
+
+err:
+    logger.users--;
+    logger.fd = -1;
+    rc = -1;
+    goto out;
+}
+
+
+void log_stop(void) {
+
+    pthread_mutex_lock(&logger.lock);
+
+    if (logger.users == 0 || --logger.users > 0) {
+        pthread_mutex_unlock(&logger.lock);
+        return;
+    }
+
+    /* Records from now on are written right away, the thread drains the
+       others before exiting, once the ones being published are there */
+    __atomic_store_n(&logger.running, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&logger.level, LOG_LEVEL_INFO, __ATOMIC_RELAXED);
+
+    while (__atomic_load_n(&logger.writers, __ATOMIC_SEQ_CST) > 0)
+        sched_yield();
+
+    logger.stopping = 1;
+    pthread_cond_signal(&logger.cond);
+
+    pthread_mutex_unlock(&logger.lock);
+
+    pthread_join(logger.thread, NULL);
+
+    if (logger.fd != STDERR_FILENO)
+        close(logger.fd);
+
+    logger.fd = -1;
+}
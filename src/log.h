@@ -0,0 +1,88 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <errno.h>
+#include <stdint.h>
+
+
+/* Records buffered by every thread, a power of two */
+#define LOG_RECORDS     1024
+
+/* Default records per second a thread can log, the others are counted and
+   reported as suppressed */
+#define LOG_RATE        100
+
+/* Interval of the background writes */
+#define LOG_FLUSH_MS    50
+
+
+/* 0 stands for the default level, LOG_LEVEL_INFO */
+enum log_level {
+    LOG_LEVEL_ERROR = 1,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+
+/* A structured record, formatted by the background thread. The site is a
+   string with static storage, it's never copied */
+struct log_entry {
+    /* CLOCK_REALTIME, ns */
+    uint64_t ts;
+    const char *site;
+    int32_t fd;
+    int32_t err;
+    uint32_t level;
+};
+
+
+/* Log a failed call at the error level, with its errno */
+#define log_errno(site, fd) log_record(LOG_LEVEL_ERROR, (site), (fd), errno)
+
+/* Log an event of a site, fd and err are left out of the message if < 0
+   and 0, a level of 0 is LOG_LEVEL_INFO. With the logger running, the
+   record is copied in a buffer of the calling thread, without locks nor
+   system calls, dropped if full or over the rate of the thread. Otherwise
+   it's written right away to stderr like perror does */
+void log_record(enum log_level, const char *, int, int);
+
+/* Start the background thread writing the records to a file, appended to,
+   or stderr if NULL, every LOG_FLUSH_MS. Records above the level given are
+   discarded, rate is the max records per second of every thread, LOG_RATE
+   if 0, unlimited if negative. Calls nest, once running the logger keeps
+   its settings until the last log_stop. Return -1 on error */
+int log_start(const char *, enum log_level, int);
+
+/* Write what's left and stop the background thread, on the last call */
+void log_stop(void);
+
+
+#endif
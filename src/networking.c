@@ -27,6 +27,7 @@
 
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -36,8 +37,14 @@
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <openssl/err.h>
+#include "log.h"
+#include "trace.h"
+#include "probes.h"
 #include "networking.h"
 
 
@@ -63,12 +70,13 @@ static int set_nonblocking(const int fd) {
     return 0;
 }
 
-/* Auxiliary function to create a socket and bind it to a hostname:port pair */
-static int create_and_bind(const char *host, const char *port) {
+/* Auxiliary function to create a socket of a given type (SOCK_STREAM or
+   SOCK_DGRAM) and bind it to a hostname:port pair */
+static int create_and_bind(const char *host, const char *port, int socktype) {
 
     const struct addrinfo hints = {
         .ai_family = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM,
+        .ai_socktype = socktype,
         .ai_flags = AI_PASSIVE
     };
 
@@ -85,12 +93,18 @@ static int create_and_bind(const char *host, const char *port) {
 
         if (sfd == -1) continue;
 
-        /* set SO_REUSEADDR so the socket will be reusable after process kill */
-        if (setsockopt(sfd, SOL_SOCKET, (SO_REUSEPORT | SO_REUSEADDR),
+        /* set SO_REUSEADDR so the socket will be reusable after process kill,
+           they are option names, not flags, so one call each */
+        if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR,
                     &(int) { 1 }, sizeof(int)) < 0) {
             perror("Error setting SO_REUSEADDR flag");
         }
 
+        if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT,
+                    &(int) { 1 }, sizeof(int)) < 0) {
+            perror("Error setting SO_REUSEPORT flag");
+        }
+
         if ((bind(sfd, rp->ai_addr, rp->ai_addrlen)) == 0) {
             /* Succesful bind */
             break;
@@ -109,18 +123,66 @@ static int create_and_bind(const char *host, const char *port) {
 }
 
 
+/* Set a single integer option if its value is not zero */
+static int set_option(int fd, int level, int name, int value, const char *msg) {
+
+    if (value == 0)
+        return 0;
+
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        perror(msg);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int set_sockopts(const int fd, const struct sockopts *opts, int tcp) {
+
+    int r = 0;
+
+    if (!opts)
+        return 0;
+
+    r |= set_option(fd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf,
+                    "setsockopt(2): SO_RCVBUF");
+    r |= set_option(fd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf,
+                    "setsockopt(2): SO_SNDBUF");
+
+    if (!tcp)
+        return r;
+
+    r |= set_option(fd, IPPROTO_TCP, TCP_NODELAY, opts->nodelay,
+                    "setsockopt(2): TCP_NODELAY");
+    r |= set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, opts->defer_accept,
+                    "setsockopt(2): TCP_DEFER_ACCEPT");
+    r |= set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, opts->fastopen,
+                    "setsockopt(2): TCP_FASTOPEN");
+    r |= set_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, opts->notsent_lowat,
+                    "setsockopt(2): TCP_NOTSENT_LOWAT");
+
+    return r;
+}
+
+
 /*
  * Create a non-blocking socket and make it listen on the specfied address and
  * port
  */
-int make_listen(const char *host, const char *port) {
+int make_listen(const char *host, const char *port,
+                const struct sockopts *opts) {
 
     int sfd;
 
     // First create and bind a socket
-    if ((sfd = create_and_bind(host, port)) == -1)
+    if ((sfd = create_and_bind(host, port, SOCK_STREAM)) == -1)
         abort();
 
+    // Buffer sizes have to be set before listen to take part in the window
+    // scaling of the handshake, accepted sockets inherit everything
+    set_sockopts(sfd, opts, 1);
+
     // Make it non-blocking in order to take the fully advantages of
     // Epoll descriptors monitoring
     if ((set_nonblocking(sfd)) == -1)
@@ -136,15 +198,96 @@ int make_listen(const char *host, const char *port) {
 }
 
 
+socklen_t unix_address(const char *path, struct sockaddr_un *addr) {
+
+    size_t len = strlen(path);
+
+    if (len == 0 || len >= sizeof(addr->sun_path))
+        return 0;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+
+    /* Abstract names start with a NUL byte and are not NUL terminated, all
+       the bytes up to the address length are part of the name */
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+
+    return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+
+int make_unix_listen(const char *path, const struct sockopts *opts) {
+
+    struct sockaddr_un addr;
+    socklen_t addrlen = unix_address(path, &addr);
+
+    if (addrlen == 0) {
+        fprintf(stderr, "Invalid unix socket path %s\n", path);
+        abort();
+    }
+
+    int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sfd == -1) {
+        perror("socket(2)");
+        abort();
+    }
+
+    set_sockopts(sfd, opts, 0);
+
+    // A socket file left by a previous run would make bind fail
+    if (path[0] != '@')
+        unlink(path);
+
+    if (bind(sfd, (struct sockaddr *) &addr, addrlen) == -1) {
+        perror("Could not bind");
+        abort();
+    }
+
+    if ((set_nonblocking(sfd)) == -1)
+        abort();
+
+    if ((listen(sfd, SOMAXCONN)) == -1) {
+        perror("listen");
+        abort();
+    }
+
+    return sfd;
+}
+
+
+int make_dgram(const char *host, const char *port,
+               const struct sockopts *opts) {
+
+    int sfd;
+
+    if ((sfd = create_and_bind(host, port, SOCK_DGRAM)) == -1)
+        abort();
+
+    set_sockopts(sfd, opts, 0);
+
+    if ((set_nonblocking(sfd)) == -1)
+        abort();
+
+    return sfd;
+}
+
+
 int accept_connection(const int serversock) {
 
     int clientsock;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addrlen = sizeof(addr);
 
     if ((clientsock = accept(serversock,
                     (struct sockaddr *) &addr, &addrlen)) < 0) {
-        perror("accept(2)");
+        // Taken by another worker in the meanwhile
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            log_errno("accept(2)", serversock);
         return -1;
     }
 
@@ -161,6 +304,10 @@ int sendall(const int sfd, uint8_t *buf, ssize_t len, ssize_t *sent) {
     ssize_t bytesleft = len;
     int n = 0;
 
+    PROBE2(sendall_entry, sfd, len);
+
+    uint64_t start = PROBE_START(sendall_return);
+
     while (total < len) {
 
         n = send(sfd, buf + total, bytesleft, MSG_NOSIGNAL);
@@ -168,11 +315,14 @@ int sendall(const int sfd, uint8_t *buf, ssize_t len, ssize_t *sent) {
         if (n == -1) {
 
             // No more data ot be read on the current call
-            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                TRACE(TRACE_EAGAIN, sfd, 1);
+                break;
+            }
 
             // Something went wrong
             else {
-                perror("send(2): error sending data\n");
+                log_errno("send(2): error sending data", sfd);
                 break;
             }
         }
@@ -185,10 +335,46 @@ int sendall(const int sfd, uint8_t *buf, ssize_t len, ssize_t *sent) {
     // argument is passed as pointer
     *sent = total;
 
+    PROBE4(sendall_return, sfd, total, n == -1 ? -1 : 0,
+           PROBE_ELAPSED(start));
+
     return n == -1 ? -1 : 0;
 }
 
 
+int sendfile_all(const int sfd, const int in_fd, off_t *offset, size_t *len) {
+
+    while (*len > 0) {
+
+        /* sendfile(2) moves the offset forward by the bytes sent */
+        ssize_t n = sendfile(sfd, in_fd, offset, *len);
+
+        if (n == -1) {
+
+            // Socket buffer full, resume on the next EPOLLOUT
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                TRACE(TRACE_EAGAIN, sfd, 1);
+                return 1;
+            }
+
+            log_errno("sendfile(2): error sending file", sfd);
+            return -1;
+        }
+
+        // File truncated under our feet, the length announced to the peer
+        // can't be honoured anymore
+        if (n == 0) {
+            log_record(LOG_LEVEL_ERROR, "sendfile(2): file truncated", sfd, 0);
+            return -1;
+        }
+
+        *len -= n;
+    }
+
+    return 0;
+}
+
+
 int recvall(const int sfd, Ringbuf *ringbuf, ssize_t len) {
 
     int n = 0;
@@ -202,21 +388,30 @@ int recvall(const int sfd, Ringbuf *ringbuf, ssize_t len) {
 
     uint8_t buf[bufsize];
 
+    PROBE2(recvall_entry, sfd, len);
+
+    uint64_t start = PROBE_START(recvall_return);
+
     for (;;) {
 
         if ((n = recv(sfd, buf, bufsize - 1, 0)) < 0) {
 
             // No more data ot be read on the current call
-            if (errno == EAGAIN || errno == EWOULDBLOCK)  break;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                TRACE(TRACE_EAGAIN, sfd, 0);
+                break;
+            }
 
             // Something went wrong
             else {
-                perror("recv(2): error reading data");
+                log_errno("recv(2): error reading data", sfd);
+                PROBE3(recvall_return, sfd, -1, PROBE_ELAPSED(start));
                 return -1;
             }
         }
 
         if (n == 0) {
+            PROBE3(recvall_return, sfd, 0, PROBE_ELAPSED(start));
             return 0;
         }
 
@@ -226,11 +421,19 @@ int recvall(const int sfd, Ringbuf *ringbuf, ssize_t len) {
 
         total += n;
     }
+
+    PROBE3(recvall_return, sfd, total, PROBE_ELAPSED(start));
+
     return total;
 }
 
 
 void add_epoll(const int efd, const int fd, void *data) {
+    add_epoll_events(efd, fd, EPOLLIN, data);
+}
+
+
+void add_epoll_events(const int efd, const int fd, const int evs, void *data) {
 
     struct epoll_event ev;
     ev.data.fd = fd;
@@ -240,10 +443,10 @@ void add_epoll(const int efd, const int fd, void *data) {
     if (data)
         ev.data.ptr = data;
 
-    ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    ev.events = evs | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
 
     if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
-        perror("epoll_ctl(2): add epollin");
+        log_errno("epoll_ctl(2): add epoll", fd);
     }
 }
 
@@ -257,10 +460,10 @@ void mod_epoll(const int efd, const int fd, const int evs, void *data) {
     if (data)
         ev.data.ptr = data;
 
-    ev.events = evs | EPOLLET | EPOLLONESHOT;
+    ev.events = evs | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
 
     if (epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev) < 0) {
-        perror("epoll_ctl(2): set epoll");
+        log_errno("epoll_ctl(2): set epoll", fd);
     }
 }
 
@@ -290,6 +493,11 @@ SSL_CTX *create_ssl_context() {
         exit(EXIT_FAILURE);
     }
 
+    /* Allow resuming a write interrupted by a full socket buffer from a
+       different buffer holding the same bytes, as ssl_sendfile does */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                     | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
     return ctx;
 }
 
@@ -328,7 +536,7 @@ int ssl_send(SSL *ssl, uint8_t *buf, ssize_t len, ssize_t *sent) {
         if (n == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
             else {
-                perror("SSL_write(2): error sending data\n");
+                log_errno("SSL_write(2): error sending data", -1);
                 break;
             }
         }
@@ -344,6 +552,47 @@ int ssl_send(SSL *ssl, uint8_t *buf, ssize_t len, ssize_t *sent) {
 }
 
 
+int ssl_sendfile(SSL *ssl, const int in_fd, off_t *offset, size_t *len) {
+
+    uint8_t buf[16384];
+
+    while (*len > 0) {
+
+        size_t chunk = *len < sizeof(buf) ? *len : sizeof(buf);
+        ssize_t r = pread(in_fd, buf, chunk, *offset);
+
+        if (r < 0) {
+            log_errno("pread(2): error reading file", in_fd);
+            return -1;
+        }
+
+        if (r == 0) {
+            log_record(LOG_LEVEL_ERROR, "pread(2): file truncated", in_fd, 0);
+            return -1;
+        }
+
+        int n = SSL_write(ssl, buf, r);
+
+        if (n <= 0) {
+
+            int err = SSL_get_error(ssl, n);
+
+            // The same bytes will be read again and written on resume
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+                return 1;
+
+            ERR_print_errors_fp(stderr);
+            return -1;
+        }
+
+        *offset += n;
+        *len -= n;
+    }
+
+    return 0;
+}
+
+
 int ssl_recv(SSL *ssl, Ringbuf *ringbuf, ssize_t len) {
 
     int n = 0;
@@ -360,7 +609,7 @@ int ssl_recv(SSL *ssl, Ringbuf *ringbuf, ssize_t len) {
 
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
             else {
-                perror("recv(2): error reading data");
+                log_errno("recv(2): error reading data", -1);
                 return -1;
             }
         }
@@ -29,6 +29,7 @@
 #ifndef NETWORKING_H
 #define NETWORKING_H
 
+#include <sys/un.h>
 #include <openssl/ssl.h>
 #include "ringbuf.h"
 
@@ -36,11 +37,49 @@
 #define BUFSIZE 256
 
 
+/* Socket options profile, fields left to zero keep the system defaults */
+struct sockopts {
+    /* TCP_NODELAY, disable Nagle's algorithm */
+    int nodelay;
+    /* TCP_DEFER_ACCEPT, seconds a connection can wait for its first data
+       before being accepted anyway */
+    int defer_accept;
+    /* TCP_FASTOPEN, max pending Fast Open requests of a listener */
+    int fastopen;
+    /* TCP_NOTSENT_LOWAT, a socket is reported writable only while it has
+       fewer unsent bytes than this */
+    int notsent_lowat;
+    /* SO_RCVBUF and SO_SNDBUF sizes in bytes */
+    int rcvbuf;
+    int sndbuf;
+};
+
+
+/* Apply the set fields of a socket options profile to a socket, TCP options
+   only if the last argument is set. Return -1 if any of them fails */
+int set_sockopts(const int, const struct sockopts *, int);
+
 /*
  * Create a non-blocking socket and make it listen on the specfied address and
- * port
+ * port, applying a socket options profile if not NULL. Accepted connections
+ * inherit all of them from the listener on Linux
  */
-int make_listen(const char *, const char *);
+int make_listen(const char *, const char *, const struct sockopts *);
+
+/* Create a non-blocking datagram socket bound to the specified address and
+   port, only the buffer sizes of the socket options profile apply */
+int make_dgram(const char *, const char *, const struct sockopts *);
+
+/* Fill a unix socket address with a path, a leading '@' selects the
+   abstract namespace, the name has no file on the filesystem and goes away
+   with the last socket using it. Return the length of the address, 0 if the
+   path is empty or too long */
+socklen_t unix_address(const char *, struct sockaddr_un *);
+
+/* Create a non-blocking unix stream socket listening on the specified path,
+   replacing any socket file left there. Only the buffer sizes of the socket
+   options profile apply and accepted connections do not inherit them */
+int make_unix_listen(const char *, const struct sockopts *);
 
 /* Accept a connection and add it to the right epollfd */
 int accept_connection(const int);
@@ -51,13 +90,19 @@ int accept_connection(const int);
    EDGE-TRIGGERED mode, with EPOLLONESHOT flag on, this way EPOLL_WAIT on read
    or write events will wake up just one thread instead of waking up all of
    them causing race-conditions difficult to handle. The downside is that it
-   has to be manually re-armed each time an event is triggered. Being struct
+   has to be manually re-armed each time an event is triggered. EPOLLRDHUP is
+   always requested too, so a peer shutting down its side of the connection
+   can be told apart from plain readable data. Being struct
    epoll_event FD or data mutually exclusive in an union, if NULL is passed as
    last argument the FD will be registered instead, so if there's need of a
    structure with additional info as well as an FD, it should be stored in the
    structure alongside other info needed */
 void add_epoll(const int, const int, void *);
 
+/* Add an FD to the EPOLL event loop as add_epoll, waiting for the events
+   passed instead of EPOLLIN */
+void add_epoll_events(const int, const int, const int, void *);
+
 /* Modify state of an already watched FD on the EPOLL event loop, as add_epoll,
    accept a pointer to a struct that can be passed instead of jsut the FD */
 void mod_epoll(const int, const int, const int, void *);
@@ -69,6 +114,13 @@ void mod_epoll(const int, const int, const int, void *);
    send out */
 int sendall(const int, uint8_t *, ssize_t, ssize_t *);
 
+/* Send a region of a file with sendfile(2), without copying it through user
+   space. Offset and length are updated with the progress, so the transfer
+   can be resumed when the socket becomes writable again. Return 0 when the
+   whole region is sent, 1 if the socket buffer is full and -1 on error,
+   the file being truncated before the end of the region included */
+int sendfile_all(const int, const int, off_t *, size_t *);
+
 /* Recv all data, eventually with multiple recv call exactly like sendall,
    instead of using a buffer to recv, it requires a ringbuffer, this way
    it is possible to fill the buffer with subsequent calls and empty it at
@@ -90,6 +142,10 @@ void load_certificates(SSL_CTX *, const char *, const char *);
 /* Send data like sendall but adding encryption SSL */
 int ssl_send(SSL *, uint8_t *, ssize_t, ssize_t *);
 
+/* Send a region of a file like sendfile_all on an SSL connection, the file
+   has to be encrypted in user space so it's read in chunks with pread(2) */
+int ssl_sendfile(SSL *, const int, off_t *, size_t *);
+
 /* Recv data like recvall but adding encryption SSL */
 int ssl_recv(SSL *, Ringbuf *, ssize_t);
 
@@ -0,0 +1,132 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <time.h>
+#include <stdint.h>
+
+
+/* USDT probes of the vessel provider, for perf, bpftrace and the other
+   tools attaching to them. Arguments in order, ns are latencies measured
+   only while a tool is attached:
+
+   accept(fd, peer)                     connection accepted
+   tls_handshake(fd, ok, ns)            SSL_accept done
+   wakeup(events)                       epoll_wait returning
+   request_start(fd)                    ctx_in called
+   request_done(fd, ns)                 ctx_in returned
+   reply_start(fd)                      ctx_out called
+   reply_done(fd, rc, ns)               ctx_out returned
+   coro_resume(fd)                      coroutine handler resumed
+   coro_yield(fd, done, ns)             suspended, or returned if done
+   sendall_entry(fd, len)
+   sendall_return(fd, sent, rc, ns)
+   recvall_entry(fd, len)
+   recvall_return(fd, bytes, ns)        bytes is -1 on error, 0 on EOF
+   close(fd)                            connection closed */
+#define VESSEL_PROBES(X)    \
+    X(accept)               \
+    X(tls_handshake)        \
+    X(wakeup)               \
+    X(request_start)        \
+    X(request_done)         \
+    X(reply_start)          \
+    X(reply_done)           \
+    X(coro_resume)          \
+    X(coro_yield)           \
+    X(sendall_entry)        \
+    X(sendall_return)       \
+    X(recvall_entry)        \
+    X(recvall_return)       \
+    X(close)
+
+
+/* Probes are compiled in wherever sys/sdt.h is available, from the systemtap
+   sdt headers, unless VESSEL_NO_PROBES is defined */
+#if !defined(VESSEL_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define VESSEL_USDT 1
+#endif
+#endif
+
+
+#ifdef VESSEL_USDT
+
+/* Every probe gets a semaphore, counting the tools attached to it, so that
+   latencies are only measured when someone looks at them */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBE_SEMAPHORE(name) vessel_##name##_semaphore
+
+#define PROBE_DECLARE(name) extern unsigned short PROBE_SEMAPHORE(name);
+
+VESSEL_PROBES(PROBE_DECLARE)
+
+#define PROBE_ENABLED(name) __builtin_expect(PROBE_SEMAPHORE(name) != 0, 0)
+
+#define PROBE1(name, a)             STAP_PROBE1(vessel, name, a)
+#define PROBE2(name, a, b)          STAP_PROBE2(vessel, name, a, b)
+#define PROBE3(name, a, b, c)       STAP_PROBE3(vessel, name, a, b, c)
+#define PROBE4(name, a, b, c, d)    STAP_PROBE4(vessel, name, a, b, c, d)
+
+#else
+
+/* The arguments are still looked at, not evaluated, to leave no variable
+   unused */
+#define PROBE_ENABLED(name) 0
+
+#define PROBE1(name, a) \
+    do { (void) sizeof(a); } while (0)
+#define PROBE2(name, a, b) \
+    do { (void) sizeof(a); (void) sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) \
+    do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); } while (0)
+#define PROBE4(name, a, b, c, d) \
+    do { PROBE2(name, a, b); PROBE2(name, c, d); } while (0)
+
+#endif
+
+/* Start of a latency measured for a probe, 0 if nobody is attached to it */
+#define PROBE_START(name) (PROBE_ENABLED(name) ? probe_now() : 0)
+
+/* Time elapsed since PROBE_START, 0 if it wasn't measured */
+#define PROBE_ELAPSED(start) ((start) ? probe_now() - (start) : 0)
+
+
+static inline uint64_t probe_now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+#endif
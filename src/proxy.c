@@ -0,0 +1,370 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "log.h"
+#include "proxy.h"
+#include "vessel.h"
+#include "networking.h"
+
+
+/* Max bytes moved from a socket into a pipe with a single splice(2) */
+#define SPLICE_CHUNK    65536
+
+
+/* One direction of a proxy, bytes read from src are spliced into the pipe
+   and from the pipe into dst, without ever being copied to user space */
+struct flow {
+    int src;
+    int dst;
+    int pipe[2];
+    /* Bytes sitting in the pipe */
+    size_t len;
+    /* End of stream read from src */
+    int eof;
+    /* Everything forwarded, dst shut down for writing */
+    int done;
+};
+
+
+struct proxy {
+    /* Private epoll instance watching the client and the upstream */
+    int epfd;
+    int client;
+    int upstream;
+    /* Client to upstream and back */
+    struct flow up;
+    struct flow down;
+    /* Events currently watched on the two sockets, 0 if not watched */
+    int client_events;
+    int upstream_events;
+    /* Bytes forwarded to the upstream and back */
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    /* The upstream connection can serve another client */
+    int reusable;
+};
+
+
+/* Idle upstream connections of the worker, the most recent on top */
+static __thread int *pool = NULL;
+static __thread int pool_len = 0;
+
+
+socklen_t proxy_resolve(const char *host, const char *port,
+                        struct sockaddr_storage *addr) {
+
+    if (!port)
+        return unix_address(host, (struct sockaddr_un *) addr);
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+    struct addrinfo *result;
+
+    int s = getaddrinfo(host, port, &hints, &result);
+    if (s != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+        return 0;
+    }
+
+    socklen_t len = result->ai_addrlen;
+    memcpy(addr, result->ai_addr, len);
+    freeaddrinfo(result);
+
+    return len;
+}
+
+/* Take an idle connection from the pool of the worker, checking that the
+   upstream didn't close it or send anything in the meanwhile */
+static int pool_get(void) {
+
+    while (pool_len > 0) {
+
+        int fd = pool[--pool_len];
+        uint8_t b;
+
+        if (recv(fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+                && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            STATS_ADD(upstream_reuses, 1);
+            return fd;
+        }
+
+        STATS_ADD(upstream_stale, 1);
+        close(fd);
+    }
+
+    return -1;
+}
+
+
+static void pool_put(int fd) {
+
+    if (!pool) {
+        pool = malloc(sizeof(int) * instance.proxy_pool_size);
+        if (!pool) {
+            perror("creating upstream pool");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (pool_len == instance.proxy_pool_size) {
+        close(fd);
+        return;
+    }
+
+    pool[pool_len++] = fd;
+}
+
+
+void proxy_pool_close(void) {
+
+    while (pool_len > 0)
+        close(pool[--pool_len]);
+
+    free(pool);
+    pool = NULL;
+}
+
+
+static int upstream_connect(void) {
+
+    const struct sockaddr *sa = (const struct sockaddr *) &instance.proxy_upstream;
+
+    int fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_errno("socket(2) to the upstream", -1);
+        return -1;
+    }
+
+    /* Requests are forwarded as they come, holding them back for Nagle
+       would just add latency */
+    if (sa->sa_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    /* Data spliced before the connection is established waits for EPOLLOUT
+       like on a full socket buffer, nothing else to do here */
+    if (connect(fd, sa, instance.proxy_upstream_len) < 0
+            && errno != EINPROGRESS) {
+        log_errno("connect(2) to the upstream", fd);
+        close(fd);
+        return -1;
+    }
+
+    STATS_ADD(upstream_connects, 1);
+
+    return fd;
+}
+
+/* Change the events watched on one of the sockets, sockets with nothing to
+   wait for are removed, or hang ups would be reported over and over */
+static void watch(Proxy *p, int fd, int *current, int events) {
+
+    if (events == *current)
+        return;
+
+    int op = *current == 0 ? EPOLL_CTL_ADD :
+        events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+
+    if (epoll_ctl(p->epfd, op, fd, &ev) < 0)
+        log_errno("epoll_ctl(2) of a proxy", fd);
+
+    *current = events;
+}
+
+
+Proxy *proxy_open(int client) {
+
+    int upstream = pool_get();
+
+    if (upstream < 0 && (upstream = upstream_connect()) < 0)
+        return NULL;
+
+    Proxy *p = calloc(1, sizeof(*p));
+    if (!p) {
+        perror("creating proxy");
+        exit(EXIT_FAILURE);
+    }
+
+    p->client = client;
+    p->upstream = upstream;
+    p->up = (struct flow) { .src = client, .dst = upstream, .pipe = {-1, -1} };
+    p->down = (struct flow) { .src = upstream, .dst = client, .pipe = {-1, -1} };
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (p->epfd < 0 || pipe2(p->up.pipe, O_NONBLOCK | O_CLOEXEC) < 0
+            || pipe2(p->down.pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("creating proxy");
+        proxy_free(p);
+        return NULL;
+    }
+
+    /* Both sides wait for data to begin with */
+    watch(p, client, &p->client_events, EPOLLIN);
+    watch(p, upstream, &p->upstream_events, EPOLLIN);
+
+    return p;
+}
+
+
+int proxy_fd(const Proxy *p) {
+    return p->epfd;
+}
+
+/* Move bytes along a flow until either its source has nothing to read or
+   its destination can't take more, return the bytes delivered or -1 on
+   error */
+static ssize_t flow_pump(struct flow *f) {
+
+    ssize_t total = 0, n;
+
+    while (!f->done) {
+
+        if (!f->eof) {
+            n = splice(f->src, NULL, f->pipe[1], NULL, SPLICE_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+                f->len += n;
+            else if (n == 0)
+                f->eof = 1;
+            else if (errno != EAGAIN)
+                return -1;
+        }
+
+        /* The source is drained, or the pipe is full */
+        if (f->len == 0)
+            break;
+
+        n = splice(f->pipe[0], NULL, f->dst, NULL, f->len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno != EAGAIN)
+            return -1;
+
+        /* The destination is full, stop reading until it drains */
+        if (n <= 0)
+            break;
+
+        f->len -= n;
+        total += n;
+    }
+
+    return total;
+}
+
+/* Events a flow waits for on its source and on its destination */
+#define SRC_EVENTS(f) (!(f)->eof && (f)->len == 0 ? EPOLLIN : 0)
+#define DST_EVENTS(f) ((f)->len > 0 ? EPOLLOUT : 0)
+
+
+int proxy_pump(Proxy *p) {
+
+    ssize_t up = flow_pump(&p->up);
+    ssize_t down = flow_pump(&p->down);
+
+    if (up < 0 || down < 0)
+        return -1;
+
+    if (up > 0) {
+        STATS_ADD(proxy_bytes_up, up);
+        p->bytes_up += up;
+    }
+
+    if (down > 0) {
+        STATS_ADD(proxy_bytes_down, down);
+        p->bytes_down += down;
+    }
+
+    /* The client is gone with all its requests answered, the upstream
+       connection can serve someone else as it is. Any byte still on its way
+       back would go to the next client, only the framing of the protocol
+       can rule that out */
+    if (p->up.eof && p->up.len == 0 && !p->up.done) {
+        if (instance.proxy_pool_size > 0 && p->down.len == 0 && !p->down.eof
+                && instance.proxy_reuse(p->bytes_up, p->bytes_down)) {
+            p->reusable = 1;
+            return -1;
+        }
+        shutdown(p->upstream, SHUT_WR);
+        p->up.done = 1;
+    }
+
+    if (p->down.eof && p->down.len == 0 && !p->down.done) {
+        shutdown(p->client, SHUT_WR);
+        p->down.done = 1;
+    }
+
+    if (p->up.done && p->down.done)
+        return -1;
+
+    watch(p, p->client, &p->client_events,
+          SRC_EVENTS(&p->up) | DST_EVENTS(&p->down));
+    watch(p, p->upstream, &p->upstream_events,
+          SRC_EVENTS(&p->down) | DST_EVENTS(&p->up));
+
+    return 0;
+}
+
+
+void proxy_free(Proxy *p) {
+
+    if (!p)
+        return;
+
+    /* Closing the epoll instance drops the sockets from it */
+    if (p->epfd >= 0)
+        close(p->epfd);
+
+    for (int i = 0; i < 2; ++i) {
+        if (p->up.pipe[i] >= 0)
+            close(p->up.pipe[i]);
+        if (p->down.pipe[i] >= 0)
+            close(p->down.pipe[i]);
+    }
+
+    if (p->reusable)
+        pool_put(p->upstream);
+    else
+        close(p->upstream);
+
+    free(p);
+}
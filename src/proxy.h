@@ -0,0 +1,69 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <sys/socket.h>
+
+
+typedef struct proxy Proxy;
+
+
+/* Resolve the address of the upstream, host and port of a TCP server or the
+   path of a unix socket when port is NULL, '@' starting abstract names.
+   Return the address length, 0 if it can't be resolved */
+socklen_t proxy_resolve(const char *, const char *, struct sockaddr_storage *);
+
+/* Forward a connected client socket to the upstream, over a connection taken
+   from the pool of the calling worker or a new one. Both sockets are watched
+   by a private epoll instance, the descriptor returned by proxy_fd, which is
+   the one to register on the event loop. Return NULL if the upstream can't
+   be reached */
+Proxy *proxy_open(int);
+
+/* Descriptor to watch for EPOLLIN, ready whenever the proxy can move data */
+int proxy_fd(const Proxy *);
+
+/* Move as many bytes as possible between the client and the upstream with
+   splice(2), through a pipe for every direction. A direction stops reading
+   its source as long as its pipe can't be emptied into the destination, so
+   a slow peer on one side throttles the other. Return 0 if the proxy has to
+   wait for more events, -1 once both directions are done or failed */
+int proxy_pump(Proxy *);
+
+/* Release a proxy, the client socket is left to the caller. The upstream
+   connection goes back to the pool of the calling worker if the client left
+   with every request answered, as proxy_reuse of the instance tells, it is
+   closed otherwise */
+void proxy_free(Proxy *);
+
+/* Close the idle upstream connections pooled by the calling worker */
+void proxy_pool_close(void);
+
+
+#endif
@@ -0,0 +1,288 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "pubsub.h"
+
+
+/* FNV-1a hash of the topic name */
+static uint64_t hash_topic(const char *name) {
+
+    uint64_t h = 14695981039346656037ull;
+
+    for (const unsigned char *p = (const unsigned char *) name; *p; ++p) {
+        h ^= *p;
+        h *= 1099511628211ull;
+    }
+
+    return h;
+}
+
+
+static struct topic_bucket *bucket_of(PubSub *ps, uint64_t hash) {
+    return &ps->buckets[hash & (ps->nbuckets - 1)];
+}
+
+/* Find a topic in its bucket, with the bucket lock held */
+static Topic *lookup(struct topic_bucket *b, const char *name, uint64_t hash) {
+
+    struct ilist_node *n, *tmp;
+
+    ilist_foreach_safe(n, tmp, &b->topics) {
+        Topic *t = ilist_entry(n, Topic, bucket);
+        if (t->hash == hash && strcmp(t->name, name) == 0)
+            return t;
+    }
+
+    return NULL;
+}
+
+/* Unlink a subscription from its topic, dropping the topic if it was the
+   last one, with the bucket write lock held */
+static void unlink_topic(struct topic_bucket *b, struct subscription *s) {
+
+    Topic *t = s->topic;
+
+    ilist_del(&t->subs, &s->topic_node);
+
+    if (ilist_empty(&t->subs)) {
+        ilist_del(&b->topics, &t->bucket);
+        free(t->name);
+        free(t);
+    }
+}
+
+
+PubSub *pubsub_new(size_t nbuckets) {
+
+    PubSub *ps = malloc(sizeof(*ps));
+    if (!ps) {
+        perror("creating pub/sub registry");
+        exit(EXIT_FAILURE);
+    }
+
+    ps->nbuckets = 1;
+    while (ps->nbuckets < nbuckets)
+        ps->nbuckets <<= 1;
+
+    ps->buckets = malloc(ps->nbuckets * sizeof(*ps->buckets));
+    if (!ps->buckets) {
+        perror("creating pub/sub buckets");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < ps->nbuckets; ++i) {
+        pthread_rwlock_init(&ps->buckets[i].lock, NULL);
+        ilist_init(&ps->buckets[i].topics);
+    }
+
+    return ps;
+}
+
+
+void pubsub_free(PubSub *ps) {
+
+    if (!ps)
+        return;
+
+    for (size_t i = 0; i < ps->nbuckets; ++i) {
+
+        struct ilist_node *n, *tmp, *sn, *stmp;
+
+        ilist_foreach_safe(n, tmp, &ps->buckets[i].topics) {
+            Topic *t = ilist_entry(n, Topic, bucket);
+            ilist_foreach_safe(sn, stmp, &t->subs)
+                free(ilist_entry(sn, struct subscription, topic_node));
+            free(t->name);
+            free(t);
+        }
+
+        pthread_rwlock_destroy(&ps->buckets[i].lock);
+    }
+
+    free(ps->buckets);
+    free(ps);
+}
+
+
+int pubsub_subscribe(PubSub *ps, Client *c, const char *name,
+                     enum outq_policy policy) {
+
+    if (c->ssl || c->proxy)
+        return -1;
+
+    uint64_t hash = hash_topic(name);
+    struct topic_bucket *b = bucket_of(ps, hash);
+    int rc = -1;
+
+    pthread_rwlock_wrlock(&b->lock);
+
+    Topic *t = lookup(b, name, hash);
+
+    /* Bucket first and client then, the same order of the publishes */
+    pthread_mutex_lock(&c->lock);
+
+    if (c->closed)
+        goto out;
+
+    /* Clients have few subscriptions, topics may have millions */
+    if (t) {
+        struct ilist_node *n, *tmp;
+        ilist_foreach_safe(n, tmp, &c->subs) {
+            if (ilist_entry(n, struct subscription, client_node)->topic == t)
+                goto out;
+        }
+    } else {
+        t = calloc(1, sizeof(*t));
+        if (!t) {
+            perror("creating topic");
+            exit(EXIT_FAILURE);
+        }
+        t->name = strdup(name);
+        t->hash = hash;
+        ilist_init(&t->subs);
+        ilist_push(&b->topics, &t->bucket);
+    }
+
+    struct subscription *s = malloc(sizeof(*s));
+    if (!s) {
+        perror("creating subscription");
+        exit(EXIT_FAILURE);
+    }
+
+    s->topic = t;
+    s->client = c;
+    s->policy = policy;
+    ilist_push_back(&t->subs, &s->topic_node);
+    ilist_push(&c->subs, &s->client_node);
+    rc = 0;
+
+out:
+    pthread_mutex_unlock(&c->lock);
+    pthread_rwlock_unlock(&b->lock);
+
+    return rc;
+}
+
+
+int pubsub_unsubscribe(PubSub *ps, Client *c, const char *name) {
+
+    uint64_t hash = hash_topic(name);
+    struct topic_bucket *b = bucket_of(ps, hash);
+    struct subscription *found = NULL;
+
+    pthread_rwlock_wrlock(&b->lock);
+
+    Topic *t = lookup(b, name, hash);
+
+    if (t) {
+        struct ilist_node *n, *tmp;
+
+        /* Whoever unlinks it from the client owns the subscription, racing
+           with pubsub_drop */
+        pthread_mutex_lock(&c->lock);
+        ilist_foreach_safe(n, tmp, &c->subs) {
+            struct subscription *s =
+                ilist_entry(n, struct subscription, client_node);
+            if (s->topic == t) {
+                ilist_del(&c->subs, n);
+                found = s;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    if (found)
+        unlink_topic(b, found);
+
+    pthread_rwlock_unlock(&b->lock);
+
+    free(found);
+
+    return found ? 0 : -1;
+}
+
+
+size_t pubsub_publish(PubSub *ps, const char *name, Sbuf *buf) {
+
+    uint64_t hash = hash_topic(name);
+    struct topic_bucket *b = bucket_of(ps, hash);
+    size_t n = 0;
+
+    STATS_ADD(publishes, 1);
+
+    pthread_rwlock_rdlock(&b->lock);
+
+    Topic *t = lookup(b, name, hash);
+
+    if (t) {
+        struct ilist_node *node, *tmp;
+        ilist_foreach_safe(node, tmp, &t->subs) {
+            struct subscription *s =
+                ilist_entry(node, struct subscription, topic_node);
+            n += client_queue(s->client, buf, s->policy) == 0;
+        }
+    }
+
+    pthread_rwlock_unlock(&b->lock);
+
+    STATS_ADD(deliveries, n);
+
+    return n;
+}
+
+
+void pubsub_drop(PubSub *ps, Client *c) {
+
+    IList subs;
+    struct ilist_node *n;
+
+    ilist_init(&subs);
+
+    /* Taken off the client first, the buckets are locked afterwards, one at
+       a time, as publishes lock them before the clients */
+    pthread_mutex_lock(&c->lock);
+    while ((n = ilist_pop(&c->subs)))
+        ilist_push(&subs, n);
+    pthread_mutex_unlock(&c->lock);
+
+    while ((n = ilist_pop(&subs))) {
+
+        struct subscription *s =
+            ilist_entry(n, struct subscription, client_node);
+        struct topic_bucket *b = bucket_of(ps, s->topic->hash);
+
+        pthread_rwlock_wrlock(&b->lock);
+        unlink_topic(b, s);
+        pthread_rwlock_unlock(&b->lock);
+
+        free(s);
+    }
+}
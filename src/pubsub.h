@@ -0,0 +1,100 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "list.h"
+#include "vessel.h"
+
+
+/* A topic with at least one subscriber, dropped along with the last one */
+typedef struct topic {
+    char *name;
+    uint64_t hash;
+    /* Subscriptions, linked through their topic_node */
+    IList subs;
+    /* Link in the hash bucket */
+    struct ilist_node bucket;
+} Topic;
+
+
+/* A client subscribed to a topic, with the policy followed when its out
+   queue is full */
+struct subscription {
+    Topic *topic;
+    Client *client;
+    enum outq_policy policy;
+    /* Link in the subscribers of the topic */
+    struct ilist_node topic_node;
+    /* Link in the subscriptions of the client, guarded by its lock */
+    struct ilist_node client_node;
+};
+
+
+/* Topics hashed by name into buckets, each one guarded by a read-write lock.
+   A publish holds the read lock of its bucket while queueing the message on
+   the subscribers, so publishes run in parallel even on the same topic and
+   cost a queue push per subscriber, independently of the other topics and
+   of the connections not subscribed */
+typedef struct pubsub {
+    size_t nbuckets;
+    struct topic_bucket {
+        pthread_rwlock_t lock;
+        IList topics;
+    } *buckets;
+} PubSub;
+
+
+/* Create a registry of topics with nbuckets hash buckets, rounded up to a
+   power of two */
+PubSub *pubsub_new(size_t);
+
+/* Release the registry along with all the topics and the subscriptions, to
+   be called once no client can use it anymore */
+void pubsub_free(PubSub *);
+
+/* Subscribe a client to a topic, return -1 if it is subscribed already, it
+   is closing, or it has no out queue, being a TLS or proxied connection */
+int pubsub_subscribe(PubSub *, Client *, const char *, enum outq_policy);
+
+/* Unsubscribe a client from a topic, return -1 if it was not subscribed */
+int pubsub_unsubscribe(PubSub *, Client *, const char *);
+
+/* Queue a shared buffer on all the subscribers of a topic, following the
+   policy of each subscription when their queue is full. Callable from any
+   thread, return the number of subscribers the buffer has been queued on */
+size_t pubsub_publish(PubSub *, const char *, Sbuf *);
+
+/* Drop all the subscriptions of a client, called by close_client once the
+   client is marked closed, no publish can reach it on return */
+void pubsub_drop(PubSub *, Client *);
+
+
+#endif
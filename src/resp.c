@@ -0,0 +1,478 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "resp.h"
+
+
+/*
+ * Parsing. Lines end with CRLF, bulk payloads are length prefixed and
+ * followed by CRLF too, a line longer than RESP_MAX_INLINE is malformed.
+ */
+
+/* Find the CRLF ending the line starting at pos, return the offset of the
+   CR, 0 if it isn't there yet, -1 if the line is too long or the CR isn't
+   followed by LF */
+static ssize_t line_end(const char *buf, size_t len, size_t pos) {
+
+    size_t limit = len - pos < RESP_MAX_INLINE ? len - pos : RESP_MAX_INLINE;
+    const char *cr = memchr(buf + pos, '\r', limit);
+
+    if (!cr)
+        return limit == RESP_MAX_INLINE ? -1 : 0;
+
+    if ((size_t) (cr - buf) + 1 >= len)
+        return 0;
+
+    return cr[1] == '\n' ? cr - buf : -1;
+}
+
+/* Strict signed decimal, no spaces or leading plus */
+static int parse_int(const char *p, size_t len, int64_t *n) {
+
+    int neg = len > 0 && p[0] == '-';
+    uint64_t v = 0;
+    size_t i = neg;
+
+    if (len == (size_t) neg || len - neg > 19)
+        return -1;
+
+    for (; i < len; ++i) {
+        if (p[i] < '0' || p[i] > '9')
+            return -1;
+        v = v * 10 + (p[i] - '0');
+    }
+
+    if (v > (uint64_t) INT64_MAX + neg)
+        return -1;
+
+    *n = neg ? (int64_t) -v : (int64_t) v;
+
+    return 0;
+}
+
+
+int resp_to_int(const RespStr *s, int64_t *n) {
+    return parse_int(s->p, s->len, n);
+}
+
+/* Parse a length prefixed payload whose length line starts at pos, set
+   its view and return the offset past it, 0 if incomplete, -1 if
+   malformed. A length of -1 is a null, left with a NULL view */
+static ssize_t bulk(const char *buf, size_t len, size_t pos, RespStr *s,
+                    int64_t *n) {
+
+    ssize_t cr = line_end(buf, len, pos + 1);
+
+    if (cr <= 0)
+        return cr;
+
+    if (parse_int(buf + pos + 1, cr - pos - 1, n) < 0
+            || *n < -1 || *n > RESP_MAX_BULK)
+        return -1;
+
+    size_t start = cr + 2;
+
+    if (*n == -1) {
+        s->p = NULL;
+        s->len = 0;
+        return start;
+    }
+
+    if (len - start < (size_t) *n + 2)
+        return 0;
+
+    if (buf[start + *n] != '\r' || buf[start + *n + 1] != '\n')
+        return -1;
+
+    s->p = buf + start;
+    s->len = *n;
+
+    return start + *n + 2;
+}
+
+
+ssize_t resp_parse(const char *buf, size_t len, RespValue *vals, size_t max,
+                   size_t *nvals) {
+
+    /* Values are stored in pre-order, so it's enough to know how many are
+       left to read: aggregates add their elements to the count */
+    size_t pos = 0, count = 0, left = 1;
+
+    while (left > 0) {
+
+        if (pos >= len)
+            return 0;
+
+        if (count == max)
+            return -1;
+
+        RespValue *v = &vals[count];
+        ssize_t cr, next;
+
+        v->type = buf[pos];
+        v->str.p = NULL;
+        v->str.len = 0;
+        v->n = 0;
+
+        switch (v->type) {
+            case RESP_BULK:
+            case RESP_BLOB_ERROR:
+            case RESP_VERBATIM:
+                if ((next = bulk(buf, len, pos, &v->str, &v->n)) <= 0)
+                    return next;
+                /* Only bulk strings can be null, in RESP2 */
+                if (v->n == -1 && v->type != RESP_BULK)
+                    return -1;
+                pos = next;
+                break;
+            case RESP_SIMPLE:
+            case RESP_ERROR:
+            case RESP_INTEGER:
+            case RESP_NULL:
+            case RESP_BOOLEAN:
+            case RESP_DOUBLE:
+            case RESP_BIG_NUMBER:
+            case RESP_ARRAY:
+            case RESP_MAP:
+            case RESP_SET:
+            case RESP_ATTRIBUTE:
+            case RESP_PUSH:
+                if ((cr = line_end(buf, len, pos + 1)) <= 0)
+                    return cr;
+                v->str.p = buf + pos + 1;
+                v->str.len = cr - pos - 1;
+                pos = cr + 2;
+                break;
+            default:
+                return -1;
+        }
+
+        left--;
+
+        switch (v->type) {
+            case RESP_INTEGER:
+                if (resp_to_int(&v->str, &v->n) < 0)
+                    return -1;
+                break;
+            case RESP_NULL:
+                if (v->str.len != 0)
+                    return -1;
+                break;
+            case RESP_BOOLEAN:
+                if (v->str.len != 1 || (v->str.p[0] != 't'
+                                        && v->str.p[0] != 'f'))
+                    return -1;
+                v->n = v->str.p[0] == 't';
+                break;
+            case RESP_ARRAY:
+            case RESP_MAP:
+            case RESP_SET:
+            case RESP_ATTRIBUTE:
+            case RESP_PUSH:
+                if (resp_to_int(&v->str, &v->n) < 0 || v->n < -1
+                        || v->n > RESP_MAX_VALUES
+                        || (v->n == -1 && v->type != RESP_ARRAY))
+                    return -1;
+                v->str.len = 0;
+                if (v->n > 0)
+                    left += v->type == RESP_MAP || v->type == RESP_ATTRIBUTE
+                        ? 2 * v->n : v->n;
+                /* Attributes decorate the value following them */
+                if (v->type == RESP_ATTRIBUTE)
+                    left++;
+                break;
+            default:
+                break;
+        }
+
+        count++;
+    }
+
+    *nvals = count;
+
+    return pos;
+}
+
+/* Inline commands end with LF, the CR before it is optional */
+static ssize_t parse_inline(const char *buf, size_t len, RespStr *argv,
+                            size_t max, size_t *argc) {
+
+    size_t limit = len < RESP_MAX_INLINE ? len : RESP_MAX_INLINE;
+    const char *lf = memchr(buf, '\n', limit);
+
+    if (!lf)
+        return limit == RESP_MAX_INLINE ? -1 : 0;
+
+    size_t end = lf - buf, n = 0;
+
+    if (end > 0 && buf[end - 1] == '\r')
+        end--;
+
+    for (size_t i = 0; i < end;) {
+
+        if (buf[i] == ' ' || buf[i] == '\t') {
+            ++i;
+            continue;
+        }
+
+        if (n == max)
+            return -1;
+
+        argv[n].p = buf + i;
+
+        while (i < end && buf[i] != ' ' && buf[i] != '\t')
+            ++i;
+
+        argv[n].len = buf + i - argv[n].p;
+        n++;
+    }
+
+    *argc = n;
+
+    return lf - buf + 1;
+}
+
+
+ssize_t resp_parse_command(const char *buf, size_t len, RespStr *argv,
+                           size_t max, size_t *argc) {
+
+    if (len == 0)
+        return 0;
+
+    if (buf[0] != RESP_ARRAY)
+        return parse_inline(buf, len, argv, max, argc);
+
+    ssize_t cr = line_end(buf, len, 1);
+    int64_t n;
+
+    if (cr <= 0)
+        return cr;
+
+    if (parse_int(buf + 1, cr - 1, &n) < 0 || n > (int64_t) max)
+        return -1;
+
+    size_t pos = cr + 2;
+
+    /* Empty and null arrays are skipped, as Redis does */
+    for (int64_t i = 0; i < n; ++i) {
+
+        int64_t blen;
+        ssize_t next;
+
+        if (pos >= len)
+            return 0;
+
+        if (buf[pos] != RESP_BULK)
+            return -1;
+
+        if ((next = bulk(buf, len, pos, &argv[i], &blen)) <= 0)
+            return next;
+
+        if (blen < 0)
+            return -1;
+
+        pos = next;
+    }
+
+    *argc = n > 0 ? n : 0;
+
+    return pos;
+}
+
+
+/*
+ * Encoding
+ */
+
+static void reserve(RespOut *o, size_t n) {
+
+    size_t want = o->buf->len + n;
+
+    if (want <= o->cap)
+        return;
+
+    while (o->cap < want)
+        o->cap *= 2;
+
+    Sbuf *b = realloc(o->buf, sizeof(*b) + o->cap);
+
+    if (!b) {
+        perror("growing RESP buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    o->buf = b;
+}
+
+static inline void put(RespOut *o, const void *p, size_t n) {
+
+    reserve(o, n);
+
+    memcpy(o->buf->data + o->buf->len, p, n);
+    o->buf->len += n;
+}
+
+/* Type byte, decimal number and CRLF, the header of most values */
+static void put_line(RespOut *o, char type, int64_t n) {
+
+    char tmp[24], *end = tmp + sizeof(tmp), *p = end;
+    uint64_t v = n < 0 ? -(uint64_t) n : (uint64_t) n;
+
+    *--p = '\n';
+    *--p = '\r';
+
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    if (n < 0)
+        *--p = '-';
+
+    *--p = type;
+
+    put(o, p, end - p);
+}
+
+static void put_text(RespOut *o, char type, const char *s, size_t len) {
+
+    reserve(o, len + 3);
+
+    uint8_t *p = o->buf->data + o->buf->len;
+
+    p[0] = type;
+    memcpy(p + 1, s, len);
+    p[len + 1] = '\r';
+    p[len + 2] = '\n';
+
+    o->buf->len += len + 3;
+}
+
+
+void resp_out_init(RespOut *o, int proto) {
+
+    o->buf = sbuf_new(RESP_OUT_SIZE);
+    o->buf->len = 0;
+    o->cap = RESP_OUT_SIZE;
+    o->proto = proto;
+}
+
+
+void resp_out_free(RespOut *o) {
+    sbuf_put(o->buf);
+    o->buf = NULL;
+}
+
+
+Sbuf *resp_out_sbuf(RespOut *o) {
+
+    Sbuf *b = o->buf;
+
+    resp_out_init(o, o->proto);
+
+    return b;
+}
+
+
+void resp_add_simple(RespOut *o, const char *s) {
+    put_text(o, RESP_SIMPLE, s, strlen(s));
+}
+
+
+void resp_add_error(RespOut *o, const char *s) {
+    put_text(o, RESP_ERROR, s, strlen(s));
+}
+
+
+void resp_add_integer(RespOut *o, int64_t n) {
+    put_line(o, RESP_INTEGER, n);
+}
+
+
+void resp_add_bulk(RespOut *o, const void *p, size_t len) {
+
+    put_line(o, RESP_BULK, len);
+    put(o, p, len);
+    put(o, "\r\n", 2);
+}
+
+
+void resp_add_null(RespOut *o) {
+
+    if (o->proto >= 3)
+        put(o, "_\r\n", 3);
+    else
+        put(o, "$-1\r\n", 5);
+}
+
+
+void resp_add_array(RespOut *o, size_t n) {
+    put_line(o, RESP_ARRAY, n);
+}
+
+
+void resp_add_map(RespOut *o, size_t n) {
+
+    if (o->proto >= 3)
+        put_line(o, RESP_MAP, n);
+    else
+        put_line(o, RESP_ARRAY, 2 * n);
+}
+
+
+void resp_add_set(RespOut *o, size_t n) {
+    put_line(o, o->proto >= 3 ? RESP_SET : RESP_ARRAY, n);
+}
+
+
+void resp_add_push(RespOut *o, size_t n) {
+    put_line(o, o->proto >= 3 ? RESP_PUSH : RESP_ARRAY, n);
+}
+
+
+void resp_add_boolean(RespOut *o, int b) {
+
+    if (o->proto >= 3)
+        put(o, b ? "#t\r\n" : "#f\r\n", 4);
+    else
+        put(o, b ? ":1\r\n" : ":0\r\n", 4);
+}
+
+
+void resp_add_double(RespOut *o, double d) {
+
+    char tmp[32];
+    int len = snprintf(tmp, sizeof(tmp), "%.17g", d);
+
+    if (o->proto >= 3)
+        put_text(o, RESP_DOUBLE, tmp, len);
+    else
+        resp_add_bulk(o, tmp, len);
+}
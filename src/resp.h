@@ -0,0 +1,171 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RESP_H
+#define RESP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "sbuf.h"
+
+
+/* Max number of values of a message, nested ones included, and of
+   arguments of a command */
+#define RESP_MAX_VALUES     1024
+
+/* Max length of a bulk string, as Redis' proto-max-bulk-len */
+#define RESP_MAX_BULK       (512 * 1024 * 1024)
+
+/* Max length of an inline command, or of any line */
+#define RESP_MAX_INLINE     (64 * 1024)
+
+/* Size of the first buffer of an encoder */
+#define RESP_OUT_SIZE       4096
+
+
+/* Types of the values, by their leading byte on the wire */
+enum resp_type {
+    RESP_SIMPLE = '+',
+    RESP_ERROR = '-',
+    RESP_INTEGER = ':',
+    RESP_BULK = '$',
+    RESP_ARRAY = '*',
+    /* RESP3 only */
+    RESP_NULL = '_',
+    RESP_BOOLEAN = '#',
+    RESP_DOUBLE = ',',
+    RESP_BIG_NUMBER = '(',
+    RESP_BLOB_ERROR = '!',
+    RESP_VERBATIM = '=',
+    RESP_MAP = '%',
+    RESP_SET = '~',
+    RESP_ATTRIBUTE = '|',
+    RESP_PUSH = '>'
+};
+
+
+/* A view into the input buffer, not NUL terminated */
+typedef struct resp_str {
+    const char *p;
+    size_t len;
+} RespStr;
+
+
+/* A parsed value. Strings, errors, doubles and big numbers have their text
+   in str, integers and booleans their value in n, aggregates the number of
+   their elements in n, twice the entries for maps and attributes. The RESP2
+   null bulk string and null array keep their type with n -1 */
+typedef struct resp_value {
+    enum resp_type type;
+    RespStr str;
+    int64_t n;
+} RespValue;
+
+
+/* Encoder of replies into a shared buffer, grown as needed. RESP3 types
+   are written as their closest RESP2 form when proto is 2 */
+typedef struct resp_out {
+    Sbuf *buf;
+    size_t cap;
+    int proto;
+} RespOut;
+
+
+/* Parse a single value at the start of buf, len bytes long, nested values
+   filled in vals in pre-order, at most max of them, their count in nvals.
+   Incomplete messages are parsed again from the start as more data comes,
+   without copies and stopping at the first value cut off. Return the length
+   of the message, 0 if it is incomplete, -1 if malformed or too large */
+ssize_t resp_parse(const char *, size_t, RespValue *, size_t, size_t *);
+
+/* Parse a command at the start of buf, either an array of bulk strings or
+   an inline command, space separated, its arguments filled in argv, at most
+   max of them, their count in argc. Return the length of the command, 0 if
+   incomplete, -1 if malformed or too large. An empty inline line is
+   consumed with argc 0 */
+ssize_t resp_parse_command(const char *, size_t, RespStr *, size_t, size_t *);
+
+/* Parse a string as a signed 64 bits integer, the whole of it, return -1 if
+   it isn't one or is out of range */
+int resp_to_int(const RespStr *, int64_t *);
+
+/* Initialize an encoder for a protocol version, 2 or 3 */
+void resp_out_init(RespOut *, int);
+
+/* Release the buffer of an encoder */
+void resp_out_free(RespOut *);
+
+/* Encoded length */
+static inline size_t resp_out_len(const RespOut *o) {
+    return o->buf->len;
+}
+
+/* Encoded bytes, valid until the next call on the encoder */
+static inline const uint8_t *resp_out_data(const RespOut *o) {
+    return o->buf->data;
+}
+
+/* Drop what was encoded, keeping the buffer */
+static inline void resp_out_reset(RespOut *o) {
+    o->buf->len = 0;
+}
+
+/* Hand the encoded bytes over as a shared buffer with a single reference,
+   to be queued on any number of clients, the encoder starts a new one */
+Sbuf *resp_out_sbuf(RespOut *);
+
+void resp_add_simple(RespOut *, const char *);
+
+void resp_add_error(RespOut *, const char *);
+
+void resp_add_integer(RespOut *, int64_t);
+
+void resp_add_bulk(RespOut *, const void *, size_t);
+
+/* Null bulk string in RESP2 */
+void resp_add_null(RespOut *);
+
+/* Headers of aggregates, to be followed by their elements. Maps take n
+   pairs, as flat arrays of 2 * n elements in RESP2, sets and pushes are
+   arrays in RESP2 */
+void resp_add_array(RespOut *, size_t);
+
+void resp_add_map(RespOut *, size_t);
+
+void resp_add_set(RespOut *, size_t);
+
+void resp_add_push(RespOut *, size_t);
+
+/* Integer 1 or 0 in RESP2 */
+void resp_add_boolean(RespOut *, int);
+
+/* Bulk string in RESP2 */
+void resp_add_double(RespOut *, double);
+
+
+#endif
@@ -27,15 +27,25 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "ringbuf.h"
+#include "typed_ringbuf.h"
+
+/* SSE2 is part of the x86-64 baseline, AVX2 is checked at runtime */
+#ifdef __x86_64__
+#include <immintrin.h>
+#define RINGBUF_X86
+#endif
+
+
+/* Byte specialization of the typed ring buffer, bulk operations copy whole
+   segments with memcpy instead of moving one byte at a time */
+RINGBUF_DECLARE(bytering, uint8_t)
 
 
 struct ringbuf {
-    uint8_t *buffer;
-    size_t head;
-    size_t tail;
-    size_t max;
-    uint8_t full : 1;
+    struct bytering ring;
 };
 
 
@@ -46,9 +56,7 @@ Ringbuf *ringbuf_init(uint8_t *buffer, size_t size) {
     Ringbuf *rbuf = malloc(sizeof(Ringbuf));
     assert(rbuf);
 
-    rbuf->buffer = buffer;
-    rbuf->max = size;
-    ringbuf_reset(rbuf);
+    bytering_init(&rbuf->ring, buffer, size);
 
     assert(ringbuf_empty(rbuf));
 
@@ -57,12 +65,8 @@ Ringbuf *ringbuf_init(uint8_t *buffer, size_t size) {
 
 
 void ringbuf_reset(Ringbuf *rbuf) {
-
     assert(rbuf);
-
-    rbuf->head = 0;
-    rbuf->tail = 0;
-    rbuf->full = 0;
+    bytering_reset(&rbuf->ring);
 }
 
 
@@ -75,122 +79,376 @@ void ringbuf_free(Ringbuf *rbuf) {
 
 uint8_t ringbuf_full(Ringbuf *rbuf) {
     assert(rbuf);
-    return rbuf->full;
+    return bytering_full(&rbuf->ring);
 }
 
 
 uint8_t ringbuf_empty(Ringbuf *rbuf) {
     assert(rbuf);
-    return (!rbuf->full && (rbuf->head == rbuf->tail));
+    return bytering_empty(&rbuf->ring);
 }
 
 
 size_t ringbuf_capacity(Ringbuf *rbuf) {
     assert(rbuf);
-    return rbuf->max;
+    return bytering_capacity(&rbuf->ring);
 }
 
 
 size_t ringbuf_size(Ringbuf *rbuf) {
-
     assert(rbuf);
+    return bytering_size(&rbuf->ring);
+}
 
-    size_t size = rbuf->max;
 
-    if (!rbuf->full) {
-        if (rbuf->head >= rbuf->tail) {
-            size = (rbuf->head - rbuf->tail);
-        } else {
-            size = (rbuf->max + rbuf->head - rbuf->tail);
-        }
-    }
+int8_t ringbuf_push(Ringbuf *rbuf, uint8_t dest) {
+    assert(rbuf && rbuf->ring.buf);
+    return bytering_push(&rbuf->ring, &dest);
+}
+
+/* Push as many bytes as fit, -1 if not all of them did */
+int8_t ringbuf_bulk_push(Ringbuf *rbuf, uint8_t *dest, size_t size) {
+
+    assert(rbuf && dest && rbuf->ring.buf);
 
-    return size;
+    return bytering_push_bulk(&rbuf->ring, dest, size) == size ? 0 : -1;
 }
 
 
-static void advance_pointer(Ringbuf *rbuf) {
+int8_t ringbuf_pop(Ringbuf *rbuf, uint8_t *dest) {
+    assert(rbuf && dest && rbuf->ring.buf);
+    return bytering_pop(&rbuf->ring, dest);
+}
 
-    assert(rbuf);
+/* Pop up to size bytes, fewer if the buffer doesn't hold enough of them */
+int8_t ringbuf_bulk_pop(Ringbuf *rbuf, uint8_t *dest, size_t size) {
+
+    assert(rbuf && dest && rbuf->ring.buf);
+
+    bytering_pop_bulk(&rbuf->ring, dest, size);
+
+    return 0;
+}
+
+
+/*
+ * Search kernels over a contiguous segment [p, end), the stored bytes being
+ * at most two of them. Byte and pattern searches return the first match or
+ * NULL, patterns are at least 2 bytes long and only matches ending within
+ * the segment count.
+ */
+
+static const uint8_t *find_scalar(const uint8_t *p, const uint8_t *end,
+                                  uint8_t c) {
+    for (; p < end; ++p)
+        if (*p == c)
+            return p;
+    return NULL;
+}
+
+static size_t count_scalar(const uint8_t *p, const uint8_t *end, uint8_t c) {
+    size_t n = 0;
+    for (; p < end; ++p)
+        n += *p == c;
+    return n;
+}
+
+static const uint8_t *pattern_scalar(const uint8_t *p, const uint8_t *end,
+                                     const uint8_t *pat, size_t len) {
+    for (; end - p >= (ptrdiff_t) len; ++p) {
+        size_t i = 0;
+        while (i < len && p[i] == pat[i])
+            ++i;
+        if (i == len)
+            return p;
+    }
+    return NULL;
+}
+
+#ifdef RINGBUF_X86
 
-    if (rbuf->full) {
-        rbuf->tail = (rbuf->tail + 1) % rbuf->max;
+static const uint8_t *find_sse2(const uint8_t *p, const uint8_t *end,
+                                uint8_t c) {
+
+    const __m128i v = _mm_set1_epi8(c);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *) p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(b, v));
+        if (mask)
+            return p + __builtin_ctz(mask);
     }
 
-    rbuf->head = (rbuf->head + 1) % rbuf->max;
-    rbuf->full = (rbuf->head == rbuf->tail);
+    return find_scalar(p, end, c);
 }
 
+/* Matches are accumulated as bytes of 0xff, subtracted from per lane
+   counters, and summed up with SAD every 255 blocks before they overflow */
+static size_t count_sse2(const uint8_t *p, const uint8_t *end, uint8_t c) {
 
-static void retreat_pointer(Ringbuf *rbuf) {
+    const __m128i v = _mm_set1_epi8(c);
+    size_t n = 0;
 
-    assert(rbuf);
+    while (end - p >= 16) {
+        __m128i acc = _mm_setzero_si128();
+        for (int i = 0; i < 255 && end - p >= 16; ++i, p += 16) {
+            __m128i b = _mm_loadu_si128((const __m128i *) p);
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(b, v));
+        }
+        __m128i sum = _mm_sad_epu8(acc, _mm_setzero_si128());
+        n += _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+    }
 
-    rbuf->full = 0;
-    rbuf->tail = (rbuf->tail + 1) % rbuf->max;
+    return n + count_scalar(p, end, c);
 }
 
+/* Candidates are the positions where both the first and the last byte of
+   the pattern match, only those are compared in full */
+static const uint8_t *pattern_sse2(const uint8_t *p, const uint8_t *end,
+                                   const uint8_t *pat, size_t len) {
+
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[len - 1]);
+
+    for (; end - p >= (ptrdiff_t) (len - 1 + 16); p += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) p);
+        __m128i b = _mm_loadu_si128((const __m128i *) (p + len - 1));
+        unsigned mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (memcmp(p + i + 1, pat + 1, len - 2) == 0)
+                return p + i;
+            mask &= mask - 1;
+        }
+    }
 
-int8_t ringbuf_push(Ringbuf *rbuf, uint8_t dest) {
+    return pattern_scalar(p, end, pat, len);
+}
 
-    int8_t r = -1;
+/* The AVX2 kernels clear the upper halves before going on with the scalar
+   tails, which may call into SSE code */
+__attribute__((target("avx2")))
+static const uint8_t *find_avx2(const uint8_t *p, const uint8_t *end,
+                                uint8_t c) {
 
-    assert(rbuf && rbuf->buffer);
+    const __m256i v = _mm256_set1_epi8(c);
 
-    if (!ringbuf_full(rbuf)) {
-        rbuf->buffer[rbuf->head] = dest;
-        advance_pointer(rbuf);
-        r = 0;
+    for (; end - p >= 32; p += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *) p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, v));
+        if (mask) {
+            _mm256_zeroupper();
+            return p + __builtin_ctz(mask);
+        }
     }
 
-    return r;
+    _mm256_zeroupper();
+
+    return find_scalar(p, end, c);
 }
 
+__attribute__((target("avx2")))
+static size_t count_avx2(const uint8_t *p, const uint8_t *end, uint8_t c) {
 
-int8_t ringbuf_bulk_push(Ringbuf *rbuf, uint8_t *dest, size_t size) {
+    const __m256i v = _mm256_set1_epi8(c);
+    size_t n = 0;
+
+    while (end - p >= 32) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int i = 0; i < 255 && end - p >= 32; ++i, p += 32) {
+            __m256i b = _mm256_loadu_si256((const __m256i *) p);
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(b, v));
+        }
+        __m256i sum = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+        n += _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1)
+            + _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+    }
 
-    assert(rbuf && dest && rbuf->buffer);
+    _mm256_zeroupper();
 
-    int8_t r = 0;
+    return n + count_scalar(p, end, c);
+}
 
-    for (uint8_t i = 0; i < size; ++i) {
-        r = ringbuf_push(rbuf, dest[i]);
-        if (r == -1) break;
+__attribute__((target("avx2")))
+static const uint8_t *pattern_avx2(const uint8_t *p, const uint8_t *end,
+                                   const uint8_t *pat, size_t len) {
+
+    const __m256i first = _mm256_set1_epi8(pat[0]);
+    const __m256i last = _mm256_set1_epi8(pat[len - 1]);
+
+    for (; end - p >= (ptrdiff_t) (len - 1 + 32); p += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) p);
+        __m256i b = _mm256_loadu_si256((const __m256i *) (p + len - 1));
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                             _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (memcmp(p + i + 1, pat + 1, len - 2) == 0) {
+                _mm256_zeroupper();
+                return p + i;
+            }
+            mask &= mask - 1;
+        }
     }
 
-    return r;
+    _mm256_zeroupper();
+
+    return pattern_scalar(p, end, pat, len);
 }
 
+#endif
 
-int8_t ringbuf_pop(Ringbuf *rbuf, uint8_t *dest) {
 
-    assert(rbuf && dest && rbuf->buffer);
+static struct {
+    const uint8_t *(*find)(const uint8_t *, const uint8_t *, uint8_t);
+    size_t (*count)(const uint8_t *, const uint8_t *, uint8_t);
+    const uint8_t *(*pattern)(const uint8_t *, const uint8_t *,
+                              const uint8_t *, size_t);
+} search = { find_scalar, count_scalar, pattern_scalar };
+
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+
 
-    int8_t r = -1;
+static int set_kernel(enum ringbuf_kernel kernel) {
 
-    if (!ringbuf_empty(rbuf)) {
-        *dest = rbuf->buffer[rbuf->tail];
-        retreat_pointer(rbuf);
+#ifdef RINGBUF_X86
+    __builtin_cpu_init();
 
-        r = 0;
+    if (kernel == RINGBUF_KERNEL_AUTO)
+        kernel = __builtin_cpu_supports("avx2") ?
+            RINGBUF_KERNEL_AVX2 : RINGBUF_KERNEL_SSE2;
+
+    if (kernel == RINGBUF_KERNEL_AVX2 && !__builtin_cpu_supports("avx2"))
+        return -1;
+
+    switch (kernel) {
+        case RINGBUF_KERNEL_AVX2:
+            search.find = find_avx2;
+            search.count = count_avx2;
+            search.pattern = pattern_avx2;
+            return 0;
+        case RINGBUF_KERNEL_SSE2:
+            search.find = find_sse2;
+            search.count = count_sse2;
+            search.pattern = pattern_sse2;
+            return 0;
+        default:
+            break;
     }
+#else
+    if (kernel != RINGBUF_KERNEL_AUTO && kernel != RINGBUF_KERNEL_SCALAR)
+        return -1;
+#endif
+
+    search.find = find_scalar;
+    search.count = count_scalar;
+    search.pattern = pattern_scalar;
 
-    return r;
+    return 0;
 }
 
 
-int8_t ringbuf_bulk_pop(Ringbuf *rbuf, uint8_t *dest, size_t size) {
+static void search_init(void) {
+    set_kernel(RINGBUF_KERNEL_AUTO);
+}
+
+
+int ringbuf_set_kernel(enum ringbuf_kernel kernel) {
+    pthread_once(&search_once, search_init);
+    return set_kernel(kernel);
+}
+
+/* The stored bytes as two segments, the second one empty unless they wrap
+   around the end of the buffer */
+static size_t segments(const Ringbuf *rbuf, const uint8_t **first,
+                       const uint8_t **second) {
+
+    const struct bytering *r = &rbuf->ring;
+    size_t idx = bytering_index_(r, r->tail);
+    size_t size = bytering_size(r);
+
+    *first = r->buf + idx;
+    *second = r->buf;
+
+    return size < r->capacity - idx ? size : r->capacity - idx;
+}
+
+
+ssize_t ringbuf_find(Ringbuf *rbuf, size_t from, uint8_t c) {
+
+    assert(rbuf);
+
+    pthread_once(&search_once, search_init);
 
-    assert(rbuf && dest && rbuf->buffer);
+    const uint8_t *a, *b, *m;
+    size_t n1 = segments(rbuf, &a, &b), size = ringbuf_size(rbuf);
 
-    uint8_t *cur = dest;
-    int8_t r = 0;
+    if (from < n1 && (m = search.find(a + from, a + n1, c)))
+        return m - a;
 
-    while (ringbuf_size(rbuf) > 0 && size > 0) {
-        r = ringbuf_pop(rbuf, cur++);
-        size--;
-        if (r == -1) break;
+    from = from > n1 ? from - n1 : 0;
+
+    if (n1 + from < size && (m = search.find(b + from, b + size - n1, c)))
+        return n1 + (m - b);
+
+    return -1;
+}
+
+
+ssize_t ringbuf_find_pattern(Ringbuf *rbuf, size_t from,
+                             const uint8_t *pat, size_t len) {
+
+    assert(rbuf && (pat || len == 0));
+
+    size_t size = ringbuf_size(rbuf);
+
+    if (from > size || size - from < len)
+        return -1;
+
+    if (len <= 1)
+        return len == 0 ? (ssize_t) from : ringbuf_find(rbuf, from, pat[0]);
+
+    pthread_once(&search_once, search_init);
+
+    const uint8_t *a, *b, *m;
+    size_t n1 = segments(rbuf, &a, &b), pos;
+
+    /* Matches within the first segment come first, then the ones wrapping
+       around, checked byte by byte as they are at most len - 1 */
+    if (from < n1 && (m = search.pattern(a + from, a + n1, pat, len)))
+        return m - a;
+
+    pos = n1 >= len ? n1 - len + 1 : 0;
+
+    for (pos = pos > from ? pos : from; pos < n1 && pos + len <= size; ++pos) {
+        size_t i = 0;
+        while (i < len && (pos + i < n1 ? a[pos + i] : b[pos + i - n1])
+               == pat[i])
+            ++i;
+        if (i == len)
+            return pos;
     }
 
-    return r;
+    from = from > n1 ? from - n1 : 0;
+
+    if (n1 + from < size && (m = search.pattern(b + from, b + size - n1,
+                                                pat, len)))
+        return n1 + (m - b);
+
+    return -1;
+}
+
+
+size_t ringbuf_count(Ringbuf *rbuf, uint8_t c) {
+
+    assert(rbuf);
+
+    pthread_once(&search_once, search_init);
+
+    const uint8_t *a, *b;
+    size_t n1 = segments(rbuf, &a, &b), size = ringbuf_size(rbuf);
+
+    return search.count(a, a + n1, c) + search.count(b, b + size - n1, c);
 }
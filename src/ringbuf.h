@@ -30,6 +30,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 
 typedef struct ringbuf Ringbuf;
@@ -70,5 +71,31 @@ size_t ringbuf_capacity(Ringbuf *);
    inside */
 size_t ringbuf_size(Ringbuf *);
 
+/* Implementations of the searches over the stored bytes */
+enum ringbuf_kernel {
+    /* The best one supported by the CPU */
+    RINGBUF_KERNEL_AUTO,
+    /* Plain loops, the reference of the others */
+    RINGBUF_KERNEL_SCALAR,
+    RINGBUF_KERNEL_SSE2,
+    RINGBUF_KERNEL_AVX2
+};
+
+/* Select the search kernel for the whole process, return -1 if the CPU
+   doesn't support it */
+int ringbuf_set_kernel(enum ringbuf_kernel);
+
+/* Return the offset from the front of the first occurrence of a byte at or
+   after the offset from, -1 if there's none. Nothing is consumed */
+ssize_t ringbuf_find(Ringbuf *, size_t, uint8_t);
+
+/* Return the offset from the front of the first occurrence of a pattern of
+   len bytes starting at or after the offset from, matches wrapping around
+   the end of the buffer included, -1 if there's none */
+ssize_t ringbuf_find_pattern(Ringbuf *, size_t, const uint8_t *, size_t);
+
+/* Count the occurrences of a byte in the stored bytes */
+size_t ringbuf_count(Ringbuf *, uint8_t);
+
 
 #endif
@@ -0,0 +1,65 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SBUF_H
+#define SBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* An immutable buffer shared by many connections, with the payload in the
+   same allocation of the header. Every out queue and every pending zero copy
+   send referencing it holds a reference, the last one to go frees it, so a
+   payload broadcast to any number of clients is allocated once and never
+   copied in user space */
+typedef struct sbuf {
+    /* References, updated atomically */
+    unsigned refs;
+    size_t len;
+    uint8_t data[];
+} Sbuf;
+
+
+/* Allocate a buffer of len bytes with a single reference, its content must
+   be written before sharing it and never changed afterwards */
+Sbuf *sbuf_new(size_t);
+
+/* Allocate a buffer holding a copy of len bytes of data */
+Sbuf *sbuf_from(const void *, size_t);
+
+/* Take a reference to a buffer, return the buffer itself */
+static inline Sbuf *sbuf_get(Sbuf *b) {
+    __atomic_fetch_add(&b->refs, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+/* Drop a reference to a buffer, freeing it along with the last one */
+void sbuf_put(Sbuf *);
+
+
+#endif
@@ -0,0 +1,341 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include "trace.h"
+
+
+/* Events recorded by a thread, overwriting the oldest ones. Only the owner
+   writes to it, head is the count of events written and is published after
+   every one of them */
+struct trace_ring {
+    struct trace_ring *next;
+    pid_t tid;
+    uint64_t mask;
+    uint64_t head;
+    struct trace_event events[];
+};
+
+
+int trace_enabled;
+
+static size_t ring_events = TRACE_EVENTS;
+
+/* Rings of all the threads that recorded something, they are never freed
+   so that the events of exited threads can still be dumped */
+static struct trace_ring *rings;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct trace_ring *ring;
+
+/* Eventfd waking the dump thread and where it writes */
+static int signal_fd = -1;
+
+static const char *signal_path;
+
+
+static const char *const names[TRACE_TYPES] = {
+    [TRACE_WAKEUP] = "epoll_wakeup",
+    [TRACE_ACCEPT] = "accept",
+    [TRACE_IN_BEGIN] = "ctx_in",
+    [TRACE_IN_END] = "ctx_in",
+    [TRACE_OUT_BEGIN] = "ctx_out",
+    [TRACE_OUT_END] = "ctx_out",
+    [TRACE_CO_BEGIN] = "coroutine",
+    [TRACE_CO_END] = "coroutine",
+    [TRACE_EAGAIN] = "eagain",
+    [TRACE_CLOSE] = "close"
+};
+
+
+static struct trace_ring *ring_new(void) {
+
+    size_t n = __atomic_load_n(&ring_events, __ATOMIC_RELAXED);
+    struct trace_ring *r = calloc(1, sizeof(*r) + n * sizeof(r->events[0]));
+
+    if (!r) {
+        perror("allocating trace ring");
+        exit(EXIT_FAILURE);
+    }
+
+    r->tid = syscall(SYS_gettid);
+    r->mask = n - 1;
+
+    pthread_mutex_lock(&rings_lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+
+    return r;
+}
+
+
+void trace_event(enum trace_type type, int fd, uint64_t arg) {
+
+    struct trace_ring *r = ring;
+    struct timespec ts;
+
+    if (!r)
+        r = ring = ring_new();
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t head = r->head;
+    struct trace_event *e = &r->events[head & r->mask];
+
+    e->ts = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->arg = arg;
+    e->fd = fd;
+    e->type = type;
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+void trace_start(size_t events) {
+
+    size_t n = 1;
+
+    while (n < (events ? events : TRACE_EVENTS))
+        n <<= 1;
+
+    __atomic_store_n(&ring_events, n, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELAXED);
+}
+
+
+void trace_stop(void) {
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+}
+
+/* Copy the events of a ring still being written in events, return how many
+   of them are valid. The owner may overwrite the oldest ones while they
+   are copied, head read again afterwards tells which ones */
+static size_t ring_copy(struct trace_ring *r, struct trace_event *events) {
+
+    uint64_t size = r->mask + 1;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t start = head > size ? head - size : 0;
+
+    for (uint64_t i = start; i < head; ++i)
+        events[i - start] = r->events[i & r->mask];
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    /* The slot of the event being written next is the oldest one */
+    uint64_t now = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint64_t valid = now + 1 > size ? now + 1 - size : 0;
+
+    if (valid <= start)
+        return head - start;
+
+    if (valid >= head)
+        return 0;
+
+    memmove(events, events + (valid - start),
+            (head - valid) * sizeof(*events));
+
+    return head - valid;
+}
+
+
+static void write_event(FILE *fp, pid_t pid, pid_t tid,
+                        const struct trace_event *e) {
+
+    fprintf(fp, ",\n{\"name\":\"%s\",\"ts\":%" PRIu64 ".%03u,"
+            "\"pid\":%d,\"tid\":%d,", names[e->type], e->ts / 1000,
+            (unsigned) (e->ts % 1000), pid, tid);
+
+    switch (e->type) {
+        case TRACE_WAKEUP:
+            fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",\"args\":{\"events\":%"
+                    PRIu64 "}}", e->arg);
+            break;
+        case TRACE_IN_BEGIN:
+        case TRACE_OUT_BEGIN:
+        case TRACE_CO_BEGIN:
+            fprintf(fp, "\"ph\":\"B\",\"args\":{\"fd\":%d}}", e->fd);
+            break;
+        case TRACE_OUT_END:
+            fprintf(fp, "\"ph\":\"E\",\"args\":{\"rc\":%d}}", (int) e->arg);
+            break;
+        case TRACE_IN_END:
+        case TRACE_CO_END:
+            fprintf(fp, "\"ph\":\"E\"}");
+            break;
+        case TRACE_EAGAIN:
+            fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",\"args\":{\"fd\":%d,"
+                    "\"op\":\"%s\"}}", e->fd, e->arg ? "write" : "read");
+            break;
+        default:
+            fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",\"args\":{\"fd\":%d}}",
+                    e->fd);
+            break;
+    }
+}
+
+
+int trace_dump(const char *path) {
+
+    FILE *fp = fopen(path, "w");
+
+    if (!fp) {
+        perror("fopen(3): trace dump");
+        return -1;
+    }
+
+    pid_t pid = getpid();
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"vessel\"}}", pid);
+
+    /* Rings are only ever pushed on the list, the ones found at the start
+       are all there is to walk */
+    pthread_mutex_lock(&rings_lock);
+    struct trace_ring *r = rings;
+    pthread_mutex_unlock(&rings_lock);
+
+    for (; r; r = r->next) {
+
+        struct trace_event *events = malloc((r->mask + 1) * sizeof(*events));
+
+        if (!events) {
+            perror("allocating trace dump");
+            exit(EXIT_FAILURE);
+        }
+
+        size_t n = ring_copy(r, events);
+
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                pid, r->tid, r->tid);
+
+        for (size_t i = 0; i < n; ++i)
+            write_event(fp, pid, r->tid, &events[i]);
+
+        free(events);
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp) != 0) {
+        perror("fclose(3): trace dump");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Async signal safe, the dump itself allocates and does stdio */
+static void dump_signal(int sig) {
+
+    (void) sig;
+
+    int saved = errno;
+
+    eventfd_write(signal_fd, 1);
+
+    errno = saved;
+}
+
+
+static void *dump_thread(void *arg) {
+
+    (void) arg;
+
+    uint64_t n;
+    sigset_t all;
+
+    /* Signals go to the other threads, one landing here while reading the
+       eventfd would only be handled later */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    for (;;) {
+        if (read(signal_fd, &n, sizeof(n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read(2): trace signal");
+            break;
+        }
+        const char *path = __atomic_load_n(&signal_path, __ATOMIC_ACQUIRE);
+        if (trace_dump(path) == 0)
+            fprintf(stderr, "Trace written to %s\n", path);
+    }
+
+    return NULL;
+}
+
+
+int trace_on_signal(int sig, const char *path) {
+
+    __atomic_store_n(&signal_path, path ? path : TRACE_PATH,
+                     __ATOMIC_RELEASE);
+
+    /* The thread started by a previous call dumps to the new path */
+    if (signal_fd < 0) {
+
+        pthread_t tid;
+
+        if ((signal_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+            perror("eventfd(2): trace signal");
+            return -1;
+        }
+
+        if (pthread_create(&tid, NULL, dump_thread, NULL) != 0) {
+            perror("pthread_create(3): trace dump thread");
+            close(signal_fd);
+            signal_fd = -1;
+            return -1;
+        }
+
+        pthread_detach(tid);
+    }
+
+    struct sigaction sa = { .sa_handler = dump_signal, .sa_flags = SA_RESTART };
+
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(sig, &sa, NULL) < 0) {
+        perror("sigaction(2): trace signal");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Default number of events kept by every thread, a power of two */
+#define TRACE_EVENTS    16384
+
+/* Default file written by the dumps triggered by a signal */
+#define TRACE_PATH      "vessel-trace.json"
+
+
+/* What the workers record, begin and end pairs become durations in the
+   trace, the others instant events */
+enum trace_type {
+    /* epoll_wait returning, arg is the number of events */
+    TRACE_WAKEUP,
+    TRACE_ACCEPT,
+    TRACE_IN_BEGIN,
+    TRACE_IN_END,
+    /* arg is the return code of the handler */
+    TRACE_OUT_BEGIN,
+    TRACE_OUT_END,
+    /* Coroutine handler resumed and suspended or returned */
+    TRACE_CO_BEGIN,
+    TRACE_CO_END,
+    /* A read, arg 0, or a write, arg 1, would block */
+    TRACE_EAGAIN,
+    TRACE_CLOSE,
+    TRACE_TYPES
+};
+
+
+/* Fixed size record of a ring, ts in ns of CLOCK_MONOTONIC */
+struct trace_event {
+    uint64_t ts;
+    uint64_t arg;
+    int32_t fd;
+    uint32_t type;
+};
+
+
+/* Set while recording, checked by every trace point */
+extern int trace_enabled;
+
+/* Record an event in the ring of the calling thread. Disabled tracing costs
+   a well predicted branch, building with VESSEL_NO_TRACE removes it too */
+#ifdef VESSEL_NO_TRACE
+#define TRACE(type, fd, arg) do { } while (0)
+#else
+#define TRACE(type, fd, arg) do {                               \
+    if (__builtin_expect(__atomic_load_n(&trace_enabled,        \
+                                         __ATOMIC_RELAXED), 0)) \
+        trace_event((type), (fd), (arg));                       \
+} while (0)
+#endif
+
+/* Record an event unconditionally, TRACE is the way to call it */
+void trace_event(enum trace_type, int, uint64_t);
+
+/* Start recording. The ring of a thread is allocated at its first event
+   with the number of events given, rounded up to a power of two,
+   TRACE_EVENTS if 0, rings already allocated keep their size */
+void trace_start(size_t);
+
+/* Stop recording, the rings keep what they have for the dumps */
+void trace_stop(void);
+
+/* Write the events of all the rings to a file in the Chrome trace format,
+   loadable by chrome://tracing or Perfetto. The threads keep recording in
+   the meantime, events overwritten while being copied are left out.
+   Return 0 on success, -1 on error */
+int trace_dump(const char *);
+
+/* Dump to the path given on every delivery of a signal. The dump runs on a
+   thread of its own, the handler only wakes it. Return -1 on error */
+int trace_on_signal(int, const char *);
+
+
+#endif
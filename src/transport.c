@@ -0,0 +1,440 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <openssl/err.h>
+#include "transport.h"
+
+
+/* Initial capacity of the buffers of the in-memory connections */
+#define MEM_BUFFER_SIZE 4096
+
+
+/* Map the result of an SSL_read or SSL_write to the ones of the socket
+   calls */
+static ssize_t tls_result(Client *c, int n, int *wait) {
+
+    if (n > 0)
+        return n;
+
+    switch (SSL_get_error(c->ssl, n)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+            *wait = EPOLLIN;
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            *wait = EPOLLOUT;
+            break;
+        default:
+            ERR_print_errors_fp(stderr);
+            break;
+    }
+
+    return -1;
+}
+
+
+static ssize_t tls_read(Client *c, void *buf, size_t len, int *wait) {
+    return tls_result(c, SSL_read(c->ssl, buf, len), wait);
+}
+
+
+static ssize_t tls_write(Client *c, const void *buf, size_t len, int *wait) {
+    return tls_result(c, SSL_write(c->ssl, buf, len), wait);
+}
+
+/* Records have no scatter/gather, the vectors go one at a time up to the
+   first short transfer. Bytes already moved are returned before an error,
+   which the next call hits again */
+static ssize_t tls_readv(Client *c, const struct iovec *iov, int iovcnt,
+                         int *wait) {
+
+    ssize_t total = 0;
+
+    for (int i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len == 0)
+            continue;
+        ssize_t n = tls_read(c, iov[i].iov_base, iov[i].iov_len, wait);
+        if (n <= 0) {
+            if (total > 0)
+                *wait = 0;
+            return total > 0 ? total : n;
+        }
+        total += n;
+        if ((size_t) n < iov[i].iov_len || SSL_pending(c->ssl) == 0)
+            break;
+    }
+
+    return total;
+}
+
+
+static ssize_t tls_writev(Client *c, const struct iovec *iov, int iovcnt,
+                          int *wait) {
+
+    ssize_t total = 0;
+
+    for (int i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len == 0)
+            continue;
+        ssize_t n = tls_write(c, iov[i].iov_base, iov[i].iov_len, wait);
+        if (n <= 0) {
+            if (total > 0)
+                *wait = 0;
+            return total > 0 ? total : n;
+        }
+        total += n;
+        if ((size_t) n < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+/* Decrypted bytes first, the ones still in the socket otherwise */
+static ssize_t tls_pending(Client *c, int *wait) {
+
+    int n = SSL_pending(c->ssl);
+
+    return n > 0 ? n : sock_pending(c, wait);
+}
+
+
+static void tls_close(Client *c) {
+
+    SSL_free(c->ssl);
+    c->ssl = NULL;
+    close(c->fd);
+}
+
+/* Out of line copies of the socket calls for the tables, the dispatch of
+   TRANSPORT_CALL never goes through them */
+static ssize_t tcp_read(Client *c, void *buf, size_t len, int *wait) {
+    return sock_read(c, buf, len, wait);
+}
+
+
+static ssize_t tcp_readv(Client *c, const struct iovec *iov, int iovcnt,
+                         int *wait) {
+    return sock_readv(c, iov, iovcnt, wait);
+}
+
+
+static ssize_t tcp_write(Client *c, const void *buf, size_t len, int *wait) {
+    return sock_write(c, buf, len, wait);
+}
+
+
+static ssize_t tcp_writev(Client *c, const struct iovec *iov, int iovcnt,
+                          int *wait) {
+    return sock_writev(c, iov, iovcnt, wait);
+}
+
+
+static ssize_t tcp_pending(Client *c, int *wait) {
+    return sock_pending(c, wait);
+}
+
+
+static void tcp_close(Client *c) {
+    sock_close(c);
+}
+
+
+const Transport transport_tcp = {
+    .name = "tcp",
+    .read = tcp_read,
+    .readv = tcp_readv,
+    .write = tcp_write,
+    .writev = tcp_writev,
+    .pending = tcp_pending,
+    .close = tcp_close
+};
+
+
+const Transport transport_unix = {
+    .name = "unix",
+    .read = tcp_read,
+    .readv = tcp_readv,
+    .write = tcp_write,
+    .writev = tcp_writev,
+    .pending = tcp_pending,
+    .close = tcp_close
+};
+
+
+const Transport transport_tls = {
+    .name = "tls",
+    .read = tls_read,
+    .readv = tls_readv,
+    .write = tls_write,
+    .writev = tls_writev,
+    .pending = tls_pending,
+    .close = tls_close
+};
+
+
+/*
+ * In-memory connections
+ */
+
+/* A growing buffer, the bytes before off are consumed */
+struct mem_buf {
+    uint8_t *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+};
+
+
+struct mem_conn {
+    void (*handler)(Client *);
+    struct mem_buf in;
+    struct mem_buf out;
+    int eof;
+};
+
+
+static void mem_append(struct mem_buf *b, const void *data, size_t len) {
+
+    /* Consumed bytes make room first */
+    if (b->off > 0 && b->len + len > b->cap) {
+        memmove(b->data, b->data + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
+    }
+
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : MEM_BUFFER_SIZE;
+        while (cap < b->len + len)
+            cap *= 2;
+        if (!(b->data = realloc(b->data, cap))) {
+            perror("growing in-memory connection buffer");
+            exit(EXIT_FAILURE);
+        }
+        b->cap = cap;
+    }
+
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+
+static ssize_t mem_readv(Client *c, const struct iovec *iov, int iovcnt,
+                         int *wait) {
+
+    struct mem_conn *m = c->tp_ctx;
+    size_t avail = m->in.len - m->in.off;
+
+    if (avail == 0) {
+        if (m->eof)
+            return 0;
+        *wait = EPOLLIN;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t total = 0;
+
+    for (int i = 0; i < iovcnt && total < avail; ++i) {
+        size_t n = iov[i].iov_len < avail - total ?
+            iov[i].iov_len : avail - total;
+        memcpy(iov[i].iov_base, m->in.data + m->in.off + total, n);
+        total += n;
+    }
+
+    m->in.off += total;
+
+    if (m->in.off == m->in.len)
+        m->in.off = m->in.len = 0;
+
+    return total;
+}
+
+
+static ssize_t mem_read(Client *c, void *buf, size_t len, int *wait) {
+
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    return mem_readv(c, &iov, 1, wait);
+}
+
+
+static ssize_t mem_writev(Client *c, const struct iovec *iov, int iovcnt,
+                          int *wait) {
+
+    struct mem_conn *m = c->tp_ctx;
+    ssize_t total = 0;
+
+    (void) wait;
+
+    for (int i = 0; i < iovcnt; ++i) {
+        mem_append(&m->out, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+
+    return total;
+}
+
+
+static ssize_t mem_write(Client *c, const void *buf, size_t len, int *wait) {
+
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+
+    return mem_writev(c, &iov, 1, wait);
+}
+
+
+static ssize_t mem_pending(Client *c, int *wait) {
+
+    struct mem_conn *m = c->tp_ctx;
+
+    if (m->in.len > m->in.off || m->eof)
+        return m->in.len - m->in.off;
+
+    *wait = EPOLLIN;
+    errno = EAGAIN;
+
+    return -1;
+}
+
+
+static void mem_close(Client *c) {
+
+    struct mem_conn *m = c->tp_ctx;
+
+    free(m->in.data);
+    free(m->out.data);
+    free(m);
+    c->tp_ctx = NULL;
+}
+
+
+const Transport transport_mem = {
+    .name = "mem",
+    .read = mem_read,
+    .readv = mem_readv,
+    .write = mem_write,
+    .writev = mem_writev,
+    .pending = mem_pending,
+    .close = mem_close
+};
+
+
+static void mem_entry(void *arg) {
+
+    Client *c = arg;
+    struct mem_conn *m = c->tp_ctx;
+
+    m->handler(c);
+}
+
+
+Client *mem_client_new(void (*handler)(Client *)) {
+
+    Client *c = calloc(1, sizeof(*c));
+    struct mem_conn *m = calloc(1, sizeof(*m));
+
+    if (!c || !m) {
+        perror("creating in-memory connection");
+        exit(EXIT_FAILURE);
+    }
+
+    m->handler = handler;
+
+    c->addr = "mem";
+    c->fd = -1;
+    c->epollfd = -1;
+    c->flush_fd = -1;
+    c->refs = 1;
+    c->events = EPOLLIN;
+    c->transport = &transport_mem;
+    c->tp_ctx = m;
+    ilist_init(&c->zc_pending);
+    ilist_init(&c->subs);
+    pthread_mutex_init(&c->lock, NULL);
+    c->co = coro_new(mem_entry, c, instance.co_stack_size);
+
+    return c;
+}
+
+
+void mem_client_feed(Client *c, const void *data, size_t len) {
+
+    struct mem_conn *m = c->tp_ctx;
+
+    mem_append(&m->in, data, len);
+}
+
+
+void mem_client_shutdown(Client *c) {
+
+    struct mem_conn *m = c->tp_ctx;
+
+    m->eof = 1;
+}
+
+
+int mem_client_run(Client *c) {
+
+    if (coro_done(c->co))
+        return 1;
+
+    /* Nothing to trim, the waits of the handler return right here */
+    int done = coro_resume(c->co);
+
+    c->idle = 0;
+
+    return done;
+}
+
+
+const uint8_t *mem_client_output(Client *c, size_t *len) {
+
+    struct mem_conn *m = c->tp_ctx;
+    const uint8_t *p = m->out.data + m->out.off;
+
+    *len = m->out.len - m->out.off;
+    m->out.off = m->out.len = 0;
+
+    return p;
+}
+
+
+void mem_client_free(Client *c) {
+
+    mem_client_shutdown(c);
+    mem_client_run(c);
+
+    coro_free(c->co);
+    mem_close(c);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
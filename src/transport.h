@@ -0,0 +1,208 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "trace.h"
+#include "vessel.h"
+
+
+/* Byte stream under the I/O of the coroutine handlers, vessel_read,
+   vessel_write and friends go through the transport of the client. The
+   calls return the bytes transferred, 0 at the end of the stream, -1 on
+   error, setting wait to the epoll events to wait for if the stream is
+   just not ready, and are never called on a failed connection */
+typedef struct transport {
+    const char *name;
+    ssize_t (*read)(Client *, void *, size_t, int *);
+    ssize_t (*readv)(Client *, const struct iovec *, int, int *);
+    ssize_t (*write)(Client *, const void *, size_t, int *);
+    ssize_t (*writev)(Client *, const struct iovec *, int, int *);
+    /* Bytes ready to be read, at least 1 if any, without consuming them */
+    ssize_t (*pending)(Client *, int *);
+    /* Release the stream, along with the state of the transport */
+    void (*close)(Client *);
+} Transport;
+
+
+/* Plain TCP and unix sockets, TLS on top of a socket and in-memory
+   connections. Clients without a transport are plain sockets */
+extern const Transport transport_tcp;
+extern const Transport transport_unix;
+extern const Transport transport_tls;
+extern const Transport transport_mem;
+
+
+/* Plain sockets, defined here for the dispatch to call them directly */
+
+static inline ssize_t sock_result(Client *c, ssize_t n, int out, int *wait) {
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        TRACE(TRACE_EAGAIN, c->fd, out);
+        *wait = out ? EPOLLOUT : EPOLLIN;
+    }
+
+    return n;
+}
+
+
+static inline ssize_t sock_read(Client *c, void *buf, size_t len,
+                                int *wait) {
+
+    ssize_t n;
+
+    do {
+        n = recv(c->fd, buf, len, 0);
+    } while (n < 0 && errno == EINTR);
+
+    return sock_result(c, n, 0, wait);
+}
+
+
+static inline ssize_t sock_readv(Client *c, const struct iovec *iov,
+                                 int iovcnt, int *wait) {
+
+    ssize_t n;
+
+    do {
+        n = readv(c->fd, iov, iovcnt);
+    } while (n < 0 && errno == EINTR);
+
+    return sock_result(c, n, 0, wait);
+}
+
+
+static inline ssize_t sock_write(Client *c, const void *buf, size_t len,
+                                 int *wait) {
+
+    ssize_t n;
+
+    do {
+        n = send(c->fd, buf, len, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    return sock_result(c, n, 1, wait);
+}
+
+/* Through sendmsg as writev would raise SIGPIPE */
+static inline ssize_t sock_writev(Client *c, const struct iovec *iov,
+                                  int iovcnt, int *wait) {
+
+    struct msghdr msg = {
+        .msg_iov = (struct iovec *) iov,
+        .msg_iovlen = iovcnt
+    };
+    ssize_t n;
+
+    do {
+        n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    return sock_result(c, n, 1, wait);
+}
+
+/* What FIONREAD reports, an empty queue being either the end of the stream
+   or a quiet peer */
+static inline ssize_t sock_pending(Client *c, int *wait) {
+
+    int n = 0;
+
+    if (ioctl(c->fd, FIONREAD, &n) == 0 && n > 0)
+        return n;
+
+    char b;
+    ssize_t r;
+
+    do {
+        r = recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+    } while (r < 0 && errno == EINTR);
+
+    return sock_result(c, r, 0, wait);
+}
+
+
+static inline void sock_close(Client *c) {
+    close(c->fd);
+}
+
+
+/* Call op of the transport of a client, plain sockets are the common case
+   and are served inline, without going through the table. Building with
+   VESSEL_SOCKETS_ONLY drops TLS from the I/O path, in-memory connections
+   are still told apart as they never reach the sockets */
+#ifdef VESSEL_SOCKETS_ONLY
+#define TRANSPORT_CALL(c, op, ...)                                      \
+    ((c)->transport == &transport_mem                                   \
+     ? transport_mem.op((c), ##__VA_ARGS__)                             \
+     : sock_##op((c), ##__VA_ARGS__))
+#else
+#define TRANSPORT_CALL(c, op, ...)                                      \
+    (!(c)->transport || (c)->transport == &transport_tcp                \
+     || (c)->transport == &transport_unix                               \
+     ? sock_##op((c), ##__VA_ARGS__)                                    \
+     : (c)->transport->op((c), ##__VA_ARGS__))
+#endif
+
+
+/* In-memory connections, running a coroutine handler with no socket, loop
+   or thread around it. Reads drain an input buffer fed by the caller and
+   suspend the handler once it is empty, writes never block and append to
+   an output buffer, so handlers and the protocols on top of vessel_read
+   and vessel_write can be driven and measured without the kernel. Out
+   queues, file and zero copy replies need a socket and fail on them */
+
+/* Create a connection running handler, it starts with the first
+   mem_client_run */
+Client *mem_client_new(void (*)(Client *));
+
+/* Append len bytes to the input of the handler */
+void mem_client_feed(Client *, const void *, size_t);
+
+/* End the input, reads return 0 once the pending bytes are consumed */
+void mem_client_shutdown(Client *);
+
+/* Run the handler until it waits for more input than fed or returns,
+   return 1 in the latter case, 0 otherwise */
+int mem_client_run(Client *);
+
+/* Return the bytes written by the handler since the last call, setting
+   their length in len, valid until the next mem_client_run */
+const uint8_t *mem_client_output(Client *, size_t *);
+
+/* Shut the input down and run the handler to its end, if it isn't there
+   already, then release the connection */
+void mem_client_free(Client *);
+
+
+#endif
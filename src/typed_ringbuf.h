@@ -0,0 +1,195 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TYPED_RINGBUF_H
+#define TYPED_RINGBUF_H
+
+#include <stddef.h>
+#include <string.h>
+
+
+/*
+ * Type specialized ring buffers for fixed-size records, the same circular
+ * buffer as Ringbuf but generated for any element type, so that events,
+ * pointers or small structs can be queued in contiguous memory without being
+ * serialized to bytes. Single elements are copied with plain assignments and
+ * batches with memcpy of a size known at compile time.
+ *
+ * RINGBUF_DECLARE(name, type)
+ *     struct name over a caller provided array of any capacity, like Ringbuf,
+ *     initialized with name_init(struct name *, type *, size_t). Power of two
+ *     capacities wrap with a mask, the others with a modulo.
+ *
+ * RINGBUF_DECLARE_STATIC(name, type, capacity)
+ *     struct name embedding an array of `capacity` elements, which must be a
+ *     compile time power of two, initialized with name_init(struct name *).
+ *
+ * Both generate the same set of static inline functions:
+ *
+ *     void    name_reset(struct name *)
+ *     size_t  name_size(const struct name *)
+ *     size_t  name_capacity(const struct name *)
+ *     int     name_empty(const struct name *)
+ *     int     name_full(const struct name *)
+ *     int     name_push(struct name *, const type *)        0 or -1 if full
+ *     int     name_pop(struct name *, type *)               0 or -1 if empty
+ *     type   *name_peek(struct name *)                      NULL if empty
+ *     type   *name_at(struct name *, size_t)                i-th from the
+ *                                                           oldest, NULL
+ *                                                           past the size
+ *     size_t  name_push_bulk(struct name *, const type *, size_t)
+ *     size_t  name_pop_bulk(struct name *, type *, size_t)
+ *
+ * Bulk functions move as many elements as possible and return their number.
+ * As Ringbuf, these are not thread-safe.
+ */
+
+
+/* Functions shared by both flavours, BUF and CAP are expressions of `r` */
+#define RINGBUF_FUNCS_(name, type, BUF, CAP)                                \
+                                                                            \
+static inline void name##_reset(struct name *r) {                          \
+    r->head = r->tail = 0;                                                  \
+}                                                                           \
+                                                                            \
+static inline size_t name##_size(const struct name *r) {                   \
+    return r->head - r->tail;                                               \
+}                                                                           \
+                                                                            \
+static inline size_t name##_capacity(const struct name *r) {               \
+    return (CAP);                                                           \
+}                                                                           \
+                                                                            \
+static inline int name##_empty(const struct name *r) {                     \
+    return r->head == r->tail;                                              \
+}                                                                           \
+                                                                            \
+static inline int name##_full(const struct name *r) {                      \
+    return r->head - r->tail == (CAP);                                      \
+}                                                                           \
+                                                                            \
+static inline int name##_push(struct name *r, const type *item) {          \
+    if (name##_full(r))                                                     \
+        return -1;                                                          \
+    (BUF)[name##_index_(r, r->head++)] = *item;                             \
+    return 0;                                                               \
+}                                                                           \
+                                                                            \
+static inline int name##_pop(struct name *r, type *item) {                 \
+    if (name##_empty(r))                                                    \
+        return -1;                                                          \
+    *item = (BUF)[name##_index_(r, r->tail++)];                             \
+    return 0;                                                               \
+}                                                                           \
+                                                                            \
+static inline type *name##_peek(struct name *r) {                          \
+    return name##_empty(r) ? NULL : &(BUF)[name##_index_(r, r->tail)];      \
+}                                                                           \
+                                                                            \
+static inline type *name##_at(struct name *r, size_t i) {                  \
+    if (i >= name##_size(r))                                                \
+        return NULL;                                                        \
+    return &(BUF)[name##_index_(r, r->tail + i)];                           \
+}                                                                           \
+                                                                            \
+static inline size_t name##_push_bulk(struct name *r, const type *items,   \
+                                      size_t n) {                           \
+    size_t room = (CAP) - name##_size(r);                                   \
+    if (n > room)                                                           \
+        n = room;                                                           \
+    size_t idx = name##_index_(r, r->head);                                 \
+    size_t first = (CAP) - idx < n ? (CAP) - idx : n;                       \
+    memcpy(&(BUF)[idx], items, first * sizeof(type));                       \
+    memcpy(&(BUF)[0], items + first, (n - first) * sizeof(type));           \
+    r->head += n;                                                           \
+    return n;                                                               \
+}                                                                           \
+                                                                            \
+static inline size_t name##_pop_bulk(struct name *r, type *items,          \
+                                     size_t n) {                            \
+    size_t size = name##_size(r);                                           \
+    if (n > size)                                                           \
+        n = size;                                                           \
+    size_t idx = name##_index_(r, r->tail);                                 \
+    size_t first = (CAP) - idx < n ? (CAP) - idx : n;                       \
+    memcpy(items, &(BUF)[idx], first * sizeof(type));                       \
+    memcpy(items + first, &(BUF)[0], (n - first) * sizeof(type));           \
+    r->tail += n;                                                           \
+    return n;                                                               \
+}
+
+
+/* head and tail are free running counters, their difference is the number of
+   stored elements and they are reduced to an index only on access */
+#define RINGBUF_DECLARE(name, type)                                         \
+                                                                            \
+struct name {                                                               \
+    type *buf;                                                              \
+    size_t capacity;                                                        \
+    size_t mask;                                                            \
+    size_t head;                                                            \
+    size_t tail;                                                            \
+};                                                                          \
+                                                                            \
+static inline void name##_init(struct name *r, type *buf, size_t capacity) { \
+    r->buf = buf;                                                           \
+    r->capacity = capacity;                                                 \
+    r->mask = (capacity & (capacity - 1)) == 0 ? capacity - 1 : 0;          \
+    r->head = r->tail = 0;                                                  \
+}                                                                           \
+                                                                            \
+static inline size_t name##_index_(const struct name *r, size_t pos) {     \
+    return r->mask ? pos & r->mask : pos % r->capacity;                     \
+}                                                                           \
+                                                                            \
+RINGBUF_FUNCS_(name, type, r->buf, r->capacity)
+
+
+#define RINGBUF_DECLARE_STATIC(name, type, cap)                             \
+                                                                            \
+_Static_assert((cap) > 0 && ((cap) & ((cap) - 1)) == 0,                     \
+               #name " capacity must be a power of two");                   \
+                                                                            \
+struct name {                                                               \
+    size_t head;                                                            \
+    size_t tail;                                                            \
+    type buf[cap];                                                          \
+};                                                                          \
+                                                                            \
+static inline void name##_init(struct name *r) {                           \
+    r->head = r->tail = 0;                                                  \
+}                                                                           \
+                                                                            \
+static inline size_t name##_index_(const struct name *r, size_t pos) {     \
+    (void) r;                                                               \
+    return pos & ((cap) - 1);                                               \
+}                                                                           \
+                                                                            \
+RINGBUF_FUNCS_(name, type, r->buf, (size_t) (cap))
+
+
+#endif
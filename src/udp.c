@@ -0,0 +1,300 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <netinet/udp.h>
+#include "log.h"
+#include "udp.h"
+#include "networking.h"
+
+
+/* Buffers and message headers used by a worker to receive and send a batch
+   of datagrams, allocated once per thread */
+struct udp_batch {
+    size_t bufsize;
+    /* UDP_BATCH buffers of bufsize bytes for the datagrams received */
+    uint8_t *rxbuf;
+    /* UDP_BATCH buffers of bufsize bytes for the replies */
+    uint8_t *txbuf;
+    struct mmsghdr rx[UDP_BATCH];
+    struct iovec rx_iov[UDP_BATCH];
+    Datagram dgrams[UDP_BATCH];
+    struct mmsghdr tx[UDP_BATCH];
+    struct iovec tx_iov[UDP_BATCH];
+    /* Replies carried by every message sent */
+    int tx_segs[UDP_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } tx_control[UDP_BATCH];
+};
+
+
+static __thread struct udp_batch *batch = NULL;
+
+static pthread_key_t batch_key;
+static pthread_once_t batch_once = PTHREAD_ONCE_INIT;
+
+/* Cleared on the first UDP_SEGMENT send refused by the kernel */
+static int gso_supported = 1;
+
+
+/* Release the batch of a terminating thread */
+static void batch_free(void *arg) {
+
+    struct udp_batch *b = arg;
+
+    free(b->rxbuf);
+    free(b->txbuf);
+    free(b);
+    batch = NULL;
+}
+
+
+static void batch_key_init(void) {
+    pthread_key_create(&batch_key, batch_free);
+}
+
+
+static struct udp_batch *get_batch(void) {
+
+    if (batch)
+        return batch;
+
+    struct udp_batch *b = calloc(1, sizeof(*b));
+    if (!b) {
+        perror("creating datagrams batch");
+        exit(EXIT_FAILURE);
+    }
+
+    b->bufsize = instance.dgram_size;
+    b->rxbuf = malloc(UDP_BATCH * b->bufsize);
+    b->txbuf = malloc(UDP_BATCH * b->bufsize);
+
+    if (!b->rxbuf || !b->txbuf) {
+        perror("creating datagrams batch buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Receive side headers never change */
+    for (int i = 0; i < UDP_BATCH; ++i) {
+        b->rx_iov[i].iov_base = b->rxbuf + i * b->bufsize;
+        b->rx_iov[i].iov_len = b->bufsize;
+        b->rx[i].msg_hdr.msg_iov = &b->rx_iov[i];
+        b->rx[i].msg_hdr.msg_iovlen = 1;
+        b->rx[i].msg_hdr.msg_name = &b->dgrams[i].addr;
+    }
+
+    pthread_once(&batch_once, batch_key_init);
+    pthread_setspecific(batch_key, b);
+
+    return batch = b;
+}
+
+/* Group the replies of the batch in messages, the following replies to the
+   same peer are coalesced in a single UDP_SEGMENT message if gso is set, as
+   long as they have the same size, the last one of a group can be shorter.
+   Return the number of messages */
+static int build_replies(struct udp_batch *b, int n, int gso) {
+
+    int msgs = 0;
+    struct iovec *iov = b->tx_iov;
+
+    for (int i = 0; i < n; ) {
+
+        Datagram *d = &b->dgrams[i];
+
+        if (d->reply_len == 0) {
+            i++;
+            continue;
+        }
+
+        int segs = 1;
+        size_t total = d->reply_len;
+
+        iov[0].iov_base = d->reply;
+        iov[0].iov_len = d->reply_len;
+
+        while (gso && i + segs < n) {
+
+            Datagram *next = &b->dgrams[i + segs];
+
+            if (next->reply_len == 0 || next->reply_len > d->reply_len
+                    || total + next->reply_len > GSO_MAX_BYTES
+                    || next->addrlen != d->addrlen
+                    || memcmp(&next->addr, &d->addr, d->addrlen) != 0)
+                break;
+
+            iov[segs].iov_base = next->reply;
+            iov[segs].iov_len = next->reply_len;
+            total += next->reply_len;
+            segs++;
+
+            if (next->reply_len < d->reply_len)
+                break;
+        }
+
+        struct msghdr *m = &b->tx[msgs].msg_hdr;
+
+        memset(m, 0, sizeof(*m));
+        m->msg_name = &d->addr;
+        m->msg_namelen = d->addrlen;
+        m->msg_iov = iov;
+        m->msg_iovlen = segs;
+
+        if (segs > 1) {
+            m->msg_control = b->tx_control[msgs].buf;
+            m->msg_controllen = sizeof(b->tx_control[msgs].buf);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(m);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *) CMSG_DATA(cm) = d->reply_len;
+        }
+
+        b->tx_segs[msgs++] = segs;
+        iov += segs;
+        i += segs;
+    }
+
+    return msgs;
+}
+
+/* Send the segments of a UDP_SEGMENT message one by one */
+static void send_segments(int fd, struct msghdr *m) {
+
+    for (size_t i = 0; i < m->msg_iovlen; ++i) {
+        if (sendto(fd, m->msg_iov[i].iov_base, m->msg_iov[i].iov_len,
+                   MSG_DONTWAIT, m->msg_name, m->msg_namelen) < 0)
+            STATS_ADD(datagrams_dropped, 1);
+        else
+            STATS_ADD(datagrams_out, 1);
+    }
+}
+
+
+static void send_replies(Server *s, struct udp_batch *b, int n) {
+
+    int gso = s->listener->gso
+        && __atomic_load_n(&gso_supported, __ATOMIC_RELAXED);
+    int msgs = build_replies(b, n, gso);
+    int sent = 0;
+
+    while (sent < msgs) {
+
+        int r = sendmmsg(s->fd, b->tx + sent, msgs - sent, MSG_DONTWAIT);
+
+        if (r < 0) {
+
+            /* The message at the head of the batch failed, if it's a GSO one
+               the kernel or the device may not support it, send it as plain
+               datagrams and stop using UDP_SEGMENT */
+            if (b->tx_segs[sent] > 1 && (errno == EINVAL || errno == EIO)) {
+                __atomic_store_n(&gso_supported, 0, __ATOMIC_RELAXED);
+                send_segments(s->fd, &b->tx[sent].msg_hdr);
+                sent++;
+                continue;
+            }
+
+            /* Socket buffer full, datagrams can be dropped anyway */
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_errno("sendmmsg(2)", s->fd);
+
+            for (int i = sent; i < msgs; ++i)
+                STATS_ADD(datagrams_dropped, b->tx_segs[i]);
+
+            break;
+        }
+
+        for (int i = sent; i < sent + r; ++i) {
+            STATS_ADD(datagrams_out, b->tx_segs[i]);
+            if (b->tx_segs[i] > 1)
+                STATS_ADD(gso_sends, 1);
+        }
+
+        sent += r;
+    }
+}
+
+
+int udp_handler(Server *s) {
+
+    struct udp_batch *b = get_batch();
+
+    for (int i = 0; i < UDP_BATCH; ++i)
+        b->rx[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+
+    int n = recvmmsg(s->fd, b->rx, UDP_BATCH, MSG_DONTWAIT, NULL);
+
+    /* Let another worker receive the next batch while this one is handled,
+       the socket is reported again right away if datagrams are queued */
+    mod_epoll(s->epollfd, s->fd, EPOLLIN, s);
+
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        log_errno("recvmmsg(2)", s->fd);
+        return -1;
+    }
+
+    STATS_ADD(datagrams_in, n);
+
+    for (int i = 0; i < n; ++i) {
+
+        Datagram *d = &b->dgrams[i];
+
+        d->reply = b->txbuf + i * b->bufsize;
+        d->reply_cap = b->bufsize;
+        d->reply_len = 0;
+
+        /* Larger than the buffers, can't be handled */
+        if (b->rx[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            STATS_ADD(datagrams_dropped, 1);
+            continue;
+        }
+
+        d->data = b->rx_iov[i].iov_base;
+        d->len = b->rx[i].msg_len;
+        d->addrlen = b->rx[i].msg_hdr.msg_namelen;
+
+        instance.dgram_handler(d);
+
+        if (d->reply_len > d->reply_cap)
+            d->reply_len = d->reply_cap;
+    }
+
+    send_replies(s, b, n);
+
+    return 0;
+}
@@ -25,23 +25,100 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/sysinfo.h>
 #include <openssl/err.h>
+#include <linux/errqueue.h>
+#include "udp.h"
+#include "log.h"
 #include "list.h"
+#include "trace.h"
+#include "probes.h"
 #include "vessel.h"
+#include "pubsub.h"
+#include "transport.h"
 #include "networking.h"
 
 
 struct server_conf instance;
 
 
+/* Busy poll parameters of an epoll instance, available since Linux 6.9,
+   defined here as libc headers don't carry them yet */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/* Hint the CPU that we are spinning */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ volatile("yield" ::: "memory")
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+/* Shared buffers of an out queue sent with a single sendmsg */
+#define OUTQ_IOV    16
+
+/* Max buffers of a vessel_writev, copied on the stack of the coroutine */
+#define CO_IOV      16
+
+/* Set on the epoll data of the flush registrations, the clients are at least
+   pointer aligned so their low bit is free */
+#define FLUSH_TAG   1ULL
+
+
+/* A timer of the loop and its next expiration in ns */
+struct loop_timer {
+    Timer timer;
+    uint64_t next;
+};
+
+
+/* A reply buffer or a reference to a shared buffer, waiting for the
+   completion of its MSG_ZEROCOPY sends */
+struct zc_buf {
+    uint8_t *buf;
+    Sbuf *sbuf;
+    /* Id of the last send using the buffer */
+    uint32_t id;
+    struct ilist_node node;
+};
+
+
+static void co_run(Client *);
+
+
+/* Socket options of a listener */
+static const struct sockopts *listener_sockopts(const Listener *l) {
+    return l->sockopts ? l->sockopts : &instance.sockopts;
+}
+
+/* Entry point of the coroutine of a connection, running the handler */
+static void co_entry(void *arg) {
+    instance.co_handler(arg);
+}
+
 /* Handle new connection, create a a fresh new Client structure and link it
    to the fd, ready to be set in EPOLLIN event */
 static int accept_handler(Client *server) {
@@ -51,62 +128,534 @@ static int accept_handler(Client *server) {
     /* Accept the connection */
     int clientsock = accept_connection(fd);
 
+    /* Rearm server fd to accept new connections, whatever happens to this
+       one */
+    mod_epoll(server->epollfd, fd, EPOLLIN, server);
+
     /* Abort if not accepted */
     if (clientsock == -1)
         return -1;
 
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addrlen = sizeof(addr);
 
     if (getpeername(clientsock, (struct sockaddr *) &addr, &addrlen) < 0) {
+        close(clientsock);
         return -1;
     }
 
-    char ip_buff[INET_ADDRSTRLEN + 1];
-    if (inet_ntop(AF_INET, &addr.sin_addr, ip_buff, sizeof(ip_buff)) == NULL) {
+    char ip_buff[INET6_ADDRSTRLEN + 1];
+    const char *peer = ip_buff;
+
+    switch (addr.ss_family) {
+        case AF_INET:
+            peer = inet_ntop(AF_INET, &((struct sockaddr_in *) &addr)->sin_addr,
+                             ip_buff, sizeof(ip_buff));
+            break;
+        case AF_INET6:
+            peer = inet_ntop(AF_INET6,
+                             &((struct sockaddr_in6 *) &addr)->sin6_addr,
+                             ip_buff, sizeof(ip_buff));
+            break;
+        default:
+            /* Unix peers are usually unnamed, use the listener path */
+            peer = server->listener->addr;
+            break;
+    }
+
+    if (peer == NULL) {
+        close(clientsock);
         return -1;
     }
 
+    /* TCP connections inherit the options of the listener, unix ones don't */
+    if (server->listener->type == LISTEN_UNIX)
+        set_sockopts(clientsock, listener_sockopts(server->listener), 0);
+
     /* Create a server structure to handle his context connection */
-    Client *client = malloc(sizeof(Client));
+    Client *client = calloc(1, sizeof(Client));
     if (!client) {
         perror("creating client during accept");
         exit(EXIT_FAILURE);
     }
 
-    client->addr = strdup(ip_buff);
+    client->addr = strdup(peer);
     client->fd = clientsock;
     client->epollfd = server->epollfd;
-    client->reply = malloc(sizeof(Reply));
+    client->reply = calloc(1, sizeof(Reply));
     client->ctx_in = server->ctx_in;
     client->ctx_out = server->ctx_out;
+    client->events = EPOLLIN;
+    client->transport = server->listener->type == LISTEN_UNIX ?
+        &transport_unix : &transport_tcp;
+    ilist_init(&client->zc_pending);
+    pthread_mutex_init(&client->lock, NULL);
+    client->flush_fd = -1;
+    client->refs = 1;
+    ilist_init(&client->subs);
+
+    /* Zero copy is not possible when the data must be encrypted anyway */
+    if (instance.zerocopy_threshold > 0 && instance.encryption == 0) {
+        int one = 1;
+        if (setsockopt(clientsock, SOL_SOCKET,
+                       SO_ZEROCOPY, &one, sizeof(one)) == 0)
+            client->zerocopy = 1;
+    }
 
     if (instance.encryption == 1) {
+        uint64_t start = PROBE_START(tls_handshake);
+
         client->ssl = SSL_new(server->ssl_ctx);
+        client->transport = &transport_tls;
         SSL_set_fd(client->ssl, clientsock);
 
-        if (SSL_accept(client->ssl) <= 0) {
+        int ok = SSL_accept(client->ssl) > 0;
+
+        if (!ok) {
             ERR_print_errors_fp(stderr);
         }
+
+        PROBE3(tls_handshake, clientsock, ok, PROBE_ELAPSED(start));
+    }
+
+    STATS_ADD(accepted, 1);
+
+    TRACE(TRACE_ACCEPT, clientsock, 0);
+    PROBE2(accept, clientsock, client->addr);
+
+    /* In proxy mode the epoll loop watches the proxy, on both sockets. It is
+       opened before the client becomes visible to client_send, which leaves
+       proxied connections alone */
+    if (instance.proxy_upstream_len > 0) {
+        client->proxy = proxy_open(clientsock);
+        if (!client->proxy) {
+            close_client(client);
+            return -1;
+        }
     }
 
     add_client(client);
 
+    if (client->proxy) {
+        add_epoll(server->epollfd, proxy_fd(client->proxy), client);
+        return 0;
+    }
+
+    /* Coroutine handlers run right away up to their first wait, and the
+       connection is registered for whatever they are waiting for, as no
+       other worker can see it yet */
+    if (instance.co_handler) {
+        client->co = coro_new(co_entry, client, instance.co_stack_size);
+        if (coro_resume(client->co))
+            close_client(client);
+        else
+            add_epoll_events(server->epollfd, clientsock,
+                             client->events, client);
+        return 0;
+    }
+
     /* clientsock = SSL_get_fd(client->ssl); */
     add_epoll(server->epollfd, clientsock, client);
 
-    /* Rearm server fd to accept new connections */
-    mod_epoll(server->epollfd, fd, EPOLLIN, server);
+    return 0;
+}
+
+/* Release a buffer once its zero copy sends are complete */
+static void zc_release(struct zc_buf *zb) {
+    free(zb->buf);
+    sbuf_put(zb->sbuf);
+    free(zb);
+}
+
+/* Keep a reply buffer or a shared one until the completion of the last
+   MSG_ZEROCOPY send, called with the lock of the client held */
+static void zc_pin(Client *c, uint8_t *buf, Sbuf *sbuf) {
+
+    struct zc_buf *zb = malloc(sizeof(*zb));
+    if (!zb) {
+        perror("pinning zero copy buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    zb->buf = buf;
+    zb->sbuf = sbuf;
+    zb->id = c->zc_next - 1;
+    ilist_push_back(&c->zc_pending, &zb->node);
+}
+
+/* Release all the resources of a client, it has to be already unlinked from
+   the connected clients list */
+static void free_client(Client *c) {
+
+    /* File reply interrupted by the connection being closed */
+    if (c->reply && c->reply->file)
+        filecache_put(instance.files, c->reply->file);
+
+    if (c->reply)
+        free(c->reply->buf);
+
+    /* The socket is closed, no completion will ever be reported */
+    struct ilist_node *n, *tmp;
+
+    ilist_foreach_safe(n, tmp, &c->zc_pending)
+        zc_release(ilist_entry(n, struct zc_buf, node));
+
+    /* Shared buffers never sent */
+    Sbuf *b;
+
+    while (sbuf_queue_pop(&c->outq, &b) == 0)
+        sbuf_put(b);
+
+    free(c->outq.buf);
+
+    if (c->flush_fd >= 0)
+        close(c->flush_fd);
+
+    pthread_mutex_destroy(&c->lock);
+    coro_free(c->co);
+    proxy_free(c->proxy);
+    TRANSPORT_CALL(c, close);
+    free(c->reply);
+    free((void *) c->addr);
+    free(c);
+}
+
+/* The peer shut down its side of the connection, check if there's still data
+   to be read before it, EPOLLRDHUP is reported along with EPOLLIN so without
+   this check a closed connection would bounce between the handlers forever */
+static int peer_closed(Client *c) {
+
+    uint8_t b;
+    ssize_t n = recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/* Rearm a client on the epoll loop, keeping track of the events requested */
+static void rearm(Client *c, int events) {
+    c->events = events;
+    mod_epoll(c->epollfd, c->fd, events, c);
+}
+
+/* Resume the coroutine handler of a client, closing the connection once the
+   handler returns, rearming it for what the handler waits for otherwise */
+static void co_run(Client *c) {
+
+    TRACE(TRACE_CO_BEGIN, c->fd, 0);
+    PROBE1(coro_resume, c->fd);
+
+    uint64_t start = PROBE_START(coro_yield);
+    int done = coro_resume(c->co);
+
+    TRACE(TRACE_CO_END, c->fd, 0);
+    PROBE3(coro_yield, c->fd, done, PROBE_ELAPSED(start));
+
+    if (done) {
+        close_client(c);
+        return;
+    }
+
+    /* Nothing above the saved context is live while the handler waits for
+       input with its buffers released */
+    if (c->idle) {
+        coro_trim(c->co);
+        c->idle = 0;
+    }
+
+    rearm(c, c->events);
+}
+
+/* Read the MSG_ZEROCOPY completion notifications queued on the socket error
+   queue, updating the counters and releasing the buffers of the completed
+   sends. Called with the lock of the client held, return -1 if the socket
+   reported an actual error */
+static int zerocopy_reap(Client *c) {
+
+    char control[128];
+
+    for (;;) {
+
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control)
+        };
+
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+                cm; cm = CMSG_NXTHDR(&msg, cm)) {
+
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    && !(cm->cmsg_level == SOL_IPV6
+                         && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            struct sock_extended_err *serr = (void *) CMSG_DATA(cm);
+
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno)
+                return -1;
+
+            /* Sends from ee_info to ee_data are complete, ids are 32 bits
+               counters wrapping around */
+            uint32_t lo = serr->ee_info, hi = serr->ee_data;
+
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                STATS_ADD(zerocopy_copied, hi - lo + 1);
+            else
+                STATS_ADD(zerocopy_sends, hi - lo + 1);
+
+            /* TCP completes sends in order, so buffers are released from the
+               oldest up to the last one covered by the range */
+            struct ilist_node *n, *tmp;
+
+            ilist_foreach_safe(n, tmp, &c->zc_pending) {
+                struct zc_buf *zb = ilist_entry(n, struct zc_buf, node);
+                if ((int32_t) (zb->id - hi) > 0)
+                    break;
+                ilist_del(&c->zc_pending, n);
+                zc_release(zb);
+            }
+        }
+    }
+
+    /* A pending socket error is reported by EPOLLERR as well */
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+        return -1;
+
+    return 0;
+}
+
+/* Register the duplicate of a client socket for a single EPOLLOUT, taking a
+   reference to the client for it. Called with the lock held and only when
+   not armed already, so the registration is never changed while a worker
+   may be handling its last event */
+static int flush_arm(Client *c) {
+
+    int op = EPOLL_CTL_MOD;
+
+    if (c->flush_fd < 0) {
+        c->flush_fd = dup(c->fd);
+        if (c->flush_fd < 0) {
+            log_errno("dup(2): flush registration", c->fd);
+            return -1;
+        }
+        op = EPOLL_CTL_ADD;
+    }
+
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLET | EPOLLONESHOT };
+    ev.data.u64 = (uintptr_t) c | FLUSH_TAG;
+
+    if (epoll_ctl(c->epollfd, op, c->flush_fd, &ev) < 0) {
+        log_errno("epoll_ctl(2): flush registration", c->fd);
+        return -1;
+    }
+
+    c->flush_armed = 1;
+    c->refs++;
 
     return 0;
 }
 
+/* Send the out queue of a client as far as the socket takes it, up to
+   OUTQ_IOV buffers per sendmsg, with MSG_ZEROCOPY when they add up to the
+   zero copy threshold. Called with the lock held, return 0 once the queue
+   is empty, 1 if the socket buffer is full, -1 on error */
+static int outq_flush(Client *c) {
+
+    int copy = 0;
+
+    while (!sbuf_queue_empty(&c->outq)) {
+
+        struct iovec iov[OUTQ_IOV];
+        size_t cnt = 0, total = 0;
+        Sbuf **b;
+
+        while (cnt < OUTQ_IOV && (b = sbuf_queue_at(&c->outq, cnt))) {
+            size_t off = cnt == 0 ? c->outq_off : 0;
+            iov[cnt].iov_base = (*b)->data + off;
+            iov[cnt].iov_len = (*b)->len - off;
+            total += iov[cnt++].iov_len;
+        }
+
+        int zerocopy = !copy && c->zerocopy
+            && total >= instance.zerocopy_threshold;
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+        ssize_t n = sendmsg(c->fd, &msg,
+                            MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                TRACE(TRACE_EAGAIN, c->fd, 1);
+                return 1;
+            }
+            /* Out of memory to pin pages, copy the rest */
+            if (errno == ENOBUFS && zerocopy) {
+                STATS_ADD(zerocopy_copied, 1);
+                copy = 1;
+                continue;
+            }
+            return -1;
+        }
+
+        STATS_ADD(outq_bytes, n);
+
+        if (zerocopy)
+            c->zc_next++;
+
+        /* Drop the buffers sent completely, those the kernel may still read
+           are pinned by a reference of their own */
+        size_t left = n;
+
+        for (size_t i = 0; i < cnt; ++i) {
+
+            Sbuf *head = *sbuf_queue_peek(&c->outq);
+            size_t rest = head->len - c->outq_off;
+            size_t sent = left < rest ? left : rest;
+
+            if (zerocopy && sent > 0)
+                zc_pin(c, NULL, sbuf_get(head));
+
+            if (sent < rest) {
+                c->outq_off += sent;
+                return 1;
+            }
+
+            sbuf_queue_pop(&c->outq, &head);
+            sbuf_put(head);
+            c->outq_off = 0;
+            left -= sent;
+        }
+    }
+
+    return 0;
+}
+
+/* Flush the out queue of a client on the EPOLLOUT of its second
+   registration, arming it again while the socket can't take the whole
+   queue. Failures shut the socket down, the worker handling the client sees
+   it and closes the connection */
+static void flush_event(Client *c, uint32_t events) {
+
+    pthread_mutex_lock(&c->lock);
+
+    c->flush_armed = 0;
+
+    if (!c->closed) {
+
+        int rc = 0;
+
+        /* Zero copy completions are signaled on both registrations */
+        if (events & EPOLLERR)
+            rc = c->zerocopy ? zerocopy_reap(c) : -1;
+
+        if (rc == 0 && !(events & EPOLLHUP))
+            rc = outq_flush(c);
+
+        if (rc == 1)
+            rc = flush_arm(c);
+        else if (rc == 0 && c->finish)
+            shutdown(c->fd, SHUT_WR);
+
+        /* Drained, the slots are allocated again by the next client_queue */
+        if (rc == 0 && instance.release_idle
+            && sbuf_queue_empty(&c->outq)) {
+            free(c->outq.buf);
+            c->outq = (struct sbuf_queue) { 0 };
+        }
+
+        if (rc < 0) {
+            shutdown(c->fd, SHUT_RDWR);
+            c->shut = 1;
+        }
+    }
+
+    int refs = --c->refs;
+
+    pthread_mutex_unlock(&c->lock);
+
+    if (refs == 0)
+        free_client(c);
+}
+
+static inline uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Wait for events, in busy poll mode epoll is polled without blocking for
+   up to the busy poll budget before falling back to a blocking wait. The
+   stop eventfd is polled like any other descriptor, so spinning workers
+   stop as promptly as sleeping ones */
+static int wait_events(int epollfd, struct epoll_event *evs) {
+
+    if (instance.busy_poll_ns == 0)
+        return epoll_wait(epollfd, evs, instance.epoll_max_events, -1);
+
+    /* Empty polls are counted locally, the counters are shared by all the
+       workers and spinning on them would just move cache lines around */
+    uint64_t empty = 0;
+    uint64_t deadline = now_ns() + instance.busy_poll_ns;
+    int n;
+
+    do {
+        n = epoll_wait(epollfd, evs, instance.epoll_max_events, 0);
+        if (n != 0)
+            break;
+        empty++;
+        cpu_relax();
+    } while (now_ns() < deadline);
+
+    STATS_ADD(busy_polls_empty, empty);
+
+    if (n != 0) {
+        STATS_ADD(busy_polls_hit, 1);
+        return n;
+    }
+
+    STATS_ADD(busy_poll_sleeps, 1);
+
+    return epoll_wait(epollfd, evs, instance.epoll_max_events, -1);
+}
+
+/* Run the timers due on a tick of the timer fd, rearming it afterwards so
+   that no other worker runs them meanwhile */
+static void run_timers(int epollfd) {
+
+    uint64_t ticks, now = now_ns();
+
+    if (read(instance.timer_fd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN)
+        log_errno("read(2): timer fd", instance.timer_fd);
+
+    for (int i = 0; i < instance.ntimers; ++i) {
+        struct loop_timer *t = &instance.timers[i];
+        if (now >= t->next) {
+            t->timer.fn(t->timer.arg);
+            /* Kept on schedule, unless too late to catch up */
+            t->next += t->timer.interval_ms * 1000000ULL;
+            if (t->next <= now)
+                t->next = now + t->timer.interval_ms * 1000000ULL;
+        }
+    }
+
+    mod_epoll(epollfd, instance.timer_fd, EPOLLIN, &instance.timer_fd);
+}
+
 /* Main worker function, his responsibility is to wait on events on a shared
    EPOLL fd, use the same way for clients or peer to distribute messages */
 static void *worker(void *args) {
 
     struct socks *fds = (struct socks *) args;
-    struct epoll_event *evs = malloc(sizeof(*evs) * MAX_EVENTS);
+    struct epoll_event *evs = malloc(sizeof(*evs) * instance.epoll_max_events);
 
     if (!evs) {
         perror("malloc(3) failed");
@@ -115,12 +664,31 @@ static void *worker(void *args) {
 
     int events_cnt = 0;
 
-    /* Start looping through FDs for READ/WRITE events */
-    while ((events_cnt = epoll_wait(fds->epollfd,
-                    evs, instance.epoll_max_events, -1)) > 0) {
+    /* Start looping through FDs for READ/WRITE events, a signal handled by
+       this thread, such as the one of the trace dumps, just interrupts the
+       wait */
+    while ((events_cnt = wait_events(fds->epollfd, evs)) > 0
+           || (events_cnt < 0 && errno == EINTR)) {
+
+        if (events_cnt < 0)
+            continue;
+
+        TRACE(TRACE_WAKEUP, -1, events_cnt);
+        PROBE1(wakeup, events_cnt);
+
+        STATS_ADD(epoll_wakeups, 1);
+        STATS_ADD(events, events_cnt);
 
         for (int i = 0; i < events_cnt; i++) {
 
+            /* Out queue flushes come from the second registration of the
+               client sockets, tagged to be told apart from the first one */
+            if (evs[i].data.u64 & FLUSH_TAG) {
+                flush_event((Client *) (uintptr_t)
+                            (evs[i].data.u64 & ~FLUSH_TAG), evs[i].events);
+                continue;
+            }
+
             /* Check for errors first */
             if ((evs[i].events & EPOLLERR) ||
                     (evs[i].events & EPOLLHUP) ||
@@ -128,12 +696,42 @@ static void *worker(void *args) {
 
                 /* An error has occured on this fd, or the socket is not
                    ready for reading */
-                perror ("epoll_wait(2)");
-                close(evs[i].data.fd);
+                Client *c = (Client *) evs[i].data.ptr;
+
+                if (c->listener) {
+                    log_errno("epoll_wait(2)", c->fd);
+                    continue;
+                }
+
+                /* Zero copy completions are signaled through EPOLLERR, the
+                   socket is fine if that's all there is, wait again for the
+                   same events, they will be reported if already ready */
+                if (c->zerocopy && !(evs[i].events & EPOLLHUP)) {
+                    pthread_mutex_lock(&c->lock);
+                    int rc = zerocopy_reap(c);
+                    pthread_mutex_unlock(&c->lock);
+                    if (rc == 0) {
+                        rearm(c, c->events);
+                        continue;
+                    }
+                }
+
+                /* Let the coroutine handler see the error and clean up, its
+                   I/O fails right away from now on */
+                if (c->co) {
+                    c->co_err = 1;
+                    coro_resume(c->co);
+                }
+
+                close_client(c);
 
                 continue;
 
-            } else if (evs[i].data.fd == instance.event_fd) {
+            } else if (evs[i].data.ptr == &instance.timer_fd) {
+
+                run_timers(fds->epollfd);
+
+            } else if (evs[i].data.ptr == &instance.event_fd) {
 
                 /* And quit event after that */
                 eventfd_t val;
@@ -145,18 +743,42 @@ static void *worker(void *args) {
 
                 Client * c = (Client *) evs[i].data.ptr;
 
-                if (c->fd == fds->serversock) {
+                if (c->listener) {
                     c->ctx_accept(evs[i].data.ptr);
+                } else if (c->proxy) {
+                    if (proxy_pump(c->proxy) < 0)
+                        close_client(c);
+                    else
+                        mod_epoll(c->epollfd, proxy_fd(c->proxy), EPOLLIN, c);
+                } else if (c->co) {
+                    /* The handler reads the end of the stream itself */
+                    co_run(c);
+                } else if ((evs[i].events & EPOLLRDHUP) && peer_closed(c)) {
+                    /* Nothing left to read and nobody to reply to */
+                    close_client(c);
                 } else {
                     /* Finally handle the request according to its type */
+                    TRACE(TRACE_IN_BEGIN, c->fd, 0);
+                    PROBE1(request_start, c->fd);
+                    uint64_t start = PROBE_START(request_done);
                     c->ctx_in(evs[i].data.ptr);
-                    mod_epoll(fds->epollfd, c->fd, EPOLLOUT, evs[i].data.ptr);
+                    PROBE2(request_done, c->fd, PROBE_ELAPSED(start));
+                    TRACE(TRACE_IN_END, c->fd, 0);
+                    rearm(c, EPOLLOUT);
                 }
+            } else if (((Client *) evs[i].data.ptr)->co) {
+                co_run(evs[i].data.ptr);
             } else {
                 Client * c = (Client *) evs[i].data.ptr;
-                c->ctx_out(evs[i].data.ptr);
-                /* Rearm socket for READ event */
-                mod_epoll(fds->epollfd, c->fd, EPOLLIN, evs[i].data.ptr);
+                TRACE(TRACE_OUT_BEGIN, c->fd, 0);
+                PROBE1(reply_start, c->fd);
+                uint64_t start = PROBE_START(reply_done);
+                int rc = c->ctx_out(evs[i].data.ptr);
+                PROBE3(reply_done, c->fd, rc, PROBE_ELAPSED(start));
+                TRACE(TRACE_OUT_END, c->fd, rc);
+                /* Rearm socket for READ event, or for WRITE again if the
+                   reply is not completely sent yet */
+                rearm(c, rc == HANDLER_AGAIN ? EPOLLOUT : EPOLLIN);
             }
         }
     }
@@ -165,6 +787,8 @@ exit:
     if (events_cnt == 0 && instance.event_fd == 0)
         perror("epoll_wait(2) error");
 
+    proxy_pool_close();
+
     free(evs);
 
     return NULL;
@@ -172,7 +796,525 @@ exit:
 
 
 void add_client(Client *c) {
-    list_push(instance.clients, c);
+    pthread_mutex_lock(&instance.clients_lock);
+    ilist_push(&instance.clients, &c->node);
+    pthread_mutex_unlock(&instance.clients_lock);
+}
+
+
+void close_client(Client *c) {
+
+    TRACE(TRACE_CLOSE, c->fd, 0);
+    PROBE1(close, c->fd);
+
+    pthread_mutex_lock(&instance.clients_lock);
+    if (ilist_linked(&c->node))
+        ilist_del(&instance.clients, &c->node);
+    pthread_mutex_unlock(&instance.clients_lock);
+
+    /* An armed flush registration still refers to the client, shutting the
+       socket down makes it report EPOLLHUP and its worker frees the client */
+    pthread_mutex_lock(&c->lock);
+
+    c->closed = 1;
+
+    if (c->flush_armed)
+        shutdown(c->fd, SHUT_RDWR);
+
+    pthread_mutex_unlock(&c->lock);
+
+    /* No publish can reach the client from now on */
+    pubsub_drop(instance.pubsub, c);
+
+    pthread_mutex_lock(&c->lock);
+
+    int refs = --c->refs;
+
+    pthread_mutex_unlock(&c->lock);
+
+    if (refs == 0)
+        free_client(c);
+}
+
+
+int client_queuev(Client *c, Sbuf **bufs, size_t n,
+                  enum outq_policy policy) {
+
+    /* Shared buffers are sent in the clear and can't go through the pipes of
+       the proxy */
+    if (c->ssl || c->proxy)
+        return -1;
+
+    pthread_mutex_lock(&c->lock);
+
+    int rc = -1;
+
+    if (!c->outq.buf) {
+        Sbuf **slots = malloc(instance.outq_size * sizeof(*slots));
+        if (!slots) {
+            perror("allocating out queue");
+            exit(EXIT_FAILURE);
+        }
+        sbuf_queue_init(&c->outq, slots, instance.outq_size);
+    }
+
+    size_t size = sbuf_queue_size(&c->outq);
+
+    if (c->closed || c->shut || c->finish) {
+        /* Going away, nothing is sent anymore */
+    } else if (size + n <= instance.outq_size) {
+        if (c->flush_armed || flush_arm(c) == 0) {
+            for (size_t i = 0; i < n; ++i) {
+                sbuf_get(bufs[i]);
+                sbuf_queue_push(&c->outq, &bufs[i]);
+            }
+            rc = 0;
+        }
+    } else if (policy == OUTQ_COALESCE && n == 1
+               && (size > 1 || c->outq_off == 0)) {
+        /* A full queue is being flushed already, the newest buffer gives
+           way unless it is the one partially sent */
+        Sbuf **last = sbuf_queue_at(&c->outq, size - 1);
+        sbuf_put(*last);
+        *last = sbuf_get(bufs[0]);
+        STATS_ADD(outq_coalesced, 1);
+        rc = 0;
+    } else if (policy == OUTQ_DISCONNECT) {
+        shutdown(c->fd, SHUT_RDWR);
+        c->shut = 1;
+        STATS_ADD(outq_disconnects, 1);
+    } else {
+        STATS_ADD(outq_full, 1);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return rc;
+}
+
+
+int client_queue(Client *c, Sbuf *b, enum outq_policy policy) {
+    return client_queuev(c, &b, 1, policy);
+}
+
+
+void client_finish(Client *c) {
+
+    pthread_mutex_lock(&c->lock);
+
+    c->finish = 1;
+
+    /* Otherwise the flush does it once the queue is empty */
+    if (!c->flush_armed && !c->closed && !c->shut)
+        shutdown(c->fd, SHUT_WR);
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+
+int client_send(Client *c, Sbuf *b) {
+    return client_queue(c, b, OUTQ_DROP);
+}
+
+
+size_t broadcast(Sbuf *b) {
+
+    size_t n = 0;
+    struct ilist_node *node, *tmp;
+
+    pthread_mutex_lock(&instance.clients_lock);
+
+    ilist_foreach_safe(node, tmp, &instance.clients)
+        n += client_send(ilist_entry(node, Client, node), b) == 0;
+
+    pthread_mutex_unlock(&instance.clients_lock);
+
+    return n;
+}
+
+
+int reply_file(Client *c, const char *path, off_t offset, size_t len) {
+
+    struct file_entry *e = filecache_get(instance.files, path);
+
+    if (!e)
+        return -1;
+
+    if (offset < 0 || offset > e->st.st_size
+            || len > (size_t) (e->st.st_size - offset)) {
+        filecache_put(instance.files, e);
+        return -1;
+    }
+
+    /* Replace a previous file reply not sent yet */
+    if (c->reply->file)
+        filecache_put(instance.files, c->reply->file);
+
+    c->reply->file = e;
+    c->reply->offset = offset;
+    c->reply->len = len > 0 ? len : (size_t) (e->st.st_size - offset);
+
+    return 0;
+}
+
+
+int send_file_reply(Client *c) {
+
+    Reply *r = c->reply;
+
+    if (!r->file)
+        return HANDLER_OK;
+
+    size_t len = r->len;
+    int rc;
+
+    /* Encrypted connections can't skip user space */
+    if (c->ssl)
+        rc = ssl_sendfile(c->ssl, r->file->fd, &r->offset, &r->len);
+    else
+        rc = sendfile_all(c->fd, r->file->fd, &r->offset, &r->len);
+
+    STATS_ADD(file_bytes, len - r->len);
+
+    if (rc == 1)
+        return HANDLER_AGAIN;
+
+    filecache_put(instance.files, r->file);
+    r->file = NULL;
+
+    return rc;
+}
+
+
+void reply_buffer(Client *c, uint8_t *buf, size_t len) {
+
+    Reply *r = c->reply;
+
+    /* Replace a previous buffer not sent yet */
+    free(r->buf);
+
+    r->buf = buf;
+    r->buflen = len;
+    r->bufsent = 0;
+    r->pinned = 0;
+}
+
+
+/* Send the buffer of a client reply, with the lock of the client held */
+static int buffer_send(Client *c) {
+
+    Reply *r = c->reply;
+    int zerocopy = c->zerocopy && r->buflen >= instance.zerocopy_threshold;
+
+    while (r->bufsent < r->buflen) {
+
+        uint8_t *p = r->buf + r->bufsent;
+        size_t left = r->buflen - r->bufsent;
+        ssize_t n;
+
+        if (c->ssl) {
+            n = SSL_write(c->ssl, p, left);
+            if (n <= 0) {
+                int err = SSL_get_error(c->ssl, n);
+                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+                    return HANDLER_AGAIN;
+                ERR_print_errors_fp(stderr);
+                return -1;
+            }
+        } else {
+            n = send(c->fd, p, left,
+                     MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    TRACE(TRACE_EAGAIN, c->fd, 1);
+                    return HANDLER_AGAIN;
+                }
+                /* Out of memory to pin pages, copy the rest */
+                if (errno == ENOBUFS && zerocopy) {
+                    STATS_ADD(zerocopy_copied, 1);
+                    zerocopy = 0;
+                    continue;
+                }
+                log_errno("send(2): error sending reply", c->fd);
+                return -1;
+            }
+            if (zerocopy) {
+                c->zc_next++;
+                r->pinned = 1;
+            }
+        }
+
+        r->bufsent += n;
+    }
+
+    /* The kernel may still read from the buffer, keep it until the last
+       send using it is reported complete */
+    if (r->pinned)
+        zc_pin(c, r->buf, NULL);
+    else
+        free(r->buf);
+
+    r->buf = NULL;
+    r->pinned = 0;
+
+    return HANDLER_OK;
+}
+
+
+int send_buffer_reply(Client *c) {
+
+    if (!c->reply->buf)
+        return HANDLER_OK;
+
+    /* Zero copy sends take their ids from the same counter of the out
+       queue flushes */
+    pthread_mutex_lock(&c->lock);
+    int rc = buffer_send(c);
+    pthread_mutex_unlock(&c->lock);
+
+    return rc;
+}
+
+/* Suspend the coroutine handler of a client until the events it waits for
+   are reported, return -1 if the connection failed in the meanwhile */
+static int co_wait(Client *c, int events) {
+
+    if (c->co_err)
+        return -1;
+
+    c->events = events;
+    coro_yield(c->co);
+
+    return c->co_err ? -1 : 0;
+}
+
+/* Single read, or write if out is set, for a coroutine handler, through
+   the transport of the client. Return the bytes transferred, 0 at the end
+   of the stream, -1 on error, setting wait to the events to wait for if the
+   stream is just not ready. It is kept out of line as errno is thread local
+   and the coroutine may be resumed by another worker, its address must not
+   be reused across a switch */
+static __attribute__((noinline))
+ssize_t co_io(Client *c, void *buf, size_t len, int out, int *wait) {
+
+    *wait = 0;
+
+    if (c->co_err)
+        return -1;
+
+    return out ? TRANSPORT_CALL(c, write, buf, len, wait)
+        : TRANSPORT_CALL(c, read, buf, len, wait);
+}
+
+/* Vectored co_io */
+static __attribute__((noinline))
+ssize_t co_iov(Client *c, const struct iovec *iov, int iovcnt, int out,
+               int *wait) {
+
+    *wait = 0;
+
+    if (c->co_err)
+        return -1;
+
+    return out ? TRANSPORT_CALL(c, writev, iov, iovcnt, wait)
+        : TRANSPORT_CALL(c, readv, iov, iovcnt, wait);
+}
+
+
+ssize_t vessel_read(Client *c, void *buf, size_t len) {
+
+    int wait;
+
+    if (len == 0)
+        return 0;
+
+    for (;;) {
+        ssize_t n = co_io(c, buf, len, 0, &wait);
+        if (n >= 0 || !wait)
+            return n;
+        if (co_wait(c, wait) < 0)
+            return -1;
+    }
+}
+
+
+/* Bytes waiting to be read by a coroutine handler, as the transport
+   reports them, 0 at the end of the stream, -1 on error, setting wait to
+   EPOLLIN if there is nothing to read yet. Out of line for the same reason
+   of co_io */
+static __attribute__((noinline))
+ssize_t co_pending(Client *c, int *wait) {
+
+    *wait = 0;
+
+    if (c->co_err)
+        return -1;
+
+    return TRANSPORT_CALL(c, pending, wait);
+}
+
+
+ssize_t vessel_wait_readable(Client *c) {
+
+    int wait;
+
+    for (;;) {
+        ssize_t n = co_pending(c, &wait);
+        if (n >= 0 || !wait)
+            return n;
+        if (instance.release_idle) {
+            c->idle = 1;
+            STATS_ADD(idle_releases, 1);
+        }
+        if (co_wait(c, EPOLLIN) < 0)
+            return -1;
+    }
+}
+
+
+ssize_t vessel_read_full(Client *c, void *buf, size_t len) {
+
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t n = vessel_read(c, (uint8_t *) buf + total, len - total);
+        if (n <= 0)
+            return n;
+        total += n;
+    }
+
+    return total;
+}
+
+
+ssize_t vessel_readv(Client *c, const struct iovec *iov, int iovcnt) {
+
+    int wait;
+
+    for (;;) {
+        ssize_t n = co_iov(c, iov, iovcnt, 0, &wait);
+        if (n >= 0 || !wait)
+            return n;
+        if (co_wait(c, wait) < 0)
+            return -1;
+    }
+}
+
+
+ssize_t vessel_write(Client *c, const void *buf, size_t len) {
+
+    size_t total = 0;
+    int wait;
+
+    while (total < len) {
+        ssize_t n = co_io(c, (uint8_t *) buf + total, len - total, 1, &wait);
+        if (n > 0) {
+            total += n;
+        } else if (n == 0 || !wait || co_wait(c, wait) < 0) {
+            return -1;
+        }
+    }
+
+    return total;
+}
+
+
+
+ssize_t vessel_writev(Client *c, const struct iovec *iov, int iovcnt) {
+
+    struct iovec vec[CO_IOV];
+    struct iovec *v = vec;
+    ssize_t total = 0;
+    int wait;
+
+    if (iovcnt > CO_IOV) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Partial writes consume the vectors of a copy */
+    memcpy(vec, iov, iovcnt * sizeof(*iov));
+
+    for (;;) {
+
+        while (iovcnt > 0 && v->iov_len == 0) {
+            v++;
+            iovcnt--;
+        }
+
+        if (iovcnt == 0)
+            return total;
+
+        ssize_t n = co_iov(c, v, iovcnt, 1, &wait);
+
+        if (n < 0 && wait && co_wait(c, wait) == 0)
+            continue;
+
+        if (n <= 0)
+            return -1;
+
+        total += n;
+
+        while (iovcnt > 0 && (size_t) n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            v->iov_base = (uint8_t *) v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+}
+
+/* Open the additional listeners of the instance and register them on the
+   epoll loop, TCP ones share the handlers and the SSL context of the main
+   server */
+static Server *open_listeners(int epollfd, const Server *server) {
+
+    if (instance.nlisteners == 0)
+        return NULL;
+
+    Server *ls = calloc(instance.nlisteners, sizeof(Server));
+    if (!ls) {
+        perror("creating listeners");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < instance.nlisteners; ++i) {
+
+        const Listener *l = &instance.listeners[i];
+
+        ls[i].addr = l->addr;
+        ls[i].epollfd = epollfd;
+        ls[i].listener = l;
+
+        switch (l->type) {
+            case LISTEN_TCP:
+                ls[i].fd = make_listen(l->addr, l->port, listener_sockopts(l));
+                ls[i].ctx_accept = server->ctx_accept;
+                ls[i].ctx_in = server->ctx_in;
+                ls[i].ctx_out = server->ctx_out;
+                ls[i].ssl_ctx = server->ssl_ctx;
+                break;
+            case LISTEN_UNIX:
+                ls[i].fd = make_unix_listen(l->addr, listener_sockopts(l));
+                ls[i].ctx_accept = server->ctx_accept;
+                ls[i].ctx_in = server->ctx_in;
+                ls[i].ctx_out = server->ctx_out;
+                ls[i].ssl_ctx = server->ssl_ctx;
+                break;
+            case LISTEN_UDP:
+                ls[i].fd = make_dgram(l->addr, l->port, listener_sockopts(l));
+                ls[i].ctx_accept = udp_handler;
+                break;
+        }
+
+        add_epoll(epollfd, ls[i].fd, &ls[i]);
+    }
+
+    return ls;
 }
 
 /*
@@ -190,8 +1332,19 @@ int server(const char *addr, const char *port, Client *server) {
         exit(EXIT_FAILURE);
     }
 
+    /* Let the kernel busy poll the NIC queues of the sockets as well, on
+       older kernels workers just spin in user space */
+    if (instance.busy_poll_ns > 0) {
+        struct epoll_params params = {
+            .busy_poll_usecs = instance.busy_poll_ns / 1000,
+            .busy_poll_budget = 8,
+            .prefer_busy_poll = 1
+        };
+        ioctl(epollfd, EPIOCSPARAMS, &params);
+    }
+
     /* Initialize the sockets, first the server one */
-    const int fd = make_listen(addr, port);
+    const int fd = make_listen(addr, port, &instance.sockopts);
 
     if (server->fd == -1) server->fd = fd;
 
@@ -201,20 +1354,39 @@ int server(const char *addr, const char *port, Client *server) {
         openssl_init();
         server->ssl_ctx = create_ssl_context();
         load_certificates(server->ssl_ctx, instance.certfile, instance.keyfile);
+        /* Record buffers are freed whenever OpenSSL has nothing buffered */
+        if (instance.release_idle)
+            SSL_CTX_set_mode(server->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
     }
 
+    /* The main listener, on addr:port */
+    const Listener main_listener = {
+        .type = LISTEN_TCP,
+        .addr = addr,
+        .port = port
+    };
+
+    server->listener = &main_listener;
+
     /* Set socket in EPOLLIN flag mode, ready to read data */
     add_epoll(epollfd, fd, server);
 
+    Server *listeners = open_listeners(epollfd, server);
+
     /* Add event fd to epoll */
     struct epoll_event ev;
-    ev.data.fd = instance.event_fd;
+    ev.data.ptr = &instance.event_fd;
     ev.events = EPOLLIN;
 
     if (epoll_ctl(epollfd, EPOLL_CTL_ADD, instance.event_fd, &ev) < 0) {
         perror("epoll_ctl(2): add epollin");
     }
 
+    /* Timers tick on a timer fd of their own, taken by one worker at a
+       time as any other descriptor */
+    if (instance.timer_fd >= 0)
+        add_epoll(epollfd, instance.timer_fd, &instance.timer_fd);
+
     /* Worker thread pool */
     pthread_t workers[instance.epoll_workers - 1];
 
@@ -232,6 +1404,16 @@ int server(const char *addr, const char *port, Client *server) {
     for (int i = 0; i < instance.epoll_workers - 1; ++i)
         pthread_join(workers[i], NULL);
 
+    for (int i = 0; i < instance.nlisteners; ++i) {
+        close(listeners[i].fd);
+        /* Abstract names go away with the socket, files don't */
+        if (instance.listeners[i].type == LISTEN_UNIX
+                && instance.listeners[i].addr[0] != '@')
+            unlink(instance.listeners[i].addr);
+    }
+
+    free(listeners);
+
     if (instance.encryption == 1) {
         SSL_CTX_free(server->ssl_ctx);
         SSL_free(server->ssl);
@@ -244,10 +1426,133 @@ int server(const char *addr, const char *port, Client *server) {
 }
 
 
+/* Release what open_timers set up, safe to call more than once */
+static void close_timers(void) {
+
+    if (instance.timer_fd >= 0)
+        close(instance.timer_fd);
+
+    instance.timer_fd = -1;
+
+    free(instance.timers);
+    instance.timers = NULL;
+}
+
+
+/* Set the timers of the configuration up, along with the pings of the
+   WebSocket connections, on a timer fd ticking at the shortest interval */
+static int open_timers(const Config *conf) {
+
+    int n = conf->timers ? conf->ntimers : 0;
+    unsigned tick = 0;
+    uint64_t now = now_ns();
+
+    instance.ntimers = n + (conf->ws_handler != NULL);
+    instance.timers = NULL;
+    instance.timer_fd = -1;
+
+    if (instance.ntimers == 0)
+        return 0;
+
+    instance.timers = calloc(instance.ntimers, sizeof(*instance.timers));
+    if (!instance.timers) {
+        perror("allocating timers");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < n; ++i)
+        instance.timers[i].timer = conf->timers[i];
+
+    if (conf->ws_handler)
+        instance.timers[n].timer = (Timer) {
+            instance.ws_ping_ms, ws_tick, NULL
+        };
+
+    for (int i = 0; i < instance.ntimers; ++i) {
+        struct loop_timer *t = &instance.timers[i];
+        t->next = now + t->timer.interval_ms * 1000000ULL;
+        if (tick == 0 || t->timer.interval_ms < tick)
+            tick = t->timer.interval_ms;
+    }
+
+    instance.timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                       TFD_NONBLOCK | TFD_CLOEXEC);
+    if (instance.timer_fd < 0) {
+        perror("timerfd_create(2)");
+        close_timers();
+        return -1;
+    }
+
+    struct itimerspec its = {
+        .it_interval = { tick / 1000, (tick % 1000) * 1000000L },
+        .it_value = { tick / 1000, (tick % 1000) * 1000000L }
+    };
+
+    if (timerfd_settime(instance.timer_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime(2)");
+        close_timers();
+        return -1;
+    }
+
+    return 0;
+}
+
+
 int start_server(Config *conf) {
 
     int r = 0;
 
+    /* Datagrams received need a handler */
+    for (int i = 0; conf->listeners && i < conf->nlisteners; ++i) {
+        if (conf->listeners[i].type == LISTEN_UDP && !conf->dgram_handler) {
+            fprintf(stderr, "UDP listener on %s:%s without dgram_handler\n",
+                    conf->listeners[i].addr, conf->listeners[i].port);
+            return -1;
+        }
+    }
+
+    if ((conf->http_handler || conf->ws_handler) && conf->co_handler) {
+        fprintf(stderr, "http_handler and co_handler are exclusive\n");
+        return -1;
+    }
+
+#ifdef VESSEL_SOCKETS_ONLY
+    if (conf->use_ssl) {
+        fprintf(stderr, "TLS is not built in with VESSEL_SOCKETS_ONLY\n");
+        return -1;
+    }
+#endif
+
+    /* WebSocket frames are sent through the out queues */
+    if (conf->ws_handler && conf->use_ssl) {
+        fprintf(stderr, "WebSocket doesn't support TLS\n");
+        return -1;
+    }
+
+    for (int i = 0; conf->timers && i < conf->ntimers; ++i) {
+        if (conf->timers[i].interval_ms == 0 || !conf->timers[i].fn) {
+            fprintf(stderr, "Timer without interval or callback\n");
+            return -1;
+        }
+    }
+
+    /* Proxy mode, splice(2) can't go through TLS */
+    instance.proxy_upstream_len = 0;
+
+    if (conf->proxy_addr) {
+        if (conf->use_ssl) {
+            fprintf(stderr, "Proxy mode doesn't support TLS\n");
+            return -1;
+        }
+        instance.proxy_upstream_len = proxy_resolve(conf->proxy_addr,
+                                                    conf->proxy_port,
+                                                    &instance.proxy_upstream);
+        if (instance.proxy_upstream_len == 0) {
+            fprintf(stderr, "Can't resolve upstream %s\n", conf->proxy_addr);
+            return -1;
+        }
+    }
+
     Server s = {
         .addr = conf->addr,
         .fd = -1,
@@ -260,10 +1565,21 @@ int start_server(Config *conf) {
     };
 
     /* Init global configuration, starting with clients list */
-    instance.clients = list_init();
+    ilist_init(&instance.clients);
+    pthread_mutex_init(&instance.clients_lock, NULL);
+
+    /* Counters start from zero on every run */
+    memset(&instance.stats, 0, sizeof(instance.stats));
 
-    /* Event fd to interrupt epoll wait inside workers */
-    instance.event_fd = eventfd(0, EFD_NONBLOCK);
+    /* Event fd to interrupt epoll wait inside workers, in semaphore mode every
+       worker consumes exactly one of the writes done by stop_server */
+    instance.event_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+
+    /* If epoll workers number is not set (e.g. -1) set it to the # of core of
+       the machine */
+    if (conf->epoll_workers == -1) {
+        conf->epoll_workers = get_nprocs();
+    }
 
     /* Register epoll_workers, number of thread workers */
     instance.epoll_workers = conf->epoll_workers;
@@ -277,41 +1593,125 @@ int start_server(Config *conf) {
 
     instance.encryption = conf->use_ssl;
 
+    instance.zerocopy_threshold =
+        conf->zerocopy_threshold > 0 ? conf->zerocopy_threshold : 0;
+
+    instance.release_idle = conf->release_idle;
+
+    instance.sockopts = conf->sockopts;
+
+    instance.busy_poll_ns =
+        conf->busy_poll_us > 0 ? (uint64_t) conf->busy_poll_us * 1000 : 0;
+
+    instance.co_handler = conf->co_handler;
+    instance.co_stack_size = conf->co_stack_size;
+
+    /* HTTP runs as a coroutine handler of its own */
+    instance.http_handler = conf->http_handler;
+    instance.http_max_body =
+        conf->http_max_body > 0 ? conf->http_max_body : HTTP_MAX_BODY;
+
+    /* WebSocket connections start as HTTP ones */
+    instance.ws_open = conf->ws_open;
+    instance.ws_handler = conf->ws_handler;
+    instance.ws_close = conf->ws_close;
+    instance.ws_ping_ms = conf->ws_ping_ms > 0 ? conf->ws_ping_ms : WS_PING_MS;
+    instance.ws_max_message =
+        conf->ws_max_message > 0 ? conf->ws_max_message : WS_MAX_MESSAGE;
+    ilist_init(&instance.ws_conns);
+    pthread_mutex_init(&instance.ws_lock, NULL);
+
+    if (conf->http_handler || conf->ws_handler)
+        instance.co_handler = http_serve;
+
+    if (open_timers(conf) < 0)
+        goto err;
+
+    if (conf->trace_events > 0)
+        trace_start(conf->trace_events);
+
+    if (conf->trace_signal > 0
+            && trace_on_signal(conf->trace_signal, conf->trace_path) < 0)
+        goto err_trace;
+
+    if (log_start(conf->log_path, conf->log_level, conf->log_rate) < 0)
+        goto err_trace;
+
+    instance.outq_size = conf->outq_size > 0 ? conf->outq_size : OUTQ_SIZE;
+
+    instance.pubsub = pubsub_new(conf->pubsub_buckets > 0 ?
+                                 conf->pubsub_buckets : PUBSUB_BUCKETS);
+
+    /* Without a way to tell an answered upstream from a busy one, every
+       client gets its own */
+    instance.proxy_reuse = conf->proxy_reuse;
+    instance.proxy_pool_size = conf->proxy_reuse && conf->proxy_pool_size > 0 ?
+        conf->proxy_pool_size : 0;
+
+    instance.listeners = conf->listeners;
+    instance.nlisteners = conf->listeners ? conf->nlisteners : 0;
+    instance.dgram_handler = conf->dgram_handler;
+    instance.dgram_size = conf->dgram_size > 0 ? conf->dgram_size : DGRAM_SIZE;
+
+    /* Open files cache, revalidation can be disabled with a negative value */
+    int revalidate_ms = conf->file_cache_revalidate_ms;
+
+    if (revalidate_ms == 0)
+        revalidate_ms = FILE_CACHE_REVALIDATE_MS;
+
+    instance.files = filecache_new(conf->file_cache_size > 0 ?
+                                   conf->file_cache_size : FILE_CACHE_SIZE,
+                                   revalidate_ms > 0 ? revalidate_ms : 0);
+
     /* Set certificates and key in case of SSL server */
     if (conf->use_ssl) {
         instance.certfile = conf->certfile;
         instance.keyfile = conf->keyfile;
     }
 
-    /* If epoll workers number is not set (e.g. -1) set it to the # of core of
-       the machine */
-    if (conf->epoll_workers == -1) {
-        conf->epoll_workers = get_nprocs();
-    }
-
     /* Fallback to default accept_handler */
-    if (!conf->acc_handler) {
-        s.ctx_accept = accept_handler;
-    }
+    s.ctx_accept = conf->acc_handler ? conf->acc_handler : accept_handler;
 
     /* Run server, blocking call */
     r = server(conf->addr, conf->port, &s);
 
     /* Free allocated resources */
-    for (ListNode *n = instance.clients->head; n != NULL; n = n->next) {
-        Client *c = (Client *) n->data;
+    struct ilist_node *n, *tmp;
 
-        if (conf->use_ssl == 1)
-            SSL_free(c->ssl);
-
-        close(c->fd);
-        free(c->reply);
-        free((void *) c->addr);
+    ilist_foreach_safe(n, tmp, &instance.clients) {
+        Client *c = ilist_entry(n, Client, node);
+        ilist_del(&instance.clients, n);
+        free_client(c);
     }
 
-    list_free(instance.clients, 1);
+    pthread_mutex_destroy(&instance.clients_lock);
+    pthread_mutex_destroy(&instance.ws_lock);
+
+    close_timers();
+
+    close(instance.event_fd);
+    instance.event_fd = -1;
+
+    pubsub_free(instance.pubsub);
+    instance.pubsub = NULL;
+
+    filecache_free(instance.files);
+    instance.files = NULL;
+
+    log_stop();
 
     return r;
+
+err_trace:
+    if (conf->trace_events > 0)
+        trace_stop();
+    close_timers();
+err:
+    close(instance.event_fd);
+    instance.event_fd = -1;
+    pthread_mutex_destroy(&instance.clients_lock);
+    pthread_mutex_destroy(&instance.ws_lock);
+    return -1;
 }
 
 
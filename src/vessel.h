@@ -29,18 +29,115 @@
 #define VESSEL_H
 
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <openssl/ssl.h>
+#include "log.h"
 #include "list.h"
+#include "coro.h"
+#include "proxy.h"
+#include "http.h"
+#include "ws.h"
+#include "sbuf.h"
+#include "filecache.h"
+#include "networking.h"
+#include "typed_ringbuf.h"
 
 
 #define MAX_EVENTS	  64
 
+/* Defaults of the open files cache used by reply_file */
+#define FILE_CACHE_SIZE             1024
+#define FILE_CACHE_REVALIDATE_MS    1000
+
+/* Return values of the handlers, a reply handler returning HANDLER_AGAIN
+   leaves the client armed for EPOLLOUT, as the reply is not complete yet */
+#define HANDLER_OK      0
+#define HANDLER_AGAIN   1
+
+/* Default max size of the datagrams received by UDP listeners */
+#define DGRAM_SIZE      2048
+
+/* Default max number of shared buffers queued on a connection */
+#define OUTQ_SIZE       64
+
+/* Default number of hash buckets of the pub/sub topics */
+#define PUBSUB_BUCKETS  1024
+
 
 typedef struct client Client;
 typedef struct client Server;
 
 typedef struct reply Reply;
 
+/* Defined in transport.h */
+struct transport;
+
+
+/* Out queue of the connections, references to shared buffers. Through a
+   typedef, the ring functions take const elements and a bare pointer type
+   would turn them into pointers to const */
+typedef Sbuf *SbufRef;
+
+RINGBUF_DECLARE(sbuf_queue, SbufRef)
+
+
+/* What client_queue does when the out queue of a client is full */
+enum outq_policy {
+    /* Refuse the new buffer */
+    OUTQ_DROP,
+    /* Replace the newest buffer not being sent yet, for consumers needing
+       only the latest state */
+    OUTQ_COALESCE,
+    /* Shut the connection down, its worker then closes it */
+    OUTQ_DISCONNECT
+};
+
+
+enum listener_type { LISTEN_TCP, LISTEN_UDP, LISTEN_UNIX };
+
+
+/* A listening socket, served by the workers along with the connections */
+typedef struct listener {
+    enum listener_type type;
+    /* Path of unix listeners, starting with '@' for abstract names */
+    const char *addr;
+    /* Not used by unix listeners */
+    const char *port;
+    /* Socket options of the listener and its connections, replacing the
+       sockopts of the Config when set */
+    const struct sockopts *sockopts;
+    /* UDP only, send consecutive replies of the same size to the same peer
+       as a single UDP_SEGMENT (GSO) send */
+    int gso;
+} Listener;
+
+
+/* Periodic callback run on the epoll loop, by one worker at a time, it must
+   not block as the events wait meanwhile */
+typedef struct timer {
+    unsigned interval_ms;
+    void (*fn)(void *);
+    void *arg;
+} Timer;
+
+
+/* A datagram received by a UDP listener. The handler can write a reply of
+   up to reply_cap bytes in reply, setting reply_len, the replies of a whole
+   batch of datagrams are sent together once all of them are handled */
+typedef struct datagram {
+    /* Payload, valid only during the handler call */
+    uint8_t *data;
+    size_t len;
+    /* Source address, replies are sent back to it */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint8_t *reply;
+    size_t reply_len;
+    size_t reply_cap;
+} Datagram;
+
 struct client {
     const char *addr;
     int fd;
@@ -54,6 +151,57 @@ struct client {
     };
     SSL_CTX *ssl_ctx;
     SSL *ssl;
+    /* Stream the coroutine I/O goes through, NULL for a plain socket, and
+       the state of the transports needing one */
+    const struct transport *transport;
+    void *tp_ctx;
+    /* Set on listening sockets only, their events go to ctx_accept */
+    const Listener *listener;
+    /* Link in the list of connected clients */
+    struct ilist_node node;
+    /* Events the client is armed for on the epoll loop */
+    int events;
+    /* SO_ZEROCOPY enabled on the socket */
+    int zerocopy;
+    /* Id the kernel gives to the next MSG_ZEROCOPY send */
+    uint32_t zc_next;
+    /* Buffers sent with MSG_ZEROCOPY, pinned until the kernel reports the
+       completion of their last send */
+    IList zc_pending;
+    /* Coroutine running the co_handler of the connection, events holds
+       what it is waiting for while suspended */
+    Coro *co;
+    /* Set once the connection failed, coroutine I/O fails from then on */
+    int co_err;
+    /* Forwarding to the upstream in proxy mode, the epoll loop watches the
+       descriptor of the proxy in place of fd */
+    Proxy *proxy;
+    /* Guards the out queue, its registration and the zero copy state, the
+       only parts of a client other threads can touch */
+    pthread_mutex_t lock;
+    /* Shared buffers queued by client_send, allocated on the first one, the
+       oldest is already sent up to outq_off bytes */
+    struct sbuf_queue outq;
+    size_t outq_off;
+    /* Duplicate of fd registered for EPOLLOUT only while the out queue has
+       to be flushed, the registration of fd belongs to the worker handling
+       the client and is never changed by other threads */
+    int flush_fd;
+    int flush_armed;
+    /* Held by the connection and by the armed flush registration, the
+       client is freed with the last one */
+    int refs;
+    int closed;
+    /* The socket has been shut down for its worker to close it, nothing
+       is queued anymore */
+    int shut;
+    /* The sending side is shut down once the out queue is flushed */
+    int finish;
+    /* Subscriptions to pub/sub topics */
+    IList subs;
+    /* Suspended by vessel_wait_readable with no buffers held, the stack of
+       the coroutine is trimmed on the way out */
+    int idle;
 };
 
 
@@ -66,6 +214,16 @@ struct socks {
 struct reply {
     int fd;
     uint8_t *data;
+    /* Region of an open file to send, set by reply_file */
+    struct file_entry *file;
+    off_t offset;
+    size_t len;
+    /* Buffer to send, set by reply_buffer and owned by vessel */
+    uint8_t *buf;
+    size_t buflen;
+    size_t bufsent;
+    /* Some part of buf has been sent with MSG_ZEROCOPY */
+    int pinned;
 };
 
 
@@ -82,9 +240,153 @@ typedef struct config {
     int (*acc_handler)(Client *);
     int (*req_handler)(Client *);
     int (*rep_handler)(Client *);
+    /* Max number of open files cached for reply_file, 0 for the default */
+    int file_cache_size;
+    /* Interval in ms to check cached files for changes, 0 for the default,
+       -1 to never check them */
+    int file_cache_revalidate_ms;
+    /* Min size in bytes of the buffer replies sent with MSG_ZEROCOPY, 0
+       disables zero copy sends */
+    int zerocopy_threshold;
+    /* Additional listeners, served by the same workers of addr:port */
+    Listener *listeners;
+    int nlisteners;
+    /* Handler of the datagrams received by UDP listeners */
+    int (*dgram_handler)(Datagram *);
+    /* Max size of the datagrams received, 0 for the default */
+    int dgram_size;
+    /* Socket options applied to all the listeners and their connections */
+    struct sockopts sockopts;
+    /* Microseconds a worker keeps polling epoll without blocking before
+       going to sleep, 0 for plain blocking workers */
+    int busy_poll_us;
+    /* Coroutine handler, run for every connection in place of req_handler
+       and rep_handler, the connection is closed once it returns */
+    void (*co_handler)(Client *);
+    /* Stack size of the coroutine handlers, 0 for the default */
+    size_t co_stack_size;
+    /* Upstream of the proxy mode, every connection is forwarded to it in
+       place of being handled. A unix socket path if proxy_port is NULL */
+    const char *proxy_addr;
+    const char *proxy_port;
+    /* Idle upstream connections kept by every worker, 0 to open a new one
+       for every client. Pooling needs proxy_reuse, the bytes are spliced
+       without being seen, only the protocol can tell whether every request
+       sent upstream has been answered in full */
+    int proxy_pool_size;
+    /* Called once a client leaves with all its bytes forwarded, with the
+       bytes sent to the upstream and received back over the connection,
+       return 1 if the upstream has nothing left to answer and can serve
+       another client, 0 to close it */
+    int (*proxy_reuse)(uint64_t, uint64_t);
+    /* Max shared buffers queued on a connection, 0 for the default */
+    int outq_size;
+    /* Hash buckets of the pub/sub topics, rounded up to a power of two, 0
+       for the default */
+    int pubsub_buckets;
+    /* HTTP/1.1 request handler, serving every connection with http_serve
+       when set. It fills the response and returns 0, -1 to reply with an
+       error and close the connection */
+    int (*http_handler)(Client *, const HttpRequest *, HttpResponse *);
+    /* Max size of the request bodies, 0 for the default */
+    size_t http_max_body;
+    /* WebSocket handlers, HTTP requests asking for an upgrade are switched
+       to the WebSocket protocol when ws_handler is set. ws_open can refuse
+       them returning -1, ws_handler gets every complete message and closes
+       the connection returning -1, ws_close is called once it's closed */
+    int (*ws_open)(Client *, const HttpRequest *);
+    int (*ws_handler)(Client *, const WsMessage *);
+    void (*ws_close)(Client *);
+    /* Interval in ms of the pings to idle WebSocket peers, closed if they
+       stay silent for another interval, 0 for the default */
+    int ws_ping_ms;
+    /* Max size of a WebSocket message, 0 for the default */
+    size_t ws_max_message;
+    /* Periodic callbacks run on the loop */
+    Timer *timers;
+    int ntimers;
+    /* Events kept by the flight recorder of every thread, recording starts
+       with the server when set, trace_start can start it at any time */
+    size_t trace_events;
+    /* Signal dumping the flight recorder to trace_path, TRACE_PATH if NULL,
+       0 for none */
+    int trace_signal;
+    const char *trace_path;
+    /* File the errors of the workers are appended to by the background
+       logger, stderr if NULL, records above log_level are discarded and
+       every thread can log up to log_rate records/s, 0 for the defaults,
+       a negative log_rate for no limit */
+    const char *log_path;
+    enum log_level log_level;
+    int log_rate;
+    /* Give the buffers of quiet connections back while they wait for input:
+       out queues are freed once flushed, the unused stack of the suspended
+       coroutines is returned to the kernel and OpenSSL releases its record
+       buffers */
+    int release_idle;
 } Config;
 
 
+/* Server wide counters, updated with relaxed atomic increments by the workers
+   and readable at any time through the global instance */
+struct stats {
+    /* Connections accepted */
+    uint64_t accepted;
+    /* epoll_wait calls returning at least one event */
+    uint64_t epoll_wakeups;
+    /* Events dispatched to the handlers */
+    uint64_t events;
+    /* Bytes sent from files by send_file_reply */
+    uint64_t file_bytes;
+    /* MSG_ZEROCOPY sends completed without copying the buffer */
+    uint64_t zerocopy_sends;
+    /* MSG_ZEROCOPY sends where the kernel fell back to copying, either
+       reported on completion or refused upfront with ENOBUFS */
+    uint64_t zerocopy_copied;
+    /* Datagrams received and sent by UDP listeners */
+    uint64_t datagrams_in;
+    uint64_t datagrams_out;
+    /* Datagrams truncated on receive or not sent */
+    uint64_t datagrams_dropped;
+    /* Sends of UDP_SEGMENT batches, each one carrying multiple replies */
+    uint64_t gso_sends;
+    /* Busy polling workers, non-blocking polls returning no events, polls
+       returning events and budgets exhausted ending in a blocking wait */
+    uint64_t busy_polls_empty;
+    uint64_t busy_polls_hit;
+    uint64_t busy_poll_sleeps;
+    /* Proxy mode, upstream connections opened, taken from the pool and
+       pooled ones found closed or with unexpected data */
+    uint64_t upstream_connects;
+    uint64_t upstream_reuses;
+    uint64_t upstream_stale;
+    /* Bytes forwarded from the clients to the upstream and back */
+    uint64_t proxy_bytes_up;
+    uint64_t proxy_bytes_down;
+    /* Bytes of shared buffers sent from the out queues and buffers refused
+       by client_send because of a full queue */
+    uint64_t outq_bytes;
+    uint64_t outq_full;
+    /* Buffers replacing a queued one and connections shut down by the
+       slow consumer policies of client_queue */
+    uint64_t outq_coalesced;
+    uint64_t outq_disconnects;
+    /* Pub/sub messages published and queued on the subscribers */
+    uint64_t publishes;
+    uint64_t deliveries;
+    /* HTTP requests handled and error responses generated by the server */
+    uint64_t http_requests;
+    uint64_t http_errors;
+    /* WebSocket messages received and sent, and pings sent by the loop */
+    uint64_t ws_messages_in;
+    uint64_t ws_messages_out;
+    uint64_t ws_pings;
+    /* Waits of vessel_wait_readable suspending a connection with its
+       buffers released */
+    uint64_t idle_releases;
+};
+
+
 struct server_conf {
     /* Eventfd to break the epoll_wait loop in case of signals */
     int event_fd;
@@ -92,16 +394,71 @@ struct server_conf {
     int epoll_workers;
     /* Epoll max number of events */
     int epoll_max_events;
-    /* List of connected clients */
-    List *clients;
+    /* List of connected clients, linked through Client->node */
+    IList clients;
+    /* Guards the list of connected clients */
+    pthread_mutex_t clients_lock;
     /* Certificate file path on the filesystem */
     const char *certfile;
     /* Key file path on the filesystem */
     const char *keyfile;
     /* Encryption flag */
     int encryption;
+    /* Open files served through reply_file */
+    FileCache *files;
+    /* Min size of buffer replies sent with MSG_ZEROCOPY, 0 if disabled */
+    size_t zerocopy_threshold;
+    /* Additional listeners */
+    Listener *listeners;
+    int nlisteners;
+    /* Datagrams handler and max size of the datagrams received */
+    int (*dgram_handler)(Datagram *);
+    size_t dgram_size;
+    /* Default socket options of the listeners */
+    struct sockopts sockopts;
+    /* Busy polling budget of the workers, 0 if they block right away */
+    uint64_t busy_poll_ns;
+    /* Coroutine handler of the connections and stack size */
+    void (*co_handler)(Client *);
+    size_t co_stack_size;
+    /* Address of the upstream in proxy mode, 0 length when not proxying */
+    struct sockaddr_storage proxy_upstream;
+    socklen_t proxy_upstream_len;
+    /* Max idle upstream connections per worker, 0 disables the pool, and
+       the check of the upstream connections answered in full */
+    int proxy_pool_size;
+    int (*proxy_reuse)(uint64_t, uint64_t);
+    /* Capacity of the out queues */
+    size_t outq_size;
+    /* Pub/sub topics and their subscribers */
+    struct pubsub *pubsub;
+    /* HTTP request handler and max size of the request bodies */
+    int (*http_handler)(Client *, const HttpRequest *, HttpResponse *);
+    size_t http_max_body;
+    /* WebSocket handlers and limits, open connections are linked in
+       ws_conns for the pings */
+    int (*ws_open)(Client *, const HttpRequest *);
+    int (*ws_handler)(Client *, const WsMessage *);
+    void (*ws_close)(Client *);
+    unsigned ws_ping_ms;
+    size_t ws_max_message;
+    IList ws_conns;
+    pthread_mutex_t ws_lock;
+    /* Timer fd of the loop, ticking at the shortest interval of the timers,
+       -1 without timers */
+    int timer_fd;
+    struct loop_timer *timers;
+    int ntimers;
+    /* Release the memory of idle connections */
+    int release_idle;
+    /* Counters */
+    struct stats stats;
 };
 
+/* Increment a counter of the global instance stats */
+#define STATS_ADD(field, n) \
+    __atomic_fetch_add(&instance.stats.field, (n), __ATOMIC_RELAXED)
+
 /* Global instance configuration */
 extern struct server_conf instance;
 
@@ -116,6 +473,88 @@ void stop_server();
 /* Add a connected client to the global instance configuration */
 void add_client(Client *);
 
+/* Close a client connection, unlinking it from the connected clients in O(1)
+   and releasing all its resources, Reply included but not the data it points
+   to, which belongs to the handlers */
+void close_client(Client *);
+
+/* Set a region of a file as the reply of a client, starting at offset and
+   len bytes long, 0 meaning up to the end of the file. The file is taken
+   from the open files cache, return -1 if it can't be opened or the region
+   is out of its bounds */
+int reply_file(Client *, const char *, off_t, size_t);
+
+/* Send the file region of a client reply, to be called by reply handlers.
+   Return HANDLER_OK once the region is completely sent, HANDLER_AGAIN when
+   the socket buffer is full, in that case the reply handler has to return it
+   too and it will be called again on the next EPOLLOUT, -1 on error */
+int send_file_reply(Client *);
+
+/* Set a buffer allocated with malloc as the reply of a client, len bytes
+   long, vessel takes ownership of it and frees it once sent */
+void reply_buffer(Client *, uint8_t *, size_t);
+
+/* Send the buffer of a client reply, to be called by reply handlers, return
+   values are the same of send_file_reply. Buffers at least as large as the
+   zero copy threshold are sent with MSG_ZEROCOPY, without copying them into
+   the socket buffer, and are released only when the kernel reports their
+   completion on the socket error queue */
+int send_buffer_reply(Client *);
+
+/* Coroutine handlers only, read up to len bytes, suspending the handler
+   until some data is available. Return the bytes read, 0 once the peer has
+   closed the connection, -1 on error */
+ssize_t vessel_read(Client *, void *, size_t);
+
+/* Coroutine handlers only, suspend the handler until the connection is
+   readable without reading anything, the handler is expected to hold no
+   buffers meanwhile and with release_idle set its unused stack is given
+   back too. Return a hint of the bytes readable, at least 1, 0 once the
+   peer has closed the connection, -1 on error */
+ssize_t vessel_wait_readable(Client *);
+
+/* Coroutine handlers only, read exactly len bytes, suspending as needed.
+   Return len, 0 if the peer closes the connection before, -1 on error */
+ssize_t vessel_read_full(Client *, void *, size_t);
+
+/* Coroutine handlers only, scatter read into iovcnt buffers, as
+   vessel_read */
+ssize_t vessel_readv(Client *, const struct iovec *, int);
+
+/* Coroutine handlers only, gather write of all the bytes of up to 16
+   buffers, as vessel_write */
+ssize_t vessel_writev(Client *, const struct iovec *, int);
+
+/* Coroutine handlers only, write all the len bytes of buf, suspending while
+   the socket buffer is full. Return len or -1 on error */
+ssize_t vessel_write(Client *, const void *, size_t);
+
+/* Queue a reference to a shared buffer on a client, to be sent after the
+   buffers already queued, callable from any thread. The queue is flushed by
+   the workers as the socket becomes writable, independently of the replies
+   of the handlers, so a client receiving queued buffers should reply through
+   the queue too. Return -1 if the queue is full, the client is closing, or
+   it is a TLS or proxied connection */
+int client_send(Client *, Sbuf *);
+
+/* Same as client_send, with the policy to follow if the queue is full.
+   Return 0 if the buffer has been queued, replacing another one or not */
+int client_queue(Client *, Sbuf *, enum outq_policy);
+
+/* Queue n shared buffers one after the other, all of them or none, the
+   policy applying to the whole batch. Coalescing replaces only single
+   buffers, a batch is dropped in its place */
+int client_queuev(Client *, Sbuf **, size_t, enum outq_policy);
+
+/* Shut down the sending side of a client once everything queued so far is
+   sent, the peer sees the end of the stream after it. Nothing else can be
+   queued afterwards */
+void client_finish(Client *);
+
+/* Queue a shared buffer on all the connected clients, return the number of
+   clients it has been queued on */
+size_t broadcast(Sbuf *);
+
 /* Run the serveri instance, accept addr, port and a Client structure pointer */
 int server(const char *, const char *, Client *);
 
@@ -0,0 +1,839 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+#include "ws.h"
+#include "vessel.h"
+#include "bufpool.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define WS_X86
+#endif
+
+
+/* Size of the input buffer of a new connection, it grows as needed up to
+   the largest frame */
+#define WS_BUFFER_SIZE      4096
+
+/* Longest header of a client frame, with a 64 bits length and the key */
+#define WS_MAX_HEADER       14
+
+/* Appended to the key of the handshake before hashing it */
+#define WS_GUID             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/* Close status codes */
+#define WS_NORMAL           1000
+#define WS_PROTOCOL_ERROR   1002
+#define WS_INVALID_DATA     1007
+#define WS_TOO_BIG          1009
+
+
+/* A connection served by ws_serve, linked in the instance for the pings */
+struct ws_conn {
+    Client *c;
+    /* Last time in ms something was read from the peer */
+    uint64_t seen;
+    /* Close handshake started, no pings from now on */
+    int closing;
+    struct ilist_node node;
+};
+
+
+static inline uint64_t now_ms(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * Unmasking, len bytes XORed with the key starting from its byte at offset
+ * % 4, and UTF-8 validation, returning 1 if valid.
+ */
+
+static void unmask_scalar(uint8_t *p, size_t len, const uint8_t *key,
+                          size_t offset) {
+    for (size_t i = 0; i < len; ++i)
+        p[i] ^= key[(offset + i) & 3];
+}
+
+/* Following the table of well-formed byte sequences of the Unicode
+   standard, no overlong forms, surrogates or code points past U+10FFFF */
+static int utf8_scalar(const uint8_t *p, size_t len) {
+
+    size_t i = 0;
+
+    while (i < len) {
+
+        uint8_t c = p[i];
+        uint32_t cp, min;
+        size_t n;
+
+        if (c < 0x80) {
+            ++i;
+            continue;
+        } else if ((c & 0xe0) == 0xc0) {
+            n = 1, cp = c & 0x1f, min = 0x80;
+        } else if ((c & 0xf0) == 0xe0) {
+            n = 2, cp = c & 0x0f, min = 0x800;
+        } else if ((c & 0xf8) == 0xf0) {
+            n = 3, cp = c & 0x07, min = 0x10000;
+        } else {
+            return 0;
+        }
+
+        if (len - i - 1 < n)
+            return 0;
+
+        for (size_t k = 1; k <= n; ++k) {
+            if ((p[i + k] & 0xc0) != 0x80)
+                return 0;
+            cp = (cp << 6) | (p[i + k] & 0x3f);
+        }
+
+        if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+            return 0;
+
+        i += n + 1;
+    }
+
+    return 1;
+}
+
+/* The vector kernels validate whole blocks and leave the tail to the
+   scalar one, starting from the last character crossing into it */
+static int utf8_tail(const uint8_t *p, size_t len, size_t done) {
+
+    size_t start = done, k = 0;
+
+    while (k < 3 && start > k && (p[start - k - 1] & 0xc0) == 0x80)
+        ++k;
+
+    start -= k;
+
+    if (start > 0 && p[start - 1] >= 0xc0)
+        --start;
+
+    return utf8_scalar(p + start, len - start);
+}
+
+#ifdef WS_X86
+
+/*
+ * UTF-8 validation with lookup tables (Keiser and Lemire, "Validating UTF-8
+ * in less than one instruction per byte"). Each byte is classified by its
+ * high nibble and the two nibbles of the previous byte through three table
+ * lookups, whose AND is non zero where a pair of bytes is invalid, the
+ * third and fourth bytes of long sequences are checked apart.
+ */
+
+#define TOO_SHORT       (1 << 0)
+#define TOO_LONG        (1 << 1)
+#define OVERLONG_3      (1 << 2)
+#define TOO_LARGE       (1 << 3)
+#define SURROGATE       (1 << 4)
+#define OVERLONG_2      (1 << 5)
+#define TOO_LARGE_1000  (1 << 6)
+#define OVERLONG_4      (1 << 6)
+#define TWO_CONTS       (1 << 7)
+#define CARRY           (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define BYTE_1_HIGH                                                         \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,                                 \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,                                 \
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,                             \
+    TOO_SHORT | OVERLONG_2,                                                 \
+    TOO_SHORT,                                                              \
+    TOO_SHORT | OVERLONG_3 | SURROGATE,                                     \
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW                                                          \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,                           \
+    CARRY | OVERLONG_2,                                                     \
+    CARRY,                                                                  \
+    CARRY,                                                                  \
+    CARRY | TOO_LARGE,                                                      \
+    CARRY | TOO_LARGE | TOO_LARGE_1000,                                     \
+    CARRY | TOO_LARGE | TOO_LARGE_1000,                                     \
+    CARRY | TOO_LARGE | TOO_LARGE_1000,                                     \
+    CARRY | TOO_LARGE | TOO_LARGE_1000,                                     \
+    CARRY | TOO_LARGE | TOO_LARGE_1000,                                     \
+    CARRY | TOO_LARGE | TOO_LARGE_1000,                                     \
+    CARRY | TOO_LARGE | TOO_LARGE_1000,                                     \
+    CARRY | TOO_LARGE | TOO_LARGE_1000,                                     \
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,                         \
+    CARRY | TOO_LARGE | TOO_LARGE_1000,                                     \
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH                                                         \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,                             \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,                             \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000         \
+    | OVERLONG_4,                                                           \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,             \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,              \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,              \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+__attribute__((target("ssse3")))
+static void unmask_ssse3(uint8_t *p, size_t len, const uint8_t *key,
+                         size_t offset) {
+
+    uint8_t k[4];
+    size_t i = 0;
+
+    for (int j = 0; j < 4; ++j)
+        k[j] = key[(offset + j) & 3];
+
+    uint32_t k32;
+    memcpy(&k32, k, 4);
+
+    const __m128i m = _mm_set1_epi32(k32);
+
+    for (; len - i >= 16; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *) (p + i));
+        _mm_storeu_si128((__m128i *) (p + i), _mm_xor_si128(b, m));
+    }
+
+    unmask_scalar(p + i, len - i, key, offset + i);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i lookup_ssse3(__m128i table, __m128i nibbles) {
+    return _mm_shuffle_epi8(table, nibbles);
+}
+
+__attribute__((target("ssse3")))
+static int utf8_ssse3(const uint8_t *p, size_t len) {
+
+    const __m128i t1 = _mm_setr_epi8(BYTE_1_HIGH);
+    const __m128i t2 = _mm_setr_epi8(BYTE_1_LOW);
+    const __m128i t3 = _mm_setr_epi8(BYTE_2_HIGH);
+    const __m128i nib = _mm_set1_epi8(0x0f);
+    const __m128i incomplete = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                             -1, -1, -1, -1, -1,
+                                             0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+    __m128i prev = _mm_setzero_si128(), prev_incomplete = prev, err = prev;
+    size_t i = 0;
+
+    for (; len - i >= 16; i += 16) {
+
+        __m128i in = _mm_loadu_si128((const __m128i *) (p + i));
+
+        /* ASCII only, just a character left incomplete before can fail */
+        if (_mm_movemask_epi8(in) == 0) {
+            err = _mm_or_si128(err, prev_incomplete);
+            prev = in;
+            prev_incomplete = _mm_setzero_si128();
+            continue;
+        }
+
+        __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+        __m128i sc = _mm_and_si128(
+            _mm_and_si128(
+                lookup_ssse3(t1, _mm_and_si128(_mm_srli_epi16(prev1, 4), nib)),
+                lookup_ssse3(t2, _mm_and_si128(prev1, nib))),
+            lookup_ssse3(t3, _mm_and_si128(_mm_srli_epi16(in, 4), nib)));
+
+        /* Third and fourth bytes of long sequences must be continuations */
+        __m128i prev2 = _mm_alignr_epi8(in, prev, 14);
+        __m128i prev3 = _mm_alignr_epi8(in, prev, 13);
+        __m128i must23 = _mm_or_si128(
+            _mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80)),
+            _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80)));
+
+        must23 = _mm_and_si128(must23, _mm_set1_epi8(0x80));
+        err = _mm_or_si128(err, _mm_xor_si128(must23, sc));
+
+        prev = in;
+        prev_incomplete = _mm_subs_epu8(in, incomplete);
+    }
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, _mm_setzero_si128())) != 0xffff)
+        return 0;
+
+    return utf8_tail(p, len, i);
+}
+
+/* The AVX2 kernels clear the upper halves of the registers before going on
+   with the scalar tails */
+__attribute__((target("avx2")))
+static void unmask_avx2(uint8_t *p, size_t len, const uint8_t *key,
+                        size_t offset) {
+
+    uint8_t k[4];
+    size_t i = 0;
+
+    for (int j = 0; j < 4; ++j)
+        k[j] = key[(offset + j) & 3];
+
+    uint32_t k32;
+    memcpy(&k32, k, 4);
+
+    const __m256i m = _mm256_set1_epi32(k32);
+
+    for (; len - i >= 32; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *) (p + i));
+        _mm256_storeu_si256((__m256i *) (p + i), _mm256_xor_si256(b, m));
+    }
+
+    _mm256_zeroupper();
+
+    unmask_scalar(p + i, len - i, key, offset + i);
+}
+
+/* Bytes of in preceded by those of prev, shifted by n, across the lanes */
+#define PREV_AVX2(in, prev, n)                                              \
+    _mm256_alignr_epi8(in, _mm256_permute2x128_si256(prev, in, 0x21), 16 - n)
+
+__attribute__((target("avx2")))
+static int utf8_avx2(const uint8_t *p, size_t len) {
+
+    const __m256i t1 = _mm256_setr_epi8(BYTE_1_HIGH, BYTE_1_HIGH);
+    const __m256i t2 = _mm256_setr_epi8(BYTE_1_LOW, BYTE_1_LOW);
+    const __m256i t3 = _mm256_setr_epi8(BYTE_2_HIGH, BYTE_2_HIGH);
+    const __m256i nib = _mm256_set1_epi8(0x0f);
+    const __m256i incomplete = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+    __m256i prev = _mm256_setzero_si256(), prev_incomplete = prev, err = prev;
+    size_t i = 0;
+
+    for (; len - i >= 32; i += 32) {
+
+        __m256i in = _mm256_loadu_si256((const __m256i *) (p + i));
+
+        if (_mm256_movemask_epi8(in) == 0) {
+            err = _mm256_or_si256(err, prev_incomplete);
+            prev = in;
+            prev_incomplete = _mm256_setzero_si256();
+            continue;
+        }
+
+        __m256i prev1 = PREV_AVX2(in, prev, 1);
+        __m256i sc = _mm256_and_si256(
+            _mm256_and_si256(
+                _mm256_shuffle_epi8(t1, _mm256_and_si256(
+                    _mm256_srli_epi16(prev1, 4), nib)),
+                _mm256_shuffle_epi8(t2, _mm256_and_si256(prev1, nib))),
+            _mm256_shuffle_epi8(t3, _mm256_and_si256(
+                _mm256_srli_epi16(in, 4), nib)));
+
+        __m256i must23 = _mm256_or_si256(
+            _mm256_subs_epu8(PREV_AVX2(in, prev, 2),
+                             _mm256_set1_epi8(0xe0 - 0x80)),
+            _mm256_subs_epu8(PREV_AVX2(in, prev, 3),
+                             _mm256_set1_epi8(0xf0 - 0x80)));
+
+        must23 = _mm256_and_si256(must23, _mm256_set1_epi8(0x80));
+        err = _mm256_or_si256(err, _mm256_xor_si256(must23, sc));
+
+        prev = in;
+        prev_incomplete = _mm256_subs_epu8(in, incomplete);
+    }
+
+    int ok = _mm256_testz_si256(err, err);
+
+    _mm256_zeroupper();
+
+    return ok && utf8_tail(p, len, i);
+}
+
+#endif
+
+
+static struct {
+    void (*unmask)(uint8_t *, size_t, const uint8_t *, size_t);
+    int (*utf8)(const uint8_t *, size_t);
+} kernel = { unmask_scalar, utf8_scalar };
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+
+static int set_kernel(enum ws_kernel k) {
+
+#ifdef WS_X86
+    __builtin_cpu_init();
+
+    if (k == WS_KERNEL_AUTO)
+        k = __builtin_cpu_supports("avx2") ? WS_KERNEL_AVX2 :
+            __builtin_cpu_supports("ssse3") ? WS_KERNEL_SSSE3 :
+            WS_KERNEL_SCALAR;
+
+    if ((k == WS_KERNEL_AVX2 && !__builtin_cpu_supports("avx2"))
+            || (k == WS_KERNEL_SSSE3 && !__builtin_cpu_supports("ssse3")))
+        return -1;
+
+    switch (k) {
+        case WS_KERNEL_AVX2:
+            kernel.unmask = unmask_avx2;
+            kernel.utf8 = utf8_avx2;
+            return 0;
+        case WS_KERNEL_SSSE3:
+            kernel.unmask = unmask_ssse3;
+            kernel.utf8 = utf8_ssse3;
+            return 0;
+        default:
+            break;
+    }
+#else
+    if (k != WS_KERNEL_AUTO && k != WS_KERNEL_SCALAR)
+        return -1;
+#endif
+
+    kernel.unmask = unmask_scalar;
+    kernel.utf8 = utf8_scalar;
+
+    return 0;
+}
+
+
+static void kernel_init(void) {
+    set_kernel(WS_KERNEL_AUTO);
+}
+
+
+int ws_set_kernel(enum ws_kernel k) {
+    pthread_once(&kernel_once, kernel_init);
+    return set_kernel(k);
+}
+
+
+void ws_unmask(uint8_t *p, size_t len, const uint8_t *key, size_t offset) {
+    pthread_once(&kernel_once, kernel_init);
+    kernel.unmask(p, len, key, offset);
+}
+
+
+int ws_utf8_valid(const uint8_t *p, size_t len) {
+    pthread_once(&kernel_once, kernel_init);
+    return kernel.utf8(p, len);
+}
+
+
+ssize_t ws_parse_frame(const uint8_t *buf, size_t len, WsFrame *f) {
+
+    if (len < 2)
+        return 0;
+
+    /* No extension is negotiated, the reserved bits must be clear */
+    if (buf[0] & 0x70)
+        return -1;
+
+    f->fin = buf[0] >> 7;
+    f->opcode = buf[0] & 0x0f;
+    f->masked = buf[1] >> 7;
+    f->len = buf[1] & 0x7f;
+
+    switch (f->opcode) {
+        case WS_CONTINUATION:
+        case WS_TEXT:
+        case WS_BINARY:
+            break;
+        case WS_CLOSE:
+        case WS_PING:
+        case WS_PONG:
+            if (!f->fin || f->len > 125)
+                return -1;
+            break;
+        default:
+            return -1;
+    }
+
+    /* Clients always mask their frames */
+    if (!f->masked)
+        return -1;
+
+    size_t hlen = 2;
+
+    if (f->len == 126) {
+        if (len < 4)
+            return 0;
+        f->len = (uint64_t) buf[2] << 8 | buf[3];
+        hlen = 4;
+    } else if (f->len == 127) {
+        if (len < 10)
+            return 0;
+        f->len = 0;
+        for (int i = 0; i < 8; ++i)
+            f->len = f->len << 8 | buf[2 + i];
+        if (f->len >> 63)
+            return -1;
+        hlen = 10;
+    }
+
+    if (len < hlen + 4)
+        return 0;
+
+    memcpy(f->key, buf + hlen, 4);
+
+    return hlen + 4;
+}
+
+
+int ws_is_upgrade(const HttpRequest *r) {
+
+    const HttpStr *upgrade = http_find_header(r, "upgrade");
+    const HttpStr *connection = http_find_header(r, "connection");
+
+    return upgrade && connection && http_has_token(upgrade, "websocket")
+        && http_has_token(connection, "upgrade");
+}
+
+
+int ws_accept(const HttpRequest *r, HttpResponse *res) {
+
+    const HttpStr *version = http_find_header(r, "sec-websocket-version");
+    const HttpStr *key = http_find_header(r, "sec-websocket-key");
+
+    /* The key is 16 random bytes in base64 */
+    if (r->method.len != 3 || memcmp(r->method.p, "GET", 3) != 0
+            || r->minor < 1 || !version || version->len != 2
+            || memcmp(version->p, "13", 2) != 0 || !key || key->len != 24)
+        return -1;
+
+    char concat[24 + sizeof(WS_GUID)], accept[29];
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+
+    memcpy(concat, key->p, 24);
+    memcpy(concat + 24, WS_GUID, sizeof(WS_GUID) - 1);
+
+    if (!EVP_Digest(concat, 24 + sizeof(WS_GUID) - 1, md, &mdlen,
+                    EVP_sha1(), NULL))
+        return -1;
+
+    EVP_EncodeBlock((unsigned char *) accept, md, mdlen);
+
+    res->status = 101;
+
+    return http_add_header(res, "Upgrade", "websocket")
+        | http_add_header(res, "Connection", "Upgrade")
+        | http_add_header(res, "Sec-WebSocket-Accept", accept);
+}
+
+/* Write the header of an unmasked, final, frame, return its length */
+static size_t frame_header(uint8_t *h, enum ws_opcode op, size_t len) {
+
+    h[0] = 0x80 | op;
+
+    if (len < 126) {
+        h[1] = len;
+        return 2;
+    }
+
+    if (len <= 0xffff) {
+        h[1] = 126;
+        h[2] = len >> 8;
+        h[3] = len;
+        return 4;
+    }
+
+    h[1] = 127;
+
+    for (int i = 0; i < 8; ++i)
+        h[2 + i] = (uint64_t) len >> (56 - 8 * i);
+
+    return 10;
+}
+
+/* Messages are counted, control frames aren't */
+static int queued(int rc, enum ws_opcode op) {
+
+    if (rc == 0 && op < WS_CLOSE)
+        STATS_ADD(ws_messages_out, 1);
+
+    return rc;
+}
+
+
+int ws_send(Client *c, enum ws_opcode op, const void *data, size_t len) {
+
+    uint8_t h[10];
+    size_t hlen = frame_header(h, op, len);
+    Sbuf *b = sbuf_new(hlen + len);
+
+    memcpy(b->data, h, hlen);
+    if (len)
+        memcpy(b->data + hlen, data, len);
+
+    /* Frames can't be dropped from the middle of a stream, a peer falling
+       behind is cut off instead */
+    int rc = client_queue(c, b, OUTQ_DISCONNECT);
+
+    sbuf_put(b);
+
+    return queued(rc, op);
+}
+
+
+int ws_send_sbuf(Client *c, enum ws_opcode op, Sbuf *b) {
+
+    if (b->len <= WS_INLINE_FRAME)
+        return ws_send(c, op, b->data, b->len);
+
+    uint8_t h[10];
+    size_t hlen = frame_header(h, op, b->len);
+    Sbuf *bufs[2] = { sbuf_from(h, hlen), b };
+    int rc = client_queuev(c, bufs, 2, OUTQ_DISCONNECT);
+
+    sbuf_put(bufs[0]);
+
+    return queued(rc, op);
+}
+
+/* Status of the close frame answering the one of the peer, 0 for an empty
+   one */
+static int close_status(const uint8_t *p, size_t len) {
+
+    if (len == 0)
+        return 0;
+
+    if (len == 1)
+        return WS_PROTOCOL_ERROR;
+
+    int code = p[0] << 8 | p[1];
+
+    if (!ws_utf8_valid(p + 2, len - 2))
+        return WS_INVALID_DATA;
+
+    if ((code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011)
+            || (code >= 3000 && code <= 4999))
+        return code;
+
+    return WS_PROTOCOL_ERROR;
+}
+
+/* Pass a complete message to the handler, return the status to close the
+   connection with, 0 to go on */
+static int deliver(Client *c, enum ws_opcode op, const uint8_t *p,
+                   size_t len) {
+
+    if (op == WS_TEXT && !ws_utf8_valid(p, len))
+        return WS_INVALID_DATA;
+
+    STATS_ADD(ws_messages_in, 1);
+
+    WsMessage msg = { op, p, len };
+
+    return instance.ws_handler(c, &msg) < 0 ? WS_NORMAL : 0;
+}
+
+static void *grow(void *p, size_t *cap, size_t want) {
+
+    if (want <= *cap)
+        return p;
+
+    while (*cap < want)
+        *cap *= 2;
+
+    if (!(p = realloc(p, *cap))) {
+        perror("growing WebSocket buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    return p;
+}
+
+
+void ws_serve(Client *c, const uint8_t *pending, size_t plen) {
+
+    struct ws_conn conn = { .c = c, .seen = now_ms(), .closing = 0 };
+    size_t max = instance.ws_max_message;
+    size_t cap, len = plen;
+    size_t msg_cap = WS_BUFFER_SIZE, msg_len = 0;
+    enum ws_opcode msg_op = WS_CONTINUATION;
+    uint8_t *in = grow(bufpool_get(WS_BUFFER_SIZE, &cap), &cap, plen);
+    uint8_t *msg = NULL;
+    int status = -1;
+
+    memcpy(in, pending, plen);
+
+    pthread_mutex_lock(&instance.ws_lock);
+    ilist_push(&instance.ws_conns, &conn.node);
+    pthread_mutex_unlock(&instance.ws_lock);
+
+    /* status is the code of the close frame to send once out of the loop,
+       0 for an empty one and -1 for none as the connection is gone */
+    for (;;) {
+
+        WsFrame f;
+        ssize_t hlen = ws_parse_frame(in, len, &f);
+
+        if (hlen < 0) {
+            status = WS_PROTOCOL_ERROR;
+            break;
+        }
+
+        if (hlen > 0 && f.len > max) {
+            status = WS_TOO_BIG;
+            break;
+        }
+
+        /* Between messages, the buffers go back until the peer speaks */
+        if (len == 0 && msg_len == 0 && instance.release_idle) {
+            bufpool_put(in, cap);
+            free(msg);
+            msg = NULL;
+            msg_cap = WS_BUFFER_SIZE;
+            ssize_t n = vessel_wait_readable(c);
+            in = bufpool_get(n <= 0 ? 0 : n < BUFPOOL_MAX ? n : BUFPOOL_MAX,
+                             &cap);
+            if (n <= 0)
+                break;
+        }
+
+        if (hlen == 0 || len - hlen < f.len) {
+            in = grow(in, &cap, hlen ? hlen + f.len : len + WS_MAX_HEADER);
+            ssize_t n = vessel_read(c, in + len, cap - len);
+            if (n <= 0)
+                break;
+            __atomic_store_n(&conn.seen, now_ms(), __ATOMIC_RELAXED);
+            len += n;
+            continue;
+        }
+
+        uint8_t *payload = in + hlen;
+        size_t frame_len = hlen + f.len;
+
+        ws_unmask(payload, f.len, f.key, 0);
+
+        if (f.opcode == WS_PING) {
+            ws_send(c, WS_PONG, payload, f.len);
+        } else if (f.opcode == WS_CLOSE) {
+            status = close_status(payload, f.len);
+            break;
+        } else if (f.opcode == WS_PONG) {
+            /* Reading it is enough to show the peer is alive */
+        } else if ((f.opcode == WS_CONTINUATION) == (msg_op == 0)) {
+            /* A continuation of nothing or a new message in the middle of
+               a fragmented one */
+            status = WS_PROTOCOL_ERROR;
+            break;
+        } else if (f.fin && f.opcode != WS_CONTINUATION) {
+            /* Unfragmented, straight from the input buffer */
+            if ((status = deliver(c, f.opcode, payload, f.len)) != 0)
+                break;
+        } else {
+            if (msg_len + f.len > max) {
+                status = WS_TOO_BIG;
+                break;
+            }
+            if (!msg && !(msg = malloc(msg_cap))) {
+                perror("allocating WebSocket message");
+                exit(EXIT_FAILURE);
+            }
+            msg = grow(msg, &msg_cap, msg_len + f.len);
+            memcpy(msg + msg_len, payload, f.len);
+            msg_len += f.len;
+            if (f.opcode != WS_CONTINUATION)
+                msg_op = f.opcode;
+            if (f.fin) {
+                if ((status = deliver(c, msg_op, msg, msg_len)) != 0)
+                    break;
+                msg_op = WS_CONTINUATION;
+                msg_len = 0;
+            }
+        }
+
+        memmove(in, in + frame_len, len - frame_len);
+        len -= frame_len;
+        status = -1;
+    }
+
+    pthread_mutex_lock(&instance.ws_lock);
+    conn.closing = 1;
+    pthread_mutex_unlock(&instance.ws_lock);
+
+    /* Close frame, then the end of the stream once it is sent, waiting for
+       the peer to close its side too. The pings timer cuts off peers that
+       never do */
+    if (status >= 0) {
+
+        uint8_t code[2] = { status >> 8, status & 0xff };
+
+        ws_send(c, WS_CLOSE, code, status ? 2 : 0);
+        client_finish(c);
+
+        while (vessel_read(c, in, cap) > 0)
+            __atomic_store_n(&conn.seen, now_ms(), __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&instance.ws_lock);
+    ilist_del(&instance.ws_conns, &conn.node);
+    pthread_mutex_unlock(&instance.ws_lock);
+
+    if (instance.ws_close)
+        instance.ws_close(c);
+
+    free(msg);
+    bufpool_put(in, cap);
+}
+
+
+void ws_tick(void *arg) {
+
+    uint64_t now = now_ms(), interval = instance.ws_ping_ms;
+    struct ilist_node *n, *tmp;
+
+    pthread_mutex_lock(&instance.ws_lock);
+
+    ilist_foreach_safe(n, tmp, &instance.ws_conns) {
+
+        struct ws_conn *conn = ilist_entry(n, struct ws_conn, node);
+        uint64_t seen = __atomic_load_n(&conn->seen, __ATOMIC_RELAXED);
+        Client *c = conn->c;
+
+        /* Read from after the clock was */
+        uint64_t idle = seen < now ? now - seen : 0;
+
+        if (idle >= 2 * interval) {
+            /* Silent since the last ping, its worker closes it */
+            pthread_mutex_lock(&c->lock);
+            if (!c->closed && !c->shut) {
+                shutdown(c->fd, SHUT_RDWR);
+                c->shut = 1;
+            }
+            pthread_mutex_unlock(&c->lock);
+        } else if (idle >= interval && !conn->closing
+                   && ws_send(c, WS_PING, NULL, 0) == 0) {
+            STATS_ADD(ws_pings, 1);
+        }
+    }
+
+    pthread_mutex_unlock(&instance.ws_lock);
+}
@@ -0,0 +1,134 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2018, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WS_H
+#define WS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "sbuf.h"
+#include "http.h"
+
+
+/* Default interval of the pings to idle peers */
+#define WS_PING_MS          30000
+
+/* Default max size of a message, fragmented or not */
+#define WS_MAX_MESSAGE      (1024 * 1024)
+
+/* Payloads up to this size are copied next to the frame header, larger ones
+   are queued by reference right after it */
+#define WS_INLINE_FRAME     1024
+
+
+enum ws_opcode {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT         = 0x1,
+    WS_BINARY       = 0x2,
+    WS_CLOSE        = 0x8,
+    WS_PING         = 0x9,
+    WS_PONG         = 0xa
+};
+
+
+/* Header of a frame */
+typedef struct ws_frame {
+    int fin;
+    enum ws_opcode opcode;
+    int masked;
+    uint8_t key[4];
+    uint64_t len;
+} WsFrame;
+
+
+/* A complete message, unmasked and reassembled from its fragments, the
+   payload is valid only during the handler call */
+typedef struct ws_message {
+    enum ws_opcode opcode;
+    const uint8_t *data;
+    size_t len;
+} WsMessage;
+
+
+/* Implementations of unmasking and UTF-8 validation */
+enum ws_kernel {
+    /* The best one supported by the CPU */
+    WS_KERNEL_AUTO,
+    /* Plain loops, the reference of the others */
+    WS_KERNEL_SCALAR,
+    WS_KERNEL_SSSE3,
+    WS_KERNEL_AVX2
+};
+
+
+struct client;
+
+/* Select the kernel for the whole process, return -1 if the CPU doesn't
+   support it */
+int ws_set_kernel(enum ws_kernel);
+
+/* Parse the header of a frame sent by a client at the start of buf, len
+   bytes long. Return the length of the header, 0 if incomplete, -1 if the
+   frame is malformed: unmasked, with reserved bits or opcodes, or a
+   fragmented or oversized control frame */
+ssize_t ws_parse_frame(const uint8_t *, size_t, WsFrame *);
+
+/* XOR len bytes of a payload with the masking key in place, offset being
+   the position of the first byte in the payload */
+void ws_unmask(uint8_t *, size_t, const uint8_t *, size_t);
+
+/* Return 1 if len bytes are valid UTF-8, 0 otherwise */
+int ws_utf8_valid(const uint8_t *, size_t);
+
+/* Check if an HTTP request asks for an upgrade to WebSocket */
+int ws_is_upgrade(const HttpRequest *);
+
+/* Fill the 101 response accepting an upgrade request, return -1 if the
+   handshake is invalid */
+int ws_accept(const HttpRequest *, HttpResponse *);
+
+/* Send a message in a single frame, copying the payload, callable from any
+   thread. Frames go through the out queue of the client, a client not
+   keeping up with them is disconnected. Return -1 if not queued */
+int ws_send(struct client *, enum ws_opcode, const void *, size_t);
+
+/* Send a shared buffer as a message, large ones are queued by reference so
+   the same payload can go to many clients without copies */
+int ws_send_sbuf(struct client *, enum ws_opcode, Sbuf *);
+
+/* Serve the WebSocket protocol on a connection upgraded by http_serve, len
+   bytes already read after the upgrade request in buf. Return once the
+   connection is closed */
+void ws_serve(struct client *, const uint8_t *, size_t);
+
+/* Ping the idle connections and close those not answering, run by the
+   loop timer every ping interval */
+void ws_tick(void *);
+
+
+#endif
@@ -25,11 +25,32 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+#include <time.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include "unit.h"
 #include "vessel_test.h"
 #include "../src/list.h"
 #include "../src/ringbuf.h"
+#include "../src/typed_ringbuf.h"
+#include "../src/filecache.h"
+#include "../src/coro.h"
+#include "../src/sbuf.h"
+#include "../src/http.h"
+#include "../src/ws.h"
+#include "../src/resp.h"
+#include "../src/hashmap.h"
+#include "../src/trace.h"
+#include "../src/log.h"
+#include "../src/bufpool.h"
+#include "../src/transport.h"
+#include "../src/networking.h"
 
 
 int tests_run = 0;
@@ -179,7 +200,7 @@ static char *test_ringbuf_bulk_pop(void) {
     ASSERT("[! ringbuf_bulk_pop]: ringbuf_bulk_pop doesn't work as expected", ringbuf_size(r) == 0);
     ringbuf_bulk_push(r, (uint8_t *) "abc", 3);
     ASSERT("[! ringbuf_bulk_pop]: ringbuf_bulk_pop doesn't work as expected", ringbuf_size(r) == 3);
-    uint8_t x[4];
+    uint8_t x[4] = { 0 };
     ringbuf_bulk_pop(r, x, 3);
     ASSERT("[! ringbuf_bulk_pop]: ringbuf_bulk_pop doesn't work as expected", strcmp((const char *) x, "abc") == 0);
     ringbuf_free(r);
@@ -187,6 +208,190 @@ static char *test_ringbuf_bulk_pop(void) {
 }
 
 
+/*
+ * Tests bulk push and pop of the ringbuffer across the end of the buffer
+ */
+static char *test_ringbuf_bulk_wrap(void) {
+    uint8_t buf[8];
+    uint8_t x[8];
+    Ringbuf *r = ringbuf_init(buf, 8);
+    ringbuf_bulk_push(r, (uint8_t *) "abcde", 5);
+    ringbuf_bulk_pop(r, x, 4);
+    ASSERT("[! ringbuf_bulk_push]: wrapping push should fit",
+           ringbuf_bulk_push(r, (uint8_t *) "fghijkl", 7) == 0);
+    ASSERT("[! ringbuf_bulk_push]: ringbuf should be full", ringbuf_full(r));
+    ASSERT("[! ringbuf_bulk_push]: push on a full ringbuf should fail",
+           ringbuf_bulk_push(r, (uint8_t *) "m", 1) == -1);
+    ringbuf_bulk_pop(r, x, 8);
+    ASSERT("[! ringbuf_bulk_pop]: wrong data across the wrap",
+           memcmp(x, "efghijkl", 8) == 0);
+    ASSERT("[! ringbuf_bulk_pop]: ringbuf should be empty", ringbuf_empty(r));
+    ringbuf_free(r);
+    return 0;
+}
+
+
+/*
+ * Tests the searches on contents wrapping around the end of the buffer
+ */
+static char *test_ringbuf_find(void) {
+    uint8_t buf[16], x[16];
+    Ringbuf *r = ringbuf_init(buf, 16);
+    ringbuf_bulk_push(r, (uint8_t *) "0123456789ab", 12);
+    ringbuf_bulk_pop(r, x, 12);
+    ringbuf_bulk_push(r, (uint8_t *) "GET /\r\n\r\nx\nyz", 14);
+    ASSERT("[! ringbuf_find]: wrong offset", ringbuf_find(r, 0, '\n') == 6);
+    ASSERT("[! ringbuf_find]: wrong offset from",
+           ringbuf_find(r, 7, '\n') == 8);
+    ASSERT("[! ringbuf_find]: missing byte found",
+           ringbuf_find(r, 0, 'q') == -1 && ringbuf_find(r, 14, 'z') == -1);
+    ASSERT("[! ringbuf_find_pattern]: wrapping match not found",
+           ringbuf_find_pattern(r, 0, (uint8_t *) "\r\n\r\n", 4) == 5);
+    ASSERT("[! ringbuf_find_pattern]: wrong offset from",
+           ringbuf_find_pattern(r, 6, (uint8_t *) "\nyz", 3) == 10);
+    ASSERT("[! ringbuf_find_pattern]: match past the end",
+           ringbuf_find_pattern(r, 0, (uint8_t *) "yz!", 3) == -1);
+    ASSERT("[! ringbuf_count]: wrong count", ringbuf_count(r, '\n') == 3);
+    ASSERT("[! ringbuf_find]: bytes consumed", ringbuf_size(r) == 14);
+    ringbuf_free(r);
+    return 0;
+}
+
+
+/*
+ * Tests every search kernel supported against the scalar reference, on
+ * random contents at every offset of the buffer
+ */
+static char *test_ringbuf_find_kernels(void) {
+    static const char *pats[] = { "\r\n", "\r\n\r\n", "a\rb", "abab\n" };
+    uint8_t buf[1000], data[1000] = { 0 }, x[1000];
+    Ringbuf *r = ringbuf_init(buf, sizeof(buf));
+    unsigned seed = 42;
+    for (int round = 0; round < 50; ++round) {
+        size_t len = rand_r(&seed) % 1000, skip = rand_r(&seed) % 1000;
+        ringbuf_reset(r);
+        ringbuf_bulk_push(r, data, skip);
+        ringbuf_bulk_pop(r, x, skip);
+        for (size_t i = 0; i < len; ++i)
+            data[i] = "ab\r\n"[rand_r(&seed) % 4];
+        ringbuf_bulk_push(r, data, len);
+        size_t from = len ? rand_r(&seed) % len : 0;
+        ringbuf_set_kernel(RINGBUF_KERNEL_SCALAR);
+        ssize_t find = ringbuf_find(r, from, '\n');
+        size_t count = ringbuf_count(r, '\r');
+        ssize_t found[4];
+        for (int p = 0; p < 4; ++p)
+            found[p] = ringbuf_find_pattern(r, from, (uint8_t *) pats[p],
+                                            strlen(pats[p]));
+        for (int k = RINGBUF_KERNEL_SSE2; k <= RINGBUF_KERNEL_AVX2; ++k) {
+            if (ringbuf_set_kernel(k) < 0)
+                continue;
+            ASSERT("[! ringbuf_find]: kernel differs from the reference",
+                   ringbuf_find(r, from, '\n') == find);
+            ASSERT("[! ringbuf_count]: kernel differs from the reference",
+                   ringbuf_count(r, '\r') == count);
+            for (int p = 0; p < 4; ++p)
+                ASSERT("[! ringbuf_find_pattern]: kernel differs from the "
+                       "reference", ringbuf_find_pattern(
+                           r, from, (uint8_t *) pats[p], strlen(pats[p]))
+                       == found[p]);
+        }
+    }
+    ringbuf_set_kernel(RINGBUF_KERNEL_AUTO);
+    ringbuf_free(r);
+    return 0;
+}
+
+
+struct event {
+    int fd;
+    unsigned events;
+    void *ptr;
+};
+
+
+RINGBUF_DECLARE(event_ring, struct event)
+
+RINGBUF_DECLARE_STATIC(fd_ring, int, 4)
+
+
+/*
+ * Tests push and pop of records on a typed ringbuffer
+ */
+static char *test_typed_ringbuf_push_pop(void) {
+    struct event storage[3];
+    struct event_ring r;
+    struct event e = { 1, 2, &r }, out;
+    event_ring_init(&r, storage, 3);
+    ASSERT("[! typed ringbuf]: should be empty", event_ring_empty(&r));
+    ASSERT("[! typed ringbuf]: pop on empty should fail",
+           event_ring_pop(&r, &out) == -1);
+    for (int i = 0; i < 3; ++i) {
+        e.fd = i;
+        ASSERT("[! typed ringbuf]: push failed", event_ring_push(&r, &e) == 0);
+    }
+    ASSERT("[! typed ringbuf]: should be full", event_ring_full(&r));
+    ASSERT("[! typed ringbuf]: push on full should fail",
+           event_ring_push(&r, &e) == -1);
+    ASSERT("[! typed ringbuf]: wrong peek", event_ring_peek(&r)->fd == 0);
+    event_ring_pop(&r, &out);
+    ASSERT("[! typed ringbuf]: wrong record",
+           out.fd == 0 && out.events == 2 && out.ptr == &r);
+    e.fd = 3;
+    event_ring_push(&r, &e);
+    ASSERT("[! typed ringbuf]: wrong record at index across the wrap",
+           event_ring_at(&r, 2)->fd == 3 && event_ring_at(&r, 0)->fd == 1);
+    ASSERT("[! typed ringbuf]: index past the size should be NULL",
+           event_ring_at(&r, 3) == NULL);
+    for (int i = 1; i < 4; ++i) {
+        event_ring_pop(&r, &out);
+        ASSERT("[! typed ringbuf]: wrong order after wrap", out.fd == i);
+    }
+    ASSERT("[! typed ringbuf]: should be empty", event_ring_size(&r) == 0);
+    return 0;
+}
+
+
+/*
+ * Tests bulk operations on a static power of two typed ringbuffer
+ */
+static char *test_typed_ringbuf_bulk(void) {
+    struct fd_ring r;
+    int in[6] = { 1, 2, 3, 4, 5, 6 }, out[6] = { 0 };
+    fd_ring_init(&r);
+    ASSERT("[! typed ringbuf]: wrong capacity", fd_ring_capacity(&r) == 4);
+    ASSERT("[! typed ringbuf]: bulk push should be partial",
+           fd_ring_push_bulk(&r, in, 6) == 4);
+    ASSERT("[! typed ringbuf]: bulk pop failed", fd_ring_pop_bulk(&r, out, 3) == 3);
+    ASSERT("[! typed ringbuf]: wrong records", out[0] == 1 && out[2] == 3);
+    ASSERT("[! typed ringbuf]: wrapping bulk push failed",
+           fd_ring_push_bulk(&r, in + 4, 2) == 2);
+    ASSERT("[! typed ringbuf]: bulk pop should be partial",
+           fd_ring_pop_bulk(&r, out, 6) == 3);
+    ASSERT("[! typed ringbuf]: wrong records across the wrap",
+           out[0] == 4 && out[1] == 5 && out[2] == 6);
+    return 0;
+}
+
+
+/*
+ * Tests the references of a shared buffer
+ */
+static char *test_sbuf_refs(void) {
+    Sbuf *b = sbuf_from("hello", 5);
+    ASSERT("[! sbuf]: wrong content",
+           b->len == 5 && memcmp(b->data, "hello", 5) == 0);
+    ASSERT("[! sbuf]: should have one reference", b->refs == 1);
+    ASSERT("[! sbuf]: get should return the buffer", sbuf_get(b) == b);
+    ASSERT("[! sbuf]: should have two references", b->refs == 2);
+    sbuf_put(b);
+    ASSERT("[! sbuf]: put should drop one reference", b->refs == 1);
+    sbuf_put(b);
+    sbuf_put(NULL);
+    return 0;
+}
+
+
 /*
  * Tests the init feature of the list
  */
@@ -235,6 +440,968 @@ static char *test_list_push_back(void) {
 }
 
 
+static int compare_data(void *node, void *target) {
+    return ((ListNode *) node)->data != ((ListNode *) target)->data;
+}
+
+
+/*
+ * Tests the remove feature of the list
+ */
+static char *test_list_remove(void) {
+    List *l = list_init();
+    char *x = "a", *y = "b", *z = "c";
+    list_push_back(l, x);
+    list_push_back(l, y);
+    list_push_back(l, z);
+    ListNode target = { .data = z };
+    list_remove(l, &target, compare_data);
+    ASSERT("[! list_remove]: item not removed", l->len == 2);
+    ASSERT("[! list_remove]: tail not updated", l->tail->data == y);
+    ASSERT("[! list_remove]: tail next not updated", l->tail->next == NULL);
+    target.data = x;
+    list_remove(l, &target, compare_data);
+    ASSERT("[! list_remove]: head not updated", l->head->data == y);
+    ASSERT("[! list_remove]: head prev not updated", l->head->prev == NULL);
+    list_free(l, 0);
+    return 0;
+}
+
+
+/*
+ * Tests the O(1) remove_node feature of the list
+ */
+static char *test_list_remove_node(void) {
+    List *l = list_init();
+    char *x = "a", *y = "b", *z = "c";
+    list_push_back(l, x);
+    list_push_back(l, y);
+    ListNode *middle = l->tail;
+    list_push_back(l, z);
+    ASSERT("[! list_remove_node]: wrong data returned",
+           list_remove_node(l, middle) == y);
+    ASSERT("[! list_remove_node]: item not removed", l->len == 2);
+    ASSERT("[! list_remove_node]: nodes not linked",
+           l->head->next == l->tail && l->tail->prev == l->head);
+    list_remove_node(l, l->tail);
+    list_remove_node(l, l->head);
+    ASSERT("[! list_remove_node]: list not empty",
+           l->len == 0 && l->head == NULL && l->tail == NULL);
+    list_free(l, 0);
+    return 0;
+}
+
+
+static pthread_key_t list_exit_key;
+
+
+static void list_exit_free(void *arg) {
+    list_free(arg, 0);
+}
+
+
+static void *list_exit_thread(void *arg) {
+    List *pooled = list_init();
+    List *late = list_init();
+    for (int i = 0; i < 8; ++i) {
+        list_push(pooled, arg);
+        list_push(late, arg);
+    }
+    /* Registers the pool drain, which runs before the destructor below */
+    list_free(pooled, 0);
+    pthread_setspecific(list_exit_key, late);
+    return NULL;
+}
+
+
+/*
+ * Tests that nodes released after the pool of an exiting thread is drained
+ * are freed as well, LeakSanitizer reports them otherwise
+ */
+static char *test_list_thread_exit(void) {
+    pthread_t t;
+    pthread_key_create(&list_exit_key, list_exit_free);
+    pthread_create(&t, NULL, list_exit_thread, "a");
+    pthread_join(t, NULL);
+    pthread_key_delete(list_exit_key);
+    return 0;
+}
+
+
+struct item {
+    int value;
+    struct ilist_node node;
+};
+
+
+/*
+ * Tests push, push_back and del of the intrusive list
+ */
+static char *test_ilist_push_del(void) {
+    IList l;
+    struct item a = { 1 }, b = { 2 }, c = { 3 };
+    ilist_init(&l);
+    ASSERT("[! ilist_init]: list not empty", ilist_empty(&l));
+    ilist_push_back(&l, &b.node);
+    ilist_push(&l, &a.node);
+    ilist_push_back(&l, &c.node);
+    ASSERT("[! ilist_push]: wrong length", l.len == 3);
+    ASSERT("[! ilist_push]: wrong head",
+           ilist_entry(l.head.next, struct item, node)->value == 1);
+    ASSERT("[! ilist_push_back]: wrong tail",
+           ilist_entry(l.head.prev, struct item, node)->value == 3);
+    ilist_del(&l, &b.node);
+    ASSERT("[! ilist_del]: node still linked", !ilist_linked(&b.node));
+    ASSERT("[! ilist_del]: wrong length", l.len == 2);
+    ASSERT("[! ilist_del]: neighbours not linked",
+           a.node.next == &c.node && c.node.prev == &a.node);
+    ASSERT("[! ilist_pop]: wrong node", ilist_pop(&l) == &a.node);
+    ASSERT("[! ilist_pop]: wrong node", ilist_pop(&l) == &c.node);
+    ASSERT("[! ilist_pop]: list not empty", ilist_empty(&l) && l.len == 0);
+    return 0;
+}
+
+
+/*
+ * Tests removal of the current element while iterating the intrusive list
+ */
+static char *test_ilist_foreach_safe(void) {
+    IList l;
+    struct item items[5];
+    struct ilist_node *pos, *tmp;
+    int sum = 0;
+    ilist_init(&l);
+    for (int i = 0; i < 5; ++i) {
+        items[i].value = i;
+        ilist_push_back(&l, &items[i].node);
+    }
+    ilist_foreach_safe(pos, tmp, &l) {
+        struct item *it = ilist_entry(pos, struct item, node);
+        if (it->value % 2 == 0)
+            ilist_del(&l, pos);
+    }
+    ilist_foreach_safe(pos, tmp, &l)
+        sum += ilist_entry(pos, struct item, node)->value;
+    ASSERT("[! ilist_foreach_safe]: wrong length", l.len == 2);
+    ASSERT("[! ilist_foreach_safe]: wrong items left", sum == 1 + 3);
+    return 0;
+}
+
+
+static void write_file(const char *path, const char *content) {
+    FILE *fp = fopen(path, "w");
+    fputs(content, fp);
+    fclose(fp);
+}
+
+
+/*
+ * Tests open files cache hits, misses and invalidation
+ */
+static char *test_filecache_get(void) {
+    const char *path = "/tmp/vessel_filecache_a";
+    write_file(path, "hello");
+    FileCache *cache = filecache_new(4, 0);
+    struct file_entry *a = filecache_get(cache, path);
+    struct file_entry *b = filecache_get(cache, path);
+    ASSERT("[! filecache_get]: file not opened", a != NULL);
+    ASSERT("[! filecache_get]: entry not shared", a == b);
+    ASSERT("[! filecache_get]: wrong size", a->st.st_size == 5);
+    ASSERT("[! filecache_get]: wrong counters",
+           cache->hits == 1 && cache->misses == 1);
+    ASSERT("[! filecache_get]: missing file opened",
+           filecache_get(cache, "/tmp/vessel_filecache_none") == NULL);
+    filecache_invalidate(cache, path);
+    /* Invalidated but still referenced, the descriptor is valid */
+    char buf[5];
+    ASSERT("[! filecache_invalidate]: fd closed",
+           pread(a->fd, buf, 5, 0) == 5 && memcmp(buf, "hello", 5) == 0);
+    filecache_put(cache, a);
+    filecache_put(cache, b);
+    b = filecache_get(cache, path);
+    ASSERT("[! filecache_invalidate]: entry not reopened",
+           b != NULL && cache->misses == 3);
+    filecache_put(cache, b);
+    filecache_free(cache);
+    unlink(path);
+    return 0;
+}
+
+
+/*
+ * Tests that changed files are reopened after the revalidation interval
+ */
+static char *test_filecache_revalidate(void) {
+    const char *path = "/tmp/vessel_filecache_b";
+    write_file(path, "hello");
+    FileCache *cache = filecache_new(4, 1);
+    struct file_entry *e = filecache_get(cache, path);
+    filecache_put(cache, e);
+    write_file(path, "hello world");
+    usleep(20000);
+    e = filecache_get(cache, path);
+    ASSERT("[! filecache_revalidate]: stale entry",
+           e != NULL && e->st.st_size == 11);
+    ASSERT("[! filecache_revalidate]: not invalidated",
+           cache->invalidations == 1);
+    filecache_put(cache, e);
+    filecache_free(cache);
+    unlink(path);
+    return 0;
+}
+
+
+/*
+ * Tests LRU eviction past the max number of entries
+ */
+static char *test_filecache_evict(void) {
+    const char *paths[] = {
+        "/tmp/vessel_filecache_c0",
+        "/tmp/vessel_filecache_c1",
+        "/tmp/vessel_filecache_c2"
+    };
+    FileCache *cache = filecache_new(2, 0);
+    for (int i = 0; i < 3; ++i) {
+        write_file(paths[i], "x");
+        filecache_put(cache, filecache_get(cache, paths[i]));
+    }
+    ASSERT("[! filecache_evict]: wrong entries", cache->lru.len == 2);
+    ASSERT("[! filecache_evict]: wrong evictions", cache->evictions == 1);
+    filecache_put(cache, filecache_get(cache, paths[2]));
+    ASSERT("[! filecache_evict]: recent entry evicted", cache->hits == 1);
+    filecache_put(cache, filecache_get(cache, paths[0]));
+    ASSERT("[! filecache_evict]: oldest entry kept", cache->misses == 4);
+    filecache_free(cache);
+    for (int i = 0; i < 3; ++i)
+        unlink(paths[i]);
+    return 0;
+}
+
+
+
+struct counter {
+    int n;
+    Coro *co;
+};
+
+
+static void counter_coro(void *arg) {
+    struct counter *c = arg;
+    char buf[1024];
+    for (int i = 0; i < 3; ++i) {
+        /* Touch the stack of the coroutine across the switches */
+        memset(buf, i, sizeof(buf));
+        c->n += buf[sizeof(buf) - 1] + 1;
+        coro_yield(c->co);
+    }
+}
+
+
+static char *test_coro_yield(void) {
+    struct counter c = { 0, NULL };
+    c.co = coro_new(counter_coro, &c, 0);
+    ASSERT("[! coro_yield]: started before resume", c.n == 0);
+    int done = coro_resume(c.co);
+    ASSERT("[! coro_yield]: wrong first step", c.n == 1 && done == 0);
+    coro_resume(c.co);
+    coro_resume(c.co);
+    ASSERT("[! coro_yield]: wrong steps", c.n == 6 && !coro_done(c.co));
+    done = coro_resume(c.co);
+    ASSERT("[! coro_yield]: not done", done == 1 && coro_done(c.co));
+    ASSERT("[! coro_yield]: resumed once done", coro_resume(c.co) == 1);
+    coro_free(c.co);
+    return 0;
+}
+
+
+static void *resume_coro(void *arg) {
+    coro_resume(arg);
+    return NULL;
+}
+
+
+static char *test_coro_threads(void) {
+    struct counter c = { 0, NULL };
+    pthread_t t;
+    c.co = coro_new(counter_coro, &c, 0);
+    /* Suspended by one thread, resumed by another */
+    coro_resume(c.co);
+    for (int i = 0; i < 3; ++i) {
+        pthread_create(&t, NULL, resume_coro, c.co);
+        pthread_join(t, NULL);
+    }
+    ASSERT("[! coro_threads]: wrong steps", c.n == 6 && coro_done(c.co));
+    coro_free(c.co);
+    return 0;
+}
+
+
+static const char http_request[] =
+    "POST /api/v1/items?id=42&name=some%20long%20value HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleGecko/20100101\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9\r\n"
+    "Content-Length: 11\r\n"
+    "X-Empty:\r\n"
+    "X-Trailing-Space: value   \r\n"
+    "\r\n"
+    "hello world";
+
+/*
+ * Tests the parsing of a request with every scan kernel supported
+ */
+static char *test_http_parse(void) {
+    HttpRequest r;
+    size_t head = sizeof(http_request) - 1 - 11;
+    for (int k = HTTP_KERNEL_SCALAR; k <= HTTP_KERNEL_AVX2; ++k) {
+        if (http_set_kernel(k) < 0)
+            continue;
+        ssize_t n = http_parse_request(http_request,
+                                       sizeof(http_request) - 1, 0, &r);
+        ASSERT("[! http_parse]: wrong head length", n == (ssize_t) head);
+        ASSERT("[! http_parse]: wrong method",
+               r.method.len == 4 && memcmp(r.method.p, "POST", 4) == 0);
+        ASSERT("[! http_parse]: wrong target", r.target.len == 44
+               && memcmp(r.target.p, "/api/v1/items?", 14) == 0);
+        ASSERT("[! http_parse]: wrong headers", r.nheaders == 6
+               && r.minor == 1 && r.keep_alive && r.content_length == 11);
+        const HttpStr *ua = http_find_header(&r, "user-agent");
+        ASSERT("[! http_parse]: wrong long value", ua && ua->len == 51
+               && memcmp(ua->p + 45, "100101", 6) == 0);
+        const HttpStr *ts = http_find_header(&r, "X-Trailing-Space");
+        ASSERT("[! http_parse]: trailing space not trimmed",
+               ts && ts->len == 5 && http_find_header(&r, "x-empty")->len == 0);
+    }
+    http_set_kernel(HTTP_KERNEL_AUTO);
+    return 0;
+}
+
+
+/*
+ * Tests requests arriving a byte at a time
+ */
+static char *test_http_incomplete(void) {
+    HttpRequest r;
+    size_t head = sizeof(http_request) - 1 - 11;
+    for (size_t len = 0; len < head; ++len) {
+        ASSERT("[! http_incomplete]: partial head parsed",
+               http_parse_request(http_request, len, 0, &r) == 0);
+        ASSERT("[! http_incomplete]: partial head parsed with hint",
+               http_parse_request(http_request, len + 1, len, &r)
+               == (len + 1 == head ? (ssize_t) head : 0));
+    }
+    return 0;
+}
+
+
+/*
+ * Tests requests refused by the parser
+ */
+static char *test_http_malformed(void) {
+    static const char *bad[] = {
+        "GET  / HTTP/1.1\r\n\r\n",
+        "GET / HTTP/2.0\r\n\r\n",
+        "G(T / HTTP/1.1\r\n\r\n",
+        "GET /\x01 HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\r\nBad Name: x\r\n\r\n",
+        "GET / HTTP/1.1\r\nName: a\x01z\r\n\r\n",
+        "GET / HTTP/1.1\r\n folded\r\n\r\n",
+        "GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+        "GET / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n",
+        "GET / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n",
+        "GET / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+        "Content-Length: 1\r\n\r\n",
+        "HTTP/1.1 200 OK\r\n\r\n"
+    };
+    HttpRequest r;
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+        ASSERT("[! http_malformed]: malformed request accepted",
+               http_parse_request(bad[i], strlen(bad[i]), 0, &r) == -1);
+    ASSERT("[! http_malformed]: HTTP/1.0 kept alive",
+           http_parse_request("GET / HTTP/1.0\r\n\r\n", 18, 0, &r) == 18
+           && !r.keep_alive);
+    return 0;
+}
+
+
+/*
+ * Tests the decoding of a chunked body fed a byte at a time
+ */
+static char *test_http_chunked(void) {
+    const char raw[] = "4\r\nWiki\r\n5;ext=x\r\npedia\r\nE\r\n in\r\n\r\nchunks."
+        "\r\n0\r\nTrailer: yes\r\n\r\nNEXT";
+    char buf[sizeof(raw)];
+    HttpChunked c = { 0 };
+    int rc = 0;
+    size_t len;
+    for (len = 1; len < sizeof(raw) && rc == 0; ++len) {
+        memcpy(buf + len - 1, raw + len - 1, 1);
+        rc = http_decode_chunked(&c, buf, len);
+    }
+    ASSERT("[! http_chunked]: not decoded", rc == 1);
+    ASSERT("[! http_chunked]: wrong body", c.out == 23
+           && memcmp(buf, "Wikipedia in\r\n\r\nchunks.", 23) == 0);
+    ASSERT("[! http_chunked]: wrong consumed length", c.in == sizeof(raw) - 5);
+    HttpChunked bad = { 0 };
+    char zz[] = "zz\r\n";
+    ASSERT("[! http_chunked]: bad size accepted",
+           http_decode_chunked(&bad, zz, 4) == -1);
+    return 0;
+}
+
+
+
+static char *test_ws_parse_frame(void) {
+    WsFrame f;
+    const uint8_t text[] = { 0x81, 0x85, 1, 2, 3, 4, 'h', 'e', 'l', 'l', 'o' };
+    ASSERT("[! ws_parse_frame]: wrong header length",
+           ws_parse_frame(text, sizeof(text), &f) == 6);
+    ASSERT("[! ws_parse_frame]: wrong frame", f.fin && f.opcode == WS_TEXT
+           && f.masked && f.len == 5 && f.key[3] == 4);
+    ASSERT("[! ws_parse_frame]: partial header parsed",
+           ws_parse_frame(text, 5, &f) == 0);
+    const uint8_t mid[] = { 0x02, 0xfe, 0x01, 0x00, 1, 2, 3, 4 };
+    ASSERT("[! ws_parse_frame]: wrong 16 bits length",
+           ws_parse_frame(mid, sizeof(mid), &f) == 8 && !f.fin && f.len == 256);
+    const uint8_t big[] = { 0x82, 0xff, 0, 0, 0, 0, 1, 0, 0, 0, 1, 2, 3, 4 };
+    ASSERT("[! ws_parse_frame]: wrong 64 bits length",
+           ws_parse_frame(big, sizeof(big), &f) == 14 && f.len == 1 << 24);
+    const uint8_t bad[][2] = {
+        { 0x81, 0x05 },     /* Unmasked */
+        { 0xc1, 0x85 },     /* Reserved bit */
+        { 0x83, 0x85 },     /* Reserved opcode */
+        { 0x09, 0x80 },     /* Fragmented ping */
+        { 0x88, 0xfe }      /* Long close */
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+        ASSERT("[! ws_parse_frame]: malformed frame accepted",
+               ws_parse_frame(bad[i], 2, &f) == -1);
+    return 0;
+}
+
+
+static char *test_ws_unmask(void) {
+    const uint8_t key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    uint8_t ref[203], buf[203];
+    for (size_t i = 0; i < sizeof(ref); ++i)
+        ref[i] = i * 7;
+    for (int k = WS_KERNEL_SCALAR; k <= WS_KERNEL_AVX2; ++k) {
+        if (ws_set_kernel(k) < 0)
+            continue;
+        for (size_t off = 0; off < 4; ++off) {
+            memcpy(buf, ref, sizeof(ref));
+            ws_unmask(buf + off, sizeof(buf) - off, key, off);
+            for (size_t i = off; i < sizeof(buf); ++i)
+                ASSERT("[! ws_unmask]: wrong byte",
+                       buf[i] == (ref[i] ^ key[i % 4]));
+        }
+    }
+    ws_set_kernel(WS_KERNEL_AUTO);
+    return 0;
+}
+
+
+static char *test_ws_utf8(void) {
+    const char *valid[] = {
+        "", "plain ascii", "caf\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+        "\xed\x9f\xbf", "\xf4\x8f\xbf\xbf", "\xef\xbb\xbf"
+    };
+    const char *invalid[] = {
+        "\x80", "\xc3", "\xc0\xaf", "\xe0\x80\xaf", "\xed\xa0\x80",
+        "\xf4\x90\x80\x80", "\xf8\x88\x80\x80\x80", "\xe2\x82", "\xff",
+        "\xf0\x80\x80\x80"
+    };
+    char buf[160];
+    for (int k = WS_KERNEL_SCALAR; k <= WS_KERNEL_AVX2; ++k) {
+        if (ws_set_kernel(k) < 0)
+            continue;
+        /* Every sample at every offset of a long ASCII run, so that it
+           lands astride the vector blocks and in the tails */
+        for (size_t off = 0; off < 70; ++off) {
+            for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); ++i) {
+                memset(buf, 'a', sizeof(buf));
+                memcpy(buf + off, valid[i], strlen(valid[i]));
+                ASSERT("[! ws_utf8]: valid text rejected",
+                       ws_utf8_valid((uint8_t *) buf, sizeof(buf)));
+            }
+            for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+                memset(buf, 'a', sizeof(buf));
+                memcpy(buf + off, invalid[i], strlen(invalid[i]));
+                ASSERT("[! ws_utf8]: invalid text accepted",
+                       !ws_utf8_valid((uint8_t *) buf, sizeof(buf)));
+                ASSERT("[! ws_utf8]: truncated text accepted",
+                       !ws_utf8_valid((uint8_t *) buf,
+                                      off + strlen(invalid[i])));
+            }
+        }
+    }
+    ws_set_kernel(WS_KERNEL_AUTO);
+    return 0;
+}
+
+
+
+static char *test_resp_parse(void) {
+    const char reply[] = "|1\r\n+ttl\r\n:3600\r\n*3\r\n$5\r\nhello\r\n$-1\r\n"
+        "%1\r\n+key\r\n~2\r\n#t\r\n,3.14\r\n>2\r\n_\r\n(12345678901234567890\r\n";
+    RespValue v[32];
+    size_t n, len = sizeof(reply) - 1;
+    ssize_t head = resp_parse(reply, len, v, 32, &n);
+    /* The attribute, its pair, then the array it decorates */
+    ASSERT("[! resp_parse]: wrong length", head == len - 30);
+    ASSERT("[! resp_parse]: wrong values", n == 11
+           && v[0].type == RESP_ATTRIBUTE && v[0].n == 1
+           && v[2].type == RESP_INTEGER && v[2].n == 3600
+           && v[3].type == RESP_ARRAY && v[3].n == 3
+           && v[4].str.len == 5 && memcmp(v[4].str.p, "hello", 5) == 0
+           && v[5].type == RESP_BULK && v[5].n == -1
+           && v[6].type == RESP_MAP && v[8].type == RESP_SET
+           && v[9].type == RESP_BOOLEAN && v[9].n == 1
+           && v[10].type == RESP_DOUBLE && v[10].str.len == 4);
+    ASSERT("[! resp_parse]: second message not parsed",
+           resp_parse(reply + head, len - head, v, 32, &n) == 30 && n == 3
+           && v[0].type == RESP_PUSH && v[1].type == RESP_NULL
+           && v[2].type == RESP_BIG_NUMBER);
+    for (size_t i = 0; i < (size_t) head; ++i)
+        ASSERT("[! resp_parse]: partial message parsed",
+               resp_parse(reply, i, v, 32, &n) == 0);
+    ASSERT("[! resp_parse]: too many values accepted",
+           resp_parse(reply, len, v, 4, &n) == -1);
+    const char *bad[] = {
+        "?1\r\n", ":12a\r\n", "$3\r\nabcd\r\n", "*-2\r\n", "#x\r\n",
+        "_x\r\n", "+ok\rx", "%-1\r\n", ":99999999999999999999\r\n"
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+        ASSERT("[! resp_parse]: malformed message accepted",
+               resp_parse(bad[i], strlen(bad[i]), v, 32, &n) == -1);
+    return 0;
+}
+
+
+static char *test_resp_command(void) {
+    const char cmds[] = "*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$5\r\nva\r\nl\r\n"
+        "GET  k\r\n\r\n*0\r\nPING\n";
+    RespStr argv[8];
+    size_t argc, off = 0, len = sizeof(cmds) - 1;
+    ssize_t n = resp_parse_command(cmds, len, argv, 8, &argc);
+    ASSERT("[! resp_command]: wrong multibulk command", n == 31 && argc == 3
+           && argv[2].len == 5 && memcmp(argv[2].p, "va\r\nl", 5) == 0);
+    for (size_t i = 0; i < (size_t) n; ++i)
+        ASSERT("[! resp_command]: partial command parsed",
+               resp_parse_command(cmds, i, argv, 8, &argc) == 0);
+    off += n;
+    n = resp_parse_command(cmds + off, len - off, argv, 8, &argc);
+    ASSERT("[! resp_command]: wrong inline command", n == 8 && argc == 2
+           && argv[1].len == 1 && argv[1].p[0] == 'k');
+    off += n;
+    n = resp_parse_command(cmds + off, len - off, argv, 8, &argc);
+    ASSERT("[! resp_command]: empty line not skipped", n == 2 && argc == 0);
+    off += n;
+    n = resp_parse_command(cmds + off, len - off, argv, 8, &argc);
+    ASSERT("[! resp_command]: empty array not skipped", n == 4 && argc == 0);
+    off += n;
+    n = resp_parse_command(cmds + off, len - off, argv, 8, &argc);
+    ASSERT("[! resp_command]: bare LF not accepted", n == 5 && argc == 1);
+    ASSERT("[! resp_command]: too many arguments accepted",
+           resp_parse_command("a b c\r\n", 7, argv, 2, &argc) == -1);
+    ASSERT("[! resp_command]: non bulk argument accepted",
+           resp_parse_command("*1\r\n:1\r\n", 8, argv, 8, &argc) == -1);
+    return 0;
+}
+
+
+static char *test_resp_encode(void) {
+    const char resp2[] = "+OK\r\n-ERR no\r\n:-42\r\n$3\r\nabc\r\n$-1\r\n"
+        "*4\r\n$1\r\nk\r\n:1\r\n*1\r\n$3\r\n1.5\r\n";
+    const char resp3[] = "+OK\r\n-ERR no\r\n:-42\r\n$3\r\nabc\r\n_\r\n"
+        "%2\r\n$1\r\nk\r\n#t\r\n~1\r\n,1.5\r\n";
+    for (int proto = 2; proto <= 3; ++proto) {
+        RespOut o;
+        resp_out_init(&o, proto);
+        resp_add_simple(&o, "OK");
+        resp_add_error(&o, "ERR no");
+        resp_add_integer(&o, -42);
+        resp_add_bulk(&o, "abc", 3);
+        resp_add_null(&o);
+        resp_add_map(&o, 2);
+        resp_add_bulk(&o, "k", 1);
+        resp_add_boolean(&o, 1);
+        resp_add_set(&o, 1);
+        resp_add_double(&o, 1.5);
+        const char *want = proto == 2 ? resp2 : resp3;
+        size_t wlen = strlen(want);
+        ASSERT("[! resp_encode]: wrong encoding", resp_out_len(&o) == wlen
+               && memcmp(resp_out_data(&o), want, wlen) == 0);
+        Sbuf *b = resp_out_sbuf(&o);
+        ASSERT("[! resp_encode]: wrong shared buffer", b->refs == 1
+               && b->len == wlen && resp_out_len(&o) == 0);
+        /* Past the initial size of the buffer */
+        for (int i = 0; i < 1000; ++i)
+            resp_add_bulk(&o, "0123456789", 10);
+        ASSERT("[! resp_encode]: buffer not grown",
+               resp_out_len(&o) == 1000 * 17);
+        sbuf_put(b);
+        resp_out_free(&o);
+    }
+    return 0;
+}
+
+
+
+static char *test_hashmap_put_get(void) {
+    HashMap *m = hashmap_new(4, hashmap_hash_str, hashmap_eq_str);
+    char k1[] = "alpha", k2[] = "alpha";
+    void *k, *v;
+    ASSERT("[! hashmap_put_get]: new key replaced",
+           hashmap_put(m, k1, "one", NULL, NULL) == 0);
+    ASSERT("[! hashmap_put_get]: missing key found",
+           hashmap_get(m, "beta", &v) == 0);
+    ASSERT("[! hashmap_put_get]: key not found",
+           hashmap_get(m, "alpha", &v) == 1 && strcmp(v, "one") == 0);
+    ASSERT("[! hashmap_put_get]: key not replaced",
+           hashmap_put(m, k2, "two", &k, &v) == 1 && k == k1
+           && strcmp(v, "one") == 0 && hashmap_size(m) == 1);
+    ASSERT("[! hashmap_put_get]: key not deleted",
+           hashmap_del(m, "alpha", &k, &v) == 1 && k == k2
+           && strcmp(v, "two") == 0 && hashmap_size(m) == 0
+           && hashmap_get(m, "alpha", &v) == 0);
+    hashmap_free(m, NULL);
+    return 0;
+}
+
+/*
+ * Grows through several incremental migrations, deleting as it goes, so
+ * lookups and deletions hit both tables of the shards
+ */
+static char *test_hashmap_grow(void) {
+    HashMap *m = hashmap_new(2, hashmap_hash_int, hashmap_eq_int);
+    const uintptr_t n = 100000;
+    void *v;
+    for (uintptr_t i = 1; i <= n; ++i) {
+        hashmap_put(m, (void *) i, (void *) (i * 2), NULL, NULL);
+        if (i % 3 == 0)
+            hashmap_del(m, (void *) (i / 3), NULL, NULL);
+        if (i % 1000 == 0)
+            for (uintptr_t j = i - 999; j <= i; ++j)
+                ASSERT("[! hashmap_grow]: recent key lost", j <= i / 3
+                       || (hashmap_get(m, (void *) j, &v)
+                           && v == (void *) (j * 2)));
+    }
+    ASSERT("[! hashmap_grow]: wrong size", hashmap_size(m) == n - n / 3);
+    for (uintptr_t i = 1; i <= n; ++i) {
+        int found = hashmap_get(m, (void *) i, &v);
+        ASSERT("[! hashmap_grow]: wrong entry", i <= n / 3 ? !found
+               : found && v == (void *) (i * 2));
+    }
+    hashmap_free(m, NULL);
+    return 0;
+}
+
+
+static int incr(void **key, void **val, int found, void *arg) {
+    *val = (void *) ((uintptr_t) *val + 1);
+    return 1;
+}
+
+
+struct hashmap_writer {
+    HashMap *m;
+    uintptr_t base;
+};
+
+
+static void *hashmap_writer(void *arg) {
+    struct hashmap_writer *w = arg;
+    for (uintptr_t i = 1; i <= 20000; ++i) {
+        hashmap_put(w->m, (void *) (w->base + i), (void *) i, NULL, NULL);
+        hashmap_update(w->m, (void *) 1, incr, NULL);
+    }
+    return NULL;
+}
+
+
+static char *test_hashmap_threads(void) {
+    HashMap *m = hashmap_new(0, hashmap_hash_int, hashmap_eq_int);
+    struct hashmap_writer w[4];
+    pthread_t t[4];
+    void *v;
+    for (int i = 0; i < 4; ++i) {
+        w[i] = (struct hashmap_writer) { m, (uintptr_t) (i + 1) << 32 };
+        pthread_create(&t[i], NULL, hashmap_writer, &w[i]);
+    }
+    for (int i = 0; i < 4; ++i)
+        pthread_join(t[i], NULL);
+    ASSERT("[! hashmap_threads]: wrong size", hashmap_size(m) == 80001);
+    ASSERT("[! hashmap_threads]: lost update",
+           hashmap_get(m, (void *) 1, &v) && v == (void *) 80000);
+    for (int i = 0; i < 4; ++i)
+        for (uintptr_t j = 1; j <= 20000; ++j)
+            ASSERT("[! hashmap_threads]: entry lost",
+                   hashmap_get(m, (void *) (w[i].base + j), &v)
+                   && v == (void *) j);
+    hashmap_free(m, NULL);
+    return 0;
+}
+
+
+/* Record in a thread of its own, so that its ring gets the size asked */
+static void *trace_writer(void *arg) {
+    trace_start(64);
+    for (int i = 0; i < 100; ++i)
+        TRACE(TRACE_ACCEPT, i, 0);
+    trace_stop();
+    TRACE(TRACE_ACCEPT, 1000, 0);
+    return NULL;
+}
+
+
+static char *test_trace_dump(void) {
+    const char *path = "/tmp/vessel-trace-test.json";
+    char buf[16384];
+    pthread_t t;
+    pthread_create(&t, NULL, trace_writer, NULL);
+    pthread_join(t, NULL);
+    ASSERT("[! trace_dump]: dump failed", trace_dump(path) == 0);
+    FILE *fp = fopen(path, "r");
+    ASSERT("[! trace_dump]: no dump", fp != NULL);
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[n] = '\0';
+    fclose(fp);
+    unlink(path);
+    ASSERT("[! trace_dump]: not a trace",
+           strncmp(buf, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 38) == 0
+           && strcmp(buf + n - 4, "\n]}\n") == 0);
+    ASSERT("[! trace_dump]: newest events missing",
+           strstr(buf, "\"args\":{\"fd\":99}}")
+           && strstr(buf, "\"args\":{\"fd\":40}}"));
+    ASSERT("[! trace_dump]: oldest events not overwritten",
+           !strstr(buf, "\"args\":{\"fd\":35}}"));
+    ASSERT("[! trace_dump]: event recorded while stopped",
+           !strstr(buf, "\"args\":{\"fd\":1000}}"));
+    return 0;
+}
+
+
+static char *test_log_rate(void) {
+    const char *path = "/tmp/vessel-log-test.log";
+    char buf[4096];
+    unlink(path);
+    ASSERT("[! log_rate]: start failed",
+           log_start(path, LOG_LEVEL_WARNING, 5) == 0);
+    for (int i = 0; i < 10; ++i)
+        log_record(LOG_LEVEL_ERROR, "test site", i, EPIPE);
+    log_record(LOG_LEVEL_INFO, "filtered out", -1, 0);
+    log_stop();
+    FILE *fp = fopen(path, "r");
+    ASSERT("[! log_rate]: no log", fp != NULL);
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[n] = '\0';
+    fclose(fp);
+    unlink(path);
+    int lines = 0;
+    for (char *p = buf; (p = strstr(p, " ERROR test site: fd ")); ++p)
+        lines++;
+    ASSERT("[! log_rate]: wrong records", lines == 5
+           && strstr(buf, "ERROR test site: fd 4: Broken pipe\n")
+           && !strstr(buf, "fd 5:"));
+    ASSERT("[! log_rate]: suppressed not reported",
+           strstr(buf, "\n5 records of thread "));
+    ASSERT("[! log_rate]: level not filtered", !strstr(buf, "filtered out"));
+    return 0;
+}
+
+
+static char *test_log_default_level(void) {
+    const char *path = "/tmp/vessel-log-default.log";
+    char buf[512];
+    unlink(path);
+    ASSERT("[! log_default_level]: start failed",
+           log_start(path, LOG_LEVEL_INFO, -1) == 0);
+    log_record(0, "default level", -1, 0);
+    log_stop();
+    FILE *fp = fopen(path, "r");
+    ASSERT("[! log_default_level]: no log", fp != NULL);
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[n] = '\0';
+    fclose(fp);
+    unlink(path);
+    ASSERT("[! log_default_level]: not logged at INFO",
+           strstr(buf, " INFO default level\n") != NULL);
+    return 0;
+}
+
+
+static int log_go = 0;
+
+
+static void *log_racer(void *arg) {
+    while (!__atomic_load_n(&log_go, __ATOMIC_ACQUIRE))
+        sched_yield();
+    for (int i = 0; i < 4; ++i)
+        log_record(LOG_LEVEL_ERROR, "racing site", i, 0);
+    return NULL;
+}
+
+
+/* Stop after a delay growing with the rounds, for the racers to be caught
+   at different points of their first record */
+static void *log_stopper(void *arg) {
+    __atomic_store_n(&log_go, 1, __ATOMIC_RELEASE);
+    usleep(*(int *) arg * 100);
+    log_stop();
+    return NULL;
+}
+
+
+static char *test_log_stop_race(void) {
+    const char *path = "/tmp/vessel-log-race.log";
+    int started = 1, stopped = 1;
+    /* Records logged once stopped go to stderr */
+    int err = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    for (int round = 0; round < 50 && started && stopped; ++round) {
+        pthread_t t[4], stopper;
+        struct timespec ts;
+        log_go = 0;
+        started = log_start(path, LOG_LEVEL_ERROR, -1) == 0;
+        if (!started)
+            break;
+        /* Fresh threads take their ring on their first record */
+        for (int i = 0; i < 4; ++i)
+            pthread_create(&t[i], NULL, log_racer, NULL);
+        pthread_create(&stopper, NULL, log_stopper, &round);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 5;
+        stopped = pthread_timedjoin_np(stopper, NULL, &ts) == 0;
+        for (int i = 0; stopped && i < 4; ++i)
+            stopped = pthread_timedjoin_np(t[i], NULL, &ts) == 0;
+    }
+    dup2(err, STDERR_FILENO);
+    close(err);
+    close(null);
+    unlink(path);
+    ASSERT("[! log_stop_race]: start failed", started);
+    ASSERT("[! log_stop_race]: log_stop deadlocked with log_record", stopped);
+    return 0;
+}
+
+
+static char *test_sendfile_truncated(void) {
+    const char *path = "/tmp/vessel-truncated.bin";
+    char data[100], out[200];
+    int sv[2];
+    FILE *fp = fopen(path, "w");
+    memset(data, 'a', sizeof(data));
+    fwrite(data, 1, sizeof(data), fp);
+    fclose(fp);
+    int fd = open(path, O_RDONLY);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    off_t offset = 0;
+    size_t len = sizeof(out);
+    int rc = sendfile_all(sv[0], fd, &offset, &len);
+    ssize_t n = recv(sv[1], out, sizeof(out), 0);
+    close(sv[0]);
+    close(sv[1]);
+    close(fd);
+    unlink(path);
+    ASSERT("[! sendfile_truncated]: short region reported as sent", rc == -1);
+    ASSERT("[! sendfile_truncated]: wrong bytes sent",
+           n == sizeof(data) && offset == sizeof(data));
+    return 0;
+}
+
+
+static char *test_bufpool(void) {
+    size_t cap, cap2;
+    void *a = bufpool_get(100, &cap);
+    ASSERT("[! bufpool]: smallest class", a && cap == BUFPOOL_MIN);
+    size_t before = bufpool_bytes();
+    bufpool_put(a, cap);
+    ASSERT("[! bufpool]: not pooled", bufpool_bytes() == before + cap);
+    void *b = bufpool_get(BUFPOOL_MIN, &cap2);
+    ASSERT("[! bufpool]: not reused", b == a && cap2 == BUFPOOL_MIN
+           && bufpool_bytes() == before);
+    bufpool_put(b, cap2);
+    void *c = bufpool_get(BUFPOOL_MIN + 1, &cap);
+    ASSERT("[! bufpool]: wrong class", cap == 2 * BUFPOOL_MIN);
+    memset(c, 0, cap);
+    bufpool_put(c, cap);
+    void *d = bufpool_get(BUFPOOL_MAX + 1, &cap);
+    ASSERT("[! bufpool]: oversize", cap == BUFPOOL_MAX + 1);
+    before = bufpool_bytes();
+    bufpool_put(d, cap);
+    ASSERT("[! bufpool]: oversize pooled", bufpool_bytes() == before);
+    return 0;
+}
+
+
+static void mem_echo(Client *c) {
+    char buf[64];
+    ssize_t n;
+    while (vessel_wait_readable(c) > 0
+           && (n = vessel_read(c, buf, sizeof(buf))) > 0) {
+        struct iovec iov[2] = {
+            { .iov_base = "> ", .iov_len = 2 },
+            { .iov_base = buf, .iov_len = n }
+        };
+        if (vessel_writev(c, iov, 2) < 0)
+            break;
+    }
+}
+
+
+static int mem_http_handler(Client *c, const HttpRequest *req,
+                            HttpResponse *res) {
+    res->body = req->body.p;
+    res->body_len = req->body.len;
+    return 0;
+}
+
+
+static char *test_mem_transport(void) {
+    size_t len;
+    Client *c = mem_client_new(mem_echo);
+    ASSERT("[! mem_transport]: finished early", mem_client_run(c) == 0);
+    mem_client_feed(c, "hello", 5);
+    ASSERT("[! mem_transport]: not waiting", mem_client_run(c) == 0);
+    const uint8_t *out = mem_client_output(c, &len);
+    ASSERT("[! mem_transport]: wrong echo",
+           len == 7 && memcmp(out, "> hello", 7) == 0);
+    mem_client_output(c, &len);
+    ASSERT("[! mem_transport]: output not taken", len == 0);
+    mem_client_shutdown(c);
+    ASSERT("[! mem_transport]: not finished", mem_client_run(c) == 1);
+    mem_client_free(c);
+    /* Pipelined requests through http_serve, the large body goes out with
+       a vectored write */
+    char body[HTTP_INLINE_BODY + 4096], head[128];
+    memset(body, 'x', sizeof(body));
+    int hlen = snprintf(head, sizeof(head),
+                        "POST / HTTP/1.1\r\nContent-Length: %zu\r\n\r\n",
+                        sizeof(body));
+    instance.http_handler = mem_http_handler;
+    instance.http_max_body = HTTP_MAX_BODY;
+    c = mem_client_new(http_serve);
+    mem_client_feed(c, "GET / HTTP/1.1\r\n\r\n", 18);
+    mem_client_feed(c, head, hlen);
+    mem_client_feed(c, body, 100);
+    mem_client_run(c);
+    out = mem_client_output(c, &len);
+    ASSERT("[! mem_transport]: first response",
+           len > 12 && memcmp(out, "HTTP/1.1 200", 12) == 0);
+    mem_client_feed(c, body + 100, sizeof(body) - 100);
+    mem_client_run(c);
+    out = mem_client_output(c, &len);
+    ASSERT("[! mem_transport]: second response",
+           len > sizeof(body) && memcmp(out, "HTTP/1.1 200", 12) == 0
+           && memcmp(out + len - sizeof(body), body, sizeof(body)) == 0);
+    mem_client_free(c);
+    instance.http_handler = NULL;
+    return 0;
+}
+
+
 /*
  * All datastructure tests
  */
@@ -249,12 +1416,63 @@ static char *ringbuf_tests() {
     RUN_TEST(test_ringbuf_pop);
     RUN_TEST(test_ringbuf_bulk_push);
     RUN_TEST(test_ringbuf_bulk_pop);
+    RUN_TEST(test_ringbuf_bulk_wrap);
+    RUN_TEST(test_ringbuf_find);
+    RUN_TEST(test_ringbuf_find_kernels);
+    RUN_TEST(test_typed_ringbuf_push_pop);
+    RUN_TEST(test_typed_ringbuf_bulk);
+    RUN_TEST(test_sbuf_refs);
     RUN_TEST(test_list_init);
     RUN_TEST(test_list_free);
     RUN_TEST(test_list_push);
     RUN_TEST(test_list_push_back);
+    RUN_TEST(test_list_remove);
+    RUN_TEST(test_list_remove_node);
+    RUN_TEST(test_list_thread_exit);
+    RUN_TEST(test_ilist_push_del);
+    RUN_TEST(test_hashmap_put_get);
+    RUN_TEST(test_hashmap_grow);
+    RUN_TEST(test_hashmap_threads);
+    RUN_TEST(test_ilist_foreach_safe);
+    RUN_TEST(test_filecache_get);
+    RUN_TEST(test_filecache_revalidate);
+    RUN_TEST(test_filecache_evict);
+    RUN_TEST(test_coro_yield);
+    RUN_TEST(test_coro_threads);
+    RUN_TEST(test_http_parse);
+    RUN_TEST(test_http_incomplete);
+    RUN_TEST(test_http_malformed);
+    RUN_TEST(test_http_chunked);
+    RUN_TEST(test_ws_parse_frame);
+    RUN_TEST(test_ws_unmask);
+    RUN_TEST(test_ws_utf8);
+    RUN_TEST(test_resp_parse);
+    RUN_TEST(test_resp_command);
+    RUN_TEST(test_resp_encode);
+    RUN_TEST(test_trace_dump);
+    RUN_TEST(test_log_rate);
+    RUN_TEST(test_log_default_level);
+    RUN_TEST(test_log_stop_race);
+    RUN_TEST(test_bufpool);
+    RUN_TEST(test_sendfile_truncated);
+    RUN_TEST(test_mem_transport);
     RUN_TEST(vessel_plain_test);
     RUN_TEST(vessel_ssl_test);
+    RUN_TEST(vessel_sendfile_test);
+    RUN_TEST(vessel_zerocopy_test);
+    RUN_TEST(vessel_udp_test);
+    RUN_TEST(vessel_unix_test);
+    RUN_TEST(vessel_sockopts_test);
+    RUN_TEST(vessel_busy_poll_test);
+    RUN_TEST(vessel_coro_test);
+    RUN_TEST(vessel_proxy_test);
+    RUN_TEST(vessel_proxy_pipeline_test);
+    RUN_TEST(vessel_broadcast_test);
+    RUN_TEST(vessel_pubsub_test);
+    RUN_TEST(vessel_http_test);
+    RUN_TEST(vessel_http_idle_test);
+    RUN_TEST(vessel_ws_test);
+    RUN_TEST(vessel_ws_idle_test);
     return 0;
 }
 
@@ -25,17 +25,21 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <time.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <resolv.h>
 #include <netdb.h>
 #include <malloc.h>
+#include <stddef.h>
 #include <sys/socket.h>
 #include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -45,15 +49,53 @@
 #include "vessel_test.h"
 #include "../src/networking.h"
 #include "../src/vessel.h"
+#include "../src/pubsub.h"
 
 
-#define ONEMB 1024 * 1024
+#define ONEMB (1024 * 1024)
+
+#define BLOB_PATH   "/tmp/vessel_test_blob"
+#define BLOB_SIZE   (4 * ONEMB)
+
+#define ZC_REPLY_SIZE   (2 * ONEMB)
+
+#define UDP_DGRAMS      32
+#define UDP_DGRAM_SIZE  100
+
+#define UNIX_PATH       "/tmp/vessel_test.sock"
+#define UNIX_ABSTRACT   "@vessel_test"
+
+#define CORO_LARGE      (4 * ONEMB)
+
+#define PROXY_CHUNK     65536
+#define PROXY_LARGE     (2 * ONEMB)
+#define PROXY_MSG       5
+
+#define BCAST_CLIENTS   8
+#define BCAST_SIZE      ONEMB
+
+#define SLOW_MSGS       64
+#define SLOW_MSG_SIZE   (256 * 1024)
+
+#define HTTP_LARGE      65536
 
 
 static int reply_handler(Client *);
 static int request_handler(Client *);
 static int reply_ssl_handler(Client *);
 static int request_ssl_handler(Client *);
+static int reply_file_handler(Client *);
+static int request_file_handler(Client *);
+static int reply_buffer_handler(Client *);
+static int request_buffer_handler(Client *);
+static int dgram_handler(Datagram *);
+static void echo_coro_handler(Client *);
+static int request_sub_handler(Client *);
+static int reply_ack_handler(Client *);
+static int echo_answered(uint64_t, uint64_t);
+static int http_echo_handler(Client *, const HttpRequest *, HttpResponse *);
+static int ws_echo_handler(Client *, const WsMessage *);
+static void ws_closed(Client *);
 
 
 static Config plain_conf = {
@@ -82,6 +124,199 @@ static Config ssl_conf = {
 };
 
 
+static Config file_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 4,
+    .addr = "127.0.0.1",
+    .port = "4041",
+    .use_ssl = 0,
+    .acc_handler = NULL,
+    .req_handler = request_file_handler,
+    .rep_handler = reply_file_handler
+};
+
+
+static Config zerocopy_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 4,
+    .addr = "127.0.0.1",
+    .port = "4042",
+    .use_ssl = 0,
+    .acc_handler = NULL,
+    .req_handler = request_buffer_handler,
+    .rep_handler = reply_buffer_handler,
+    .zerocopy_threshold = 4096
+};
+
+
+static Listener udp_listeners[] = {
+    { .type = LISTEN_UDP, .addr = "127.0.0.1", .port = "4044", .gso = 1 }
+};
+
+
+static Config udp_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 4,
+    .addr = "127.0.0.1",
+    .port = "4043",
+    .use_ssl = 0,
+    .acc_handler = NULL,
+    .req_handler = request_handler,
+    .rep_handler = reply_handler,
+    .listeners = udp_listeners,
+    .nlisteners = 1,
+    .dgram_handler = dgram_handler,
+    .dgram_size = 512
+};
+
+
+static Listener unix_listeners[] = {
+    { .type = LISTEN_UNIX, .addr = UNIX_PATH },
+    { .type = LISTEN_UNIX, .addr = UNIX_ABSTRACT }
+};
+
+
+static Config unix_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 4,
+    .addr = "127.0.0.1",
+    .port = "4045",
+    .use_ssl = 0,
+    .acc_handler = NULL,
+    .req_handler = request_handler,
+    .rep_handler = reply_handler,
+    .listeners = unix_listeners,
+    .nlisteners = 2
+};
+
+
+static const struct sockopts unix_sockopts = { .sndbuf = 100000 };
+
+
+static Listener sockopts_listeners[] = {
+    { .type = LISTEN_UNIX, .addr = "@vessel_sockopts",
+      .sockopts = &unix_sockopts }
+};
+
+
+static Config sockopts_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 4,
+    .addr = "127.0.0.1",
+    .port = "4046",
+    .use_ssl = 0,
+    .acc_handler = NULL,
+    .req_handler = request_handler,
+    .rep_handler = reply_handler,
+    .listeners = sockopts_listeners,
+    .nlisteners = 1,
+    .sockopts = {
+        .nodelay = 1,
+        .defer_accept = 1,
+        .fastopen = 16,
+        .notsent_lowat = 16384,
+        .rcvbuf = 65536
+    }
+};
+
+
+static Config busy_poll_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 2,
+    .addr = "127.0.0.1",
+    .port = "4047",
+    .use_ssl = 0,
+    .acc_handler = NULL,
+    .req_handler = request_handler,
+    .rep_handler = reply_handler,
+    .busy_poll_us = 200
+};
+
+
+static Config coro_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 2,
+    .addr = "127.0.0.1",
+    .port = "4048",
+    .use_ssl = 0,
+    .co_handler = echo_coro_handler
+};
+
+static Config proxy_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 1,
+    .addr = "127.0.0.1",
+    .port = "4049",
+    .use_ssl = 0,
+    .proxy_addr = "127.0.0.1",
+    .proxy_port = "4050",
+    .proxy_pool_size = 4,
+    .proxy_reuse = echo_answered
+};
+
+static Config proxy_pipeline_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 1,
+    .addr = "127.0.0.1",
+    .port = "4055",
+    .use_ssl = 0,
+    .proxy_addr = "127.0.0.1",
+    .proxy_port = "4056",
+    .proxy_pool_size = 4,
+    .proxy_reuse = echo_answered
+};
+
+static Config broadcast_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 2,
+    .addr = "127.0.0.1",
+    .port = "4051",
+    .use_ssl = 0,
+    .acc_handler = NULL,
+    .req_handler = request_handler,
+    .rep_handler = reply_handler,
+    .zerocopy_threshold = 4096
+};
+
+static Config pubsub_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 2,
+    .addr = "127.0.0.1",
+    .port = "4052",
+    .use_ssl = 0,
+    .acc_handler = NULL,
+    .req_handler = request_sub_handler,
+    .rep_handler = reply_ack_handler,
+    .outq_size = 4
+};
+
+static Config http_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 2,
+    .addr = "127.0.0.1",
+    .port = "4053",
+    .use_ssl = 0,
+    .http_handler = http_echo_handler
+};
+
+static Config ws_conf = {
+    .epoll_events = 64,
+    .epoll_workers = 2,
+    .addr = "127.0.0.1",
+    .port = "4054",
+    .use_ssl = 0,
+    .ws_handler = ws_echo_handler,
+    .ws_close = ws_closed,
+    .ws_ping_ms = 100
+};
+
+/* Set by the coroutine handler once it sees the connection closed */
+static volatile int coro_finished = 0;
+
+/* WebSocket connections gone */
+static volatile int ws_closes = 0;
+
+
 static int make_connection(const char *hostname, int port) {   int sd;
 
     struct hostent *host;
@@ -239,6 +474,148 @@ static int request_handler(Client *client) {
 }
 
 
+static int reply_file_handler(Client *client) {
+    return send_file_reply(client);
+}
+
+/* Any request is answered with the whole blob file */
+static int request_file_handler(Client *client) {
+
+    uint8_t buffer[BUFSIZE];
+    Ringbuf *rbuf = ringbuf_init(buffer, BUFSIZE);
+
+    if (recvall(client->fd, rbuf, -1) < 0) {
+        ringbuf_free(rbuf);
+        return -1;
+    }
+
+    ringbuf_free(rbuf);
+
+    return reply_file(client, BLOB_PATH, 0, 0);
+}
+
+
+static int reply_buffer_handler(Client *client) {
+    return send_buffer_reply(client);
+}
+
+/* Any request is answered with ZC_REPLY_SIZE bytes of a known pattern */
+static int request_buffer_handler(Client *client) {
+
+    uint8_t buffer[BUFSIZE];
+    Ringbuf *rbuf = ringbuf_init(buffer, BUFSIZE);
+
+    if (recvall(client->fd, rbuf, -1) < 0) {
+        ringbuf_free(rbuf);
+        return -1;
+    }
+
+    ringbuf_free(rbuf);
+
+    uint8_t *data = malloc(ZC_REPLY_SIZE);
+    for (size_t i = 0; i < ZC_REPLY_SIZE; ++i)
+        data[i] = i % 253;
+
+    reply_buffer(client, data, ZC_REPLY_SIZE);
+
+    return 0;
+}
+
+
+/* Pub/sub commands, one per line, "<op><topic>" where op is u to
+   unsubscribe or the policy of a subscription: d(rop), c(oalesce) or
+   x (disconnect) */
+static int request_sub_handler(Client *client) {
+
+    char buf[256], *save;
+    ssize_t n = recv(client->fd, buf, sizeof(buf) - 1, 0);
+
+    if (n <= 0)
+        return -1;
+
+    buf[n] = '\0';
+
+    for (char *l = strtok_r(buf, "\n", &save); l;
+            l = strtok_r(NULL, "\n", &save)) {
+        if (l[0] == 'u')
+            pubsub_unsubscribe(instance.pubsub, client, l + 1);
+        else
+            pubsub_subscribe(instance.pubsub, client, l + 1,
+                             l[0] == 'c' ? OUTQ_COALESCE :
+                             l[0] == 'x' ? OUTQ_DISCONNECT : OUTQ_DROP);
+    }
+
+    return 0;
+}
+
+/* Commands are acknowledged before anything is published */
+static int reply_ack_handler(Client *client) {
+    send(client->fd, "+", 1, MSG_NOSIGNAL);
+    return HANDLER_OK;
+}
+
+
+/* Reply with the body of the request, or its target if there's none */
+static int http_echo_handler(Client *client, const HttpRequest *req,
+                             HttpResponse *res) {
+
+    const HttpStr *body = req->body.len ? &req->body : &req->target;
+
+    res->body = body->p;
+    res->body_len = body->len;
+
+    return http_add_header(res, "Content-Type", "text/plain");
+}
+
+
+/* Echo text messages from a copy, binary ones by reference */
+static int ws_echo_handler(Client *client, const WsMessage *msg) {
+
+    if (msg->opcode == WS_TEXT)
+        return ws_send(client, WS_TEXT, msg->data, msg->len);
+
+    Sbuf *b = sbuf_from(msg->data, msg->len);
+    int rc = ws_send_sbuf(client, WS_BINARY, b);
+
+    sbuf_put(b);
+
+    return rc;
+}
+
+
+static void ws_closed(Client *client) {
+    __atomic_add_fetch(&ws_closes, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* Echo every datagram back */
+static int dgram_handler(Datagram *d) {
+    memcpy(d->reply, d->data, d->len);
+    d->reply_len = d->len;
+    return 0;
+}
+
+
+/* Echo messages framed by a 4 bytes length, whatever the way they arrive */
+static void echo_coro_handler(Client *client) {
+
+    uint32_t len;
+
+    while (vessel_read_full(client, &len, sizeof(len)) > 0) {
+        len = ntohl(len);
+        uint8_t *buf = malloc(len);
+        if (vessel_read_full(client, buf, len) <= 0
+                || vessel_write(client, buf, len) < 0) {
+            free(buf);
+            break;
+        }
+        free(buf);
+    }
+
+    coro_finished = 1;
+}
+
+
 static void *start_ssl_server(void *x) {
     start_server(&ssl_conf);
     return NULL;
@@ -251,86 +628,1256 @@ static void *start_plain_server(void *x) {
 }
 
 
-static char *start_ssl_client(const char *hostname, const char *portnum) {
+static void *start_file_server(void *x) {
+    start_server(&file_conf);
+    return NULL;
+}
 
-    SSL_CTX *ctx;
-    int server;
-    SSL *ssl;
-    char buf[6];
-    char *sendstring = "HELLO";
-    int bytes;
 
-    ctx = init_CTX();
-    server = make_connection(hostname, atoi(portnum));
-    ssl = SSL_new(ctx);
-    SSL_set_fd(ssl, server);
+static void *start_zerocopy_server(void *x) {
+    start_server(&zerocopy_conf);
+    return NULL;
+}
 
-    if (SSL_connect(ssl) == -1) ERR_print_errors_fp(stderr);
-    else {
 
-        SSL_write(ssl, sendstring, strlen(sendstring));
-        bytes = SSL_read(ssl, buf, sizeof(buf));
-        buf[bytes] = 0;
+static void *start_udp_server(void *x) {
+    start_server(&udp_conf);
+    return NULL;
+}
 
-        ASSERT("[! SSL client]: SSL client wrong result", strcmp(buf, sendstring) == 0);
 
-        SSL_free(ssl);        /* release connection state */
-    }
+static void *start_unix_server(void *x) {
+    start_server(&unix_conf);
+    return NULL;
+}
 
-    close(server);         /* close socket */
-    SSL_CTX_free(ctx);        /* release context */
 
-    return 0;
+static void *start_busy_poll_server(void *x) {
+    start_server(&busy_poll_conf);
+    return NULL;
 }
 
 
-static char *start_plain_client(const char *hostname, const char *portnum) {
-    char buf[6];
-    char *sendstring = "HELLO";
-    ssize_t bytes;
+static void *start_coro_server(void *x) {
+    start_server(&coro_conf);
+    return NULL;
+}
 
-    int server = make_connection(hostname, atoi(portnum));
-    sendall(server, (uint8_t *) sendstring, strlen(sendstring), &bytes);
-    bytes = recv(server, buf, sizeof(buf), 0);
-    buf[bytes] = 0;
 
-    ASSERT("[! Plain client]: Plain client wrong result", strcmp(buf, sendstring) == 0);
+static void *start_proxy_server(void *x) {
+    start_server(&proxy_conf);
+    return NULL;
+}
 
-    close(server);         /* close socket */
 
-    return 0;
+static void *start_proxy_pipeline_server(void *x) {
+    start_server(&proxy_pipeline_conf);
+    return NULL;
 }
 
+/* Every byte of an echo is answered once as many came back */
+static int echo_answered(uint64_t up, uint64_t down) {
+    return up == down;
+}
 
-char *vessel_plain_test(void) {
-
-    pthread_t plain_server;
+/* Upstream stand-in answering PROXY_MSG bytes requests one at a time, the
+   ones starting with "slow" late */
+static void *start_slow_upstream(void *arg) {
+
+    int fd = *(int *) arg;
+    uint8_t buf[PROXY_MSG];
+    ssize_t sent;
+    int conn;
+
+    while ((conn = accept(fd, NULL, NULL)) >= 0) {
+        while (recv(conn, buf, sizeof(buf), MSG_WAITALL) == sizeof(buf)) {
+            if (memcmp(buf, "slow", 4) == 0)
+                usleep(30000);
+            if (sendall(conn, buf, sizeof(buf), &sent) < 0)
+                break;
+        }
+        close(conn);
+    }
 
-    pthread_create(&plain_server, NULL, start_plain_server, NULL);
+    return NULL;
+}
 
-    usleep(3000);
-    start_plain_client("127.0.0.1", "4040");
+/* Upstream stand-in of the proxy, a blocking echo server handling one
+   connection at a time until its listening socket is shut down */
+static void *start_echo_upstream(void *arg) {
 
-    stop_server();
+    int fd = *(int *) arg;
+    uint8_t buf[PROXY_CHUNK];
+    ssize_t n, sent;
+    int conn;
 
-    pthread_join(plain_server, NULL);
+    while ((conn = accept(fd, NULL, NULL)) >= 0) {
+        while ((n = recv(conn, buf, sizeof(buf), 0)) > 0)
+            sendall(conn, buf, n, &sent);
+        close(conn);
+    }
 
-    return 0;
+    return NULL;
 }
 
 
-char *vessel_ssl_test(void) {
+static void *start_broadcast_server(void *x) {
+    start_server(&broadcast_conf);
+    return NULL;
+}
 
-    pthread_t ssl_server;
 
-    pthread_create(&ssl_server, NULL, start_ssl_server, NULL);
+static void *start_pubsub_server(void *x) {
+    start_server(&pubsub_conf);
+    return NULL;
+}
 
-    usleep(3000);
-    start_ssl_client("127.0.0.1", "14040");
 
-    stop_server();
+static void *start_http_server(void *x) {
+    start_server(&http_conf);
+    return NULL;
+}
 
-    pthread_join(ssl_server, NULL);
 
-    return 0;
+static void *start_sockopts_server(void *x) {
+    start_server(&sockopts_conf);
+    return NULL;
+}
+
+
+static int get_option(int fd, int level, int name) {
+    int value = 0;
+    socklen_t len = sizeof(value);
+    getsockopt(fd, level, name, &value, &len);
+    return value;
+}
+
+
+static char *start_unix_client(const char *path) {
+
+    char buf[6];
+    char *sendstring = "HELLO";
+    struct sockaddr_un addr;
+    socklen_t addrlen = unix_address(path, &addr);
+    ssize_t bytes;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    ASSERT("[! Unix client]: connection refused",
+           connect(sock, (struct sockaddr *) &addr, addrlen) == 0);
+
+    sendall(sock, (uint8_t *) sendstring, strlen(sendstring), &bytes);
+    bytes = recv(sock, buf, sizeof(buf), 0);
+    close(sock);
+
+    ASSERT("[! Unix client]: Unix client wrong result",
+           bytes == 5 && memcmp(buf, sendstring, 5) == 0);
+
+    return 0;
+}
+
+
+static char *start_ssl_client(const char *hostname, const char *portnum) {
+
+    SSL_CTX *ctx;
+    int server;
+    SSL *ssl;
+    char buf[6];
+    char *sendstring = "HELLO";
+    int bytes;
+
+    ctx = init_CTX();
+    server = make_connection(hostname, atoi(portnum));
+    ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, server);
+
+    if (SSL_connect(ssl) == -1) ERR_print_errors_fp(stderr);
+    else {
+
+        SSL_write(ssl, sendstring, strlen(sendstring));
+        bytes = SSL_read(ssl, buf, sizeof(buf));
+        buf[bytes] = 0;
+
+        ASSERT("[! SSL client]: SSL client wrong result", strcmp(buf, sendstring) == 0);
+
+        SSL_free(ssl);        /* release connection state */
+    }
+
+    close(server);         /* close socket */
+    SSL_CTX_free(ctx);        /* release context */
+
+    return 0;
+}
+
+
+static char *start_plain_client(const char *hostname, const char *portnum) {
+    char buf[6];
+    char *sendstring = "HELLO";
+    ssize_t bytes;
+
+    int server = make_connection(hostname, atoi(portnum));
+    sendall(server, (uint8_t *) sendstring, strlen(sendstring), &bytes);
+    bytes = recv(server, buf, sizeof(buf), 0);
+    buf[bytes] = 0;
+
+    ASSERT("[! Plain client]: Plain client wrong result", strcmp(buf, sendstring) == 0);
+
+    close(server);         /* close socket */
+
+    return 0;
+}
+
+
+char *vessel_plain_test(void) {
+
+    pthread_t plain_server;
+
+    pthread_create(&plain_server, NULL, start_plain_server, NULL);
+
+    usleep(3000);
+    start_plain_client("127.0.0.1", "4040");
+
+    stop_server();
+
+    pthread_join(plain_server, NULL);
+
+    return 0;
+}
+
+
+char *vessel_ssl_test(void) {
+
+    pthread_t ssl_server;
+
+    pthread_create(&ssl_server, NULL, start_ssl_server, NULL);
+
+    usleep(3000);
+    start_ssl_client("127.0.0.1", "14040");
+
+    stop_server();
+
+    pthread_join(ssl_server, NULL);
+
+    return 0;
+}
+
+
+char *vessel_sendfile_test(void) {
+
+    pthread_t file_server;
+
+    /* Binary content, larger than the socket buffers so the reply has to be
+       resumed on EPOLLOUT multiple times */
+    uint8_t *blob = malloc(BLOB_SIZE);
+    for (size_t i = 0; i < BLOB_SIZE; ++i)
+        blob[i] = (i * 7) % 251;
+
+    FILE *fp = fopen(BLOB_PATH, "w");
+    fwrite(blob, 1, BLOB_SIZE, fp);
+    fclose(fp);
+
+    pthread_create(&file_server, NULL, start_file_server, NULL);
+
+    usleep(3000);
+
+    int sock = make_connection("127.0.0.1", 4041);
+    uint8_t *buf = malloc(BLOB_SIZE);
+    size_t total = 0;
+    ssize_t n;
+
+    send(sock, "GET", 3, 0);
+
+    /* Read slowly at first to fill up the socket buffers */
+    usleep(50000);
+
+    while (total < BLOB_SIZE
+            && (n = recv(sock, buf + total, BLOB_SIZE - total, 0)) > 0)
+        total += n;
+
+    close(sock);
+
+    stop_server();
+
+    pthread_join(file_server, NULL);
+
+    int same = total == BLOB_SIZE && memcmp(buf, blob, BLOB_SIZE) == 0;
+
+    free(buf);
+    free(blob);
+    unlink(BLOB_PATH);
+
+    ASSERT("[! sendfile]: file reply corrupted", same);
+
+    return 0;
+}
+
+
+char *vessel_zerocopy_test(void) {
+
+    pthread_t zerocopy_server;
+
+    pthread_create(&zerocopy_server, NULL, start_zerocopy_server, NULL);
+
+    usleep(3000);
+
+    int sock = make_connection("127.0.0.1", 4042);
+    uint8_t *buf = malloc(ZC_REPLY_SIZE);
+    size_t total = 0;
+    ssize_t n;
+
+    send(sock, "GET", 3, 0);
+
+    while (total < ZC_REPLY_SIZE
+            && (n = recv(sock, buf + total, ZC_REPLY_SIZE - total, 0)) > 0)
+        total += n;
+
+    /* Give the worker time to read the completions */
+    usleep(50000);
+
+    uint64_t completed = instance.stats.zerocopy_sends
+        + instance.stats.zerocopy_copied;
+
+    close(sock);
+
+    stop_server();
+
+    pthread_join(zerocopy_server, NULL);
+
+    int same = total == ZC_REPLY_SIZE;
+
+    for (size_t i = 0; same && i < ZC_REPLY_SIZE; ++i)
+        same = buf[i] == i % 253;
+
+    free(buf);
+
+    ASSERT("[! zerocopy]: reply corrupted", same);
+    ASSERT("[! zerocopy]: no completion reported", completed > 0);
+
+    return 0;
+}
+
+
+char *vessel_udp_test(void) {
+
+    pthread_t udp_server;
+
+    pthread_create(&udp_server, NULL, start_udp_server, NULL);
+
+    usleep(3000);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(4044),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    struct timeval tv = { 1, 0 };
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    connect(sock, (struct sockaddr *) &addr, sizeof(addr));
+
+    /* Larger than the datagram buffers, dropped by the server */
+    uint8_t big[1024] = { 0 };
+    send(sock, big, sizeof(big), 0);
+
+    /* Sent back to back so the server receives them in batches, replies of
+       the same size to the same peer are coalesced with GSO */
+    uint8_t dgram[UDP_DGRAM_SIZE];
+
+    for (int i = 0; i < UDP_DGRAMS; ++i) {
+        memset(dgram, i, sizeof(dgram));
+        send(sock, dgram, sizeof(dgram), 0);
+    }
+
+    int received = 0, ok = 1;
+    uint8_t buf[2048];
+    ssize_t n;
+
+    while (received < UDP_DGRAMS && (n = recv(sock, buf, sizeof(buf), 0)) > 0) {
+        /* Every reply is a datagram on its own, in order */
+        ok = ok && n == UDP_DGRAM_SIZE && buf[0] == received
+            && buf[UDP_DGRAM_SIZE - 1] == received;
+        received++;
+    }
+
+    close(sock);
+
+    stop_server();
+
+    pthread_join(udp_server, NULL);
+
+    ASSERT("[! udp]: missing replies", received == UDP_DGRAMS);
+    ASSERT("[! udp]: wrong replies", ok);
+    ASSERT("[! udp]: oversized datagram not dropped",
+           instance.stats.datagrams_dropped == 1);
+    ASSERT("[! udp]: wrong counters",
+           instance.stats.datagrams_in == UDP_DGRAMS + 1
+           && instance.stats.datagrams_out == UDP_DGRAMS);
+
+    return 0;
+}
+
+
+char *vessel_unix_test(void) {
+
+    pthread_t unix_server;
+    struct sockaddr_un addr;
+
+    /* Abstract names have no trailing NUL */
+    ASSERT("[! unix_address]: wrong abstract length",
+           unix_address(UNIX_ABSTRACT, &addr)
+           == offsetof(struct sockaddr_un, sun_path) + strlen(UNIX_ABSTRACT)
+           && addr.sun_path[0] == '\0');
+
+    pthread_create(&unix_server, NULL, start_unix_server, NULL);
+
+    usleep(3000);
+
+    char *path_result = start_unix_client(UNIX_PATH);
+    char *abstract_result = start_unix_client(UNIX_ABSTRACT);
+
+    stop_server();
+
+    pthread_join(unix_server, NULL);
+
+    if (path_result)
+        return path_result;
+
+    if (abstract_result)
+        return abstract_result;
+
+    ASSERT("[! unix]: socket file not removed", access(UNIX_PATH, F_OK) < 0);
+
+    return 0;
+}
+
+
+char *vessel_sockopts_test(void) {
+
+    pthread_t sockopts_server;
+    char buf[6];
+    struct sockaddr_un addr;
+    socklen_t addrlen = unix_address("@vessel_sockopts", &addr);
+
+    pthread_create(&sockopts_server, NULL, start_sockopts_server, NULL);
+
+    usleep(3000);
+
+    /* With TCP_DEFER_ACCEPT the connection is accepted with the request */
+    int tcp = make_connection("127.0.0.1", 4046);
+    send(tcp, "HELLO", 5, 0);
+    recv(tcp, buf, sizeof(buf), 0);
+
+    int local = socket(AF_UNIX, SOCK_STREAM, 0);
+    connect(local, (struct sockaddr *) &addr, addrlen);
+    send(local, "HELLO", 5, 0);
+    recv(local, buf, sizeof(buf), 0);
+
+    int tcp_ok = 0, unix_ok = 0;
+    struct ilist_node *n, *tmp;
+
+    /* Check the options on the server side of the connections */
+    pthread_mutex_lock(&instance.clients_lock);
+    ilist_foreach_safe(n, tmp, &instance.clients) {
+        Client *c = ilist_entry(n, Client, node);
+        struct sockaddr_storage sa;
+        socklen_t salen = sizeof(sa);
+        getsockname(c->fd, (struct sockaddr *) &sa, &salen);
+        if (sa.ss_family == AF_INET)
+            /* The kernel doubles the buffer sizes set */
+            tcp_ok = get_option(c->fd, IPPROTO_TCP, TCP_NODELAY) == 1
+                && get_option(c->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT) == 16384
+                && get_option(c->fd, SOL_SOCKET, SO_RCVBUF) == 2 * 65536;
+        else if (sa.ss_family == AF_UNIX)
+            unix_ok = get_option(c->fd, SOL_SOCKET, SO_SNDBUF) == 2 * 100000;
+    }
+    pthread_mutex_unlock(&instance.clients_lock);
+
+    close(tcp);
+    close(local);
+
+    stop_server();
+
+    pthread_join(sockopts_server, NULL);
+
+    ASSERT("[! sockopts]: TCP options not inherited", tcp_ok);
+    ASSERT("[! sockopts]: unix listener override not applied", unix_ok);
+
+    return 0;
+}
+
+
+char *vessel_busy_poll_test(void) {
+
+    pthread_t busy_poll_server;
+    struct timespec start, end;
+
+    pthread_create(&busy_poll_server, NULL, start_busy_poll_server, NULL);
+
+    usleep(3000);
+
+    char *result = start_plain_client("127.0.0.1", "4047");
+
+    /* Spinning workers have to notice the stop request promptly */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stop_server();
+    pthread_join(busy_poll_server, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (result)
+        return result;
+
+    ASSERT("[! busy_poll]: no event caught spinning",
+           instance.stats.busy_polls_hit > 0);
+    ASSERT("[! busy_poll]: slow stop", elapsed < 0.5);
+
+    return 0;
+}
+
+
+/* Send a framed message to the echo coroutine handler */
+static void send_framed(int sock, const uint8_t *buf, uint32_t len) {
+
+    uint32_t hdr = htonl(len);
+    ssize_t sent;
+
+    sendall(sock, (uint8_t *) &hdr, sizeof(hdr), &sent);
+    sendall(sock, (uint8_t *) buf, len, &sent);
+}
+
+
+static size_t recv_full(int sock, uint8_t *buf, size_t len) {
+
+    size_t total = 0;
+    ssize_t n;
+
+    while (total < len && (n = recv(sock, buf + total, len - total, 0)) > 0)
+        total += n;
+
+    return total;
+}
+
+
+char *vessel_coro_test(void) {
+
+    pthread_t coro_server;
+
+    coro_finished = 0;
+
+    pthread_create(&coro_server, NULL, start_coro_server, NULL);
+
+    usleep(3000);
+
+    int sock = make_connection("127.0.0.1", 4048);
+    uint8_t reply[16];
+    uint32_t hdr = htonl(11);
+
+    /* A message arriving in pieces suspends the handler in the middle */
+    send(sock, &hdr, 2, 0);
+    usleep(10000);
+    send(sock, (uint8_t *) &hdr + 2, 2, 0);
+    send(sock, "hello ", 6, 0);
+    usleep(10000);
+    send(sock, "world", 5, 0);
+
+    size_t small = recv_full(sock, reply, 11);
+
+    /* A reply larger than the socket buffers suspends it while writing */
+    uint8_t *large = malloc(CORO_LARGE), *echo = malloc(CORO_LARGE);
+
+    for (size_t i = 0; i < CORO_LARGE; ++i)
+        large[i] = i % 251;
+
+    send_framed(sock, large, CORO_LARGE);
+
+    size_t total = recv_full(sock, echo, CORO_LARGE);
+    int same = total == CORO_LARGE && memcmp(large, echo, CORO_LARGE) == 0;
+
+    close(sock);
+
+    /* The handler sees the end of the stream and returns */
+    usleep(20000);
+
+    int finished = coro_finished;
+
+    stop_server();
+
+    pthread_join(coro_server, NULL);
+
+    free(large);
+    free(echo);
+
+    ASSERT("[! coro]: wrong reply",
+           small == 11 && memcmp(reply, "hello world", 11) == 0);
+    ASSERT("[! coro]: large reply corrupted", same);
+    ASSERT("[! coro]: handler not finished", finished);
+
+    return 0;
+}
+
+
+char *vessel_proxy_test(void) {
+
+    pthread_t proxy_server, upstream;
+
+    int upstream_fd = make_listen("127.0.0.1", "4050", NULL);
+
+    /* The stand-in blocks on accept(2) */
+    fcntl(upstream_fd, F_SETFL, fcntl(upstream_fd, F_GETFL) & ~O_NONBLOCK);
+
+    pthread_create(&upstream, NULL, start_echo_upstream, &upstream_fd);
+    pthread_create(&proxy_server, NULL, start_proxy_server, NULL);
+
+    usleep(3000);
+
+    int sock = make_connection("127.0.0.1", 4049);
+    uint8_t reply[16];
+
+    send(sock, "hello", 5, 0);
+    size_t small = recv_full(sock, reply, 5);
+
+    /* Larger than the pipes, forwarded in both directions chunk by chunk */
+    uint8_t *large = malloc(PROXY_LARGE), *echo = malloc(PROXY_LARGE);
+    ssize_t sent;
+    size_t total = 0;
+
+    for (size_t i = 0; i < PROXY_LARGE; ++i)
+        large[i] = i % 251;
+
+    for (size_t off = 0; off < PROXY_LARGE; off += PROXY_CHUNK) {
+        sendall(sock, large + off, PROXY_CHUNK, &sent);
+        total += recv_full(sock, echo + off, PROXY_CHUNK);
+    }
+
+    int same = total == PROXY_LARGE && memcmp(large, echo, PROXY_LARGE) == 0;
+
+    close(sock);
+    usleep(20000);
+
+    /* The upstream connection of the first client serves the second one */
+    sock = make_connection("127.0.0.1", 4049);
+    send(sock, "again", 5, 0);
+    size_t again = recv_full(sock, reply + 5, 5);
+    close(sock);
+    usleep(20000);
+
+    uint64_t connects = instance.stats.upstream_connects;
+    uint64_t reuses = instance.stats.upstream_reuses;
+    uint64_t bytes_up = instance.stats.proxy_bytes_up;
+    uint64_t bytes_down = instance.stats.proxy_bytes_down;
+
+    stop_server();
+    pthread_join(proxy_server, NULL);
+
+    shutdown(upstream_fd, SHUT_RDWR);
+    pthread_join(upstream, NULL);
+    close(upstream_fd);
+
+    free(large);
+    free(echo);
+
+    ASSERT("[! proxy]: wrong replies", small == 5 && again == 5
+           && memcmp(reply, "helloagain", 10) == 0);
+    ASSERT("[! proxy]: large reply corrupted", same);
+    ASSERT("[! proxy]: upstream not reused", connects == 1 && reuses == 1);
+    ASSERT("[! proxy]: wrong bytes forwarded",
+           bytes_up == PROXY_LARGE + 10 && bytes_down == PROXY_LARGE + 10);
+
+    return 0;
+}
+
+
+/* A client leaving with a pipelined request still unanswered, the late
+   answer must not reach the next client through a pooled upstream */
+char *vessel_proxy_pipeline_test(void) {
+
+    pthread_t proxy_server, upstream;
+
+    int upstream_fd = make_listen("127.0.0.1", "4056", NULL);
+
+    fcntl(upstream_fd, F_SETFL, fcntl(upstream_fd, F_GETFL) & ~O_NONBLOCK);
+
+    pthread_create(&upstream, NULL, start_slow_upstream, &upstream_fd);
+    pthread_create(&proxy_server, NULL, start_proxy_pipeline_server, NULL);
+
+    usleep(3000);
+
+    int sock = make_connection("127.0.0.1", 4055);
+    uint8_t first[PROXY_MSG], second[PROXY_MSG] = { 0 };
+
+    send(sock, "fast1slow2", 2 * PROXY_MSG, 0);
+    size_t answered = recv_full(sock, first, PROXY_MSG);
+    close(sock);
+    usleep(5000);
+
+    sock = make_connection("127.0.0.1", 4055);
+    send(sock, "third", PROXY_MSG, 0);
+    size_t next = recv_full(sock, second, PROXY_MSG);
+    close(sock);
+    usleep(50000);
+
+    uint64_t connects = instance.stats.upstream_connects;
+    uint64_t reuses = instance.stats.upstream_reuses;
+
+    stop_server();
+    pthread_join(proxy_server, NULL);
+
+    shutdown(upstream_fd, SHUT_RDWR);
+    pthread_join(upstream, NULL);
+    close(upstream_fd);
+
+    ASSERT("[! proxy_pipeline]: first reply",
+           answered == PROXY_MSG && memcmp(first, "fast1", PROXY_MSG) == 0);
+    ASSERT("[! proxy_pipeline]: reply of another client",
+           next == PROXY_MSG && memcmp(second, "third", PROXY_MSG) == 0);
+    ASSERT("[! proxy_pipeline]: busy upstream pooled",
+           connects == 2 && reuses == 0);
+
+    return 0;
+}
+
+
+char *vessel_broadcast_test(void) {
+
+    pthread_t broadcast_server;
+    int socks[BCAST_CLIENTS];
+
+    pthread_create(&broadcast_server, NULL, start_broadcast_server, NULL);
+
+    usleep(3000);
+
+    for (int i = 0; i < BCAST_CLIENTS; ++i)
+        socks[i] = make_connection("127.0.0.1", 4051);
+
+    for (int i = 0; i < 100 && instance.stats.accepted < BCAST_CLIENTS; ++i)
+        usleep(1000);
+
+    /* One allocation for all the clients, followed by a small buffer that
+       must arrive after it */
+    Sbuf *large = sbuf_new(BCAST_SIZE);
+    Sbuf *small = sbuf_from("end", 3);
+
+    for (size_t i = 0; i < BCAST_SIZE; ++i)
+        large->data[i] = i % 251;
+
+    size_t queued = broadcast(large);
+    broadcast(small);
+    sbuf_put(small);
+
+    /* A client going away with its queue still full */
+    close(socks[0]);
+
+    uint8_t *buf = malloc(BCAST_SIZE + 3);
+    int same = 1;
+
+    for (int i = 1; i < BCAST_CLIENTS; ++i) {
+        size_t total = recv_full(socks[i], buf, BCAST_SIZE + 3);
+        same = same && total == BCAST_SIZE + 3
+            && memcmp(buf, large->data, BCAST_SIZE) == 0
+            && memcmp(buf + BCAST_SIZE, "end", 3) == 0;
+        close(socks[i]);
+    }
+
+    /* Zero copy sends keep their references until the completions */
+    for (int i = 0; i < 500 && large->refs > 1; ++i)
+        usleep(1000);
+
+    unsigned refs = large->refs;
+
+    stop_server();
+
+    pthread_join(broadcast_server, NULL);
+
+    sbuf_put(large);
+    free(buf);
+
+    ASSERT("[! broadcast]: not queued on every client",
+           queued == BCAST_CLIENTS);
+    ASSERT("[! broadcast]: buffer corrupted", same);
+    ASSERT("[! broadcast]: references not released", refs == 1);
+
+    return 0;
+}
+
+
+/* Send a pub/sub command and wait for its acknowledgement */
+static void pubsub_command(int sock, const char *cmd) {
+    char ack;
+    send(sock, cmd, strlen(cmd), 0);
+    recv(sock, &ack, 1, 0);
+}
+
+/* Publish SLOW_MSGS large messages, each filled with its index */
+static void publish_slow(const char *topic) {
+
+    for (int i = 0; i < SLOW_MSGS; ++i) {
+        Sbuf *b = sbuf_new(SLOW_MSG_SIZE);
+        memset(b->data, i, SLOW_MSG_SIZE);
+        pubsub_publish(instance.pubsub, topic, b);
+        sbuf_put(b);
+    }
+}
+
+/* Read from a socket until it stays idle for 200 ms or it is closed */
+static size_t drain(int sock, uint8_t *buf, size_t len, int *closed) {
+
+    struct timeval tv = { .tv_usec = 200000 };
+    size_t total = 0;
+    ssize_t n;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (total < len && (n = recv(sock, buf + total, len - total, 0)) > 0)
+        total += n;
+
+    *closed = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+
+    return total;
+}
+
+
+char *vessel_pubsub_test(void) {
+
+    pthread_t pubsub_server;
+
+    pthread_create(&pubsub_server, NULL, start_pubsub_server, NULL);
+
+    usleep(3000);
+
+    int a = make_connection("127.0.0.1", 4052);
+    int b = make_connection("127.0.0.1", 4052);
+    int c = make_connection("127.0.0.1", 4052);
+    uint8_t buf[8];
+
+    pubsub_command(a, "dnews\n");
+    pubsub_command(b, "dnews\ndsport\n");
+    pubsub_command(c, "dsport\n");
+
+    /* Each message goes only to the subscribers of its topic */
+    Sbuf *news = sbuf_from("N1", 2), *sport = sbuf_from("S1", 2);
+    size_t to_news = pubsub_publish(instance.pubsub, "news", news);
+    size_t to_sport = pubsub_publish(instance.pubsub, "sport", sport);
+    size_t to_none = pubsub_publish(instance.pubsub, "weather", news);
+    sbuf_put(news);
+    sbuf_put(sport);
+
+    int routed = recv_full(a, buf, 2) == 2 && memcmp(buf, "N1", 2) == 0
+        && recv_full(b, buf, 4) == 4 && memcmp(buf, "N1S1", 4) == 0
+        && recv_full(c, buf, 2) == 2 && memcmp(buf, "S1", 2) == 0;
+
+    pubsub_command(b, "unews\n");
+    news = sbuf_from("N2", 2);
+    size_t after_unsub = pubsub_publish(instance.pubsub, "news", news);
+    sbuf_put(news);
+    routed = routed && recv_full(a, buf, 2) == 2 && memcmp(buf, "N2", 2) == 0;
+
+    close(a);
+    close(b);
+    close(c);
+
+    /* Slow consumers not reading while a burst is published */
+    int rcvbuf = 65536, closed;
+    int co = make_connection("127.0.0.1", 4052);
+    int dc = make_connection("127.0.0.1", 4052);
+
+    setsockopt(co, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(dc, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    pubsub_command(co, "clatest\n");
+    pubsub_command(dc, "xstrict\n");
+
+    publish_slow("latest");
+    publish_slow("strict");
+
+    uint8_t *slow = malloc(SLOW_MSGS * SLOW_MSG_SIZE);
+    size_t total = drain(co, slow, SLOW_MSGS * SLOW_MSG_SIZE, &closed);
+
+    /* Whole messages in order, the newest one last */
+    int ordered = total > 0 && total % SLOW_MSG_SIZE == 0
+        && slow[total - 1] == SLOW_MSGS - 1;
+
+    for (size_t i = SLOW_MSG_SIZE; ordered && i < total; i += SLOW_MSG_SIZE)
+        ordered = slow[i] > slow[i - SLOW_MSG_SIZE];
+
+    drain(dc, slow, SLOW_MSGS * SLOW_MSG_SIZE, &closed);
+
+    uint64_t coalesced = instance.stats.outq_coalesced;
+    uint64_t disconnects = instance.stats.outq_disconnects;
+
+    close(co);
+    close(dc);
+
+    stop_server();
+
+    pthread_join(pubsub_server, NULL);
+
+    free(slow);
+
+    ASSERT("[! pubsub]: wrong subscriber counts", to_news == 2
+           && to_sport == 2 && to_none == 0 && after_unsub == 1);
+    ASSERT("[! pubsub]: messages not routed by topic", routed);
+    ASSERT("[! pubsub]: coalescing consumer out of order",
+           ordered && coalesced > 0);
+    ASSERT("[! pubsub]: slow consumer not disconnected",
+           closed && disconnects > 0);
+
+    return 0;
+}
+
+
+/* Read a response and check it against the expected head and body */
+static int http_expect(int sock, const char *body, size_t len, int close) {
+
+    char head[256];
+    int hlen = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+                        "Content-Length: %zu\r\nConnection: %s\r\n"
+                        "Content-Type: text/plain\r\n\r\n",
+                        len, close ? "close" : "keep-alive");
+    uint8_t *buf = malloc(hlen + len);
+    int ok = recv_full(sock, buf, hlen + len) == hlen + len
+        && memcmp(buf, head, hlen) == 0 && memcmp(buf + hlen, body, len) == 0;
+
+    free(buf);
+
+    return ok;
+}
+
+
+/* The same exchanges with the buffers of the idle connections released or
+   kept */
+static char *http_test(int release_idle) {
+
+    pthread_t http_server;
+
+    http_conf.release_idle = release_idle;
+
+    pthread_create(&http_server, NULL, start_http_server, NULL);
+
+    usleep(3000);
+
+    int sock = make_connection("127.0.0.1", 4053);
+    char byte;
+
+    /* Pipelined requests in a single write */
+    const char *pipelined =
+        "GET /a HTTP/1.1\r\nHost: test\r\n\r\n"
+        "POST /b HTTP/1.1\r\nHost: test\r\nContent-Length: 5\r\n\r\nhello";
+
+    send(sock, pipelined, strlen(pipelined), 0);
+
+    int pipeline = http_expect(sock, "/a", 2, 0)
+        && http_expect(sock, "hello", 5, 0);
+
+    /* Chunked body split across writes, with an extension */
+    const char *chunked[] = {
+        "POST /c HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel",
+        "lo\r\n6;ext=1\r\n world\r\n0\r\n",
+        "\r\n"
+    };
+
+    for (int i = 0; i < 3; ++i) {
+        send(sock, chunked[i], strlen(chunked[i]), 0);
+        usleep(1000);
+    }
+
+    int dechunked = http_expect(sock, "hello world", 11, 0);
+
+    /* A body larger than the ones copied next to the head */
+    char *large = malloc(HTTP_LARGE), head[128];
+    int hlen = snprintf(head, sizeof(head),
+                        "PUT /d HTTP/1.1\r\nContent-Length: %d\r\n\r\n",
+                        HTTP_LARGE);
+
+    for (int i = 0; i < HTTP_LARGE; ++i)
+        large[i] = 'a' + i % 26;
+
+    send(sock, head, hlen, 0);
+    send(sock, large, HTTP_LARGE, 0);
+
+    int big = http_expect(sock, large, HTTP_LARGE, 0);
+
+    /* Connection closed after the response */
+    const char *last = "GET /e HTTP/1.1\r\nConnection: close\r\n\r\n";
+
+    send(sock, last, strlen(last), 0);
+
+    int closed = http_expect(sock, "/e", 2, 1) && recv(sock, &byte, 1, 0) == 0;
+
+    close(sock);
+
+    /* Length and chunked together are refused */
+    const char *smuggle = "POST /f HTTP/1.1\r\nContent-Length: 3\r\n"
+        "Transfer-Encoding: chunked\r\n\r\n0\r\n\r\n";
+    char reply[64] = { 0 };
+
+    sock = make_connection("127.0.0.1", 4053);
+    send(sock, smuggle, strlen(smuggle), 0);
+    recv_full(sock, (uint8_t *) reply, sizeof(reply) - 1);
+    close(sock);
+
+    uint64_t requests = instance.stats.http_requests;
+    uint64_t releases = instance.stats.idle_releases;
+
+    stop_server();
+
+    pthread_join(http_server, NULL);
+
+    free(large);
+
+    ASSERT("[! http]: pipelined requests", pipeline);
+    ASSERT("[! http]: chunked body", dechunked);
+    ASSERT("[! http]: large body", big);
+    ASSERT("[! http]: connection not closed", closed);
+    ASSERT("[! http]: malformed request accepted",
+           strncmp(reply, "HTTP/1.1 400 ", 13) == 0);
+    ASSERT("[! http]: wrong request count", requests == 5);
+    ASSERT("[! http]: wrong idle releases",
+           release_idle ? releases > 0 : releases == 0);
+
+    return 0;
+}
+
+
+char *vessel_http_test(void) {
+    return http_test(0);
+}
+
+
+char *vessel_http_idle_test(void) {
+    return http_test(1);
+}
+
+
+static void *start_ws_server(void *ptr) {
+    start_server(&ws_conf);
+    return NULL;
+}
+
+
+/* Send a masked frame as a client would */
+static void ws_client_send(int sock, int fin, int op, const void *data,
+                           size_t len) {
+
+    uint8_t *frame = malloc(len + 14), key[4] = { 0x12, 0x34, 0x56, 0x78 };
+    size_t hlen = 2;
+
+    frame[0] = (fin ? 0x80 : 0) | op;
+
+    if (len < 126) {
+        frame[1] = 0x80 | len;
+    } else if (len <= 0xffff) {
+        frame[1] = 0x80 | 126;
+        frame[2] = len >> 8;
+        frame[3] = len;
+        hlen = 4;
+    } else {
+        frame[1] = 0x80 | 127;
+        for (int i = 0; i < 8; ++i)
+            frame[2 + i] = (uint64_t) len >> (56 - 8 * i);
+        hlen = 10;
+    }
+
+    memcpy(frame + hlen, key, 4);
+
+    for (size_t i = 0; i < len; ++i)
+        frame[hlen + 4 + i] = ((const uint8_t *) data)[i] ^ key[i % 4];
+
+    send(sock, frame, hlen + 4 + len, 0);
+
+    free(frame);
+}
+
+
+/* Read a frame from the server, return its opcode and length in len, -1
+   if the connection closes first */
+static int ws_client_recv(int sock, uint8_t *buf, size_t *len) {
+
+    uint8_t h[10];
+    size_t n;
+
+    if (recv_full(sock, h, 2) != 2)
+        return -1;
+
+    n = h[1] & 0x7f;
+
+    if (n == 126) {
+        if (recv_full(sock, h + 2, 2) != 2)
+            return -1;
+        n = h[2] << 8 | h[3];
+    } else if (n == 127) {
+        if (recv_full(sock, h + 2, 8) != 8)
+            return -1;
+        n = 0;
+        for (int i = 0; i < 8; ++i)
+            n = n << 8 | h[2 + i];
+    }
+
+    if (n > *len || recv_full(sock, buf, n) != n)
+        return -1;
+
+    *len = n;
+
+    return h[0] & 0x0f;
+}
+
+
+/* Open a connection and upgrade it, the 101 response is checked */
+static int ws_connect(void) {
+
+    const char *upgrade = "GET /chat HTTP/1.1\r\nHost: test\r\n"
+        "Upgrade: websocket\r\nConnection: keep-alive, Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n\r\n";
+    const char *expected = "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n\r\n";
+    char reply[256] = { 0 };
+    int sock = make_connection("127.0.0.1", 4054);
+
+    send(sock, upgrade, strlen(upgrade), 0);
+
+    size_t n = recv_full(sock, (uint8_t *) reply, strlen(expected));
+
+    if (n != strlen(expected) || strcmp(reply, expected) != 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+
+static char *ws_test(int release_idle) {
+
+    pthread_t ws_server;
+
+    ws_conf.release_idle = release_idle;
+    ws_closes = 0;
+
+    pthread_create(&ws_server, NULL, start_ws_server, NULL);
+
+    usleep(3000);
+
+    int sock = ws_connect();
+    uint8_t *buf = malloc(HTTP_LARGE);
+    size_t len;
+
+    ASSERT("[! ws]: upgrade refused", sock >= 0);
+
+    /* Text echoed */
+    ws_client_send(sock, 1, WS_TEXT, "hello", 5);
+
+    len = HTTP_LARGE;
+    int echoed = ws_client_recv(sock, buf, &len) == WS_TEXT && len == 5
+        && memcmp(buf, "hello", 5) == 0;
+
+    /* Fragmented message with a ping in between */
+    ws_client_send(sock, 0, WS_TEXT, "frag", 4);
+    ws_client_send(sock, 1, WS_PING, "p", 1);
+    ws_client_send(sock, 1, WS_CONTINUATION, "mented", 6);
+
+    len = HTTP_LARGE;
+    int ponged = ws_client_recv(sock, buf, &len) == WS_PONG && len == 1
+        && buf[0] == 'p';
+
+    len = HTTP_LARGE;
+    int joined = ws_client_recv(sock, buf, &len) == WS_TEXT && len == 10
+        && memcmp(buf, "fragmented", 10) == 0;
+
+    /* Binary message sent back by reference */
+    uint8_t *large = malloc(HTTP_LARGE);
+
+    for (int i = 0; i < HTTP_LARGE; ++i)
+        large[i] = i * 31;
+
+    ws_client_send(sock, 1, WS_BINARY, large, HTTP_LARGE);
+
+    len = HTTP_LARGE;
+    int big = ws_client_recv(sock, buf, &len) == WS_BINARY
+        && len == HTTP_LARGE && memcmp(buf, large, HTTP_LARGE) == 0;
+
+    /* Pinged by the timer when idle, answered before being cut off */
+    len = HTTP_LARGE;
+    int pinged = ws_client_recv(sock, buf, &len) == WS_PING && len == 0;
+
+    ws_client_send(sock, 1, WS_PONG, NULL, 0);
+
+    /* Close handshake, the status is echoed before the end of stream */
+    uint8_t normal[2] = { 1000 >> 8, 1000 & 0xff };
+
+    ws_client_send(sock, 1, WS_CLOSE, normal, 2);
+
+    /* Pings may have been queued before the close */
+    int op;
+
+    do {
+        len = HTTP_LARGE;
+        op = ws_client_recv(sock, buf, &len);
+    } while (op == WS_PING);
+
+    int closed = op == WS_CLOSE && len == 2 && memcmp(buf, normal, 2) == 0
+        && recv(sock, buf, 1, 0) == 0;
+
+    close(sock);
+
+    /* Invalid UTF-8 closes the connection with 1007 */
+    sock = ws_connect();
+    ws_client_send(sock, 1, WS_TEXT, "\xc0\xaf", 2);
+
+    len = HTTP_LARGE;
+    int invalid = ws_client_recv(sock, buf, &len) == WS_CLOSE && len == 2
+        && (buf[0] << 8 | buf[1]) == 1007 && recv(sock, buf, 1, 0) == 0;
+
+    close(sock);
+
+    /* Plain requests are told to upgrade */
+    const char *plain = "GET / HTTP/1.1\r\nHost: test\r\n\r\n";
+    char reply[64] = { 0 };
+
+    sock = make_connection("127.0.0.1", 4054);
+    send(sock, plain, strlen(plain), 0);
+    recv_full(sock, (uint8_t *) reply, 13);
+    close(sock);
+
+    usleep(10000);
+
+    uint64_t in = instance.stats.ws_messages_in;
+    uint64_t out = instance.stats.ws_messages_out;
+    uint64_t pings = instance.stats.ws_pings;
+    uint64_t releases = instance.stats.idle_releases;
+
+    stop_server();
+
+    pthread_join(ws_server, NULL);
+
+    free(large);
+    free(buf);
+
+    ASSERT("[! ws]: text not echoed", echoed);
+    ASSERT("[! ws]: ping not answered", ponged);
+    ASSERT("[! ws]: fragmented message not joined", joined);
+    ASSERT("[! ws]: large message not echoed", big);
+    ASSERT("[! ws]: idle connection not pinged", pinged && pings > 0);
+    ASSERT("[! ws]: close not echoed", closed);
+    ASSERT("[! ws]: invalid text not refused", invalid);
+    ASSERT("[! ws]: plain request not refused",
+           strncmp(reply, "HTTP/1.1 426 ", 13) == 0);
+    ASSERT("[! ws]: wrong message counts", in == 3 && out == 3);
+    ASSERT("[! ws]: close callback not run", ws_closes == 2);
+    ASSERT("[! ws]: wrong idle releases",
+           release_idle ? releases > 0 : releases == 0);
+
+    return 0;
+}
+
+
+char *vessel_ws_test(void) {
+    return ws_test(0);
+}
+
+
+char *vessel_ws_idle_test(void) {
+    return ws_test(1);
 }
@@ -33,5 +33,35 @@ char *vessel_plain_test();
 
 char *vessel_ssl_test();
 
+char *vessel_sendfile_test();
+
+char *vessel_zerocopy_test();
+
+char *vessel_udp_test();
+
+char *vessel_unix_test();
+
+char *vessel_sockopts_test();
+
+char *vessel_busy_poll_test();
+
+char *vessel_coro_test();
+
+char *vessel_proxy_test();
+
+char *vessel_proxy_pipeline_test();
+
+char *vessel_broadcast_test();
+
+char *vessel_pubsub_test();
+
+char *vessel_http_test();
+
+char *vessel_http_idle_test();
+
+char *vessel_ws_test();
+
+char *vessel_ws_idle_test();
+
 
 #endif